@@ -31,6 +31,7 @@
 #include <lsvmutils/alloc.h>
 #include <lsvmutils/blkdev.h>
 #include <lsvmutils/luksblkdev.h>
+#include <lsvmutils/luks2.h>
 #include <lsvmutils/efiblkdev.h>
 #include <lsvmutils/efibio.h>
 #include "luksbio.h"
@@ -124,7 +125,19 @@ done:
 static EFI_STATUS EFIAPI _EFI_BLOCK_IO_FlushBlocks(
     IN struct _EFI_BLOCK_IO *this)
 {
-    return EFI_SUCCESS;
+    EFI_STATUS status = EFI_UNSUPPORTED;
+    BlockIO* impl = (BlockIO*)this;
+
+    if (!impl)
+        goto done;
+
+    if (BlkdevFlush(impl->dev) != 0)
+        goto done;
+
+    status = EFI_SUCCESS;
+
+done:
+    return status;
 }
 
 static BlockIO _block_io =
@@ -181,7 +194,7 @@ EFI_STATUS WrapBootBIO(
         union 
         {
             LUKSHeader header;
-            UINT8 blocks[LUKS_SECTOR_SIZE*2];
+            UINT8 blocks[BLKDEV_MAX_BLKSIZE]; /* whole blocks on 4Kn media */
         }
         u;
         static UINT8 _magic[LUKS_MAGIC_SIZE] = LUKS_MAGIC_INITIALIZER;
@@ -203,8 +216,37 @@ EFI_STATUS WrapBootBIO(
         /* Fix the byte order of the hader */
         LUKSFixByteOrder(&u.header);
 
-        /* Adjust the last block field (omit leading LUKS metadata) */
-        _block_io.media.LastBlock -= u.header.payload_offset;
+        /* LUKS2 keeps the payload offset in its JSON metadata */
+        if (u.header.version == 2)
+        {
+            LUKS2Header* header;
+
+            if (!(header = (LUKS2Header*)Malloc(sizeof(LUKS2Header))))
+                goto done;
+
+            if (LUKS2ReadHeader(globals.cachedev, header) != 0)
+            {
+                LOGE(L"WrapBootBIO(): LUKS2ReadHeader() failed"); 
+                Free(header);
+                goto done;
+            }
+
+            u.header.payload_offset = header->header.payload_offset;
+            Free(header);
+        }
+
+        /* Adjust the last block field (omit leading LUKS metadata). Blocks
+         * are those of the LUKS device (LUKS2 sectors may exceed the media
+         * block size) */
+        {
+            UINT64 size = (_block_io.media.LastBlock + 1) * 
+                _block_io.media.BlockSize;
+            UINTN blksize = BlkdevBlockSize(bootdev);
+
+            size -= (UINT64)u.header.payload_offset * LUKS_SECTOR_SIZE;
+            _block_io.media.BlockSize = blksize;
+            _block_io.media.LastBlock = size / blksize - 1;
+        }
     }
 
     /* Set the function pointers */
@@ -40,11 +40,32 @@
 #include <lsvmutils/luksblkdev.h>
 #include <lsvmutils/efifile.h>
 #include <lsvmutils/cacheblkdev.h>
+#include <lsvmutils/statsblkdev.h>
 #include "luksbio.h"
 #include "paths.h"
 #include "strings.h"
 #include "log.h"
 
+/* Memory budget of the plaintext cache stacked on the LUKS device */
+#define PLAINTEXT_CACHE_BUDGET (8 * 1024 * 1024)
+
+/* Count the I/O that passes through this point of the stack (if possible) */
+static Blkdev* _AddStats(
+    Blkdev* dev,
+    const char* name)
+{
+    Blkdev* statsdev;
+
+    if (globals.numStatsdevs == MAX_STATSDEVS)
+        return dev;
+
+    if (!(statsdev = NewStatsBlkdev(dev, name)))
+        return dev;
+
+    globals.statsdevs[globals.numStatsdevs++] = statsdev;
+    return statsdev;
+}
+
 Blkdev* GetBootDevice(
     EFI_HANDLE imageHandle,
     EFI_TCG2_PROTOCOL* tcg2Protocol,
@@ -55,11 +76,16 @@ Blkdev* GetBootDevice(
     Blkdev* rawdev = NULL;
     Blkdev* bootdev = NULL;
     Blkdev* cachedev = NULL;
+    Blkdev* plaindev = NULL;
+    Blkdev* luksdev = NULL;
+    Blkdev* topdev = NULL;
+    UINTN numStatsdevs = globals.numStatsdevs;
 
-    /* bootdev -> cachedev -> rawdev -> bio */
+    /* [ext2] -> plaindev -> [luks] -> bootdev -> cachedev -> [bio] -> rawdev 
+     * (where [name] is a statistics device) */
 
-    if (globals.bootdev)
-        return globals.bootdev;
+    if (globals.fsdev)
+        return globals.fsdev;
 
     /* Open 'LUKS BIO' */
     if (!(bio = OpenLUKSBIO(imageHandle, globals.bootDevice)))
@@ -76,6 +102,8 @@ Blkdev* GetBootDevice(
         goto done;
     }
 
+    rawdev = _AddStats(rawdev, "bio");
+
     /* Wrap 'raw device' in 'cache device' */
     if (!(cachedev = NewCacheBlkdev(rawdev)))
     {
@@ -84,30 +112,132 @@ Blkdev* GetBootDevice(
         goto done;
     }
 
-#if 0
-    /* Enable caching to prevent writes to boot partition */
-    /* cachedev->SetFlags(cachedev, BLKDEV_ENABLE_CACHING); */
-#endif
+    /* Cache the ciphertext so that sequential reads (the kernel and initrd
+     * loads) read ahead. Writes still pass through to the boot partition. */
+    cachedev->SetFlags(
+        cachedev, 
+        BLKDEV_ENABLE_CACHING | BLKDEV_WRITE_THROUGH);
 
-    /* Wrap 'cache device' in 'LUKS device' */
+    /* Wrap 'cache device' in 'LUKS device' (trying the keyslot that the
+     * sealed key opened last time first) */
     LOGD(L"GetBootDevice::LUKSBlkdevFromRawBytes");
-    if (!(bootdev = LUKSBlkdevFromRawBytes(
+    if (!(bootdev = LUKSBlkdevFromRawBytesWithHint(
         cachedev, 
         masterkeyData,
-        masterkeySize)))
+        masterkeySize,
+        globals.bootkeySlot,
+        NULL)))
     {
         LOGE(L"LUKSBlkdevNew() failed: LUKSBlkdevFromPassphrase2()");
         cachedev->Close(cachedev);
         goto done;
     }
 
+    /* Wrap 'LUKS device' in 'plaintext cache device' (avoids decrypting
+     * the same blocks repeatedly). Writes pass through to the LUKS device
+     * so that 'cache device' still decides whether they reach the disk.
+     */
+    luksdev = _AddStats(bootdev, "luks");
+
+    if (!(plaindev = NewCacheBlkdevWithBudget(
+        luksdev, 
+        PLAINTEXT_CACHE_BUDGET)))
+    {
+        LOGE(L"NewCacheBlkdevWithBudget() failed");
+        luksdev->Close(luksdev);
+        goto done;
+    }
+
+    /* Read ahead only in the ciphertext cache (enabled above): reading
+     * ahead here as well would decrypt blocks that may never be used */
+    CacheBlkdevSetReadAhead(plaindev, 0);
+    plaindev->SetFlags(plaindev, BLKDEV_ENABLE_CACHING | BLKDEV_WRITE_THROUGH);
+
     globals.bootbio = bio;
     globals.cachedev = cachedev;
     globals.bootdev = bootdev;
+    globals.plaindev = plaindev;
+
+    topdev = _AddStats(plaindev, "ext2");
+    globals.fsdev = topdev;
 
 done:
 
-    return bootdev;
+    /* Forget statistics devices of a stack that was not completed */
+    if (!topdev)
+        globals.numStatsdevs = numStatsdevs;
+
+    return topdev;
+}
+
+void LogBootDeviceStats(void)
+{
+    UINTN i;
+
+    for (i = 0; i < globals.numStatsdevs; i++)
+    {
+        Blkdev* dev = globals.statsdevs[i];
+        StatsBlkdevCounters c;
+
+        StatsBlkdevGetCounters(dev, &c);
+
+        LOGI(L"I/O stats: %a: reads=%ld blocks=%ld seq=%ld usec=%ld "
+            L"max=%ld p50<%ld p99<%ld",
+            Str(StatsBlkdevName(dev)),
+            (long)c.reads.requests,
+            (long)c.reads.blocks,
+            (long)c.reads.sequential,
+            (long)c.reads.totalMicroseconds,
+            (long)c.reads.maxMicroseconds,
+            (long)StatsBlkdevPercentile(&c.reads, 50),
+            (long)StatsBlkdevPercentile(&c.reads, 99));
+
+        LOGI(L"I/O stats: %a: writes=%ld blocks=%ld usec=%ld flushes=%ld",
+            Str(StatsBlkdevName(dev)),
+            (long)c.writes.requests,
+            (long)c.writes.blocks,
+            (long)c.writes.totalMicroseconds,
+            (long)c.flushes);
+    }
+}
+
+static void _LogCacheStats(
+    Blkdev* dev,
+    const char* name)
+{
+    CacheBlkdevCounters c;
+
+    if (!dev)
+        return;
+
+    CacheBlkdevGetCounters(dev, &c);
+
+    LOGI(L"Cache stats: %a: hits=%ld misses=%ld evictions=%ld "
+        L"blocks=%ld/%ld dirty=%ld",
+        Str(name),
+        (long)c.hits,
+        (long)c.misses,
+        (long)c.evictions,
+        (long)c.numBlocks,
+        (long)c.maxBlocks,
+        (long)c.numDirty);
+
+    LOGI(L"Cache stats: %a: prefetched=%ld used=%ld wasted=%ld "
+        L"flushes=%ld flushed=%ld",
+        Str(name),
+        (long)c.prefetched,
+        (long)c.prefetchHits,
+        (long)c.prefetchWasted,
+        (long)c.flushes,
+        (long)c.flushedBlocks);
+}
+
+/* The ciphertext cache reads ahead for the kernel and initrd loads and the
+ * plaintext cache keeps decrypted metadata blocks */
+void LogBootCacheStats(void)
+{
+    _LogCacheStats(globals.cachedev, "ciphertext");
+    _LogCacheStats(globals.plaindev, "plaintext");
 }
 
 EXT2* OpenBootFS(
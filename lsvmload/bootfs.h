@@ -41,6 +41,13 @@ Blkdev* GetBootDevice(
     const UINT8* masterkeyData,
     UINTN masterkeySize);
 
+/* Log the I/O statistics of each layer of the boot device */
+void LogBootDeviceStats(void);
+
+/* Log the counters of the ciphertext and plaintext caches (both hold
+ * blocks, so their budgets can be sized from these counters) */
+void LogBootCacheStats(void);
+
 EXT2* OpenBootFS(
     EFI_HANDLE imageHandle,
     EFI_TCG2_PROTOCOL* tcg2Protocol,
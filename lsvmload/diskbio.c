@@ -45,8 +45,6 @@
 #include "logging.h"
 #include "initrd.h"
 
-#define BLOCK_SIZE 512
-
 #define MAX_REGIONS 8
 
 typedef union _U
@@ -59,6 +57,18 @@ U;
 /* Cached GPT sectors */
 static U _u;
 
+/* GPT header and entries within _u (their offsets depend on the block size) */
+static GPTHeader* _header = &_u.gpt.header;
+static GPTEntry* _entries = _u.gpt.entries;
+
+/* Logical block size of the root disk (4096 for 4K native disks) */
+static UINT32 _blockSize = BLOCK_SIZE;
+
+UINT32 GetDiskBlockSize(void)
+{
+    return _blockSize;
+}
+
 int GetGPTEntry(
     UINTN partitionNumber,
     GPTEntry** entry)
@@ -73,7 +83,7 @@ int GetGPTEntry(
 
     for (i = 0; i < GPT_MAX_ENTRIES; i++)
     {
-        GPTEntry* e = &_u.gpt.entries[i];
+        GPTEntry* e = &_entries[i];
 
         /* If end of entries */
         if (e->typeGUID1 == 0)
@@ -107,13 +117,13 @@ int AddPartition(
 
     for (i = 1; i < GPT_MAX_ENTRIES; i++)
     {
-        GPTEntry* entry = &_u.gpt.entries[i];
+        GPTEntry* entry = &_entries[i];
 
         /* If the entry in this slot is available */
         if (entry->typeGUID1 == 0)
         {
             /* Copy the previous entry to pick up type GUID */
-            Memcpy(entry, &_u.gpt.entries[i-1], sizeof(GPTEntry));
+            Memcpy(entry, &_entries[i-1], sizeof(GPTEntry));
 
             /* Set the guid */
             SplitGUID(guid, &entry->uniqueGUID1, &entry->uniqueGUID2);
@@ -126,9 +136,9 @@ int AddPartition(
             Wcslcpy(entry->typeName, name, sizeof(entry->typeName));
 
             /* Increase size of disk if necessary */
-            if (lastLBA > _u.gpt.header.lastUsableLBA)
+            if (lastLBA > _header->lastUsableLBA)
             {
-                _u.gpt.header.lastUsableLBA = lastLBA;
+                _header->lastUsableLBA = lastLBA;
                 _bio->Media->LastBlock = lastLBA;
             }
 
@@ -145,7 +155,7 @@ typedef struct _Region
     RegionId id;
     UINT64 firstLBA;
     UINT64 lastLBA;
-    UINT64 numBlocks;
+    UINT64 numBlocks; /* blocks of _blockSize bytes */
     BOOLEAN readOnly;
     Block* blocks;
     EFI_BLOCK_IO* bio; /* if non-null, use it to get blocks */
@@ -183,9 +193,9 @@ int AddRegion(
     _regions[_nregions].bio = bio;
     _nregions++;
 
-    if (lastLBA > _u.gpt.header.lastUsableLBA)
+    if (lastLBA > _header->lastUsableLBA)
     {
-        _u.gpt.header.lastUsableLBA = lastLBA;
+        _header->lastUsableLBA = lastLBA;
         _bio->Media->LastBlock = lastLBA;
     }
 
@@ -233,6 +243,7 @@ static EFI_STATUS EFIAPI _EFI_BLOCK_IO_ReadBlocksHook(
     BOOLEAN enableIOHooks = globals.enableIOHooks;
     UINT8* ptr = (UINT8*)buffer;
     UINTN rem = bufferSize;
+    UINTN blockSize = this->Media->BlockSize;
 
     if (!globals.enableIOHooks)
         return _EFI_BLOCK_IO_ReadBlocks(this, mediaId, lba, rem, ptr);
@@ -259,7 +270,7 @@ static EFI_STATUS EFIAPI _EFI_BLOCK_IO_ReadBlocksHook(
 
         for (i = lba; i <= reg->lastLBA && rem > 0; i++)
         {
-            Block block;
+            UINT8 block[BLKDEV_MAX_BLKSIZE];
             EFI_LBA localLBA = i - reg->firstLBA;
 
             if (reg->bio)
@@ -269,8 +280,8 @@ static EFI_STATUS EFIAPI _EFI_BLOCK_IO_ReadBlocksHook(
                     reg->bio,
                     reg->bio->Media->MediaId,
                     localLBA,
-                    sizeof(Block),
-                    &block) != EFI_SUCCESS)
+                    blockSize,
+                    block) != EFI_SUCCESS)
                 {
                     LOGE(L"ReadBlocks() failed: 1");
                     goto done;
@@ -279,19 +290,24 @@ static EFI_STATUS EFIAPI _EFI_BLOCK_IO_ReadBlocksHook(
             else
             {
                 if (localLBA < reg->numBlocks)
-                    Memcpy(&block, &reg->blocks[localLBA], sizeof(Block));
+                {
+                    Memcpy(
+                        block, 
+                        (UINT8*)reg->blocks + localLBA * blockSize, 
+                        blockSize);
+                }
                 else
-                    Memset(&block, 0, sizeof(Block));
+                    Memset(block, 0, blockSize);
             }
 
             /* Copy block to caller's buffer */
             {
-                UINTN n = sizeof(Block);
+                UINTN n = blockSize;
 
                 if (n > rem)
                     n = rem;
 
-                Memcpy(ptr, block.data, n);
+                Memcpy(ptr, block, n);
                 ptr += n;
                 rem -= n;
             }
@@ -333,6 +349,7 @@ static EFI_STATUS EFIAPI _EFI_BLOCK_IO_WriteBlocksHook(
     UINT8* buffer = (UINT8*)voidBuffer;
     Region* reg;
     BOOLEAN enableIOHooks = globals.enableIOHooks;
+    UINTN blockSize = this->Media->BlockSize;
 
     if (!globals.enableIOHooks)
         return _EFI_BLOCK_IO_WriteBlocks(this, mediaId, lba, bufferSize, buffer);
@@ -359,18 +376,18 @@ static EFI_STATUS EFIAPI _EFI_BLOCK_IO_WriteBlocksHook(
 
         for (i = lba; i <= reg->lastLBA && bufferSize > 0; i++)
         {
-            Block block;
+            UINT8 block[BLKDEV_MAX_BLKSIZE];
             EFI_LBA localLBA = i - reg->firstLBA;
 
             /* Copy caller's buffer onto block */
             {
-                UINTN n = sizeof(Block);
+                UINTN n = blockSize;
 
                 if (n > bufferSize)
                     n = bufferSize;
 
-                Memset(block.data, 0, sizeof(Block));
-                Memcpy(block.data, buffer, n);
+                Memset(block, 0, blockSize);
+                Memcpy(block, buffer, n);
                 buffer += n;
                 bufferSize -= n;
             }
@@ -383,8 +400,8 @@ static EFI_STATUS EFIAPI _EFI_BLOCK_IO_WriteBlocksHook(
                     reg->bio,
                     reg->bio->Media->MediaId,
                     localLBA,
-                    sizeof(Block),
-                    &block) != EFI_SUCCESS)
+                    blockSize,
+                    block) != EFI_SUCCESS)
                 {
                     LOGE(L"WriteBlocks() failed 1: lba=%d", (int)i);
                     goto done;
@@ -392,14 +409,19 @@ static EFI_STATUS EFIAPI _EFI_BLOCK_IO_WriteBlocksHook(
 
 #if 0
                 LOGI(L"WRITE: lba=%d localLBA=%d", (int)i, (int)localLBA);
-                LogASCIIStr(L"WRITE", (UINT8*)&block, sizeof(Block));
-                LogHexStr(L"WRITE", (UINT8*)&block, sizeof(Block));
+                LogASCIIStr(L"WRITE", block, blockSize);
+                LogHexStr(L"WRITE", block, blockSize);
 #endif
             }
             else
             {
                 if (localLBA < reg->numBlocks)
-                    Memcpy(&reg->blocks[localLBA], &block, sizeof(Block));
+                {
+                    Memcpy(
+                        (UINT8*)reg->blocks + localLBA * blockSize, 
+                        block, 
+                        blockSize);
+                }
                 else
                 {
                     /* Ignore excess writes */
@@ -535,22 +557,43 @@ EFI_STATUS InstallRootBIO(
     bio->WriteBlocks = _EFI_BLOCK_IO_WriteBlocksHook;
     bio->FlushBlocks = _EFI_BLOCK_IO_FlushBlocksHook;
 
+    /* Reject block sizes that the region buffers cannot hold */
+    if (!BlkdevValidBlockSize(bio->Media->BlockSize))
+    {
+        LOGE(L"unsupported block size: %d", (int)bio->Media->BlockSize);
+        goto done;
+    }
+
+    _blockSize = bio->Media->BlockSize;
+
     /* Read the GPT into memory (LBA 0) */
     if (_EFI_BLOCK_IO_ReadBlocks(
         bio, 
         bio->Media->MediaId, 
         0, /* lba */
-        sizeof(_u.gpt),
-        &_u.gpt) != EFI_SUCCESS)
+        sizeof(_u),
+        &_u) != EFI_SUCCESS)
     {
         LOGE(L"failed to read GPT");
         goto done;
     }
 
+    /* The GPT header is in LBA 1 and the entries start at firstEntryLBA */
+    _header = (GPTHeader*)((UINT8*)&_u + _blockSize);
+
+    if (_header->firstEntryLBA * _blockSize + 
+        GPT_MAX_ENTRIES * sizeof(GPTEntry) > sizeof(_u))
+    {
+        LOGE(L"GPT entries out of range");
+        goto done;
+    }
+
+    _entries = (GPTEntry*)((UINT8*)&_u + _header->firstEntryLBA * _blockSize);
+
     /* Add GPT to list of regions */
     {
         const UINT64 firstRegion = 0;
-        const UINT64 lastRegion = (sizeof(_u) / BLOCK_SIZE) - 1;
+        const UINT64 lastRegion = (sizeof(_u) / _blockSize) - 1;
 
         if (AddRegion(
             REGION_ID_GPT,
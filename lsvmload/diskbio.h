@@ -55,7 +55,10 @@ typedef enum _RegionId
 }
 RegionId;
 
-/* Either 'blocks' or 'bio' must be null */
+/* Logical block size of the root disk (all LBAs are in these units) */
+UINT32 GetDiskBlockSize(void);
+
+/* Either 'blocks' or 'bio' must be null ('numBlocks' counts disk blocks) */
 int AddRegion(
     RegionId id,
     UINT64 firstLBA, 
@@ -316,7 +316,7 @@ int MapEFIVFAT(
         REGION_ID_ESP,
         entry->startingLBA,
         entry->endingLBA,
-        efivfat_size / GPT_BLOCK_SIZE,
+        efivfat_size / GetDiskBlockSize(),
         TRUE,
         (Block*)efivfat,
         NULL) != 0)
@@ -40,6 +40,9 @@
 #include <lsvmutils/initrd.h>
 #include <lsvmutils/strarr.h>
 
+/* Maximum number of I/O statistics devices in the boot device stack */
+#define MAX_STATSDEVS 4
+
 /* All global variables for this binary */
 
 typedef struct _Globals
@@ -78,6 +81,16 @@ typedef struct _Globals
     /* Cache device that bootdev uses */
     Blkdev* cachedev;
 
+    /* Plaintext cache device stacked on bootdev */
+    Blkdev* plaindev;
+
+    /* Device the boot file system uses (plaindev or statistics over it) */
+    Blkdev* fsdev;
+
+    /* I/O statistics devices between the boot device layers */
+    Blkdev* statsdevs[MAX_STATSDEVS];
+    UINTN numStatsdevs;
+
     /* Sealed keys */
     CHAR16* sealedKeysPath;
     TPM2X_BLOB sealedKeys;
@@ -88,13 +101,21 @@ typedef struct _Globals
     BOOLEAN bootkeyFound;
     UINT8* bootkeyData;
     UINTN bootkeySize;
+    UINTN bootkeySlot; /* LUKS keyslot to try first */
 
     /* rootkey */
     BOOLEAN rootkeyFound;
     UINT8* rootkeyData;
     UINTN rootkeySize;
+    UINTN rootkeySlot; /* LUKS keyslot to try first */
     BOOLEAN rootkeyValid;
 
+    /* Master key of the root device (from TestRootDevice()), injected into
+     * the initrd when lsvmconf has "InjectRootVolumeKey=true" */
+    BOOLEAN injectRootVolumeKey;
+    UINT8* rootVolumeKeyData;
+    UINTN rootVolumeKeySize;
+
     /* specialization file */
     CHAR16* specializePath;
 
@@ -175,6 +175,8 @@ int PatchInitrd(
                     globals.bootkeySize,
                     globals.rootkeyData,
                     globals.rootkeySize,
+                    globals.rootVolumeKeyData,
+                    globals.rootVolumeKeySize,
                     &newInitrdData,
                     &newInitrdSize) != 0)
                 {
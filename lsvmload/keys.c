@@ -274,6 +274,23 @@ EFI_STATUS UnsealKeys(
         goto done;
     }
 
+    /* Try the keyslots that the keys opened when they were sealed */
+    {
+        KEYS_SLOT_HINTS hints;
+
+        if (GetKeySlotHints(
+            globals.unsealedKeys,
+            globals.unsealedKeySize,
+            &hints) == 0)
+        {
+            if (hints.BootSlot != KEYS_SLOT_HINT_NONE)
+                globals.bootkeySlot = hints.BootSlot;
+
+            if (hints.RootSlot != KEYS_SLOT_HINT_NONE)
+                globals.rootkeySlot = hints.RootSlot;
+        }
+    }
+
     globals.bootkeyFound = TRUE;
     globals.rootkeyFound = TRUE;
     status = EFI_SUCCESS;
@@ -95,6 +95,18 @@ static int _confCallback(
 
         Strcpy(globals.rootDevice, value);
     }
+    else if (Strcmp(name, "InjectRootVolumeKey") == 0)
+    {
+        if (Strcmp(value, "true") == 0)
+            globals.injectRootVolumeKey = TRUE;
+        else if (Strcmp(value, "false") == 0)
+            globals.injectRootVolumeKey = FALSE;
+        else
+        {
+            SetErr(err, L"invalid InjectRootVolumeKey option: %a", Str(value));
+            goto done;
+        }
+    }
     else if (Strcmp(name, "BootDevice") != 0 && Strcmp(name, "RootDevice") != 0)
     {
         // BootDevice/RootDevice are used elsewhere. Any other key is an error
@@ -54,7 +54,7 @@ static BOOLEAN _MatchBIO(
     union
     {
         LUKSHeader header;
-        UINT8 blocks[LUKS_SECTOR_SIZE*2];
+        UINT8 blocks[BLKDEV_MAX_BLKSIZE]; /* whole blocks on 4Kn media */
     }
     u;
 
@@ -65,8 +65,8 @@ static BOOLEAN _MatchBIO(
         goto done;
     }
 
-    /* Check that block size is not LUKS_SECTOR_SIZE */
-    if (BlockSizeBIO(bio) != LUKS_SECTOR_SIZE)
+    /* Check for a supported block size (512 or 4096 on 4Kn media) */
+    if (!BlkdevValidBlockSize(BlockSizeBIO(bio)))
         goto done;
 
     /* Read the LUKS header (blkno == 0) */
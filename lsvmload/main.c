@@ -37,6 +37,7 @@
 #include <lsvmutils/alloc.h>
 #include <lsvmutils/strings.h>
 #include <lsvmutils/cacheblkdev.h>
+#include <lsvmutils/luks.h>
 #include <xz/lzmaextras.h>
 #include <zlib/zlibextras.h>
 #include <time.h>
@@ -107,6 +108,10 @@ EFI_STATUS efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
     /* Set measured boot failure flag (innocent till proven guilty) */
     globals.measuredBootFailed = TRUE;
 
+    /* No keyslot hints until the sealed keys provide them */
+    globals.bootkeySlot = LUKS_SLOT_HINT_NONE;
+    globals.rootkeySlot = LUKS_SLOT_HINT_NONE;
+
     /* Print the logo */
     PrintSplashScreen();
 
@@ -228,6 +233,7 @@ EFI_STATUS efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
             Free(globals.bootkeyData);
             globals.bootkeyData = NULL;
             globals.bootkeySize = 0;
+            globals.bootkeySlot = LUKS_SLOT_HINT_NONE;
             break;
         }
 
@@ -376,6 +382,15 @@ EFI_STATUS efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
         }
     }
 
+    /* The root volume key is no longer needed once in the initrd */
+    if (globals.rootVolumeKeyData)
+    {
+        Memset(globals.rootVolumeKeyData, 0, globals.rootVolumeKeySize);
+        Free(globals.rootVolumeKeyData);
+        globals.rootVolumeKeyData = NULL;
+        globals.rootVolumeKeySize = 0;
+    }
+
 #if 0
     /* Print cachedev stats */
     if (globals.cachedev)
@@ -400,6 +415,12 @@ EFI_STATUS efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
     }
 #endif
 
+    /* Record how long each layer of the boot device spent on I/O */
+    LogBootDeviceStats();
+
+    /* Record how well the boot device caches did (to size their budgets) */
+    LogBootCacheStats();
+
     /* If this line was reached, measured boot worked */
     globals.measuredBootFailed = FALSE;
 
@@ -31,6 +31,7 @@
 #include <lsvmutils/eficommon.h>
 #include <lsvmutils/efiblkdev.h>
 #include <lsvmutils/luksblkdev.h>
+#include <lsvmutils/strings.h>
 #include "luksbio.h"
 #include "globals.h"
 #include "log.h"
@@ -68,15 +69,34 @@ int TestRootDevice(
 
     LOGD(L"TestRootDevice::LUKSBlkdevFromRawBytes");
     /* Wrap 'cache device' in 'LUKS device' */
-    if (!(rootdev = LUKSBlkdevFromRawBytes(
+    if (!(rootdev = LUKSBlkdevFromRawBytesWithHint(
         rawdev, 
         passphraseData,
-        passphraseSize)))
+        passphraseSize,
+        globals.rootkeySlot,
+        NULL)))
     {
         rawdev->Close(rawdev);
         goto done;
     }
 
+    /* Keep the master key for the initrd (saves its key derivation) */
+    if (globals.injectRootVolumeKey && !globals.rootVolumeKeyData)
+    {
+        const UINT8* data;
+        UINTN size;
+
+        if (LUKSBlkdevGetMasterKey(rootdev, &data, &size) == 0 &&
+            (globals.rootVolumeKeyData = (UINT8*)Memdup(data, size)))
+        {
+            globals.rootVolumeKeySize = size;
+        }
+        else
+        {
+            LOGW(L"failed to keep the root volume key");
+        }
+    }
+
     /* Close the device */
     rootdev->Close(rootdev);
 
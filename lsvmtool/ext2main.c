@@ -40,6 +40,10 @@
 #include <lsvmutils/luks.h>
 #include <lsvmutils/luksblkdev.h>
 #include <lsvmutils/cacheblkdev.h>
+#include <lsvmutils/uringblkdev.h>
+#include <lsvmutils/vhdblkdev.h>
+#include <lsvmutils/statsblkdev.h>
+#include <lsvmutils/overlayblkdev.h>
 #include <lsvmutils/file.h>
 #include <lsvmutils/guid.h>
 
@@ -788,6 +792,169 @@ done:
     return status;
 }
 
+static int _extents_command(
+    EXT2* ext2,
+    int argc, 
+    const char* argv[])
+{
+    int status = 0;
+    EXT2Inode inode;
+    Buf extents = BUF_INITIALIZER;
+    const EXT2Extent* p;
+    const EXT2Extent* end;
+
+    /* Check arguments */
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s PATH\n", argv[0]);
+        status = 1;
+        goto done;
+    }
+
+    /* Get the runs of this file */
+    if (EXT2PathToInode(ext2, argv[1], NULL, &inode) != EXT2_ERR_NONE ||
+        EXT2GetExtents(ext2, &inode, &extents) != EXT2_ERR_NONE)
+    {
+        fprintf(stderr, "%s: EXT2GetExtents() failed\n", argv[0]);
+        status = 1;
+        goto done;
+    }
+
+    /* Print the runs: logical block, physical block, count */
+    p = (const EXT2Extent*)extents.data;
+    end = p + extents.size / sizeof(EXT2Extent);
+
+    for (; p != end; p++)
+    {
+        printf("%u %u %u%s\n", p->lblkno, p->blkno, p->count, 
+            (p->flags & EXT2_EXTENT_UNINIT) ? " uninit" : "");
+    }
+
+    printf("\n");
+
+done:
+
+    BufRelease(&extents);
+
+    return status;
+}
+
+static int _map_command(
+    EXT2* ext2,
+    int argc, 
+    const char* argv[])
+{
+    int status = 0;
+    EXT2File* file = NULL;
+    Buf extents = BUF_INITIALIZER;
+    const EXT2Extent* p;
+    const EXT2Extent* end;
+
+    /* Check arguments */
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: %s PATH LBLKNO COUNT\n", argv[0]);
+        status = 1;
+        goto done;
+    }
+
+    /* Open the file */
+    if (!(file = EXT2OpenFile(ext2, argv[1], EXT2FILE_RDONLY)))
+    {
+        fprintf(stderr, "%s: failed to open: %s\n", argv[0], argv[1]);
+        status = 1;
+        goto done;
+    }
+
+    /* Map the given range of blocks */
+    if (EXT2MapBlocks(
+        file, 
+        strtoul(argv[2], NULL, 10),
+        strtoul(argv[3], NULL, 10),
+        &extents) != EXT2_ERR_NONE)
+    {
+        fprintf(stderr, "%s: EXT2MapBlocks() failed\n", argv[0]);
+        status = 1;
+        goto done;
+    }
+
+    /* Print the runs: logical block, physical block, count */
+    p = (const EXT2Extent*)extents.data;
+    end = p + extents.size / sizeof(EXT2Extent);
+
+    for (; p != end; p++)
+    {
+        printf("%u %u %u%s\n", p->lblkno, p->blkno, p->count, 
+            (p->flags & EXT2_EXTENT_UNINIT) ? " uninit" : "");
+    }
+
+    printf("\n");
+
+done:
+
+    if (file)
+        EXT2CloseFile(file);
+
+    BufRelease(&extents);
+
+    return status;
+}
+
+static void _PrintHitRate(
+    const char* name,
+    UINTN hits,
+    UINTN misses)
+{
+    UINTN total = hits + misses;
+
+    printf("%s: %lu hits, %lu misses (%lu%%)\n", name, (unsigned long)hits, 
+        (unsigned long)misses, 
+        total ? (unsigned long)(hits * 100 / total) : 0UL);
+}
+
+static int _lookup_command(
+    EXT2* ext2,
+    int argc, 
+    const char* argv[])
+{
+    int status = 0;
+    EXT2CacheStats stats;
+    int i;
+
+    /* Check arguments */
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s PATH...\n", argv[0]);
+        status = 1;
+        goto done;
+    }
+
+    /* Resolve each path */
+    for (i = 1; i < argc; i++)
+    {
+        EXT2Ino ino;
+
+        if (EXT2PathToIno(ext2, argv[i], &ino) != EXT2_ERR_NONE)
+        {
+            fprintf(stderr, "%s: not found: %s\n", argv[0], argv[i]);
+            status = 1;
+            continue;
+        }
+
+        printf("%u %s\n", ino, argv[i]);
+    }
+
+    /* Print the cache hit rates */
+    EXT2GetCacheStats(ext2, &stats);
+    _PrintHitRate("inodes", stats.inode_hits, stats.inode_misses);
+    _PrintHitRate("inode-table blocks", stats.block_hits, stats.block_misses);
+    _PrintHitRate("directory entries", stats.dentry_hits, stats.dentry_misses);
+
+done:
+
+    return status;
+}
+
 static int _uuid_command(
     EXT2* ext2,
     int argc, 
@@ -915,6 +1082,21 @@ static Command _commands[] =
         "Print out the blocks used by this file",
         _blocks_command,
     },
+    {
+        "extents", 
+        "Print out the block runs (logical, physical, count) of this file",
+        _extents_command,
+    },
+    {
+        "map", 
+        "Print out the block runs of a range of blocks of this file",
+        _map_command,
+    },
+    {
+        "lookup", 
+        "Resolve paths to inode numbers and print cache hit rates",
+        _lookup_command,
+    },
     {
         "uuid", 
         "Print out the UUID of this EXT2 file system",
@@ -940,10 +1122,16 @@ int ext2_main(
     const char* keyfile = NULL;
     const char* masterkeyfile = NULL;
     char* passphrase = NULL;
+    char* passphraseAlloc = NULL;
     size_t passphraseSize = 0;
     UINT8* masterkey = NULL;
     size_t masterkeySize;
     BOOLEAN cached = FALSE;
+    UINT32 openFlags = 0;
+    BOOLEAN dryrun = FALSE;
+    const char* deltafile = NULL;
+    BOOLEAN commit = FALSE;
+    Blkdev* overlay = NULL;
         
     /* Get the --keyfile option (if any) */
     GetOpt(&argc, argv, "--keyfile", &keyfile);
@@ -967,6 +1155,33 @@ int ext2_main(
     if (GetOpt(&argc, argv, "--cached", NULL) == 1)
         cached = TRUE;
 
+    /* Get the --direct option (bypass the page cache) */
+    if (GetOpt(&argc, argv, "--direct", NULL) == 1)
+        openFlags |= BLKDEV_OPEN_DIRECT;
+
+    /* Get the --mmap option (map the image so reads need not copy it) */
+    if (GetOpt(&argc, argv, "--mmap", NULL) == 1)
+        openFlags |= BLKDEV_OPEN_MMAP;
+
+    /* Get the --dryrun option (keep changes in memory and discard them) */
+    if (GetOpt(&argc, argv, "--dryrun", NULL) == 1)
+        dryrun = TRUE;
+
+    /* Get the --delta option (write changes to this sparse file instead,
+     * adding to the changes it holds from earlier commands) */
+    GetOpt(&argc, argv, "--delta", &deltafile);
+
+    /* Get the --commit option (write the --delta changes to the image) */
+    if (GetOpt(&argc, argv, "--commit", NULL) == 1)
+        commit = TRUE;
+
+    if (commit && (!deltafile || dryrun))
+    {
+        fprintf(stderr, "%s: --commit requires --delta (without --dryrun)\n",
+            argv[0]);
+        exit(1);
+    }
+
     /* If no --ext2fs option, fallback on EXT2FS environment variable */
     if (!ext2fs)
     {
@@ -990,6 +1205,7 @@ int ext2_main(
         }
 
         passphrase[passphraseSize] = '\0';
+        passphraseAlloc = passphrase;
     }
 
     /* Load the masterkey file (if any) */
@@ -1020,13 +1236,86 @@ int ext2_main(
         exit(1);
     }
 
-    /* Open the block device file */
-    if (!(rawdev = BlkdevOpen(ext2fs, BLKDEV_ACCESS_RDWR, 0)))
+    /* A VHD cannot be mapped (it grows as blocks are allocated) */
+    if ((openFlags & BLKDEV_OPEN_MMAP) && IsVHDFile(ext2fs))
+    {
+        fprintf(stderr, "%s: --mmap cannot be used with VHD images\n", 
+            argv[0]);
+        status = 1;
+        goto done;
+    }
+
+    /* Open the block device file (mapped into memory for --mmap, otherwise
+     * asynchronously if the kernel allows). Either way the I/O that reaches
+     * the image is counted if --iostats was given. */
+    if ((openFlags & BLKDEV_OPEN_MMAP) || IsVHDFile(ext2fs))
+    {
+        UINT32 imageFlags = openFlags;
+
+        /* hashdir reads every file under the directory */
+        if (strcmp(argv[1], "hashdir") == 0)
+            imageFlags |= BLKDEV_OPEN_SEQUENTIAL;
+
+        rawdev = BlkdevOpenImage(ext2fs, BLKDEV_ACCESS_RDWR, 0, imageFlags);
+    }
+    else
+    {
+        rawdev = StatsBlkdevWrap(UringBlkdevOpen(
+            ext2fs, 
+            BLKDEV_ACCESS_RDWR, 
+            0, 
+            openFlags,
+            URINGBLKDEV_DEFAULT_DEPTH), ext2fs);
+    }
+
+    if (!rawdev)
     {
         fprintf(stderr, "%s: failed to open: %s\n", argv[0], ext2fs);
         status = 1;
         goto done;
     }
+    /* Redirect writes away from the image */
+    if (dryrun || deltafile)
+    {
+        Blkdev* store = NULL;
+
+        if (deltafile)
+        {
+            FILE* os;
+
+            /* Create the file if needed (blocks are only allocated when
+             * written) but keep the changes of earlier commands */
+            if (!(os = fopen(deltafile, "ab")) || fclose(os) != 0 ||
+                !(store = BlkdevOpen(deltafile, BLKDEV_ACCESS_RDWR, 0, 0)))
+            {
+                fprintf(stderr, "%s: failed to create: %s\n", argv[0], 
+                    deltafile);
+                rawdev->Close(rawdev);
+                status = 1;
+                goto done;
+            }
+
+            overlay = NewOverlayBlkdevWithStore(rawdev, store);
+        }
+        else
+        {
+            overlay = NewOverlayBlkdev(rawdev);
+        }
+
+        if (!overlay)
+        {
+            fprintf(stderr, "%s: failed to create overlay\n", argv[0]);
+
+            if (store)
+                store->Close(store);
+
+            rawdev->Close(rawdev);
+            status = 1;
+            goto done;
+        }
+
+        rawdev = overlay;
+    }
 
     /* Inject cached device into stack */
     if (!(cachedev = NewCacheBlkdev(rawdev)))
@@ -1036,9 +1325,13 @@ int ext2_main(
         goto done;
     }
 
-    /* Enable caching if --cached option given */
+    /* Enable caching if --cached option given (writes never reach disk).
+     * Otherwise hold writes in the cache and write them back in large runs
+     * when the file system is closed. */
     if (cached)
         cachedev->SetFlags(cachedev, BLKDEV_ENABLE_CACHING);
+    else
+        cachedev->SetFlags(cachedev, BLKDEV_ENABLE_CACHING|BLKDEV_WRITE_BACK);
 
     /* Create ext2_file_t object from LUKS or raw device */
     if (IsRawLUKSDevice(cachedev))
@@ -1094,6 +1387,9 @@ int ext2_main(
         dev = cachedev;
     }
 
+    /* Count the I/O that the file system requests (if --iostats) */
+    dev = StatsBlkdevWrap(dev, "ext2");
+
     /* Open the file system (takes ownership of 'file') */
     if (EXT2_IFERR(err = EXT2New(dev, &ext2)))
     {
@@ -1108,7 +1404,47 @@ int ext2_main(
     {
         if (strcmp(argv[1], _commands[i].name) == 0)
         {
-            exit((*_commands[i].callback)(ext2, argc-1, argv+1));
+            status = (*_commands[i].callback)(ext2, argc-1, argv+1);
+
+            /* Write back any changes held by the cache */
+            if (BlkdevFlush(dev) != 0)
+            {
+                fprintf(stderr, "%s: failed to flush: %s\n", argv[0], ext2fs);
+                status = 1;
+            }
+
+            if (overlay && deltafile && commit && status == 0)
+            {
+                UINTN count = OverlayBlkdevCount(overlay);
+
+                /* Write the changes to the image (emptying the delta) */
+                if (OverlayBlkdevCommit(overlay) != 0 || 
+                    BlkdevFlush(overlay) != 0)
+                {
+                    fprintf(stderr, "%s: failed to commit %s to %s\n",
+                        argv[0], deltafile, ext2fs);
+                    status = 1;
+                }
+                else
+                {
+                    fprintf(stderr, "%s: %lu blocks committed to %s\n",
+                        argv[0], (unsigned long)count, ext2fs);
+                }
+            }
+            else if (overlay && deltafile)
+            {
+                fprintf(stderr, "%s: %lu blocks changed (written to %s)\n",
+                    argv[0], (unsigned long)OverlayBlkdevCount(overlay),
+                    deltafile);
+            }
+            else if (overlay)
+            {
+                fprintf(stderr, "%s: %lu blocks changed (discarded)\n",
+                    argv[0], (unsigned long)OverlayBlkdevCount(overlay));
+                OverlayBlkdevDiscard(overlay);
+            }
+
+            goto done;
         }
     }
 
@@ -1120,8 +1456,9 @@ done:
     if (masterkey)
         free(masterkey);
 
-    if (passphrase)
-        free(passphrase);
+    /* Only free a passphrase loaded from the key file (not argv/getpass) */
+    if (passphraseAlloc)
+        free(passphraseAlloc);
 
     if (ext2)
         EXT2Delete(ext2);
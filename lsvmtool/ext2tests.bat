@@ -68,6 +68,17 @@ echo Testing rm
 %target% rm /newdir/main.c
 echo.
 
+echo Testing directory shrink
+%target% mkdir /bigdir
+for /l %%i in (1,1,1000) do %target% put main.c /bigdir/main%%i.c
+for /l %%i in (1,1,990) do %target% rm /bigdir/main%%i.c
+%target% put main.c /bigdir/main.c
+%target% get /bigdir/main.c m3.c
+fc main.c m3.c
+del m3.c
+%target% check
+echo.
+
 echo Final check
 %target% check
 echo.
@@ -63,9 +63,14 @@
 #include <lsvmutils/file.h>
 #include <lsvmutils/linux.h>
 #include <lsvmutils/luks.h>
+#include <lsvmutils/luks2.h>
+#include <lsvmutils/luksblkdev.h>
+#include <lsvmutils/lukscryptpool.h>
+#include <lsvmutils/luksreencrypt.h>
 #include <lsvmutils/dump.h>
 #include <lsvmutils/ext2.h>
 #include <lsvmutils/gpt.h>
+#include <lsvmutils/vhdblkdev.h>
 #include <lsvmutils/guid.h>
 #include <lsvmutils/luks.h>
 #include <lsvmutils/alloc.h>
@@ -3003,7 +3008,7 @@ static int _luks_command(
     keyfile = argv[2];
 
     /* Open the raw block device */
-    if (!(rawdev = BlkdevOpen(luksfs, BLKDEV_ACCESS_RDWR, 0)))
+    if (!(rawdev = BlkdevOpenImage(luksfs, BLKDEV_ACCESS_RDWR, 0, 0)))
     {
         fprintf(stderr, "%s: failed to open: %s\n", argv[0], luksfs);
         status = 1;
@@ -3116,6 +3121,7 @@ static int _luksmk_command(
     const char* mkfile;
     Blkdev* rawdev = NULL;
     LUKSHeader header;
+    LUKS2Header* luks2 = NULL;
     UINT8 *masterKey = NULL;
     UINT8 *passphrase = NULL;
     size_t passphraseSize = 0;
@@ -3133,14 +3139,28 @@ static int _luksmk_command(
     mkfile = argv[3];
 
     /* Open the raw block device */
-    if (!(rawdev = BlkdevOpen(luksfs, BLKDEV_ACCESS_RDWR, 0)))
+    if (!(rawdev = BlkdevOpenImage(luksfs, BLKDEV_ACCESS_RDWR, 0, 0)))
     {
         fprintf(stderr, "%s: failed to open: %s\n", argv[0], luksfs);
         goto done;
     }
 
     /* Read the LUKS header */
-    if (LUKSReadHeader(rawdev, &header) != 0)
+    if (IsRawLUKS2Device(rawdev))
+    {
+        if (!(luks2 = (LUKS2Header*)malloc(sizeof(LUKS2Header))))
+            goto done;
+
+        if (LUKS2ReadHeader(rawdev, luks2) != 0)
+        {
+            fprintf(stderr, "%s: failed to read LUKS2 header: %s\n", 
+                argv[0], luksfs);
+            goto done;
+        }
+
+        header = luks2->header;
+    }
+    else if (LUKSReadHeader(rawdev, &header) != 0)
     {
         fprintf(stderr, "%s: failed to read LUKS header: %s\n", argv[0], 
             luksfs);
@@ -3160,15 +3180,31 @@ static int _luksmk_command(
 
     /* Get the master key */
     {
+        int r;
+
         if (!(masterKey = (UINT8*)malloc(header.key_bytes)))
             goto done;
 
-        if (LUKSGetMasterKey(
-            rawdev, 
-            &header,
-            passphrase,
-            passphraseSize,
-            masterKey) != 0)
+        if (luks2)
+        {
+            r = LUKS2GetMasterKey(
+                rawdev, 
+                luks2,
+                passphrase,
+                passphraseSize,
+                masterKey);
+        }
+        else
+        {
+            r = LUKSGetMasterKey(
+                rawdev, 
+                &header,
+                passphrase,
+                passphraseSize,
+                masterKey);
+        }
+
+        if (r != 0)
         {
             fprintf(stderr, "%s: failed to get master key", argv[0]);
             goto done;
@@ -3207,10 +3243,496 @@ done:
     if (masterKey)
         free(masterKey);
 
+    if (luks2)
+        free(luks2);
+
     return status;
 }
 #endif /* defined(ENABLE_LUKS) */
 
+#if defined(ENABLE_LUKS) && defined(__linux__)
+static double _Seconds(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int _luksbench_command(
+    int argc, 
+    const char* argv[])
+{
+    static const struct
+    {
+        const char* mode;
+        UINT32 keyBytes;
+    }
+    modes[] =
+    {
+        { "xts-plain64", 64 },
+        { "cbc-plain", 32 },
+        { "cbc-essiv:sha256", 32 },
+        { "ecb", 32 },
+    };
+    const size_t bufSize = 1024 * 1024;
+    int status = 1;
+    unsigned long mbytes = 256;
+    UINT8* buf = NULL;
+    size_t i;
+
+    /* Check arguments */
+    if (argc > 2 || (argc == 2 && !(mbytes = strtoul(argv[1], NULL, 10))))
+    {
+        fprintf(stderr, "Usage: %s [MBYTES]\n", argv[0]);
+        goto done;
+    }
+
+    if (!(buf = (UINT8*)malloc(bufSize)))
+    {
+        fprintf(stderr, "%s: malloc() failed\n", argv[0]);
+        goto done;
+    }
+
+    for (i = 0; i < bufSize; i++)
+        buf[i] = (UINT8)i;
+
+    printf("%-18s %14s %14s\n", "MODE", "ENCRYPT(MB/s)", "DECRYPT(MB/s)");
+
+    for (i = 0; i < ARRSIZE(modes); i++)
+    {
+        LUKSHeader header;
+        LUKSCryptContext context;
+        UINT8 key[64];
+        double rates[2];
+        int m;
+        size_t j;
+
+        memset(&header, 0, sizeof(header));
+        Strlcpy(header.cipher_name, "aes", sizeof(header.cipher_name));
+        Strlcpy(header.cipher_mode, modes[i].mode, sizeof(header.cipher_mode));
+        header.key_bytes = modes[i].keyBytes;
+
+        for (j = 0; j < sizeof(key); j++)
+            key[j] = (UINT8)(j * 7 + 1);
+
+        if (LUKSInitCryptContext(&context, &header, key) != 0)
+        {
+            fprintf(stderr, "%s: unsupported mode: %s\n", argv[0], 
+                modes[i].mode);
+            goto done;
+        }
+
+        /* Crypt the buffer in place, one megabyte of sectors at a time */
+        for (m = LUKS_CRYPT_MODE_ENCRYPT; m >= LUKS_CRYPT_MODE_DECRYPT; m--)
+        {
+            double start = _Seconds();
+            double elapsed;
+
+            for (j = 0; j < mbytes; j++)
+            {
+                if (LUKSCryptWithContext(
+                    &context, 
+                    (LUKSCryptMode)m, 
+                    buf, 
+                    buf, 
+                    bufSize,
+                    j * (bufSize / LUKS_SECTOR_SIZE)) != 0)
+                {
+                    fprintf(stderr, "%s: failed to crypt: %s\n", argv[0], 
+                        modes[i].mode);
+                    LUKSFreeCryptContext(&context);
+                    goto done;
+                }
+            }
+
+            elapsed = _Seconds() - start;
+            rates[m] = elapsed > 0 ? mbytes / elapsed : 0;
+        }
+
+        LUKSFreeCryptContext(&context);
+
+        printf("%-18s %14.1f %14.1f\n", modes[i].mode, 
+            rates[LUKS_CRYPT_MODE_ENCRYPT], rates[LUKS_CRYPT_MODE_DECRYPT]);
+    }
+
+    status = 0;
+
+done:
+
+    if (buf)
+        free(buf);
+
+    return status;
+}
+#endif /* defined(ENABLE_LUKS) && defined(__linux__) */
+
+#if defined(ENABLE_LUKS) && defined(__linux__)
+/* Size of an opened device in bytes (the virtual disk size for VHDs) */
+static int _GetDeviceSize(
+    Blkdev* dev,
+    UINT64* size)
+{
+    UINT64 nblocks;
+
+    if (BlkdevGetNumBlocks(dev, &nblocks) != 0)
+        return -1;
+
+    *size = nblocks * BlkdevBlockSize(dev);
+    return 0;
+}
+
+/* Decrypt the LUKS payload into a plain image (or encrypt a plain image
+ * into the payload) on all CPUs */
+static int _lukscrypt_command(
+    int argc, 
+    const char* argv[],
+    int encrypt)
+{
+    int status = 1;
+    const char* luksfs;
+    const char* mkfile;
+    const char* imagefile;
+    const char* threadsOpt = NULL;
+    UINTN nthreads = 0;
+    Blkdev* rawdev = NULL;
+    Blkdev* imagedev = NULL;
+    LUKSHeader header;
+    UINT8* masterKey = NULL;
+    size_t masterKeySize = 0;
+    UINT8 mkDigest[LUKS_DIGEST_SIZE];
+    LUKSCryptPool* pool = NULL;
+    UINT64 payloadOffset;
+    UINT64 luksSize;
+    UINT64 size;
+
+    /* Extract the --threads option (if any) */
+    if (GetOpt(&argc, argv, "--threads", &threadsOpt) < 0)
+    {
+        fprintf(stderr, "%s: missing option argument: --threads\n", argv[0]);
+        goto done;
+    }
+
+    if (threadsOpt)
+        nthreads = strtoul(threadsOpt, NULL, 10);
+
+    /* Check arguments */
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: %s [--threads N] LUKSFS MKFILE %s\n", 
+            argv[0], encrypt ? "INFILE" : "OUTFILE");
+        goto done;
+    }
+
+    /* Collect arguments */
+    luksfs = argv[1];
+    mkfile = argv[2];
+    imagefile = argv[3];
+
+    /* Open the raw block device */
+    if (!(rawdev = BlkdevOpenImage(luksfs, BLKDEV_ACCESS_RDWR, 0, 0)))
+    {
+        fprintf(stderr, "%s: failed to open: %s\n", argv[0], luksfs);
+        goto done;
+    }
+
+    /* Read the LUKS header */
+    if (LUKSReadHeader(rawdev, &header) != 0)
+    {
+        fprintf(stderr, "%s: failed to read LUKS header: %s\n", argv[0], 
+            luksfs);
+        goto done;
+    }
+
+    /* Load the master key and check it against the header */
+    if (LoadFile(mkfile, 0, &masterKey, &masterKeySize) != 0)
+    {
+        fprintf(stderr, "%s: failed to read: %s\n", argv[0], mkfile);
+        goto done;
+    }
+
+    if (masterKeySize != header.key_bytes ||
+        LUKSComputeMKDigest(&header, masterKey, mkDigest) != 0 ||
+        memcmp(mkDigest, header.mk_digest, LUKS_DIGEST_SIZE) != 0)
+    {
+        fprintf(stderr, "%s: wrong master key: %s\n", argv[0], mkfile);
+        goto done;
+    }
+
+    /* Determine the payload size */
+    payloadOffset = (UINT64)header.payload_offset * LUKS_SECTOR_SIZE;
+
+    if (_GetDeviceSize(rawdev, &luksSize) != 0 || luksSize < payloadOffset)
+    {
+        fprintf(stderr, "%s: failed to get size: %s\n", argv[0], luksfs);
+        goto done;
+    }
+
+    size = luksSize - payloadOffset;
+
+    /* Open (or create) the plain image */
+    if (encrypt)
+    {
+        /* The plain image is read once from start to end */
+        if (!(imagedev = BlkdevOpenImage(
+            imagefile, BLKDEV_ACCESS_RDONLY, 0, BLKDEV_OPEN_SEQUENTIAL)))
+        {
+            fprintf(stderr, "%s: failed to open: %s\n", argv[0], imagefile);
+            goto done;
+        }
+
+        if (_GetDeviceSize(imagedev, &size) != 0 || 
+            size % LUKS_SECTOR_SIZE ||
+            size > luksSize - payloadOffset)
+        {
+            fprintf(stderr, "%s: %s must be whole sectors and fit the "
+                "payload of %s\n", argv[0], imagefile, luksfs);
+            goto done;
+        }
+    }
+    else
+    {
+        FILE* os;
+
+        size -= size % LUKS_SECTOR_SIZE;
+
+        if ((os = fopen(imagefile, "wb")) && fclose(os) == 0)
+            imagedev = BlkdevOpenImage(imagefile, BLKDEV_ACCESS_RDWR, 0, 0);
+    }
+
+    if (!imagedev)
+    {
+        fprintf(stderr, "%s: failed to open: %s\n", argv[0], imagefile);
+        goto done;
+    }
+
+    /* Start the workers */
+    if (!(pool = LUKSCryptPoolNew(&header, masterKey, nthreads)))
+    {
+        fprintf(stderr, "%s: failed to start crypt threads\n", argv[0]);
+        goto done;
+    }
+
+    if (encrypt)
+    {
+        if (LUKSCryptPoolCopy(
+            pool,
+            LUKS_CRYPT_MODE_ENCRYPT,
+            imagedev,
+            0,
+            rawdev,
+            payloadOffset,
+            size,
+            0) != 0)
+        {
+            fprintf(stderr, "%s: failed to encrypt: %s\n", argv[0], luksfs);
+            goto done;
+        }
+    }
+    else
+    {
+        if (LUKSCryptPoolCopy(
+            pool,
+            LUKS_CRYPT_MODE_DECRYPT,
+            rawdev,
+            payloadOffset,
+            imagedev,
+            0,
+            size,
+            0) != 0)
+        {
+            fprintf(stderr, "%s: failed to decrypt: %s\n", argv[0], luksfs);
+            goto done;
+        }
+    }
+
+    status = 0;
+
+done:
+
+    if (pool)
+        LUKSCryptPoolDelete(pool);
+
+    if (imagedev)
+        imagedev->Close(imagedev);
+
+    if (rawdev)
+        rawdev->Close(rawdev);
+
+    if (masterKey)
+    {
+        memset(masterKey, 0, masterKeySize);
+        free(masterKey);
+    }
+
+    return status;
+}
+
+static int _luksencrypt_command(
+    int argc, 
+    const char* argv[])
+{
+    return _lukscrypt_command(argc, argv, 1);
+}
+
+static int _luksdecrypt_command(
+    int argc, 
+    const char* argv[])
+{
+    return _lukscrypt_command(argc, argv, 0);
+}
+
+/* Re-encrypt the LUKS payload under a new master key in place, resuming
+ * from CHECKPOINT if an earlier run was interrupted */
+static int _luksreencrypt_command(
+    int argc, 
+    const char* argv[])
+{
+    int status = 1;
+    const char* luksfs;
+    const char* ppfile;
+    const char* ckfile;
+    const char* threadsOpt = NULL;
+    const char* cipherMode = NULL;
+    UINTN nthreads = 0;
+    Blkdev* rawdev = NULL;
+    Blkdev* ckdev = NULL;
+    UINT8* passphrase = NULL;
+    size_t passphraseSize = 0;
+    UINT64 luksSize;
+    UINT64 resumedAt = 0;
+    BOOLEAN created = FALSE;
+    Error err;
+
+    /* Extract the --threads and --cipher-mode options (if any) */
+    if (GetOpt(&argc, argv, "--threads", &threadsOpt) < 0)
+    {
+        fprintf(stderr, "%s: missing option argument: --threads\n", argv[0]);
+        goto done;
+    }
+
+    if (GetOpt(&argc, argv, "--cipher-mode", &cipherMode) < 0)
+    {
+        fprintf(stderr, "%s: missing option argument: --cipher-mode\n", 
+            argv[0]);
+        goto done;
+    }
+
+    if (threadsOpt)
+        nthreads = strtoul(threadsOpt, NULL, 10);
+
+    /* Check arguments */
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: %s [--threads N] [--cipher-mode MODE] "
+            "LUKSFS PPFILE CHECKPOINT\n", argv[0]);
+        goto done;
+    }
+
+    /* Collect arguments */
+    luksfs = argv[1];
+    ppfile = argv[2];
+    ckfile = argv[3];
+
+    /* Load the passphrase file (allocate an extra byte) */
+    if (LoadFile(ppfile, 1, &passphrase, &passphraseSize) != 0)
+    {
+        fprintf(stderr, "%s: failed to read: %s\n", argv[0], ppfile);
+        goto done;
+    }
+
+    passphrase[passphraseSize] = '\0';
+
+    /* Open the raw block device */
+    if (!(rawdev = BlkdevOpenImage(luksfs, BLKDEV_ACCESS_RDWR, 0, 0)) ||
+        _GetDeviceSize(rawdev, &luksSize) != 0)
+    {
+        fprintf(stderr, "%s: failed to open: %s\n", argv[0], luksfs);
+        goto done;
+    }
+
+    /* Open (or create) the checkpoint file */
+    {
+        struct stat st;
+        int fd;
+
+        created = stat(ckfile, &st) != 0;
+
+        if ((fd = open(ckfile, O_WRONLY | O_CREAT, 0600)) >= 0)
+        {
+            close(fd);
+            ckdev = BlkdevOpen(ckfile, BLKDEV_ACCESS_RDWR, 0, 0);
+        }
+
+        if (!ckdev)
+        {
+            fprintf(stderr, "%s: failed to open: %s\n", argv[0], ckfile);
+            goto done;
+        }
+    }
+
+    if (LUKSReencrypt(
+        rawdev,
+        luksSize,
+        ckdev,
+        passphrase,
+        passphraseSize,
+        cipherMode,
+        nthreads,
+        &resumedAt,
+        &err) != 0)
+    {
+        /* Only a checkpoint that holds progress is worth keeping */
+        if (LUKSReencryptHasCheckpoint(ckdev))
+        {
+            fprintf(stderr, "%s: failed to re-encrypt: %s: %s "
+                "(keep %s to resume)\n", argv[0], luksfs, err.buf, ckfile);
+        }
+        else
+        {
+            fprintf(stderr, "%s: failed to re-encrypt: %s: %s\n", 
+                argv[0], luksfs, err.buf);
+
+            if (created)
+            {
+                ckdev->Close(ckdev);
+                ckdev = NULL;
+                unlink(ckfile);
+            }
+        }
+
+        goto done;
+    }
+
+    if (resumedAt)
+    {
+        printf("%s: resumed at byte %llu of the payload\n", argv[0], 
+            (unsigned long long)resumedAt);
+    }
+
+    ckdev->Close(ckdev);
+    ckdev = NULL;
+    unlink(ckfile);
+
+    status = 0;
+
+done:
+
+    if (ckdev)
+        ckdev->Close(ckdev);
+
+    if (rawdev)
+        rawdev->Close(rawdev);
+
+    if (passphrase)
+    {
+        memset(passphrase, 0, passphraseSize);
+        free(passphrase);
+    }
+
+    return status;
+}
+#endif /* defined(ENABLE_LUKS) && defined(__linux__) */
+
 static int _newpart_command(
     int argc, 
     const char** argv)
@@ -3648,7 +4170,7 @@ static int _partuuid_command(
     partition = argv[1];
 
     /* Open device */
-    if (!(dev = BlkdevOpen(partition, BLKDEV_ACCESS_RDWR, 0)))
+    if (!(dev = BlkdevOpenImage(partition, BLKDEV_ACCESS_RDWR, 0, 0)))
     {
         fprintf(stderr, "%s: failed to open: %s\n", argv[0], partition);
         goto done;
@@ -3667,6 +4189,23 @@ static int _partuuid_command(
     {
         printf("%s\n", luksHeader.uuid);
     }
+    else if (IsRawLUKS2Device(dev))
+    {
+        LUKS2Header* luks2;
+
+        if (!(luks2 = (LUKS2Header*)malloc(sizeof(LUKS2Header))))
+            goto done;
+
+        if (LUKS2ReadHeader(dev, luks2) != 0)
+        {
+            fprintf(stderr, "%s: failed to read LUKS2 header\n", argv[0]);
+            free(luks2);
+            goto done;
+        }
+
+        printf("%s\n", luks2->header.uuid);
+        free(luks2);
+    }
     else
     {
         fprintf(stderr, "%s: unable to resolve parition UUID\n", argv[0]);
@@ -3897,13 +4436,26 @@ static int _inject_command(
     size_t bootkeySize;
     unsigned char* rootkeyData = NULL;
     size_t rootkeySize;
+    const char* rootvolumekey = NULL;
+    unsigned char* rootvolumekeyData = NULL;
+    size_t rootvolumekeySize = 0;
     void* outfileData = NULL;
     UINTN outfileSize = 0;
 
+    /* Extract the --rootvolumekey option (if any) */
+    if (GetOpt(&argc, argv, "--rootvolumekey", &rootvolumekey) < 0)
+    {
+        fprintf(stderr, "%s: missing option argument: --rootvolumekey\n", 
+            argv[0]);
+        goto done;
+    }
+
     /* Check the arguments */
     if (argc < 5)
     {
-        fprintf(stderr, "Usage: %s INFILE BOOTKEY ROOTKEY OUTFILE\n", argv[0]);
+        fprintf(stderr, 
+            "Usage: %s [--rootvolumekey FILE] INFILE BOOTKEY ROOTKEY OUTFILE\n",
+            argv[0]);
         goto done;
     }
 
@@ -3934,6 +4486,14 @@ static int _inject_command(
         goto done;
     }
 
+    /* Load the root volume key (raw master key) */
+    if (rootvolumekey && LoadFile(rootvolumekey, 0, &rootvolumekeyData, 
+        &rootvolumekeySize) != 0)
+    {
+        fprintf(stderr, "%s: failed to load: %s\n", argv[0], rootvolumekey);
+        goto done;
+    }
+
     /* Inject the keys into the input file */
     if (InitrdInjectFiles(
         infileData,
@@ -3942,6 +4502,8 @@ static int _inject_command(
         bootkeySize,
         rootkeyData,
         rootkeySize,
+        rootvolumekeyData,
+        rootvolumekeySize,
         &outfileData,
         &outfileSize) != 0)
     {
@@ -3969,6 +4531,12 @@ done:
     if (rootkeyData)
         Free(rootkeyData);
 
+    if (rootvolumekeyData)
+    {
+        Memset(rootvolumekeyData, 0, rootvolumekeySize);
+        Free(rootvolumekeyData);
+    }
+
     if (outfileData)
         Free(outfileData);
 
@@ -4270,6 +4838,41 @@ done:
     return status;
 }
 
+/* Find the LUKS keyslot that the passphrase opens */
+static int _FindKeySlot(
+    const char* path,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    UINT8* slotOut)
+{
+    int rc = -1;
+    Blkdev* rawdev = NULL;
+    Blkdev* dev = NULL;
+    UINTN slot;
+
+    if (!(rawdev = BlkdevOpenImage(path, BLKDEV_ACCESS_RDONLY, 0, 0)))
+        goto done;
+
+    if (!(dev = LUKSBlkdevFromRawBytesWithHint(rawdev, passphrase, 
+        passphraseSize, LUKS_SLOT_HINT_NONE, &slot)))
+    {
+        rawdev->Close(rawdev);
+        goto done;
+    }
+
+    if (slot >= KEYS_SLOT_HINT_NONE)
+        goto done;
+
+    *slotOut = (UINT8)slot;
+    rc = 0;
+
+done:
+
+    if (dev)
+        dev->Close(dev);
+
+    return rc;
+}
 
 static int _serializekeys_command(
     int argc,
@@ -4279,6 +4882,8 @@ static int _serializekeys_command(
     const char* bootkey;
     const char* rootkey;
     const char* outfile;
+    const char* bootdev = NULL;
+    const char* rootdev = NULL;
     unsigned char* dataBoot = NULL;
     unsigned char* dataRoot = NULL;
     unsigned char* outData = NULL;
@@ -4286,9 +4891,18 @@ static int _serializekeys_command(
     size_t dataRootSize;
     UINTN outDataSize;
 
+    /* Record the keyslots that the keys open so lsvmload tries them first */
+    if (GetOpt(&argc, argv, "--bootdev", &bootdev) < 0 ||
+        GetOpt(&argc, argv, "--rootdev", &rootdev) < 0)
+    {
+        fprintf(stderr, "%s: invalid option\n", argv[0]);
+        goto done;
+    }
+
     if (argc != 4)
     {
-        fprintf(stderr, "Usage: %s BOOTKEY ROOTKEY OUTFILE\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--bootdev BOOTDEV] [--rootdev ROOTDEV] "
+            "BOOTKEY ROOTKEY OUTFILE\n", argv[0]);
         goto done;
     }
 
@@ -4320,6 +4934,35 @@ static int _serializekeys_command(
         goto done;
     }
 
+    if (bootdev || rootdev)
+    {
+        KEYS_SLOT_HINTS hints;
+
+        hints.BootSlot = KEYS_SLOT_HINT_NONE;
+        hints.RootSlot = KEYS_SLOT_HINT_NONE;
+
+        /* Without a hint lsvmload tries the keyslots in order */
+        if (bootdev && _FindKeySlot(bootdev, dataBoot, dataBootSize, 
+            &hints.BootSlot) != 0)
+        {
+            fprintf(stderr, "%s: warning: boot key does not open: %s\n", 
+                argv[0], bootdev);
+        }
+
+        if (rootdev && _FindKeySlot(rootdev, dataRoot, dataRootSize, 
+            &hints.RootSlot) != 0)
+        {
+            fprintf(stderr, "%s: warning: root key does not open: %s\n", 
+                argv[0], rootdev);
+        }
+
+        if (AppendKeySlotHints(&hints, &outData, &outDataSize) != 0)
+        {
+            fprintf(stderr, "%s: failed to add keyslot hints\n", argv[0]);
+            goto done;
+        }
+    }
+
     if (PutFile(outfile, outData, outDataSize) != 0)
     {
         fprintf(stderr, "%s: failed to write file: %s\n", argv[0], outfile);
@@ -4890,6 +5533,28 @@ static Command _commands[] =
         _luksmk_command,
     },
 #endif /* defined(ENABLE_LUKS) */
+#if defined(ENABLE_LUKS) && defined(__linux__)
+    {
+        "luksbench", 
+        "Measure LUKS encryption speed of each cipher mode",
+        _luksbench_command,
+    },
+    {
+        "luksencrypt", 
+        "Encrypt a plain image into the LUKS payload (on all CPUs)",
+        _luksencrypt_command,
+    },
+    {
+        "luksdecrypt", 
+        "Decrypt the LUKS payload into a plain image (on all CPUs)",
+        _luksdecrypt_command,
+    },
+    {
+        "luksreencrypt", 
+        "Re-encrypt the LUKS payload under a new master key (resumable)",
+        _luksreencrypt_command,
+    },
+#endif /* defined(ENABLE_LUKS) && defined(__linux__) */
 #if defined(HAVE_OPENSSL)
     {
         "peverify", 
@@ -31,6 +31,8 @@
 #include <stdio.h>
 #include <lsvmutils/utils.h>
 #include <lsvmutils/strings.h>
+#include <lsvmutils/getopt.h>
+#include <lsvmutils/statsblkdev.h>
 
 int ext2_main(int argc, const char* argv[]);
 
@@ -51,6 +53,11 @@ int main(int argc, const char* argv[])
 
     GetProgramName(argv[0], programName);
 
+    /* Get the --iostats option (print I/O statistics of every image opened
+     * by any command when it is closed) */
+    if (GetOpt(&argc, argv, "--iostats", NULL) == 1)
+        StatsBlkdevEnable(TRUE);
+
     if (Strcmp(programName, "ext2") == 0)
     {
         return ext2_main(argc, argv);
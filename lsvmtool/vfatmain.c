@@ -43,6 +43,7 @@
 #include <lsvmutils/print.h>
 #include <lsvmutils/chksum.h>
 #include <lsvmutils/gpt.h>
+#include <lsvmutils/vhdblkdev.h>
 #include <lsvmutils/byteorder.h>
 
 #if defined(__linux__)
@@ -497,7 +498,7 @@ int vfat_main(
     }
 
     /* Open the block device file */
-    if (!(dev = BlkdevOpen(vfatfs, BLKDEV_ACCESS_RDWR, offset)))
+    if (!(dev = BlkdevOpenImage(vfatfs, BLKDEV_ACCESS_RDWR, offset, 0)))
     {
         fprintf(stderr, "%s: failed to open: %s\n", argv[0], vfatfs);
         status = 1;
@@ -515,7 +516,13 @@ int vfat_main(
     for (i = 0; i < _ncommands; i++)
     {
         if (strcmp(argv[1], _commands[i].name) == 0)
-            return((*_commands[i].callback)(vfat, argc-1, argv+1));
+        {
+            status = (*_commands[i].callback)(vfat, argc-1, argv+1);
+
+            /* Release the file system so the device is closed (and its
+             * I/O statistics printed) */
+            goto done;
+        }
     }
 
     fprintf(stderr, "%s: unknown command: '%s'\n", argv[0], argv[1]);
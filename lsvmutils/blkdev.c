@@ -28,10 +28,33 @@
 **==============================================================================
 */
 #include "blkdev.h"
+#include "alloc.h"
 #include "strings.h"
 #include "print.h"
 #include "chksum.h"
 
+UINTN BlkdevBlockSize(
+    Blkdev* dev)
+{
+    if (!dev || !dev->blksize)
+        return BLKDEV_BLKSIZE;
+
+    return dev->blksize;
+}
+
+BOOLEAN BlkdevValidBlockSize(
+    UINTN blksize)
+{
+    /* Must be a power of two between 512 and 4096 */
+    if (blksize < BLKDEV_BLKSIZE || blksize > BLKDEV_MAX_BLKSIZE)
+        return FALSE;
+
+    if (blksize & (blksize - 1))
+        return FALSE;
+
+    return TRUE;
+}
+
 int BlkdevRead(
     Blkdev* dev,
     UINTN blkno,
@@ -39,15 +62,17 @@ int BlkdevRead(
     UINTN size)
 {
     int rc = -1;
+    UINTN blksize;
     UINTN nblocks;
     UINT8* ptr;
     UINTN rem;
-    UINT8 block[BLKDEV_BLKSIZE];
+    UINT8 block[BLKDEV_MAX_BLKSIZE];
 
     if (!dev || !data)
         goto done;
 
-    nblocks = (size + BLKDEV_BLKSIZE - 1) / BLKDEV_BLKSIZE;
+    blksize = BlkdevBlockSize(dev);
+    nblocks = (size + blksize - 1) / blksize;
     ptr = (UINT8*)data;
     rem = size;
 
@@ -59,7 +84,7 @@ int BlkdevRead(
     }
 
     /* If size is a multiple of the block size, we just do a batch read. */
-    if (size % BLKDEV_BLKSIZE == 0)
+    if (size % blksize == 0)
     {
         if (dev->GetN(dev, blkno, nblocks, ptr) != 0)
             goto done;
@@ -72,8 +97,8 @@ int BlkdevRead(
     if (dev->GetN(dev, blkno, nblocks - 1, ptr) != 0)
         goto done;
 
-    ptr += (nblocks - 1) * BLKDEV_BLKSIZE;
-    rem -= (nblocks - 1) * BLKDEV_BLKSIZE;
+    ptr += (nblocks - 1) * blksize;
+    rem -= (nblocks - 1) * blksize;
 
     /* Read the last block and copy the remaining bytes to ptr. */
     if (dev->GetN(dev, blkno + nblocks - 1, 1, block) != 0)
@@ -94,15 +119,17 @@ int BlkdevWrite(
     UINTN size)
 {
     int rc = -1;
+    UINTN blksize;
     UINTN nblocks;
     const UINT8* ptr;
     UINTN rem;
-    UINT8 block[BLKDEV_BLKSIZE];
+    UINT8 block[BLKDEV_MAX_BLKSIZE];
 
     if (!dev || !data)
         goto done;
 
-    nblocks = (size + BLKDEV_BLKSIZE - 1) / BLKDEV_BLKSIZE;
+    blksize = BlkdevBlockSize(dev);
+    nblocks = (size + blksize - 1) / blksize;
     ptr = (const UINT8*)data;
     rem = size;
 
@@ -114,7 +141,7 @@ int BlkdevWrite(
     }
 
     /* If size is aligned to block size, we just do a batch write. */
-    if (size % BLKDEV_BLKSIZE == 0)
+    if (size % blksize == 0)
     {
         if (dev->PutN(dev, blkno, nblocks, ptr) != 0)
             goto done;
@@ -127,8 +154,8 @@ int BlkdevWrite(
     if (dev->PutN(dev, blkno, nblocks - 1, ptr) != 0)
         goto done;
 
-    ptr += (nblocks - 1) * BLKDEV_BLKSIZE;
-    rem -= (nblocks - 1) * BLKDEV_BLKSIZE;
+    ptr += (nblocks - 1) * blksize;
+    rem -= (nblocks - 1) * blksize;
 
     /* Read the last block and rewrite part of it. */
     if (dev->GetN(dev, blkno + nblocks - 1, 1, block) != 0)
@@ -144,3 +171,343 @@ int BlkdevWrite(
 done:
     return rc;
 }
+
+int BlkdevReadBytes(
+    Blkdev* dev,
+    UINT64 offset,
+    void* data,
+    UINTN size)
+{
+    int rc = -1;
+    UINTN blksize;
+    UINTN blkno;
+    UINTN off;
+    UINT8* ptr = (UINT8*)data;
+    UINT8 block[BLKDEV_MAX_BLKSIZE];
+
+    if (!dev || !data)
+        goto done;
+
+    blksize = BlkdevBlockSize(dev);
+    blkno = offset / blksize;
+    off = offset % blksize;
+
+    /* Read the leading partial block (if any) */
+    if (off && size)
+    {
+        UINTN n = blksize - off;
+
+        if (n > size)
+            n = size;
+
+        if (dev->GetN(dev, blkno, 1, block) != 0)
+            goto done;
+
+        Memcpy(ptr, block + off, n);
+        ptr += n;
+        size -= n;
+        blkno++;
+    }
+
+    /* Read the whole blocks and the trailing partial block */
+    if (BlkdevRead(dev, blkno, ptr, size) != 0)
+        goto done;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+int BlkdevWriteBytes(
+    Blkdev* dev,
+    UINT64 offset,
+    const void* data,
+    UINTN size)
+{
+    int rc = -1;
+    UINTN blksize;
+    UINTN blkno;
+    UINTN off;
+    const UINT8* ptr = (const UINT8*)data;
+    UINT8 block[BLKDEV_MAX_BLKSIZE];
+
+    if (!dev || !data)
+        goto done;
+
+    blksize = BlkdevBlockSize(dev);
+    blkno = offset / blksize;
+    off = offset % blksize;
+
+    /* Rewrite part of the leading block (if any) */
+    if (off && size)
+    {
+        UINTN n = blksize - off;
+
+        if (n > size)
+            n = size;
+
+        if (dev->GetN(dev, blkno, 1, block) != 0)
+            goto done;
+
+        Memcpy(block + off, ptr, n);
+
+        if (dev->PutN(dev, blkno, 1, block) != 0)
+            goto done;
+
+        ptr += n;
+        size -= n;
+        blkno++;
+    }
+
+    /* Write the whole blocks and the trailing partial block */
+    if (BlkdevWrite(dev, blkno, ptr, size) != 0)
+        goto done;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+/* Count segments that are contiguous both on the device and in memory */
+static UINTN _CountAdjacentSegments(
+    UINTN blksize,
+    const BlkdevSegment* segments,
+    UINTN nsegments,
+    UINTN* nblocks)
+{
+    UINTN n = 1;
+
+    *nblocks = segments[0].nblocks;
+
+    while (n < nsegments)
+    {
+        const BlkdevSegment* prev = &segments[n-1];
+        const BlkdevSegment* next = &segments[n];
+
+        if (next->blkno != prev->blkno + prev->nblocks)
+            break;
+
+        if ((UINT8*)next->data != 
+            (UINT8*)prev->data + prev->nblocks * blksize)
+        {
+            break;
+        }
+
+        *nblocks += next->nblocks;
+        n++;
+    }
+
+    return n;
+}
+
+int BlkdevGenericGetV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    int rc = -1;
+    UINTN i;
+
+    if (!dev || (!segments && nsegments))
+        goto done;
+
+    for (i = 0; i < nsegments; )
+    {
+        UINTN nblocks;
+        UINTN n = _CountAdjacentSegments(
+            BlkdevBlockSize(dev), &segments[i], nsegments - i, &nblocks);
+
+        if (dev->GetN(dev, segments[i].blkno, nblocks, segments[i].data) != 0)
+            goto done;
+
+        i += n;
+    }
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+int BlkdevGenericPutV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    int rc = -1;
+    UINTN i;
+
+    if (!dev || (!segments && nsegments))
+        goto done;
+
+    for (i = 0; i < nsegments; )
+    {
+        UINTN nblocks;
+        UINTN n = _CountAdjacentSegments(
+            BlkdevBlockSize(dev), &segments[i], nsegments - i, &nblocks);
+
+        if (dev->PutN(dev, segments[i].blkno, nblocks, segments[i].data) != 0)
+            goto done;
+
+        i += n;
+    }
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+int BlkdevGetV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    if (!dev)
+        return -1;
+
+    if (dev->GetV)
+        return dev->GetV(dev, segments, nsegments);
+
+    return BlkdevGenericGetV(dev, segments, nsegments);
+}
+
+int BlkdevPutV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    if (!dev)
+        return -1;
+
+    if (dev->PutV)
+        return dev->PutV(dev, segments, nsegments);
+
+    return BlkdevGenericPutV(dev, segments, nsegments);
+}
+
+int BlkdevFlush(
+    Blkdev* dev)
+{
+    if (!dev)
+        return -1;
+
+    if (dev->Flush)
+        return dev->Flush(dev);
+
+    return 0;
+}
+
+int BlkdevGenericSubmit(
+    Blkdev* dev,
+    BlkdevRequest* req)
+{
+    if (!dev || !req || !req->data)
+        return -1;
+
+    if (req->write)
+        req->status = dev->PutN(dev, req->blkno, req->nblocks, req->data);
+    else
+        req->status = dev->GetN(dev, req->blkno, req->nblocks, req->data);
+
+    req->done = TRUE;
+
+    return 0;
+}
+
+int BlkdevSubmit(
+    Blkdev* dev,
+    BlkdevRequest* req)
+{
+    if (!dev || !req)
+        return -1;
+
+    req->done = FALSE;
+    req->status = -1;
+
+    if (dev->Submit)
+        return dev->Submit(dev, req);
+
+    return BlkdevGenericSubmit(dev, req);
+}
+
+int BlkdevComplete(
+    Blkdev* dev,
+    BlkdevRequest* req)
+{
+    if (!dev || !req)
+        return -1;
+
+    if (req->done)
+        return req->status;
+
+    if (!dev->Complete)
+        return -1;
+
+    return dev->Complete(dev, req);
+}
+
+int BlkdevBorrow(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    const void** data)
+{
+    int rc = -1;
+    void* buf = NULL;
+
+    if (data)
+        *data = NULL;
+
+    if (!dev || !data || !nblocks)
+        goto done;
+
+    /* Lend the blocks where the device can (otherwise read a copy) */
+    if (dev->Borrow && dev->Borrow(dev, blkno, nblocks, data) == 0)
+        return 0;
+
+    if (!(buf = Malloc(nblocks * BlkdevBlockSize(dev))))
+        goto done;
+
+    if (dev->GetN(dev, blkno, nblocks, buf) != 0)
+        goto done;
+
+    *data = buf;
+    buf = NULL;
+
+    rc = 0;
+
+done:
+
+    if (buf)
+        Free(buf);
+
+    return rc;
+}
+
+int BlkdevRelease(
+    Blkdev* dev,
+    const void* data)
+{
+    if (!dev || !data)
+        return -1;
+
+    /* Data that the device did not lend was copied by BlkdevBorrow() */
+    if (dev->Release && dev->Release(dev, data) == 0)
+        return 0;
+
+    Free((void*)data);
+    return 0;
+}
+
+int BlkdevGetNumBlocks(
+    Blkdev* dev,
+    UINT64* nblocks)
+{
+    if (!dev || !nblocks || !dev->GetNumBlocks)
+        return -1;
+
+    return dev->GetNumBlocks(dev, nblocks);
+}
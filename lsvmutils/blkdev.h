@@ -33,12 +33,50 @@
 #include "config.h"
 #include <lsvmutils/eficommon.h>
 
+/* Default (and smallest) logical block size */
 #define BLKDEV_BLKSIZE 512
 
+/* Largest logical block size supported (4K native media) */
+#define BLKDEV_MAX_BLKSIZE 4096
+
 #define BLKDEV_ENABLE_CACHING 1
 
+/* With BLKDEV_ENABLE_CACHING: pass writes through rather than absorb them */
+#define BLKDEV_WRITE_THROUGH 2
+
+/* With BLKDEV_ENABLE_CACHING: hold writes until Flush() (or Close()) */
+#define BLKDEV_WRITE_BACK 4
+
 typedef struct _Blkdev Blkdev;
 
+/* One element of a scatter-gather request: 'nblocks' blocks at 'blkno' */
+typedef struct _BlkdevSegment
+{
+    UINTN blkno;
+    UINTN nblocks;
+    void* data;
+}
+BlkdevSegment;
+
+/* An asynchronous transfer (see BlkdevSubmit() and BlkdevComplete()) */
+typedef struct _BlkdevRequest
+{
+    BOOLEAN write;
+    UINTN blkno;
+    UINTN nblocks;
+    void* data;
+
+    /* Set by the device: TRUE once the transfer has finished */
+    BOOLEAN done;
+
+    /* Set by the device: result of the transfer (0 or -1) once done */
+    int status;
+
+    /* Private to the device */
+    UINTN pending;
+}
+BlkdevRequest;
+
 struct _Blkdev
 {
     int (*Close)(
@@ -59,6 +97,52 @@ struct _Blkdev
     int (*SetFlags)(
         Blkdev* dev,
         UINT32 flags);
+
+    int (*GetV)(
+        Blkdev* dev,
+        const BlkdevSegment* segments,
+        UINTN nsegments);
+
+    int (*PutV)(
+        Blkdev* dev,
+        const BlkdevSegment* segments,
+        UINTN nsegments);
+
+    int (*Flush)(
+        Blkdev* dev);
+
+    /* Start a transfer (the request must stay valid until completed) */
+    int (*Submit)(
+        Blkdev* dev,
+        BlkdevRequest* req);
+
+    /* Wait for a submitted transfer to finish and return its status */
+    int (*Complete)(
+        Blkdev* dev,
+        BlkdevRequest* req);
+
+    /* Obtain a read-only pointer to blocks held in memory by the device 
+     * (fails if the device cannot lend these blocks right now) */
+    int (*Borrow)(
+        Blkdev* dev,
+        UINTN blkno,
+        UINTN nblocks,
+        const void** data);
+
+    /* Give back a pointer obtained with Borrow() (fails for pointers that
+     * the device did not lend) */
+    int (*Release)(
+        Blkdev* dev,
+        const void* data);
+
+    /* Get the number of blocks on the device (optional) */
+    int (*GetNumBlocks)(
+        Blkdev* dev,
+        UINT64* nblocks);
+
+    /* Logical block size in bytes (zero means BLKDEV_BLKSIZE). GetN(), 
+     * PutN(), and segments count blocks of this size. */
+    UINTN blksize;
 };
 
 typedef enum _BlkdevAccess
@@ -69,10 +153,34 @@ typedef enum _BlkdevAccess
 }
 BlkdevAccess;
 
+/* BlkdevOpen() flag: bypass the page cache with O_DIRECT (where supported) */
+#define BLKDEV_OPEN_DIRECT 1
+
+/* BlkdevOpenImage() flag: map regular image files into memory so that
+ * BlkdevBorrow() need not copy (BlkdevOpen() rejects this flag) */
+#define BLKDEV_OPEN_MMAP 2
+
+/* BlkdevOpenImage() flag: the image will be read from start to end (a
+ * mapped image is opened with MMAPBLKDEV_SEQUENTIAL; otherwise ignored) */
+#define BLKDEV_OPEN_SEQUENTIAL 4
+
 Blkdev* BlkdevOpen(
     const char* path,
     BlkdevAccess access,
-    UINTN offset); /* add this offset to all seeks */
+    UINTN offset, /* add this offset to all transfers */
+    UINT32 flags); /* BLKDEV_OPEN_* */
+
+/* Return the file descriptor of a device from BlkdevOpen() (else -1) */
+int BlkdevFileno(
+    Blkdev* dev);
+
+/* Return the logical block size of this device */
+UINTN BlkdevBlockSize(
+    Blkdev* dev);
+
+/* Check that this is a supported logical block size */
+BOOLEAN BlkdevValidBlockSize(
+    UINTN blksize);
 
 int BlkdevRead(
     Blkdev* dev,
@@ -86,4 +194,80 @@ int BlkdevWrite(
     const void* data,
     UINTN size);
 
+/* Read 'size' bytes at byte 'offset' (need not be block aligned) */
+int BlkdevReadBytes(
+    Blkdev* dev,
+    UINT64 offset,
+    void* data,
+    UINTN size);
+
+/* Write 'size' bytes at byte 'offset' (partial blocks are read first) */
+int BlkdevWriteBytes(
+    Blkdev* dev,
+    UINT64 offset,
+    const void* data,
+    UINTN size);
+
+/* Read segments by calling dev->GetN() for each run of adjacent segments */
+int BlkdevGenericGetV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments);
+
+/* Write segments by calling dev->PutN() for each run of adjacent segments */
+int BlkdevGenericPutV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments);
+
+/* Call dev->GetV() (or the generic version if the device has none) */
+int BlkdevGetV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments);
+
+/* Call dev->PutV() (or the generic version if the device has none) */
+int BlkdevPutV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments);
+
+/* Call dev->Flush() (devices without Flush() have nothing to flush) */
+int BlkdevFlush(
+    Blkdev* dev);
+
+/* Perform the request synchronously with dev->GetN() or dev->PutN() */
+int BlkdevGenericSubmit(
+    Blkdev* dev,
+    BlkdevRequest* req);
+
+/* Call dev->Submit() (or the generic version if the device has none) */
+int BlkdevSubmit(
+    Blkdev* dev,
+    BlkdevRequest* req);
+
+/* Wait for a request started by BlkdevSubmit() and return its status */
+int BlkdevComplete(
+    Blkdev* dev,
+    BlkdevRequest* req);
+
+/* Obtain read-only access to blocks without copying them where the device
+ * allows it (otherwise the blocks are read into a new buffer). The data 
+ * must be given back with BlkdevRelease() on the same device. */
+int BlkdevBorrow(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    const void** data);
+
+/* Give back data obtained with BlkdevBorrow() */
+int BlkdevRelease(
+    Blkdev* dev,
+    const void* data);
+
+/* Call dev->GetNumBlocks() (fails if the device cannot tell its size) */
+int BlkdevGetNumBlocks(
+    Blkdev* dev,
+    UINT64* nblocks);
+
 #endif /* _blkdev_h */
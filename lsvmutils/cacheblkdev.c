@@ -34,40 +34,277 @@
 
 #define MAX_CHAINS (64*1024)
 
+/* Number of blocks obtained from the heap each time the cache grows */
+#define SLAB_BLOCKS 64
+
+/* Block has been written but not propagated to the child device */
+#define BLOCK_DIRTY 0x00000001
+
+/* Block was read ahead and has not been requested yet */
+#define BLOCK_PREFETCHED 0x00000002
+
+/* Size of the first read-ahead window of a sequential stream */
+#define READ_AHEAD_INITIAL (64 * 1024)
+
+/* Largest single write issued to the child when flushing dirty blocks */
+#define FLUSH_MAX_BYTES (1024 * 1024)
+
 typedef struct _BlkdevImpl BlkdevImpl;
 typedef struct _Block Block;
+typedef struct _Slab Slab;
 
 struct _Block
 {
+    /* Next block on the same hash chain (or on the free list) */
+    Block* chain;
+
+    /* Links for the LRU list (head is the most recently used) */
+    Block* prev;
     Block* next;
+
     UINTN blkno;
-    UINT8 data[BLKDEV_BLKSIZE];
+    UINT32 flags;
+    UINT8* data; /* points into the slab (blksize bytes) */
+};
+
+struct _Slab
+{
+    Slab* next;
+    Block blocks[SLAB_BLOCKS];
+    /* Followed by the data of each block */
 };
 
 struct _BlkdevImpl
 {
     Blkdev base;
     Blkdev* child;
+    UINTN blksize; /* block size of the child */
     Block* chains[MAX_CHAINS];
-    UINT32 flags; /* BLKDEV_ENABLE_CACHING supported */
+    UINT32 flags; /* BLKDEV_ENABLE_CACHING and BLKDEV_WRITE_(THROUGH|BACK) */
+
+    /* LRU list of all cached blocks */
+    Block* head;
+    Block* tail;
+
+    /* Slabs backing the blocks and the list of unused blocks */
+    Slab* slabs;
+    Block* freeList;
+
+    UINTN numBlocks;
+    UINTN numDirty;
+    UINTN maxBlocks;
+
+    /* Write-back flushes once this many blocks are dirty (zero: maxBlocks) */
+    UINTN maxDirty;
+
+    /* Read-ahead state (window and maximum window are in blocks) */
+    UINTN nextBlkno;
+    UINTN window;
+    UINTN maxWindow;
+    UINT8* readAheadBuf;
+
+    /* Counters */
+    UINTN hits;
+    UINTN misses;
+    UINTN evictions;
+    UINTN prefetched;
+    UINTN prefetchHits;
+    UINTN prefetchWasted;
+    UINTN flushes;
+    UINTN flushWrites;
+    UINTN flushedBlocks;
 };
 
 static void _ReleaseCache(
     BlkdevImpl* impl)
 {
-    UINTN i;
+    Slab* p;
+    Slab* next;
 
-    for (i = 0; i < MAX_CHAINS; i++)
+    for (p = impl->slabs; p; p = next)
     {
-        Block* p;
-        Block* next;
+        next = p->next;
+        Free(p);
+    }
+
+    if (impl->readAheadBuf)
+        Free(impl->readAheadBuf);
+
+    impl->readAheadBuf = NULL;
+    impl->slabs = NULL;
+    impl->freeList = NULL;
+    impl->head = NULL;
+    impl->tail = NULL;
+    impl->numBlocks = 0;
+    impl->numDirty = 0;
+}
+
+static void _ListRemove(
+    BlkdevImpl* impl,
+    Block* block)
+{
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        impl->head = block->next;
+
+    if (block->next)
+        block->next->prev = block->prev;
+    else
+        impl->tail = block->prev;
+
+    block->prev = NULL;
+    block->next = NULL;
+}
+
+static void _ListPushFront(
+    BlkdevImpl* impl,
+    Block* block)
+{
+    block->prev = NULL;
+    block->next = impl->head;
+
+    if (impl->head)
+        impl->head->prev = block;
+    else
+        impl->tail = block;
+
+    impl->head = block;
+}
+
+static void _Touch(
+    BlkdevImpl* impl,
+    Block* block)
+{
+    if (impl->head != block)
+    {
+        _ListRemove(impl, block);
+        _ListPushFront(impl, block);
+    }
+}
 
-        for (p = impl->chains[i]; p; p = next)
+static void _ChainRemove(
+    BlkdevImpl* impl,
+    Block* block)
+{
+    Block** pp = &impl->chains[block->blkno % MAX_CHAINS];
+
+    while (*pp)
+    {
+        if (*pp == block)
         {
-            next = p->next;
-            Free(p);
+            *pp = block->chain;
+            block->chain = NULL;
+            return;
         }
+
+        pp = &(*pp)->chain;
+    }
+}
+
+/* Evict the least-recently-used clean block and return it for reuse */
+static Block* _Evict(
+    BlkdevImpl* impl)
+{
+    Block* p;
+
+    /* Dirty blocks are pinned, so skip over them */
+    for (p = impl->tail; p; p = p->prev)
+    {
+        if (!(p->flags & BLOCK_DIRTY))
+            break;
     }
+
+    if (!p)
+        return NULL;
+
+    _ListRemove(impl, p);
+    _ChainRemove(impl, p);
+    impl->numBlocks--;
+    impl->evictions++;
+
+    if (p->flags & BLOCK_PREFETCHED)
+        impl->prefetchWasted++;
+
+    return p;
+}
+
+static Block* _AllocBlock(
+    BlkdevImpl* impl,
+    BOOLEAN dirty)
+{
+    Block* block;
+
+    /* If at the budget, try to reuse a clean block */
+    if (impl->numBlocks >= impl->maxBlocks)
+    {
+        if ((block = _Evict(impl)))
+            return block;
+
+        /* Only dirty blocks may exceed the budget (they cannot be dropped) */
+        if (!dirty)
+            return NULL;
+    }
+
+    /* Carve a new slab into free blocks if necessary */
+    if (!impl->freeList)
+    {
+        Slab* slab;
+        UINTN i;
+
+        if (!(slab = (Slab*)Calloc(
+            1, 
+            sizeof(Slab) + SLAB_BLOCKS * impl->blksize)))
+        {
+            return NULL;
+        }
+
+        slab->next = impl->slabs;
+        impl->slabs = slab;
+
+        for (i = 0; i < SLAB_BLOCKS; i++)
+        {
+            slab->blocks[i].data = (UINT8*)(slab + 1) + i * impl->blksize;
+            slab->blocks[i].chain = impl->freeList;
+            impl->freeList = &slab->blocks[i];
+        }
+    }
+
+    block = impl->freeList;
+    impl->freeList = block->chain;
+    block->chain = NULL;
+
+    return block;
+}
+
+/* Account for a request that was satisfied by this block */
+static void _Hit(
+    BlkdevImpl* impl,
+    Block* block)
+{
+    if (block->flags & BLOCK_PREFETCHED)
+    {
+        block->flags &= ~BLOCK_PREFETCHED;
+        impl->prefetchHits++;
+    }
+
+    _Touch(impl, block);
+    impl->hits++;
+}
+
+/* Mark this block as overwritten (a pending read-ahead is now useless) */
+static void _Overwrite(
+    BlkdevImpl* impl,
+    Block* block,
+    const void* data)
+{
+    if (block->flags & BLOCK_PREFETCHED)
+    {
+        block->flags &= ~BLOCK_PREFETCHED;
+        impl->prefetchWasted++;
+    }
+
+    Memcpy(block->data, data, impl->blksize);
 }
 
 static Block* _GetCache(
@@ -77,7 +314,7 @@ static Block* _GetCache(
     Block* p;
     UINTN slot = blkno % MAX_CHAINS;
 
-    for (p = impl->chains[slot]; p; p = p->next)
+    for (p = impl->chains[slot]; p; p = p->chain)
     {
         if (p->blkno == blkno)
             return p;
@@ -89,23 +326,267 @@ static Block* _GetCache(
 static int _PutCache(
     BlkdevImpl* impl,
     UINTN blkno,
-    const void* data)
+    const void* data,
+    UINT32 flags)
 {
     int rc = -1;
     UINTN slot = blkno % MAX_CHAINS;
     Block* block;
+    BOOLEAN dirty = (flags & BLOCK_DIRTY) ? TRUE : FALSE;
+
+    /* Obtain a block (clean blocks are simply not cached on failure) */
+    if (!(block = _AllocBlock(impl, dirty)))
+    {
+        if (!dirty)
+            rc = 0;
 
-    /* Allocate new block */
-    if (!(block = Calloc(1, sizeof(Block))))
         goto done;
+    }
 
     /* Initialize the block */
-    Memcpy(block->data, data, sizeof(block->data));
+    Memcpy(block->data, data, impl->blksize);
     block->blkno = blkno;
+    block->flags = flags;
+
+    if (dirty)
+        impl->numDirty++;
+
+    if (flags & BLOCK_PREFETCHED)
+        impl->prefetched++;
 
     /* Add to cache */
-    block->next = impl->chains[slot];
+    block->chain = impl->chains[slot];
     impl->chains[slot] = block;
+    _ListPushFront(impl, block);
+    impl->numBlocks++;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+/* Writes are held in the cache unless write-through was requested */
+static BOOLEAN _AbsorbWrites(
+    BlkdevImpl* impl)
+{
+    return (impl->flags & BLKDEV_ENABLE_CACHING) &&
+        !(impl->flags & BLKDEV_WRITE_THROUGH);
+}
+
+static UINTN _DirtyLimit(
+    BlkdevImpl* impl)
+{
+    if (impl->maxDirty && impl->maxDirty < impl->maxBlocks)
+        return impl->maxDirty;
+
+    return impl->maxBlocks;
+}
+
+/* Sort blocks by block number (shell sort: no qsort() under EFI) */
+static void _SortBlocks(
+    Block** blocks,
+    UINTN nblocks)
+{
+    UINTN gap;
+    UINTN i;
+
+    for (gap = nblocks / 2; gap > 0; gap /= 2)
+    {
+        for (i = gap; i < nblocks; i++)
+        {
+            Block* tmp = blocks[i];
+            UINTN j;
+
+            for (j = i; j >= gap && blocks[j-gap]->blkno > tmp->blkno; j -= gap)
+                blocks[j] = blocks[j-gap];
+
+            blocks[j] = tmp;
+        }
+    }
+}
+
+/* Write all dirty blocks to the child as maximal contiguous runs */
+static int _FlushDirty(
+    BlkdevImpl* impl)
+{
+    int rc = -1;
+    Block** blocks = NULL;
+    UINT8* buf = NULL;
+    UINTN nblocks = 0;
+    UINTN bufBlocks;
+    UINTN i;
+    Block* p;
+
+    if (impl->numDirty == 0)
+        return 0;
+
+    if (!(blocks = (Block**)Malloc(impl->numDirty * sizeof(Block*))))
+        goto done;
+
+    for (p = impl->head; p && nblocks < impl->numDirty; p = p->next)
+    {
+        if (p->flags & BLOCK_DIRTY)
+            blocks[nblocks++] = p;
+    }
+
+    _SortBlocks(blocks, nblocks);
+
+    bufBlocks = FLUSH_MAX_BYTES / impl->blksize;
+
+    if (bufBlocks > nblocks)
+        bufBlocks = nblocks;
+
+    if (!(buf = (UINT8*)Malloc(bufBlocks * impl->blksize)))
+        goto done;
+
+    impl->flushes++;
+
+    for (i = 0; i < nblocks;)
+    {
+        UINTN n = 0;
+        UINTN k;
+
+        /* Stage the run of consecutive blocks that starts here */
+        while (i + n < nblocks && n < bufBlocks &&
+            blocks[i+n]->blkno == blocks[i]->blkno + n)
+        {
+            Memcpy(buf + n * impl->blksize, blocks[i+n]->data, impl->blksize);
+            n++;
+        }
+
+        if (impl->child->PutN(impl->child, blocks[i]->blkno, n, buf) != 0)
+            goto done;
+
+        /* These blocks are clean now (and may be evicted) */
+        for (k = i; k < i + n; k++)
+        {
+            blocks[k]->flags &= ~BLOCK_DIRTY;
+            impl->numDirty--;
+        }
+
+        impl->flushWrites++;
+        impl->flushedBlocks += n;
+        i += n;
+    }
+
+    rc = 0;
+
+done:
+
+    if (blocks)
+        Free(blocks);
+
+    if (buf)
+        Free(buf);
+
+    return rc;
+}
+
+/* Update the cache with blocks that were just written to the child */
+static void _RefreshCache(
+    BlkdevImpl* impl,
+    UINTN blkno,
+    UINTN nblocks,
+    const void* data)
+{
+    UINTN i;
+    Block* block;
+    const UINT8* ptr = (const UINT8*) data;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        if ((block = _GetCache(impl, blkno + i)))
+        {
+            _Overwrite(impl, block, ptr);
+
+            if (block->flags & BLOCK_DIRTY)
+            {
+                block->flags &= ~BLOCK_DIRTY;
+                impl->numDirty--;
+            }
+        }
+        else if (impl->flags & BLKDEV_ENABLE_CACHING)
+        {
+            /* Write-through: keep a clean copy (ignore allocation failure) */
+            _PutCache(impl, blkno + i, ptr, 0);
+        }
+
+        ptr += impl->blksize;
+    }
+}
+
+/* Read these blocks plus the rest of the read-ahead window in one request */
+static int _ReadAhead(
+    BlkdevImpl* impl,
+    UINTN blkno,
+    UINTN nblocks,
+    UINT8* data)
+{
+    int rc = -1;
+    UINTN window = impl->window;
+    UINTN i;
+
+    if (!impl->readAheadBuf)
+    {
+        if (!(impl->readAheadBuf = (UINT8*)Malloc(
+            impl->maxWindow * impl->blksize)))
+        {
+            goto done;
+        }
+    }
+
+    /* A failure may mean the window ran off the end of the device */
+    if (impl->child->GetN(
+        impl->child, 
+        blkno, 
+        window, 
+        impl->readAheadBuf) != 0)
+    {
+        impl->window = 0;
+
+        if (impl->child->GetN(impl->child, blkno, nblocks, data) != 0)
+            goto done;
+
+        for (i = 0; i < nblocks; i++)
+        {
+            if (_PutCache(
+                impl, 
+                blkno + i, 
+                data + i * impl->blksize, 
+                0) != 0)
+            {
+                goto done;
+            }
+        }
+
+        rc = 0;
+        goto done;
+    }
+
+    Memcpy(data, impl->readAheadBuf, nblocks * impl->blksize);
+
+    for (i = 0; i < window; i++)
+    {
+        /* Never replace a block that is already cached (it may be dirty) */
+        if (i >= nblocks && _GetCache(impl, blkno + i))
+            continue;
+
+        if (_PutCache(
+            impl, 
+            blkno + i, 
+            impl->readAheadBuf + i * impl->blksize,
+            i < nblocks ? 0 : BLOCK_PREFETCHED) != 0)
+        {
+            goto done;
+        }
+    }
+
+    /* Double the window for the next miss of this stream */
+    impl->window *= 2;
+
+    if (impl->window > impl->maxWindow)
+        impl->window = impl->maxWindow;
 
     rc = 0;
 
@@ -120,10 +601,19 @@ static int _Close(
     BlkdevImpl* impl = (BlkdevImpl*)dev;
     Blkdev* child;
 
+    BOOLEAN flushed = TRUE;
+
     /* Check for null parameters */
     if (!impl || !impl->child)
         goto done;
 
+    /* Write back dirty blocks (captured writes are discarded as before) */
+    if (impl->flags & BLKDEV_WRITE_BACK)
+    {
+        if (_FlushDirty(impl) != 0)
+            flushed = FALSE;
+    }
+
     /* Free all the cached blocks */
     _ReleaseCache(impl);
 
@@ -135,6 +625,9 @@ static int _Close(
     if (child->Close(child) != 0)
         goto done;
 
+    if (!flushed)
+        goto done;
+
     rc = 0;
 
 done:
@@ -152,22 +645,47 @@ static int _GetN(
     BlkdevImpl* impl = (BlkdevImpl*)dev;
     UINTN i;
     UINT8* ptr = (UINT8*) data;
+    BOOLEAN sequential = FALSE;
 
     /* Check for null parameters */
     if (!impl || !data || !impl->child)
         goto done;
 
+    /* Grow the read-ahead window while the stream stays sequential */
+    if ((impl->flags & BLKDEV_ENABLE_CACHING) && impl->maxWindow)
+    {
+        if (nblocks && blkno == impl->nextBlkno)
+        {
+            UINTN initial = READ_AHEAD_INITIAL / impl->blksize;
+
+            if (impl->window == 0)
+                impl->window = initial;
+
+            if (impl->window > impl->maxWindow)
+                impl->window = impl->maxWindow;
+
+            sequential = TRUE;
+        }
+        else
+        {
+            impl->window = 0;
+        }
+
+        impl->nextBlkno = blkno + nblocks;
+    }
+
     /* Loop through and check if in cache. Otherwise, read from disk. */
     for (i = 0; i < nblocks;)
     {
         UINTN j;
-        const Block* block;
+        Block* block;
 
         /* Loop through blocks and retrieve from cache. */
         while (i < nblocks && (block = _GetCache(impl, blkno + i)))
         {
             Memcpy(
-                ptr + i*sizeof(block->data), block->data, sizeof(block->data));
+                ptr + i*impl->blksize, block->data, impl->blksize);
+            _Hit(impl, block);
             i++;
         }
 
@@ -180,24 +698,46 @@ static int _GetN(
         if (j == i)
             continue;
 
-        /* Read as much as we can from the disk. */
-        if (impl->child->GetN(
-                impl->child,
-                blkno + i,
-                j - i,
-                ptr + i*sizeof(block->data)) != 0)
+        impl->misses += j - i;
+
+        /* Read as much as we can from the disk (plus any read-ahead). */
+        if (sequential && j - i < impl->window)
         {
-            goto done;
+            if (_ReadAhead(
+                impl, 
+                blkno + i, 
+                j - i, 
+                ptr + i*impl->blksize) != 0)
+            {
+                goto done;
+            }
         }
-
-        /* If caching is enabled, then put into cache. */
-        if (impl->flags & BLKDEV_ENABLE_CACHING)
+        else
         {
-            UINTN k;
-            for (k = i; k < j; k++)
+            if (impl->child->GetN(
+                    impl->child,
+                    blkno + i,
+                    j - i,
+                    ptr + i*impl->blksize) != 0)
             {
-                if (_PutCache(impl, blkno + k, ptr + k*sizeof(block->data)) != 0)
-                    goto done;
+                goto done;
+            }
+
+            /* If caching is enabled, then put into cache. */
+            if (impl->flags & BLKDEV_ENABLE_CACHING)
+            {
+                UINTN k;
+                for (k = i; k < j; k++)
+                {
+                    if (_PutCache(
+                        impl, 
+                        blkno + k, 
+                        ptr + k*impl->blksize,
+                        0) != 0)
+                    {
+                        goto done;
+                    }
+                }
             }
         }
 
@@ -225,7 +765,7 @@ static int _PutN(
         goto done;
 
     /* If caching is enabled, change cache, but not disk */
-    if (impl->flags & BLKDEV_ENABLE_CACHING)
+    if (_AbsorbWrites(impl))
     {
         UINTN i;
         Block* block;
@@ -235,13 +775,29 @@ static int _PutN(
         {
             if ((block = _GetCache(impl, blkno + i)))
             {
-                Memcpy(block->data, ptr, sizeof(block->data));
+                _Overwrite(impl, block, ptr);
+
+                if (!(block->flags & BLOCK_DIRTY))
+                {
+                    block->flags |= BLOCK_DIRTY;
+                    impl->numDirty++;
+                }
+
+                _Touch(impl, block);
             }
-            else if (_PutCache(impl, blkno + i, ptr) != 0)
+            else if (_PutCache(impl, blkno + i, ptr, BLOCK_DIRTY) != 0)
             {
                 goto done;
             }
-            ptr += sizeof(block->data);
+            ptr += impl->blksize;
+        }
+
+        /* Write back once too many blocks are dirty */
+        if ((impl->flags & BLKDEV_WRITE_BACK) &&
+            impl->numDirty >= _DirtyLimit(impl))
+        {
+            if (_FlushDirty(impl) != 0)
+                goto done;
         }
     }
     else
@@ -251,6 +807,9 @@ static int _PutN(
         {
             goto done;
         }
+
+        /* Keep any cached copies consistent with the disk */
+        _RefreshCache(impl, blkno, nblocks, data);
     }
 
     rc = 0;
@@ -259,6 +818,218 @@ done:
     return rc;
 }
 
+static int _GetV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    BlkdevSegment* misses = NULL;
+    UINTN nmisses = 0;
+    UINTN capacity = 0;
+    UINTN i;
+
+    /* Check for null parameters */
+    if (!impl || !impl->child || (!segments && nsegments))
+        goto done;
+
+    /* Copy out cached blocks and gather the missing ones into runs */
+    for (i = 0; i < nsegments; i++)
+    {
+        const BlkdevSegment* seg = &segments[i];
+        UINT8* ptr = (UINT8*)seg->data;
+        UINTN j;
+
+        for (j = 0; j < seg->nblocks; j++, ptr += impl->blksize)
+        {
+            Block* block;
+            BlkdevSegment* last;
+
+            if ((block = _GetCache(impl, seg->blkno + j)))
+            {
+                Memcpy(ptr, block->data, impl->blksize);
+                _Hit(impl, block);
+                continue;
+            }
+
+            impl->misses++;
+
+            /* Extend the last run if this block follows it */
+            if (nmisses)
+            {
+                last = &misses[nmisses-1];
+
+                if (last->blkno + last->nblocks == seg->blkno + j &&
+                    (UINT8*)last->data + last->nblocks * impl->blksize == ptr)
+                {
+                    last->nblocks++;
+                    continue;
+                }
+            }
+
+            /* Otherwise start a new run */
+            if (nmisses == capacity)
+            {
+                UINTN n = capacity ? capacity * 2 : 16;
+                BlkdevSegment* p;
+
+                if (!(p = (BlkdevSegment*)Realloc(
+                    misses, 
+                    capacity * sizeof(BlkdevSegment),
+                    n * sizeof(BlkdevSegment))))
+                {
+                    goto done;
+                }
+
+                misses = p;
+                capacity = n;
+            }
+
+            last = &misses[nmisses++];
+            last->blkno = seg->blkno + j;
+            last->nblocks = 1;
+            last->data = ptr;
+        }
+    }
+
+    /* Read all the missing runs from the child at once */
+    if (BlkdevGetV(impl->child, misses, nmisses) != 0)
+        goto done;
+
+    /* If caching is enabled, then put into cache. */
+    if (impl->flags & BLKDEV_ENABLE_CACHING)
+    {
+        for (i = 0; i < nmisses; i++)
+        {
+            const UINT8* ptr = (const UINT8*)misses[i].data;
+            UINTN j;
+
+            for (j = 0; j < misses[i].nblocks; j++, ptr += impl->blksize)
+            {
+                /* The same block may appear in more than one segment */
+                if (_GetCache(impl, misses[i].blkno + j))
+                    continue;
+
+                if (_PutCache(impl, misses[i].blkno + j, ptr, 0) != 0)
+                    goto done;
+            }
+        }
+    }
+
+    rc = 0;
+
+done:
+
+    if (misses)
+        Free(misses);
+
+    return rc;
+}
+
+static int _PutV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINTN i;
+
+    /* Check for null parameters */
+    if (!impl || !impl->child || (!segments && nsegments))
+        goto done;
+
+    /* If caching is enabled, change cache, but not disk */
+    if (_AbsorbWrites(impl))
+    {
+        for (i = 0; i < nsegments; i++)
+        {
+            const BlkdevSegment* seg = &segments[i];
+
+            if (_PutN(dev, seg->blkno, seg->nblocks, seg->data) != 0)
+                goto done;
+        }
+    }
+    else
+    {
+        /* If control reaches here, then disk will be modified */
+        if (BlkdevPutV(impl->child, segments, nsegments) != 0)
+            goto done;
+
+        /* Keep any cached copies consistent with the disk */
+        for (i = 0; i < nsegments; i++)
+        {
+            const BlkdevSegment* seg = &segments[i];
+            _RefreshCache(impl, seg->blkno, seg->nblocks, seg->data);
+        }
+    }
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+/* Reads of blocks that are not cached are passed to the child device (so 
+ * they may proceed in the background). Everything else completes here. */
+static int _Submit(
+    Blkdev* dev,
+    BlkdevRequest* req)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINTN i;
+
+    /* Check for null parameters */
+    if (!impl || !req || !req->data || !impl->child)
+        return -1;
+
+    if (req->write || !impl->child->Submit)
+        return BlkdevGenericSubmit(dev, req);
+
+    for (i = 0; i < req->nblocks; i++)
+    {
+        if (_GetCache(impl, req->blkno + i))
+            return BlkdevGenericSubmit(dev, req);
+    }
+
+    impl->misses += req->nblocks;
+
+    return BlkdevSubmit(impl->child, req);
+}
+
+static int _Complete(
+    Blkdev* dev,
+    BlkdevRequest* req)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINTN i;
+
+    /* Check for null parameters */
+    if (!impl || !req || !impl->child)
+        return -1;
+
+    if (BlkdevComplete(impl->child, req) != 0)
+        return -1;
+
+    /* Cache the blocks (skipping any written since the request started) */
+    if (impl->flags & BLKDEV_ENABLE_CACHING)
+    {
+        for (i = 0; i < req->nblocks; i++)
+        {
+            UINT8* data = (UINT8*)req->data + i * impl->blksize;
+
+            if (_GetCache(impl, req->blkno + i))
+                continue;
+
+            if (_PutCache(impl, req->blkno + i, data, 0) != 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int _SetFlags(
     Blkdev* dev,
     UINT32 flags)
@@ -271,8 +1042,22 @@ static int _SetFlags(
         goto done;
 
     /* If unrecognized flag */
-    if (flags & ~BLKDEV_ENABLE_CACHING)
+    if (flags & ~(BLKDEV_ENABLE_CACHING | BLKDEV_WRITE_THROUGH | 
+        BLKDEV_WRITE_BACK))
+    {
         goto done;
+    }
+
+    /* Write-through and write-back are mutually exclusive */
+    if ((flags & BLKDEV_WRITE_THROUGH) && (flags & BLKDEV_WRITE_BACK))
+        goto done;
+
+    /* Write back dirty blocks before leaving write-back mode */
+    if ((impl->flags & BLKDEV_WRITE_BACK) && !(flags & BLKDEV_WRITE_BACK))
+    {
+        if (_FlushDirty(impl) != 0)
+            goto done;
+    }
 
     impl->flags = flags;
 
@@ -282,14 +1067,98 @@ done:
     return rc;
 }
 
-Blkdev* NewCacheBlkdev(
+static int _Flush(
     Blkdev* dev)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    /* Check for null parameters */
+    if (!impl || !impl->child)
+        goto done;
+
+    /* Only write-back blocks go to disk (captured writes stay in memory) */
+    if (impl->flags & BLKDEV_WRITE_BACK)
+    {
+        if (_FlushDirty(impl) != 0)
+            goto done;
+    }
+
+    if (BlkdevFlush(impl->child) != 0)
+        goto done;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+/* Lend the child's blocks unless some of them are dirty here (and so newer
+ * than the child's copy) */
+static int _Borrow(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    const void** data)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINTN i;
+
+    if (!impl || !impl->child || !impl->child->Borrow)
+        return -1;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        Block* block = _GetCache(impl, blkno + i);
+
+        if (block && (block->flags & BLOCK_DIRTY))
+            return -1;
+    }
+
+    if (impl->child->Borrow(impl->child, blkno, nblocks, data) != 0)
+        return -1;
+
+    impl->misses += nblocks;
+    return 0;
+}
+
+static int _Release(
+    Blkdev* dev,
+    const void* data)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!impl || !impl->child || !impl->child->Release)
+        return -1;
+
+    return impl->child->Release(impl->child, data);
+}
+
+static int _GetNumBlocks(
+    Blkdev* dev,
+    UINT64* nblocks)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!impl || !impl->child)
+        return -1;
+
+    return BlkdevGetNumBlocks(impl->child, nblocks);
+}
+
+Blkdev* NewCacheBlkdevWithBudget(
+    Blkdev* dev,
+    UINTN budget)
 {
     BlkdevImpl* impl = NULL;
 
     if (!dev)
         goto done;
 
+    /* The budget must hold at least one block */
+    if (budget < BlkdevBlockSize(dev))
+        goto done;
+
     if (!(impl = Calloc(1, sizeof(BlkdevImpl))))
         goto done;
 
@@ -297,12 +1166,47 @@ Blkdev* NewCacheBlkdev(
     impl->base.GetN = _GetN;
     impl->base.PutN = _PutN;
     impl->base.SetFlags = _SetFlags;
+    impl->base.GetV = _GetV;
+    impl->base.PutV = _PutV;
+    impl->base.Flush = _Flush;
+    impl->base.Submit = _Submit;
+    impl->base.Complete = _Complete;
+
+    /* Only lend blocks if the child can (callers test for these methods) */
+    if (dev->Borrow)
+    {
+        impl->base.Borrow = _Borrow;
+        impl->base.Release = _Release;
+    }
+
+    if (dev->GetNumBlocks)
+        impl->base.GetNumBlocks = _GetNumBlocks;
+
     impl->child = dev;
+    impl->base.blksize = BlkdevBlockSize(dev);
+    impl->blksize = impl->base.blksize;
+    impl->maxBlocks = budget / impl->blksize;
+    impl->nextBlkno = (UINTN)-1;
+
+    if (CacheBlkdevSetReadAhead(
+        &impl->base, 
+        CACHEBLKDEV_DEFAULT_READAHEAD) != 0)
+    {
+        Free(impl);
+        impl = NULL;
+        goto done;
+    }
 
 done:
     return &impl->base;
 }
 
+Blkdev* NewCacheBlkdev(
+    Blkdev* dev)
+{
+    return NewCacheBlkdevWithBudget(dev, CACHEBLKDEV_DEFAULT_BUDGET);
+}
+
 void CacheBlkdevStats(
     Blkdev* dev,
     UINTN* numBlocks,
@@ -326,13 +1230,94 @@ void CacheBlkdevStats(
         if (impl->chains[i])
             (*numChains)++;
 
-        for (p = impl->chains[i]; p; p = p->next)
+        for (p = impl->chains[i]; p; p = p->chain)
         {
             (*numBlocks)++;
             n++;
         }
 
         if (n > *longestChain)
-            (*longestChain)++;
+            *longestChain = n;
     }
 }
+
+void CacheBlkdevGetCounters(
+    Blkdev* dev,
+    CacheBlkdevCounters* counters)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!impl || !counters)
+        return;
+
+    counters->hits = impl->hits;
+    counters->misses = impl->misses;
+    counters->evictions = impl->evictions;
+    counters->numBlocks = impl->numBlocks;
+    counters->numDirty = impl->numDirty;
+    counters->maxBlocks = impl->maxBlocks;
+    counters->prefetched = impl->prefetched;
+    counters->prefetchHits = impl->prefetchHits;
+    counters->prefetchWasted = impl->prefetchWasted;
+    counters->flushes = impl->flushes;
+    counters->flushWrites = impl->flushWrites;
+    counters->flushedBlocks = impl->flushedBlocks;
+}
+
+int CacheBlkdevSetReadAhead(
+    Blkdev* dev,
+    UINTN maxBytes)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINTN maxWindow;
+
+    if (!impl)
+        goto done;
+
+    maxWindow = maxBytes / impl->blksize;
+
+    /* Keep read-ahead from flushing more than half of the cache */
+    if (maxWindow > impl->maxBlocks / 2)
+        maxWindow = impl->maxBlocks / 2;
+
+    if (impl->readAheadBuf)
+    {
+        Free(impl->readAheadBuf);
+        impl->readAheadBuf = NULL;
+    }
+
+    impl->maxWindow = maxWindow;
+    impl->window = 0;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+int CacheBlkdevSetWriteBackLimit(
+    Blkdev* dev,
+    UINTN maxDirtyBytes)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!impl)
+        goto done;
+
+    impl->maxDirty = maxDirtyBytes / impl->blksize;
+
+    /* Write back now if already over the new limit */
+    if ((impl->flags & BLKDEV_WRITE_BACK) && 
+        impl->numDirty >= _DirtyLimit(impl))
+    {
+        if (_FlushDirty(impl) != 0)
+            goto done;
+    }
+
+    rc = 0;
+
+done:
+    return rc;
+}
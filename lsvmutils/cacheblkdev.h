@@ -33,9 +33,60 @@
 #include "config.h"
 #include <lsvmutils/blkdev.h>
 
+/* Default upper bound on the memory used to hold cached blocks */
+#define CACHEBLKDEV_DEFAULT_BUDGET (16 * 1024 * 1024)
+
+/* Default upper bound on the read-ahead window of a sequential stream */
+#define CACHEBLKDEV_DEFAULT_READAHEAD (2 * 1024 * 1024)
+
+typedef struct _CacheBlkdevCounters
+{
+    /* Number of block lookups satisfied from the cache */
+    UINTN hits;
+
+    /* Number of block lookups that went to the child device */
+    UINTN misses;
+
+    /* Number of clean blocks evicted to stay within the budget */
+    UINTN evictions;
+
+    /* Number of blocks currently held in the cache */
+    UINTN numBlocks;
+
+    /* Number of cached blocks that are dirty (pinned until released) */
+    UINTN numDirty;
+
+    /* Maximum number of blocks permitted by the budget */
+    UINTN maxBlocks;
+
+    /* Number of blocks read ahead of a sequential stream */
+    UINTN prefetched;
+
+    /* Number of read-ahead blocks that were later requested */
+    UINTN prefetchHits;
+
+    /* Number of read-ahead blocks evicted or overwritten before use */
+    UINTN prefetchWasted;
+
+    /* Number of times dirty blocks were written back */
+    UINTN flushes;
+
+    /* Number of writes issued to the child while writing back */
+    UINTN flushWrites;
+
+    /* Number of dirty blocks written back */
+    UINTN flushedBlocks;
+}
+CacheBlkdevCounters;
+
 Blkdev* NewCacheBlkdev(
     Blkdev* dev);
 
+/* Create a cache device that holds at most 'budget' bytes of block data */
+Blkdev* NewCacheBlkdevWithBudget(
+    Blkdev* dev,
+    UINTN budget);
+
 void CacheBlkdevStats(
     Blkdev* dev,
     UINTN* numBlocks,
@@ -43,4 +94,19 @@ void CacheBlkdevStats(
     UINTN* maxChains,
     UINTN* longestChain);
 
+void CacheBlkdevGetCounters(
+    Blkdev* dev,
+    CacheBlkdevCounters* counters);
+
+/* Set the maximum read-ahead window in bytes (zero disables read-ahead) */
+int CacheBlkdevSetReadAhead(
+    Blkdev* dev,
+    UINTN maxBytes);
+
+/* Write back (BLKDEV_WRITE_BACK) once this many bytes are dirty. Zero
+ * (the default) writes back when the dirty blocks fill the budget. */
+int CacheBlkdevSetWriteBackLimit(
+    Blkdev* dev,
+    UINTN maxDirtyBytes);
+
 #endif /* _cacheblkdev_h */
@@ -324,6 +324,30 @@ done:
     return status;
 }
 
+EFI_STATUS FlushBIO(
+    EFI_BIO* bio)
+{
+    EFI_STATUS status = EFI_UNSUPPORTED;
+
+    if (!ValidBIO(bio))
+        goto done;
+
+    /* Flush any blocks cached by the driver */
+    if ((status = uefi_call_wrapper(
+        bio->blockIO->FlushBlocks, 
+        1, 
+        bio->blockIO)) != EFI_SUCCESS)
+    {
+        goto done;
+    }
+
+    status = EFI_SUCCESS;
+
+done:
+
+    return status;
+}
+
 EFI_STATUS CloseBIO(EFI_BIO* bio)
 {
     EFI_STATUS status = EFI_UNSUPPORTED;
@@ -89,6 +89,9 @@ EFI_STATUS WriteBIO(
     const void* data,
     UINTN size);
 
+EFI_STATUS FlushBIO(
+    EFI_BIO* bio);
+
 EFI_STATUS LocateBlockIOHandles(
     EFI_HANDLE** handles,
     UINTN* numHandles);
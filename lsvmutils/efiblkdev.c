@@ -37,12 +37,6 @@ typedef struct _BlkdevImpl BlkdevImpl;
 
 #define CACHE_SIZE 8
 
-typedef struct _Block
-{
-    UINT8 data[BLKDEV_BLKSIZE];
-}
-Block;
-
 struct _BlkdevImpl
 {
     Blkdev base;
@@ -51,7 +45,7 @@ struct _BlkdevImpl
     /* Cache */
     BOOLEAN cached;
     UINTN blkno;
-    Block cache[CACHE_SIZE];
+    UINT8 cache[CACHE_SIZE * BLKDEV_MAX_BLKSIZE];
 };
 
 static int _Close(
@@ -82,6 +76,7 @@ static int _Get(
     void* data)
 {
     int rc = -1;
+    UINTN blksize = impl->base.blksize;
 
     /* Use the cache for single block reads */
     {
@@ -90,7 +85,7 @@ static int _Get(
             blkno < impl->blkno + CACHE_SIZE)
         {
             UINTN index = blkno - impl->blkno;
-            Memcpy(data, impl->cache[index].data, BLKDEV_BLKSIZE);
+            Memcpy(data, impl->cache + index * blksize, blksize);
             rc = 0;
             goto done;
         }
@@ -100,21 +95,21 @@ static int _Get(
             if (ReadBIO(
                 impl->bio, 
                 blkno, 
-                &impl->cache, 
-                CACHE_SIZE * BLKDEV_BLKSIZE) != EFI_SUCCESS)
+                impl->cache, 
+                CACHE_SIZE * blksize) != EFI_SUCCESS)
             {
                 goto done;
             }
 
             impl->cached = TRUE;
             impl->blkno = blkno;
-            Memcpy(data, impl->cache[0].data, BLKDEV_BLKSIZE);
+            Memcpy(data, impl->cache, blksize);
             rc = 0;
             goto done;
         }
     }
 
-    if (ReadBIO(impl->bio, blkno, data, BLKDEV_BLKSIZE) != EFI_SUCCESS)
+    if (ReadBIO(impl->bio, blkno, data, blksize) != EFI_SUCCESS)
         goto done;
 
     rc = 0;
@@ -148,7 +143,7 @@ static int _GetN(
         UINT8* ptr = (UINT8*) data;
         for (i = 0; i < nblocks; i++)
         {
-            if (_Get(impl, blkno + i, ptr + i*BLKDEV_BLKSIZE) != 0)
+            if (_Get(impl, blkno + i, ptr + i*impl->base.blksize) != 0)
                 goto done;
         }
 
@@ -157,8 +152,14 @@ static int _GetN(
     }
 
     /* Otherwise, do a full block read. */
-    if (ReadBIO(impl->bio, blkno, data, nblocks * BLKDEV_BLKSIZE) != EFI_SUCCESS)
+    if (ReadBIO(
+        impl->bio, 
+        blkno, 
+        data, 
+        nblocks * impl->base.blksize) != EFI_SUCCESS)
+    {
         goto done;
+    }
 
     rc = 0;
 
@@ -184,7 +185,31 @@ static int _PutN(
         goto done;
     }
 
-    if (WriteBIO(impl->bio, blkno, data, nblocks * BLKDEV_BLKSIZE) != EFI_SUCCESS)
+    if (WriteBIO(
+        impl->bio, 
+        blkno, 
+        data, 
+        nblocks * impl->base.blksize) != EFI_SUCCESS)
+    {
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+static int _Flush(
+    Blkdev* dev)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!impl || !impl->bio)
+        goto done;
+
+    if (FlushBIO(impl->bio) != EFI_SUCCESS)
         goto done;
 
     rc = 0;
@@ -209,6 +234,10 @@ Blkdev* BlkdevFromBIO(
     if (!bio)
         goto done;
 
+    /* Use the native block size of the media (e.g., 4096 for 4Kn disks) */
+    if (!BlkdevValidBlockSize(BlockSizeBIO(bio)))
+        goto done;
+
     if (!(impl = Calloc(1, sizeof(BlkdevImpl))))
         goto done;
 
@@ -216,6 +245,10 @@ Blkdev* BlkdevFromBIO(
     impl->base.GetN = _GetN;
     impl->base.PutN = _PutN;
     impl->base.SetFlags = _SetFlags;
+    impl->base.GetV = BlkdevGenericGetV;
+    impl->base.PutV = BlkdevGenericPutV;
+    impl->base.Flush = _Flush;
+    impl->base.blksize = BlockSizeBIO(bio);
     impl->bio = bio;
 
 done:
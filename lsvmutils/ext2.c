@@ -140,102 +140,17 @@ static void _HexDump(
 typedef unsigned long ssize_t;
 #endif
 
-static ssize_t _ReadPartialBlock(
-    Blkdev* dev,
-    UINTN blkno,
-    size_t offset,
-    size_t size,
-    void* data)
-{
-    UINT8 blk[BLKDEV_BLKSIZE];
-    UINT32 off; /* offset into this block */
-    UINT32 len; /* bytes to read from this block */
-
-    if (!size)
-        return 0;
-
-    if (dev->GetN(dev, blkno, 1, blk) != 0)
-        return -1;
-
-    off = offset % BLKDEV_BLKSIZE;
-    len = _Min(BLKDEV_BLKSIZE - off, size);
-    Memcpy(data, &blk[off], len);
-    return len;
-}
-
-static ssize_t _WritePartialBlock(
-   Blkdev* dev,
-   UINTN blkno,
-   ssize_t offset,
-   size_t size,
-   const void* data)
-{
-    UINT8 blk[BLKDEV_BLKSIZE];
-    UINT32 off; /* offset into this block */
-    UINT32 len; /* bytes to read from this block */
-
-    if (!size)
-        return 0;
-
-    /* Fetch the block */
-    if (dev->GetN(dev, blkno, 1, blk) != 0)
-        return -1;
-
-    /* Replace the specified data in the block. */
-    off = offset % BLKDEV_BLKSIZE;
-    len = _Min(BLKDEV_BLKSIZE - off, size);
-    Memcpy(&blk[off], data, len);
-
-    /* Rewrite the block */
-    if (dev->PutN(dev, blkno, 1, blk) != 0)
-        return -1;
-
-    return len;
-}
-
 static ssize_t _Read(
     Blkdev* dev,
     size_t offset,
     void* data,
     size_t size)
 {
-    UINT32 blkno;
-    UINT32 nblocks;
-    UINT32 rem;
-    UINT8* ptr;
-    ssize_t bytesRead;
-
     if (!dev || !data)
         return -1;
 
-    blkno = offset / BLKDEV_BLKSIZE;
-    rem = size;
-    ptr = data;
-
-    /* Handle the special case if offset is unaligned to the sector. */
-    if (offset % BLKDEV_BLKSIZE != 0)
-    {
-        bytesRead = _ReadPartialBlock(dev, blkno, offset, rem, ptr);
-        if (bytesRead < 0)
-            return -1;
-
-        blkno++;
-        rem -= bytesRead;
-        ptr += bytesRead;
-    }
-
-    /* Read the remaining full blocks. */
-    nblocks = rem / BLKDEV_BLKSIZE;
-    if (dev->GetN(dev, blkno, nblocks, ptr) != 0)
-        return -1;
-
-    blkno += nblocks;
-    rem -= nblocks * BLKDEV_BLKSIZE;
-    ptr += nblocks * BLKDEV_BLKSIZE;
-
-    /* Read the last partial block if needed. */
-    bytesRead = _ReadPartialBlock(dev, blkno, 0, rem, ptr);
-    if (bytesRead < 0)
+    /* Handles offsets and sizes that are unaligned to the device blocks */
+    if (BlkdevReadBytes(dev, offset, data, size) != 0)
         return -1;
 
     return size;
@@ -247,43 +162,11 @@ static ssize_t _Write(
     const void* data,
     size_t size)
 {
-    UINT32 blkno;
-    UINT32 nblocks;
-    UINT32 rem;
-    const UINT8* ptr;
-    ssize_t bytesWritten;
-
     if (!dev || !data)
         return -1;
 
-    blkno = offset / BLKDEV_BLKSIZE;
-    rem = size;
-    ptr = data;
-
-    /* Handle the special case if offset is not aligned to sector. */
-    if (offset % BLKDEV_BLKSIZE != 0)
-    {
-        bytesWritten = _WritePartialBlock(dev, blkno, offset, rem, ptr);
-        if (bytesWritten < 0)
-            return -1;
-
-        blkno++;
-        rem -= bytesWritten;
-        ptr += bytesWritten;
-    }
-
-    /* Write the remaining blocks full blocks. */
-    nblocks = rem / BLKDEV_BLKSIZE;
-    if (dev->PutN(dev, blkno, nblocks, ptr) != 0)
-        return -1;
-
-    blkno += nblocks;
-    rem -= nblocks * BLKDEV_BLKSIZE;
-    ptr += nblocks * BLKDEV_BLKSIZE;
-
-    /* Write the partial block if needed. */
-    bytesWritten = _WritePartialBlock(dev, blkno, 0, rem, ptr);
-    if (bytesWritten < 0)
+    /* Handles offsets and sizes that are unaligned to the device blocks */
+    if (BlkdevWriteBytes(dev, offset, data, size) != 0)
         return -1;
 
     return size;
@@ -680,48 +563,237 @@ static UINT32 _BlknoToLblkno(
     return (blkno - first) % ext2->sb.s_blocks_per_group;
 }
 
-static EXT2Err _ReadBlocks(
-    const EXT2* ext2,
-    UINT32 blkno,
-    UINT32 nblks,
-    Buf* buf)
+/*
+**==============================================================================
+**
+** caches:
+**
+**     Direct-mapped caches of inodes, inode-table blocks and directory
+**     entries (parent ino and name to ino). Inodes and inode-table blocks
+**     are updated or dropped when written; directory entries are dropped 
+**     whenever a directory changes.
+**
+**==============================================================================
+*/
+
+#define INODE_CACHE_BITS 8
+#define INODE_CACHE_SIZE (1 << INODE_CACHE_BITS)
+#define BLOCK_CACHE_SIZE 16
+#define DENTRY_CACHE_SIZE 512
+
+typedef struct _InodeCacheEntry
 {
-    EXT2_DECLARE_ERR(err);
-    UINT32 bytes;
+    EXT2Ino ino; /* 0 if unused */
+    EXT2Inode inode;
+}
+InodeCacheEntry;
 
-    /* Check for null parameters */
-    if (!EXT2Valid(ext2) || !buf)
+typedef struct _DentryCacheEntry
+{
+    EXT2Ino dir_ino; /* 0 if unused */
+    EXT2Ino ino;
+    UINT8 type;
+    char name[EXT2_PATH_MAX];
+}
+DentryCacheEntry;
+
+struct _EXT2Cache
+{
+    InodeCacheEntry inodes[INODE_CACHE_SIZE];
+    UINT32 blknos[BLOCK_CACHE_SIZE]; /* 0 if unused */
+    UINT8* blocks; /* BLOCK_CACHE_SIZE blocks */
+    DentryCacheEntry dentries[DENTRY_CACHE_SIZE];
+    EXT2CacheStats stats;
+};
+
+static EXT2Cache* _NewCache(
+    UINT32 block_size)
+{
+    EXT2Cache* cache;
+
+    if (!(cache = (EXT2Cache*)Calloc(1, sizeof(EXT2Cache))))
+        return NULL;
+
+    if (!(cache->blocks = (UINT8*)Malloc(BLOCK_CACHE_SIZE * block_size)))
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
+        Free(cache);
+        return NULL;
     }
 
-    /* Expand the allocation to hold the new data */
+    return cache;
+}
+
+static void _DeleteCache(
+    EXT2Cache* cache)
+{
+    if (cache)
     {
-        bytes = nblks * ext2->block_size;
+        Free(cache->blocks);
+        Free(cache);
+    }
+}
 
-        if (BufReserve(buf, buf->size + bytes) != 0)
-            GOTO(done);
+/* Inode numbers often share strides (e.g., every other inode), so scatter
+ * them with a multiplicative hash */
+static InodeCacheEntry* _InodeSlot(
+    const EXT2* ext2,
+    EXT2Ino ino)
+{
+    UINT32 hash = (UINT32)ino * 2654435761U;
+    return &ext2->cache->inodes[hash >> (32 - INODE_CACHE_BITS)];
+}
+
+static BOOLEAN _GetCachedInode(
+    const EXT2* ext2,
+    EXT2Ino ino,
+    EXT2Inode* inode)
+{
+    InodeCacheEntry* entry = _InodeSlot(ext2, ino);
+
+    if (entry->ino != ino)
+    {
+        ext2->cache->stats.inode_misses++;
+        return FALSE;
+    }
+
+    Memcpy(inode, &entry->inode, ext2->sb.s_inode_size);
+    ext2->cache->stats.inode_hits++;
+    return TRUE;
+}
+
+static void _PutCachedInode(
+    const EXT2* ext2,
+    EXT2Ino ino,
+    const EXT2Inode* inode)
+{
+    InodeCacheEntry* entry = _InodeSlot(ext2, ino);
+
+    entry->ino = ino;
+    Memcpy(&entry->inode, inode, ext2->sb.s_inode_size);
+}
+
+/* Get an inode-table block (from the cache if possible) */
+static const UINT8* _GetInodeTableBlock(
+    const EXT2* ext2,
+    UINT32 blkno)
+{
+    EXT2Cache* cache = ext2->cache;
+    UINT32 index = blkno % BLOCK_CACHE_SIZE;
+    UINT8* data = cache->blocks + index * ext2->block_size;
+
+    if (cache->blknos[index] == blkno)
+    {
+        cache->stats.block_hits++;
+        return data;
     }
 
-    /* Read the blocks */
+    cache->stats.block_misses++;
+    cache->blknos[index] = 0;
+
     if (_Read(
-        ext2->dev,
+        ext2->dev, 
         BlockOffset(blkno, ext2->block_size),
-        (unsigned char*)buf->data + buf->size,
-        bytes) != bytes)
+        data, 
+        ext2->block_size) != ext2->block_size)
     {
-        err = EXT2_ERR_READ_FAILED;
-        GOTO(done);
+        return NULL;
     }
 
-    buf->size += bytes;
+    cache->blknos[index] = blkno;
+    return data;
+}
 
-    err = EXT2_ERR_NONE;
+static void _DropCachedBlock(
+    const EXT2* ext2,
+    UINT32 blkno)
+{
+    UINT32 index = blkno % BLOCK_CACHE_SIZE;
 
-done:
+    if (ext2->cache && ext2->cache->blknos[index] == blkno)
+        ext2->cache->blknos[index] = 0;
+}
 
-    return err;
+static DentryCacheEntry* _DentrySlot(
+    const EXT2* ext2,
+    EXT2Ino dir_ino,
+    const char* name)
+{
+    UINT32 hash = 2166136261U ^ dir_ino;
+    const char* p;
+
+    /* FNV-1a hash of the parent directory and the name */
+    for (p = name; *p; p++)
+    {
+        hash ^= (UINT8)*p;
+        hash *= 16777619U;
+    }
+
+    return &ext2->cache->dentries[hash % DENTRY_CACHE_SIZE];
+}
+
+static BOOLEAN _GetCachedDentry(
+    const EXT2* ext2,
+    EXT2Ino dir_ino,
+    const char* name,
+    EXT2Ino* ino,
+    UINT8* type)
+{
+    const DentryCacheEntry* entry = _DentrySlot(ext2, dir_ino, name);
+
+    if (entry->dir_ino != dir_ino || Strcmp(entry->name, name) != 0)
+    {
+        ext2->cache->stats.dentry_misses++;
+        return FALSE;
+    }
+
+    *ino = entry->ino;
+    *type = entry->type;
+    ext2->cache->stats.dentry_hits++;
+    return TRUE;
+}
+
+static void _PutCachedDentry(
+    const EXT2* ext2,
+    EXT2Ino dir_ino,
+    const EXT2DirEnt* ent)
+{
+    DentryCacheEntry* entry;
+
+    /* Skip unused entries */
+    if (ent->d_ino == 0)
+        return;
+
+    entry = _DentrySlot(ext2, dir_ino, ent->d_name);
+    entry->dir_ino = dir_ino;
+    entry->ino = ent->d_ino;
+    entry->type = ent->d_type;
+    Strlcpy(entry->name, ent->d_name, sizeof(entry->name));
+}
+
+/* Called after directories change (entries removed, added or reused) */
+static void _DropCachedDentries(
+    const EXT2* ext2)
+{
+    UINT32 i;
+
+    if (!ext2 || !ext2->cache)
+        return;
+
+    for (i = 0; i < DENTRY_CACHE_SIZE; i++)
+        ext2->cache->dentries[i].dir_ino = 0;
+}
+
+void EXT2GetCacheStats(
+    const EXT2* ext2,
+    EXT2CacheStats* stats)
+{
+    if (!stats)
+        return;
+
+    if (ext2 && ext2->cache)
+        *stats = ext2->cache->stats;
+    else
+        Memset(stats, 0, sizeof(EXT2CacheStats));
 }
 
 EXT2Err EXT2ReadBlock(
@@ -800,6 +872,8 @@ EXT2Err EXT2WriteBlock(
         GOTO(done);
     }
 
+    _DropCachedBlock(ext2, blkno);
+
     err = EXT2_ERR_NONE;
 
 done:
@@ -934,104 +1008,338 @@ done:
     return err;
 }
 
-static EXT2Err _LoadBlockNumbersFromInode(
+/*
+**==============================================================================
+**
+** extents:
+**
+**==============================================================================
+*/
+
+/* Append the runs under this extent-tree node (and optionally the block
+ * numbers of the index and leaf blocks below it) */
+static EXT2Err _AppendExtents(
     const EXT2* ext2,
-    const EXT2Inode* inode,
-    BOOLEAN include_block_blocks,
-    BufU32 *buf)
+    const void* node,
+    UINT32 node_size,
+    UINT32 depth,
+    Buf* extents,
+    BufU32* node_blknos)
 {
     EXT2_DECLARE_ERR(err);
+    const EXT4ExtentHeader* eh = (const EXT4ExtentHeader*)node;
+    UINT32 i;
 
-    /* Check parameters */
-    if (!EXT2Valid(ext2) || !inode || !buf)
-    {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
-    }
-
-    /* Handle the direct blocks */
-    if (EXT2_IFERR(err = _AppendDirectBlockNumbers(
-        inode->i_block,
-        EXT2_SINGLE_INDIRECT_BLOCK,
-        buf)))
+    /* Check the node header (index and leaf entries are the same size) */
+    if (node_size < sizeof(EXT4ExtentHeader) ||
+        eh->eh_magic != EXT4_EXT_MAGIC ||
+        eh->eh_depth != depth ||
+        sizeof(EXT4ExtentHeader) + eh->eh_entries * sizeof(EXT4Extent) > 
+            node_size)
     {
+        err = EXT2_ERR_SANITY_CHECK_FAILED;
         GOTO(done);
     }
 
-    /* Handle single-indirect blocks */
-    if (inode->i_block[EXT2_SINGLE_INDIRECT_BLOCK])
+    if (depth == 0)
     {
-        EXT2Block block;
-        UINT32 block_no = inode->i_block[EXT2_SINGLE_INDIRECT_BLOCK];
+        const EXT4Extent* ee = (const EXT4Extent*)(eh + 1);
 
-        /* Read the next block */
-        if (EXT2_IFERR(err = EXT2ReadBlock(ext2, block_no, &block)))
+        for (i = 0; i < eh->eh_entries; i++)
         {
-            GOTO(done);
-        }
+            EXT2Extent ext;
 
-        if (include_block_blocks)
-        {
-            if (EXT2_IFERR(err = BufU32Append(buf, &block_no, 1)))
+            /* 48-bit block numbers are not supported */
+            if (ee[i].ee_start_hi)
             {
+                err = EXT2_ERR_BAD_BLKNO;
                 GOTO(done);
             }
-        }
 
-        /* Append the block numbers from this block */
-        if (EXT2_IFERR(err = _AppendDirectBlockNumbers(
-            (const UINT32*)block.data,
-            block.size / sizeof(UINT32),
-            buf)))
-        {
-            GOTO(done);
+            ext.lblkno = ee[i].ee_block;
+            ext.blkno = ee[i].ee_start_lo;
+            ext.count = ee[i].ee_len;
+            ext.flags = 0;
+
+            if (ext.count > EXT4_EXT_INIT_MAX_LEN)
+            {
+                ext.count -= EXT4_EXT_INIT_MAX_LEN;
+                ext.flags |= EXT2_EXTENT_UNINIT;
+            }
+
+            if (BufAppend(extents, &ext, sizeof(ext)) != 0)
+            {
+                err = EXT2_ERR_OUT_OF_MEMORY;
+                GOTO(done);
+            }
         }
     }
-
-    /* Handle double-indirect blocks */
-    if (inode->i_block[EXT2_DOUBLE_INDIRECT_BLOCK])
+    else
     {
-        EXT2Block block;
-        UINT32 block_no = inode->i_block[EXT2_DOUBLE_INDIRECT_BLOCK];
+        const EXT4ExtentIdx* ei = (const EXT4ExtentIdx*)(eh + 1);
 
-        /* Read the next block */
-        if (EXT2_IFERR(err = EXT2ReadBlock(ext2, block_no, &block)))
+        for (i = 0; i < eh->eh_entries; i++)
         {
-            GOTO(done);
-        }
+            EXT2Block block;
+            UINT32 block_no = ei[i].ei_leaf_lo;
 
-        if (include_block_blocks)
-        {
-            if (EXT2_IFERR(err = BufU32Append(buf, &block_no, 1)))
+            if (ei[i].ei_leaf_hi)
+            {
+                err = EXT2_ERR_BAD_BLKNO;
                 GOTO(done);
-        }
-
-        if (EXT2_IFERR(err = _AppendIndirectBlockNumbers(
-            ext2, 
-            (const UINT32*)block.data,
-            block.size / sizeof(UINT32),
-            include_block_blocks,
-            buf)))
-        {
-            GOTO(done);
-        }
-    }
+            }
 
-    /* Handle triple-indirect blocks */
-    if (inode->i_block[EXT2_TRIPLE_INDIRECT_BLOCK])
-    {
-        EXT2Block block;
-        UINT32 block_no = inode->i_block[EXT2_TRIPLE_INDIRECT_BLOCK];
+            if (node_blknos)
+            {
+                if (EXT2_IFERR(err = BufU32Append(node_blknos, &block_no, 1)))
+                    GOTO(done);
+            }
 
-        /* Read the next block */
-        if (EXT2_IFERR(err = EXT2ReadBlock(ext2, block_no, &block)))
-        {
-            GOTO(done);
-        }
+            /* Read the child node */
+            if (EXT2_IFERR(err = EXT2ReadBlock(ext2, block_no, &block)))
+                GOTO(done);
 
-        if (include_block_blocks)
-        {
-            if (EXT2_IFERR(err = BufU32Append(buf, &block_no, 1)))
+            if (EXT2_IFERR(err = _AppendExtents(
+                ext2,
+                block.data,
+                block.size,
+                depth - 1,
+                extents,
+                node_blknos)))
+            {
+                GOTO(done);
+            }
+        }
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+/* Load the runs of an inode with an extent tree (EXT4_EXTENTS_FL) */
+static EXT2Err _LoadExtentTree(
+    const EXT2* ext2,
+    const EXT2Inode* inode,
+    Buf* extents,
+    BufU32* node_blknos)
+{
+    EXT2_DECLARE_ERR(err);
+    const EXT4ExtentHeader* eh = (const EXT4ExtentHeader*)inode->i_block;
+    const EXT2Extent* p;
+    const EXT2Extent* end;
+    UINT32 next = 0;
+
+    if (eh->eh_depth > EXT4_EXT_MAX_DEPTH)
+    {
+        err = EXT2_ERR_SANITY_CHECK_FAILED;
+        GOTO(done);
+    }
+
+    if (EXT2_IFERR(err = _AppendExtents(
+        ext2,
+        inode->i_block,
+        sizeof(inode->i_block),
+        eh->eh_depth,
+        extents,
+        node_blknos)))
+    {
+        GOTO(done);
+    }
+
+    /* Runs must be in order, must not overlap and must be on the device */
+    p = (const EXT2Extent*)extents->data;
+    end = p + extents->size / sizeof(EXT2Extent);
+
+    for (; p != end; p++)
+    {
+        if (p->lblkno < next || 
+            p->count == 0 ||
+            p->blkno == 0 ||
+            p->blkno + p->count > ext2->sb.s_blocks_count ||
+            p->blkno + p->count < p->blkno)
+        {
+            err = EXT2_ERR_BAD_BLKNO;
+            GOTO(done);
+        }
+
+        next = p->lblkno + p->count;
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+/* Expand the extent tree into block numbers: holes become zero unless 
+ * include_block_blocks is set (then the tree blocks come first) */
+static EXT2Err _LoadBlockNumbersFromExtentTree(
+    const EXT2* ext2,
+    const EXT2Inode* inode,
+    BOOLEAN include_block_blocks,
+    BufU32 *buf)
+{
+    EXT2_DECLARE_ERR(err);
+    Buf extents = BUF_INITIALIZER;
+    const EXT2Extent* p;
+    const EXT2Extent* end;
+    UINT32 next = 0;
+
+    if (EXT2_IFERR(err = _LoadExtentTree(
+        ext2, 
+        inode, 
+        &extents, 
+        include_block_blocks ? buf : NULL)))
+    {
+        GOTO(done);
+    }
+
+    p = (const EXT2Extent*)extents.data;
+    end = p + extents.size / sizeof(EXT2Extent);
+
+    for (; p != end; p++)
+    {
+        UINT32 i;
+
+        for (; !include_block_blocks && next < p->lblkno; next++)
+        {
+            const UINT32 zero = 0;
+
+            if (EXT2_IFERR(err = BufU32Append(buf, &zero, 1)))
+                GOTO(done);
+        }
+
+        for (i = 0; i < p->count; i++)
+        {
+            UINT32 blkno = p->blkno + i;
+
+            if (EXT2_IFERR(err = BufU32Append(buf, &blkno, 1)))
+                GOTO(done);
+        }
+
+        next = p->lblkno + p->count;
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+
+    BufRelease(&extents);
+
+    return err;
+}
+
+static EXT2Err _LoadBlockNumbersFromInode(
+    const EXT2* ext2,
+    const EXT2Inode* inode,
+    BOOLEAN include_block_blocks,
+    BufU32 *buf)
+{
+    EXT2_DECLARE_ERR(err);
+
+    /* Check parameters */
+    if (!EXT2Valid(ext2) || !inode || !buf)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Handle ext4 extent trees */
+    if (inode->i_flags & EXT4_EXTENTS_FL)
+    {
+        err = _LoadBlockNumbersFromExtentTree(
+            ext2, 
+            inode, 
+            include_block_blocks, 
+            buf);
+        goto done;
+    }
+
+    /* Handle the direct blocks */
+    if (EXT2_IFERR(err = _AppendDirectBlockNumbers(
+        inode->i_block,
+        EXT2_SINGLE_INDIRECT_BLOCK,
+        buf)))
+    {
+        GOTO(done);
+    }
+
+    /* Handle single-indirect blocks */
+    if (inode->i_block[EXT2_SINGLE_INDIRECT_BLOCK])
+    {
+        EXT2Block block;
+        UINT32 block_no = inode->i_block[EXT2_SINGLE_INDIRECT_BLOCK];
+
+        /* Read the next block */
+        if (EXT2_IFERR(err = EXT2ReadBlock(ext2, block_no, &block)))
+        {
+            GOTO(done);
+        }
+
+        if (include_block_blocks)
+        {
+            if (EXT2_IFERR(err = BufU32Append(buf, &block_no, 1)))
+            {
+                GOTO(done);
+            }
+        }
+
+        /* Append the block numbers from this block */
+        if (EXT2_IFERR(err = _AppendDirectBlockNumbers(
+            (const UINT32*)block.data,
+            block.size / sizeof(UINT32),
+            buf)))
+        {
+            GOTO(done);
+        }
+    }
+
+    /* Handle double-indirect blocks */
+    if (inode->i_block[EXT2_DOUBLE_INDIRECT_BLOCK])
+    {
+        EXT2Block block;
+        UINT32 block_no = inode->i_block[EXT2_DOUBLE_INDIRECT_BLOCK];
+
+        /* Read the next block */
+        if (EXT2_IFERR(err = EXT2ReadBlock(ext2, block_no, &block)))
+        {
+            GOTO(done);
+        }
+
+        if (include_block_blocks)
+        {
+            if (EXT2_IFERR(err = BufU32Append(buf, &block_no, 1)))
+                GOTO(done);
+        }
+
+        if (EXT2_IFERR(err = _AppendIndirectBlockNumbers(
+            ext2, 
+            (const UINT32*)block.data,
+            block.size / sizeof(UINT32),
+            include_block_blocks,
+            buf)))
+        {
+            GOTO(done);
+        }
+    }
+
+    /* Handle triple-indirect blocks */
+    if (inode->i_block[EXT2_TRIPLE_INDIRECT_BLOCK])
+    {
+        EXT2Block block;
+        UINT32 block_no = inode->i_block[EXT2_TRIPLE_INDIRECT_BLOCK];
+
+        /* Read the next block */
+        if (EXT2_IFERR(err = EXT2ReadBlock(ext2, block_no, &block)))
+        {
+            GOTO(done);
+        }
+
+        if (include_block_blocks)
+        {
+            if (EXT2_IFERR(err = BufU32Append(buf, &block_no, 1)))
                 GOTO(done);
         }
 
@@ -1073,6 +1381,72 @@ done:
     return err;
 }
 
+EXT2Err EXT2GetExtents(
+    const EXT2* ext2,
+    const EXT2Inode* inode,
+    Buf* extents)
+{
+    EXT2_DECLARE_ERR(err);
+    BufU32 blknos = BUF_U32_INITIALIZER;
+    UINT32 i;
+
+    /* Check parameters */
+    if (!EXT2Valid(ext2) || !inode || !extents)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    if (inode->i_flags & EXT4_EXTENTS_FL)
+    {
+        err = _LoadExtentTree(ext2, inode, extents, NULL);
+        goto done;
+    }
+
+    /* Form a list of block-numbers for this file */
+    if (EXT2_IFERR(err = _LoadBlockNumbersFromInode(
+        ext2, 
+        inode,
+        0, /* include_block_blocks */
+        &blknos)))
+    {
+        GOTO(done);
+    }
+
+    /* Form one run for each run of consecutive blocks */
+    for (i = 0; i < blknos.size; )
+    {
+        EXT2Extent ext;
+
+        ext.lblkno = i;
+        ext.blkno = blknos.data[i];
+        ext.count = 1;
+        ext.flags = 0;
+
+        while (i + ext.count < blknos.size &&
+            blknos.data[i + ext.count] == ext.blkno + ext.count)
+        {
+            ext.count++;
+        }
+
+        if (BufAppend(extents, &ext, sizeof(ext)) != 0)
+        {
+            err = EXT2_ERR_OUT_OF_MEMORY;
+            GOTO(done);
+        }
+
+        i += ext.count;
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+
+    BufU32Release(&blknos);
+
+    return err;
+}
+
 static EXT2Err _WriteGroup(
     const EXT2* ext2,
     UINT32 grpno);
@@ -1080,6 +1454,25 @@ static EXT2Err _WriteGroup(
 static EXT2Err _WriteSuperBlock(
     const EXT2* ext2);
 
+/* Reject changes to file systems with features this module cannot 
+ * maintain (e.g., ext4 extent trees and metadata checksums) */
+static EXT2Err _CheckWritable(
+    const EXT2* ext2)
+{
+    const UINT32 incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+    const UINT32 ro_compat = 
+        EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | 
+        EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+
+    if ((ext2->sb.s_feature_incompat & ~incompat) ||
+        (ext2->sb.s_feature_ro_compat & ~ro_compat))
+    {
+        return EXT2_ERR_UNSUPPORTED;
+    }
+
+    return EXT2_ERR_NONE;
+}
+
 static EXT2Err _CheckBlockNumber(
     EXT2* ext2,
     UINT32 blkno,
@@ -1451,6 +1844,7 @@ void EXT2DumpSuperBlock(const EXT2SuperBlock* sb)
     printf("s_def_hash_version=%u\n", sb->s_def_hash_version);
     printf("s_default_mount_options=%u\n", sb->s_default_mount_options);
     printf("s_first_meta_bg=%u\n", sb->s_first_meta_bg);
+    printf("s_flags=%08X\n", sb->s_flags);
     printf("\n");
 }
 # endif /* !defined(BUILD_EFI) */
@@ -1535,12 +1929,30 @@ static void _DumpGroupDescs(
 }
 # endif /* !defined(BUILD_EFI) */
 
+/* Size of the on-disk group descriptors (larger on 64-bit file systems,
+ * whose upper halves are ignored) */
+static UINT32 _GroupDescSize(
+    const EXT2* ext2)
+{
+    if ((ext2->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) &&
+        ext2->sb.s_desc_size > sizeof(EXT2GroupDesc))
+    {
+        return ext2->sb.s_desc_size;
+    }
+
+    return sizeof(EXT2GroupDesc);
+}
+
 static EXT2GroupDesc* _ReadGroups(
     const EXT2* ext2)
 {
     EXT2_DECLARE_ERR(err);
     EXT2GroupDesc* groups = NULL;
     UINT32 groups_size = 0;
+    UINT8* table = NULL;
+    UINT32 table_size = 0;
+    UINT32 desc_size;
+    UINT32 i;
     UINT32 blkno;
 
     /* Check the file system argument */
@@ -1568,20 +1980,34 @@ static EXT2GroupDesc* _ReadGroups(
     else
         blkno = 1;
 
-    /* Read the block */
+    /* Read the descriptor table */
+    desc_size = _GroupDescSize(ext2);
+    table_size = ext2->group_count * desc_size;
+
+    if (!(table = (UINT8*)Malloc(table_size)))
+    {
+        GOTO(done);
+    }
+
     if (_Read(
         ext2->dev, 
         BlockOffset(blkno, ext2->block_size),
-        groups, 
-        groups_size) != groups_size)
+        table, 
+        table_size) != table_size)
     {
         GOTO(done);
     }
 
+    for (i = 0; i < ext2->group_count; i++)
+        Memcpy(&groups[i], table + i * desc_size, sizeof(EXT2GroupDesc));
+
     err = EXT2_ERR_NONE;
 
 done:
 
+    if (table)
+        Free(table);
+
     if (EXT2_IFERR(err))
     {
         if (groups)
@@ -1617,7 +2043,7 @@ static EXT2Err _WriteGroup(
     if (_Write(
         ext2->dev, 
         BlockOffset(blkno,ext2->block_size) + 
-            (grpno * sizeof(EXT2GroupDesc)),
+            (grpno * _GroupDescSize(ext2)),
         &ext2->groups[grpno], 
         sizeof(EXT2GroupDesc)) != sizeof(EXT2GroupDesc))
     {
@@ -1876,14 +2302,21 @@ EXT2Err EXT2ReadInode(
     const EXT2GroupDesc* group = &ext2->groups[grpno];
     UINT32 inode_size = ext2->sb.s_inode_size;
     UINTN offset;
+    const UINT8* block;
 
-    if (ino == 0)
+    if (ino == 0 || ino > ext2->sb.s_inodes_count)
     {
         err = EXT2_ERR_BAD_INO;
         GOTO(done);
     }
 
-#if !defined(BUILD_EFI)
+    if (_GetCachedInode(ext2, ino, inode))
+    {
+        err = EXT2_ERR_NONE;
+        goto done;
+    }
+
+#if !defined(BUILD_EFI)
     /* Check the reverse mapping */
     {
         EXT2Ino tmp;
@@ -1892,19 +2325,19 @@ EXT2Err EXT2ReadInode(
     }
 #endif /* !defined(BUILD_EFI) */
 
-    offset = BlockOffset(group->bg_inode_table, ext2->block_size) +
-        lino * inode_size;
+    offset = lino * inode_size;
 
-    /* Read the inode */
-    if (_Read(
-        ext2->dev, 
-        offset,
-        inode, 
-        inode_size) != inode_size)
+    /* Read the inode from its inode-table block */
+    if (!(block = _GetInodeTableBlock(
+        ext2, 
+        group->bg_inode_table + offset / ext2->block_size)))
     {
         GOTO(done);
     }
 
+    Memcpy(inode, block + offset % ext2->block_size, inode_size);
+    _PutCachedInode(ext2, ino, inode);
+
     err = EXT2_ERR_NONE;
 
 done:
@@ -1945,119 +2378,272 @@ static EXT2Err _WriteInode(
         GOTO(done);
     }
 
+    /* Keep the caches coherent */
+    _DropCachedBlock(ext2, 
+        group->bg_inode_table + (lino * inode_size) / ext2->block_size);
+    _PutCachedInode(ext2, ino, inode);
+
     err = EXT2_ERR_NONE;
 
 done:
     return err;
 }
 
-EXT2Err EXT2PathToIno(
-    const EXT2* ext2,
-    const char* path,
-    EXT2Ino* ino)
+/*
+**==============================================================================
+**
+** htree:
+**
+**==============================================================================
+*/
+
+/* Upper bits of dx_entry block numbers are reserved */
+#define EXT2_DX_BLOCK_MASK 0x0FFFFFFFU
+
+/* Largest hash value (reserved as an end-of-directory marker) */
+#define EXT2_DX_HASH_EOF 0x7FFFFFFFU
+
+/* Index levels below the root (the root plus one level of nodes) */
+#define EXT2_DX_MAX_LEVELS 2
+
+typedef struct _EXT2DxFrame
 {
-    EXT2_DECLARE_ERR(err);
-    char buf[EXT2_PATH_MAX];
-    const char* elements[32];
-    const UINT8 NELEMENTS = sizeof(elements) / sizeof(elements[0]);
-    UINT8 nelements = 0;
-    char* p;
-    char* save;
-    UINT8 i;
-    EXT2Ino current_ino = 0;
+    EXT2Block block;
+    UINT32 lblkno; /* logical block holding this index node */
+    UINT32 offset; /* offset of the dx_entry table within the block */
+    UINT32 index; /* table slot chosen for the hash */
+}
+EXT2DxFrame;
 
-    /* Check for null parameters */
-    if (!ext2 || !path || !ino)
+/* The path from the root of an index down to a leaf */
+typedef struct _EXT2DxPath
+{
+    BufU32 blknos; /* physical blocks of the directory */
+    UINT8 version; /* hash version from the root */
+    UINT32 hash; /* hash of the name being looked up */
+    UINT32 nframes;
+    EXT2DxFrame frames[EXT2_DX_MAX_LEVELS];
+    EXT2Block leaf;
+    UINT32 leaf_lblkno;
+    UINT32 offset; /* offset of the matching entry within the leaf */
+    UINT32 prev; /* offset of the entry before it (or 'offset' if first) */
+}
+EXT2DxPath;
+
+static __inline INT32 _DxChar(
+    const char* s, 
+    UINT32 i, 
+    BOOLEAN unsigned_chars)
+{
+    return unsigned_chars ? (INT32)(UINT8)s[i] : (INT32)(signed char)s[i];
+}
+
+static UINT32 _DxHackHash(
+    const char* name,
+    UINT32 len,
+    BOOLEAN unsigned_chars)
+{
+    UINT32 hash;
+    UINT32 hash0 = 0x12A3FE2D;
+    UINT32 hash1 = 0x37ABE8F9;
+    UINT32 i;
+
+    for (i = 0; i < len; i++)
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
+        hash = hash1 + 
+            (hash0 ^ (UINT32)(_DxChar(name, i, unsigned_chars) * 7152373));
+
+        if (hash & 0x80000000)
+            hash -= 0x7FFFFFFF;
+
+        hash1 = hash0;
+        hash0 = hash;
     }
 
-    /* Initialize to null inode for now */
-    *ino = 0;
+    return hash0 << 1;
+}
 
-    /* Check path length */
-    if (Strlen(path) >= EXT2_PATH_MAX)
+/* Pack up to 'num' words of 'msg' into 'buf' (padding with the length) */
+static void _DxStrToHashBuf(
+    const char* msg,
+    UINT32 len,
+    UINT32* buf,
+    UINT32 num,
+    BOOLEAN unsigned_chars)
+{
+    UINT32 pad;
+    UINT32 val;
+    UINT32 i;
+
+    pad = len | (len << 8);
+    pad |= pad << 16;
+    val = pad;
+
+    if (len > num * 4)
+        len = num * 4;
+
+    for (i = 0; i < len; i++)
     {
-        err = EXT2_ERR_PATH_TOO_LONG;
-        GOTO(done);
-    }
+        val = (UINT32)_DxChar(msg, i, unsigned_chars) + (val << 8);
 
-    /* Copy path */
-    Strlcpy(buf, path, sizeof(buf));
+        if ((i % 4) == 3)
+        {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
 
-    /* Be sure path begins with "/" */
-    if (path[0] != '/')
+    if (num)
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
+        *buf++ = val;
+        num--;
     }
 
-    elements[nelements++] = "/";
+    while (num--)
+        *buf++ = pad;
+}
 
-    /* Split the path into components */
-    for (p = Strtok(buf, "/", &save); p; p = Strtok(NULL, "/", &save))
+#define _DX_ROL(X, S) (((X) << (S)) | ((X) >> (32 - (S))))
+#define _DX_F(X, Y, Z) ((Z) ^ ((X) & ((Y) ^ (Z))))
+#define _DX_G(X, Y, Z) (((X) & (Y)) + (((X) ^ (Y)) & (Z)))
+#define _DX_H(X, Y, Z) ((X) ^ (Y) ^ (Z))
+#define _DX_ROUND(F, A, B, C, D, X, S) \
+    (A += F(B, C, D) + (X), A = _DX_ROL(A, S))
+#define _DX_K2 0x5A827999
+#define _DX_K3 0x6ED9EBA1
+
+static void _DxHalfMD4Transform(
+    UINT32 buf[4], 
+    const UINT32 in[8])
+{
+    UINT32 a = buf[0];
+    UINT32 b = buf[1];
+    UINT32 c = buf[2];
+    UINT32 d = buf[3];
+
+    /* Round 1 */
+    _DX_ROUND(_DX_F, a, b, c, d, in[0], 3);
+    _DX_ROUND(_DX_F, d, a, b, c, in[1], 7);
+    _DX_ROUND(_DX_F, c, d, a, b, in[2], 11);
+    _DX_ROUND(_DX_F, b, c, d, a, in[3], 19);
+    _DX_ROUND(_DX_F, a, b, c, d, in[4], 3);
+    _DX_ROUND(_DX_F, d, a, b, c, in[5], 7);
+    _DX_ROUND(_DX_F, c, d, a, b, in[6], 11);
+    _DX_ROUND(_DX_F, b, c, d, a, in[7], 19);
+
+    /* Round 2 */
+    _DX_ROUND(_DX_G, a, b, c, d, in[1] + _DX_K2, 3);
+    _DX_ROUND(_DX_G, d, a, b, c, in[3] + _DX_K2, 5);
+    _DX_ROUND(_DX_G, c, d, a, b, in[5] + _DX_K2, 9);
+    _DX_ROUND(_DX_G, b, c, d, a, in[7] + _DX_K2, 13);
+    _DX_ROUND(_DX_G, a, b, c, d, in[0] + _DX_K2, 3);
+    _DX_ROUND(_DX_G, d, a, b, c, in[2] + _DX_K2, 5);
+    _DX_ROUND(_DX_G, c, d, a, b, in[4] + _DX_K2, 9);
+    _DX_ROUND(_DX_G, b, c, d, a, in[6] + _DX_K2, 13);
+
+    /* Round 3 */
+    _DX_ROUND(_DX_H, a, b, c, d, in[3] + _DX_K3, 3);
+    _DX_ROUND(_DX_H, d, a, b, c, in[7] + _DX_K3, 9);
+    _DX_ROUND(_DX_H, c, d, a, b, in[2] + _DX_K3, 11);
+    _DX_ROUND(_DX_H, b, c, d, a, in[6] + _DX_K3, 15);
+    _DX_ROUND(_DX_H, a, b, c, d, in[1] + _DX_K3, 3);
+    _DX_ROUND(_DX_H, d, a, b, c, in[5] + _DX_K3, 9);
+    _DX_ROUND(_DX_H, c, d, a, b, in[0] + _DX_K3, 11);
+    _DX_ROUND(_DX_H, b, c, d, a, in[4] + _DX_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static void _DxTEATransform(
+    UINT32 buf[4], 
+    const UINT32 in[4])
+{
+    UINT32 sum = 0;
+    UINT32 b0 = buf[0];
+    UINT32 b1 = buf[1];
+    UINT32 n;
+
+    for (n = 0; n < 16; n++)
     {
-        if (nelements == NELEMENTS)
-        {
-            err = EXT2_ERR_BUFFER_OVERFLOW;
-            GOTO(done);
-        }
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
 
-        elements[nelements++] = p;
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/* Compute the directory hash of a name (as the kernel and e2fsprogs do) */
+static EXT2Err _DxHash(
+    const EXT2* ext2,
+    UINT8 version,
+    const char* name,
+    UINT32 len,
+    UINT32* hash)
+{
+    EXT2_DECLARE_ERR(err);
+    UINT32 buf[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+    UINT32 in[8];
+    BOOLEAN unsigned_chars;
+    const char* p = name;
+    INT32 r = (INT32)len;
+
+    unsigned_chars = 
+        (ext2->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH) ? TRUE : FALSE;
+
+    /* An all-zero seed means use the default seed */
+    if (ext2->sb.s_hash_seed[0] || ext2->sb.s_hash_seed[1] ||
+        ext2->sb.s_hash_seed[2] || ext2->sb.s_hash_seed[3])
+    {
+        Memcpy(buf, ext2->sb.s_hash_seed, sizeof(buf));
     }
 
-    /* Load each inode along the path until we find it */
-    for (i = 0; i < nelements; i++)
+    switch (version)
     {
-        if (Strcmp(elements[i], "/") == 0)
+        case EXT2_DX_HASH_LEGACY:
         {
-            current_ino = EXT2_ROOT_INO;
+            *hash = _DxHackHash(name, len, unsigned_chars);
+            break;
         }
-        else
+        case EXT2_DX_HASH_HALF_MD4:
         {
-            EXT2DirEnt* entries = NULL;
-            UINT32 nentries = 0;
-            UINT32 j;
-
-            if (EXT2_IFERR(err = EXT2ListDirInode(
-                ext2, 
-                current_ino, 
-                &entries, 
-                &nentries)))
+            for (; r > 0; r -= 32, p += 32)
             {
-                GOTO(done);
+                _DxStrToHashBuf(p, r, in, 8, unsigned_chars);
+                _DxHalfMD4Transform(buf, in);
             }
 
-            current_ino = 0;
-
-            for (j = 0; j < nentries; j++)
+            *hash = buf[1];
+            break;
+        }
+        case EXT2_DX_HASH_TEA:
+        {
+            for (; r > 0; r -= 16, p += 16)
             {
-                const EXT2DirEnt* ent = &entries[j];
-
-                if (i + 1 == nelements || ent->d_type == EXT2_DT_DIR)
-                {
-                    if (Strcmp(ent->d_name, elements[i]) == 0)
-                    {
-                        current_ino = ent->d_ino;
-                        break;
-                    }
-                }
+                _DxStrToHashBuf(p, r, in, 4, unsigned_chars);
+                _DxTEATransform(buf, in);
             }
 
-            if (entries)
-                Free(entries);
-
-            if (!current_ino)
-            {
-                /* Not found case */
-                err = EXT2_ERR_FILE_NOT_FOUND;
-                goto done;
-            }
+            *hash = buf[0];
+            break;
+        }
+        default:
+        {
+            err = EXT2_ERR_UNSUPPORTED;
+            GOTO(done);
         }
     }
 
-    *ino = current_ino;
+    /* The low bit is reserved to mark hash collisions across leaves */
+    *hash &= ~1;
+
+    if (*hash == (EXT2_DX_HASH_EOF << 1))
+        *hash = (EXT2_DX_HASH_EOF - 1) << 1;
 
     err = EXT2_ERR_NONE;
 
@@ -2065,86 +2651,77 @@ done:
     return err;
 }
 
-EXT2Err EXT2PathToInode(
+static __inline EXT2DxEntry* _DxTable(
+    EXT2DxFrame* frame)
+{
+    return (EXT2DxEntry*)(frame->block.data + frame->offset);
+}
+
+static __inline EXT2DxCountLimit* _DxCountLimit(
+    EXT2DxFrame* frame)
+{
+    return (EXT2DxCountLimit*)(frame->block.data + frame->offset);
+}
+
+static EXT2Err _DxReadBlock(
     const EXT2* ext2,
-    const char* path,
-    EXT2Ino* ino,
-    EXT2Inode* inode)
+    const EXT2DxPath* path,
+    UINT32 lblkno,
+    EXT2Block* block)
 {
     EXT2_DECLARE_ERR(err);
-    EXT2Ino tmp_ino;
 
-    /* Check parameters */
-    if (!ext2 || !path || !inode)
+    if (lblkno >= path->blknos.size)
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
+        err = EXT2_ERR_BAD_BLKNO;
         GOTO(done);
     }
 
-    /* Find the ino for this path */
-    if (EXT2_IFERR(err = EXT2PathToIno(ext2, path, &tmp_ino)))
-    {
-        /* Not found case */
-        goto done;
-    }
-
-    /* Read the inode into memory */
-    if (EXT2_IFERR(err = EXT2ReadInode(ext2, tmp_ino, inode)))
+    if (EXT2_IFERR(err = EXT2ReadBlock(ext2, path->blknos.data[lblkno], block)))
     {
         GOTO(done);
     }
 
-    if (ino)
-        *ino = tmp_ino;
-
     err = EXT2_ERR_NONE;
 
 done:
     return err;
 }
 
-/*
-**==============================================================================
-**
-** bitmaps:
-**
-**==============================================================================
-*/
-
-EXT2Err EXT2ReadBlockBitmap(
+/* Check the table of a frame and pick the slot that covers 'hash' */
+static EXT2Err _DxSearchFrame(
     const EXT2* ext2,
-    UINT32 group_index,
-    EXT2Block* block)
+    EXT2DxFrame* frame,
+    UINT32 hash)
 {
     EXT2_DECLARE_ERR(err);
-    UINT32 bitmap_size_bytes;
+    const EXT2DxCountLimit* cl = _DxCountLimit(frame);
+    const EXT2DxEntry* table = _DxTable(frame);
+    UINT32 lo;
+    UINT32 hi;
 
-    if (!EXT2Valid(ext2) || !block)
+    if (cl->limit != (ext2->block_size - frame->offset) / sizeof(EXT2DxEntry) ||
+        cl->count == 0 || cl->count > cl->limit)
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
+        err = EXT2_ERR_SANITY_CHECK_FAILED;
         GOTO(done);
     }
 
-    Memset(block, 0, sizeof(EXT2Block));
-
-    bitmap_size_bytes = ext2->sb.s_blocks_per_group / 8;
+    /* Find the last slot whose hash is <= 'hash' (slot 0 covers the rest) */
+    lo = 1;
+    hi = cl->count;
 
-    if (group_index > ext2->group_count)
+    while (lo < hi)
     {
-        err = EXT2_ERR_BAD_GRPNO;
-        GOTO(done);
-    }
+        UINT32 mid = (lo + hi) / 2;
 
-    if (EXT2_IFERR(err = EXT2ReadBlock(
-        ext2, 
-        ext2->groups[group_index].bg_block_bitmap, 
-        block)))
-    {
-        GOTO(done);
+        if (table[mid].hash > hash)
+            hi = mid;
+        else
+            lo = mid + 1;
     }
 
-    if (block->size > bitmap_size_bytes)
-        block->size = bitmap_size_bytes;
+    frame->index = lo - 1;
 
     err = EXT2_ERR_NONE;
 
@@ -2152,38 +2729,35 @@ done:
     return err;
 }
 
-EXT2Err EXT2WriteBlockBitmap(
+/* Load an interior index node into path->frames[level] */
+static EXT2Err _DxLoadNode(
     const EXT2* ext2,
-    UINT32 group_index,
-    const EXT2Block* block)
+    EXT2DxPath* path,
+    UINT32 level,
+    UINT32 lblkno)
 {
     EXT2_DECLARE_ERR(err);
-    UINT32 bitmap_size_bytes;
+    EXT2DxFrame* frame = &path->frames[level];
+    const EXT2DirEntry* fake;
 
-    if (!EXT2Valid(ext2) || !block)
+    if (EXT2_IFERR(err = _DxReadBlock(ext2, path, lblkno, &frame->block)))
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    bitmap_size_bytes = ext2->sb.s_blocks_per_group / 8;
+    /* Expect a single empty entry that spans the whole block */
+    fake = (const EXT2DirEntry*)frame->block.data;
 
-    if (block->size != bitmap_size_bytes)
+    if (fake->inode != 0 || fake->rec_len != ext2->block_size)
     {
-        err = EXT2_ERR_BAD_SIZE;
+        err = EXT2_ERR_SANITY_CHECK_FAILED;
         GOTO(done);
     }
 
-    if (group_index > ext2->group_count)
-    {
-        err = EXT2_ERR_BAD_GRPNO;
-        GOTO(done);
-    }
+    frame->lblkno = lblkno;
+    frame->offset = 8;
 
-    if (EXT2_IFERR(err = EXT2WriteBlock(
-        ext2, 
-        ext2->groups[group_index].bg_block_bitmap, 
-        block)))
+    if (EXT2_IFERR(err = _DxSearchFrame(ext2, frame, path->hash)))
     {
         GOTO(done);
     }
@@ -2194,111 +2768,89 @@ done:
     return err;
 }
 
-EXT2Err EXT2readReadInodeBitmap(
+/* Walk from the root of the index down to the leaf that covers 'name' */
+static EXT2Err _DxProbe(
     const EXT2* ext2,
-    UINT32 group_index,
-    EXT2Block* block)
+    const EXT2Inode* dir_inode,
+    const char* name,
+    UINT32 len,
+    EXT2DxPath* path)
 {
     EXT2_DECLARE_ERR(err);
-    UINT32 bitmap_size_bytes;
+    EXT2DxFrame* root = &path->frames[0];
+    const EXT2DxRootInfo* info;
+    UINT32 i;
 
-    if (!EXT2Valid(ext2) || !block)
+    /* The index is only meaningful if the file system honors it */
+    if (!(ext2->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) ||
+        !(dir_inode->i_flags & EXT2_INDEX_FL) ||
+        (ext2->block_size > EXT2_MAX_BLOCK_SIZE))
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
+        err = EXT2_ERR_UNSUPPORTED;
+        goto done;
     }
 
-    Memset(block, 0, sizeof(EXT2Block));
-
-    bitmap_size_bytes = ext2->sb.s_inodes_per_group / 8;
-
-    if (group_index > ext2->group_count)
+    if (EXT2_IFERR(err = _LoadBlockNumbersFromInode(
+        ext2, 
+        dir_inode, 
+        0, /* include_block_blocks */
+        &path->blknos)))
     {
-        err = EXT2_ERR_BAD_GRPNO;
         GOTO(done);
     }
 
-    if (EXT2_IFERR(err = EXT2ReadBlock(
-        ext2, 
-        ext2->groups[group_index].bg_inode_bitmap, 
-        block)))
+    /* Read the root: "." (12 bytes), ".." (12 bytes), then the root info */
+    if (EXT2_IFERR(err = _DxReadBlock(ext2, path, 0, &root->block)))
     {
         GOTO(done);
     }
 
-    if (block->size > bitmap_size_bytes)
-        block->size = bitmap_size_bytes;
+    info = (const EXT2DxRootInfo*)(root->block.data + 24);
 
-    err = EXT2_ERR_NONE;
-
-done:
-    return err;
-}
-
-/*
-**==============================================================================
-**
-** directory:
-**
-**==============================================================================
-*/
-
-# if !defined(BUILD_EFI)
-static void _DumpDirectoryEntry(
-    const EXT2DirEntry* dirent)
-{
-    printf("=== EXT2DirEntry:\n");
-    printf("inode=%u\n", dirent->inode);
-    printf("rec_len=%u\n", dirent->rec_len);
-    printf("name_len=%u\n", dirent->name_len);
-    printf("file_type=%u\n", dirent->file_type);
-    printf("name={%.*s}\n", dirent->name_len, dirent->name);
-}
-# endif /* !defined(BUILD_EFI) */
+    if (info->reserved_zero != 0 || 
+        info->info_length != sizeof(EXT2DxRootInfo) ||
+        info->indirect_levels >= EXT2_DX_MAX_LEVELS)
+    {
+        err = EXT2_ERR_UNSUPPORTED;
+        GOTO(done);
+    }
 
-static EXT2Err _CountDirectoryEntries(
-    const EXT2* ext2,
-    const void* data,
-    UINT32 size,
-    UINT32* count)
-{
-    EXT2_DECLARE_ERR(err);
-    const UINT8* p = (UINT8*)data;
-    const UINT8* end = (UINT8*)data + size;
+    path->version = info->hash_version;
 
-    /* Check parameters */
-    if (!EXT2Valid(ext2) || !data || !size || !count)
+    if (EXT2_IFERR(err = _DxHash(ext2, path->version, name, len, &path->hash)))
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* Initilize the count */
-    *count = 0;
+    root->lblkno = 0;
+    root->offset = 24 + info->info_length;
 
-    /* Must be divisiable by block size */
-    if ((end - p) % ext2->block_size)
+    if (EXT2_IFERR(err = _DxSearchFrame(ext2, root, path->hash)))
     {
-        err = EXT2_ERR_BAD_MULTIPLE;
         GOTO(done);
     }
 
-    while (p < end)
+    path->nframes = 1 + info->indirect_levels;
+
+    for (i = 1; i < path->nframes; i++)
     {
-        const EXT2DirEntry* ent = (const EXT2DirEntry*)p;
+        EXT2DxFrame* parent = &path->frames[i-1];
+        UINT32 lblkno = _DxTable(parent)[parent->index].block;
 
-        if (ent->name_len)
+        if (EXT2_IFERR(err = _DxLoadNode(
+            ext2, 
+            path, 
+            i, 
+            lblkno & EXT2_DX_BLOCK_MASK)))
         {
-            (*count)++;
+            GOTO(done);
         }
-        
-        p += ent->rec_len;
     }
 
-    if (p != end)
     {
-        err = EXT2_ERR_EXTRANEOUS_DATA;
-        GOTO(done);
+        EXT2DxFrame* frame = &path->frames[path->nframes-1];
+        path->leaf_lblkno = _DxTable(frame)[frame->index].block;
+        path->leaf_lblkno &= EXT2_DX_BLOCK_MASK;
     }
 
     err = EXT2_ERR_NONE;
@@ -2307,188 +2859,162 @@ done:
     return err;
 }
 
-struct _EXT2_DIR
-{
-    void *data;
-    UINT32 size;
-    const void *next;
-    EXT2DirEnt ent;
-};
-
-EXT2_DIR *EXT2OpenDir(
+/* Step to the next leaf if it continues a run of colliding hashes */
+static EXT2Err _DxNextLeaf(
     const EXT2* ext2,
-    const char *path)
+    EXT2DxPath* path,
+    BOOLEAN* more)
 {
-    EXT2_DIR *dir = NULL;
-    EXT2Ino ino;
-
-    /* Check parameters */
-    if (!ext2 || !path)
-    {
-        GOTO(done);
-    }
-
-    /* Find inode number for this directory */
-    if (EXT2_IFERR(EXT2PathToIno(ext2, path, &ino)))
-        GOTO(done);
-
-    /* Open directory from this inode */
-    if (!(dir = EXT2OpenDirIno(ext2, ino)))
-        GOTO(done);
-
-done:
-    return dir;
-}
+    EXT2_DECLARE_ERR(err);
+    EXT2DxFrame* frame;
+    UINT32 i;
 
-EXT2_DIR *EXT2OpenDirIno(
-    const EXT2* ext2,
-    EXT2Ino ino)
-{
-    EXT2_DIR *dir = NULL;
-    EXT2Inode inode;
+    *more = FALSE;
 
-    /* Check parameters */
-    if (!ext2 || !ino)
+    /* Find the lowest level with another slot to its right */
+    for (i = path->nframes; i > 0; i--)
     {
-        GOTO(done);
-    }
+        frame = &path->frames[i-1];
 
-    /* Read the inode into memory */
-    if (EXT2_IFERR(EXT2ReadInode(ext2, ino, &inode)))
-    {
-        GOTO(done);
+        if (frame->index + 1 < _DxCountLimit(frame)->count)
+            break;
     }
 
-    /* Fail if not a directory */
-    if (!(inode.i_mode & EXT2_S_IFDIR))
+    /* End of the directory */
+    if (i == 0)
     {
-        GOTO(done);
+        err = EXT2_ERR_NONE;
+        goto done;
     }
 
-    /* Allocate directory object */
-    if (!(dir = (EXT2_DIR*)Calloc(1, sizeof(EXT2_DIR))))
+    /* Stop unless the next slot carries on with this very hash */
+    if ((_DxTable(frame)[frame->index + 1].hash & ~1) != path->hash)
     {
-        GOTO(done);
+        err = EXT2_ERR_NONE;
+        goto done;
     }
 
-    /* Load the blocks for this inode into memory */
-    if (EXT2_IFERR(EXT2LoadFileFromInode(
-        ext2, 
-        &inode, 
-        &dir->data, 
-        &dir->size)))
+    frame->index++;
+
+    /* Reload the levels below with their leftmost slots */
+    for (; i < path->nframes; i++)
     {
-        Free(dir);
-        dir = NULL;
-        GOTO(done);
+        EXT2DxFrame* parent = &path->frames[i-1];
+        UINT32 lblkno = _DxTable(parent)[parent->index].block;
+
+        if (EXT2_IFERR(err = _DxLoadNode(
+            ext2, 
+            path, 
+            i, 
+            lblkno & EXT2_DX_BLOCK_MASK)))
+        {
+            GOTO(done);
+        }
+
+        path->frames[i].index = 0;
     }
 
-    /* Set pointer to current directory */
-    dir->next = dir->data;
+    frame = &path->frames[path->nframes-1];
+    path->leaf_lblkno = _DxTable(frame)[frame->index].block;
+    path->leaf_lblkno &= EXT2_DX_BLOCK_MASK;
+    *more = TRUE;
+
+    err = EXT2_ERR_NONE;
 
 done:
-    return dir;
+    return err;
 }
 
-EXT2DirEnt *EXT2ReadDir(
-    EXT2_DIR *dir)
+/* Scan path->leaf for 'name', checking the entries along the way */
+static EXT2Err _DxScanLeaf(
+    const EXT2* ext2,
+    EXT2DxPath* path,
+    const char* name,
+    UINT32 len,
+    BOOLEAN* found)
 {
-    EXT2DirEnt *ent = NULL;
+    EXT2_DECLARE_ERR(err);
+    UINT32 offset = 0;
+    UINT32 prev = 0;
 
-    if (!dir || !dir->data || !dir->next)
-        goto done;
+    *found = FALSE;
 
-    /* Find the next entry (possibly skipping padding entries) */
+    while (offset < ext2->block_size)
     {
-        const void* end = (void*) ((char*) dir->data + dir->size);
+        const EXT2DirEntry* ent = 
+            (const EXT2DirEntry*)(path->leaf.data + offset);
 
-        while (!ent && dir->next < end)
+        if (ent->rec_len < 8 || (ent->rec_len % 4) ||
+            offset + ent->rec_len > ext2->block_size ||
+            8U + ent->name_len > ent->rec_len)
         {
-            const EXT2DirEntry* de = 
-                (EXT2DirEntry*)dir->next;
-
-            if (de->rec_len == 0)
-                break;
-
-            if (de->name_len > 0)
-            {
-                /* Found! */
-
-                /* Set EXT2DirEnt.d_ino */
-                dir->ent.d_ino = de->inode;
-
-                /* Set EXT2DirEnt.d_off (not used) */
-                dir->ent.d_off = 0;
-
-                /* Set EXT2DirEnt.d_reclen (not used) */
-                dir->ent.d_reclen = sizeof(EXT2DirEnt);
-
-                /* Set EXT2DirEnt.type */
-                switch (de->file_type)
-                {
-                    case EXT2_FT_UNKNOWN:
-                        dir->ent.d_type = EXT2_DT_UNKNOWN;
-                        break;
-                    case EXT2_FT_REG_FILE:
-                        dir->ent.d_type = EXT2_DT_REG;
-                        break;
-                    case EXT2_FT_DIR:
-                        dir->ent.d_type = EXT2_DT_DIR;
-                        break;
-                    case EXT2_FT_CHRDEV:
-                        dir->ent.d_type = EXT2_DT_CHR;
-                        break;
-                    case EXT2_FT_BLKDEV:
-                        dir->ent.d_type = EXT2_DT_BLK;
-                        break;
-                    case EXT2_FT_FIFO:
-                        dir->ent.d_type = EXT2_DT_FIFO;
-                        break;
-                    case EXT2_FT_SOCK:
-                        dir->ent.d_type = EXT2_DT_SOCK;
-                        break;
-                    case EXT2_FT_SYMLINK:
-                        dir->ent.d_type = EXT2_DT_LNK;
-                        break;
-                    default:
-                        dir->ent.d_type = EXT2_DT_UNKNOWN;
-                        break;
-                }
-
-                /* Set EXT2DirEnt.d_name */
-                dir->ent.d_name[0] = '\0';
-
-                Strncat(
-                    dir->ent.d_name, 
-                    sizeof(dir->ent.d_name),
-                    de->name, 
-                    _Min(EXT2_PATH_MAX-1, de->name_len));
-
-                /* Success! */
-                ent = &dir->ent;
-            }
+            err = EXT2_ERR_SANITY_CHECK_FAILED;
+            GOTO(done);
+        }
 
-            /* Position to the next entry (for next call to readdir) */
-                dir->next = (void*)((char*)dir->next + de->rec_len); 
+        if (ent->inode && ent->name_len == len && 
+            Memcmp(ent->name, name, len) == 0)
+        {
+            path->offset = offset;
+            path->prev = prev;
+            *found = TRUE;
+            break;
         }
+
+        prev = offset;
+        offset += ent->rec_len;
     }
 
+    err = EXT2_ERR_NONE;
+
 done:
-    return ent;
+    return err;
 }
 
-EXT2Err EXT2CloseDir(
-    EXT2_DIR* dir)
+/* Look 'name' up in a hashed directory, reading only the blocks on its path
+ * (fails if the directory is not indexed or its index is unusable) */
+static EXT2Err _DxLookup(
+    const EXT2* ext2,
+    const EXT2Inode* dir_inode,
+    const char* name,
+    EXT2DxPath* path,
+    BOOLEAN* found)
 {
     EXT2_DECLARE_ERR(err);
+    UINT32 len = (UINT32)Strlen(name);
+    BOOLEAN more = TRUE;
 
-    if (!dir)
+    *found = FALSE;
+
+    if (EXT2_IFERR(err = _DxProbe(ext2, dir_inode, name, len, path)))
     {
-        GOTO(done);
+        goto done;
     }
 
-    Free(dir->data);
-    Free(dir);
+    while (more)
+    {
+        if (EXT2_IFERR(err = _DxReadBlock(
+            ext2, 
+            path, 
+            path->leaf_lblkno, 
+            &path->leaf)))
+        {
+            GOTO(done);
+        }
+
+        if (EXT2_IFERR(err = _DxScanLeaf(ext2, path, name, len, found)))
+        {
+            GOTO(done);
+        }
+
+        if (*found)
+            break;
+
+        if (EXT2_IFERR(err = _DxNextLeaf(ext2, path, &more)))
+        {
+            GOTO(done);
+        }
+    }
 
     err = EXT2_ERR_NONE;
 
@@ -2496,325 +3022,373 @@ done:
     return err;
 }
 
-EXT2Err EXT2ListDirInode(
+static UINT8 _FileTypeToDType(
+    UINT8 file_type)
+{
+    switch (file_type)
+    {
+        case EXT2_FT_REG_FILE:
+            return EXT2_DT_REG;
+        case EXT2_FT_DIR:
+            return EXT2_DT_DIR;
+        case EXT2_FT_CHRDEV:
+            return EXT2_DT_CHR;
+        case EXT2_FT_BLKDEV:
+            return EXT2_DT_BLK;
+        case EXT2_FT_FIFO:
+            return EXT2_DT_FIFO;
+        case EXT2_FT_SOCK:
+            return EXT2_DT_SOCK;
+        case EXT2_FT_SYMLINK:
+            return EXT2_DT_LNK;
+        default:
+            return EXT2_DT_UNKNOWN;
+    }
+}
+
+/* Find a directory entry through the index (fails if dir is not indexed) */
+static EXT2Err _DxFindDirEnt(
     const EXT2* ext2,
-    EXT2Ino ino,
-    EXT2DirEnt** entries,
-    UINT32* nentries)
+    EXT2Ino dir_ino,
+    const char* name,
+    EXT2DirEnt* dirent,
+    BOOLEAN* found)
 {
     EXT2_DECLARE_ERR(err);
-    EXT2_DIR* dir = NULL;
-    EXT2DirEnt* ent;
-    Buf buf = BUF_INITIALIZER;
+    EXT2Inode dir_inode;
+    EXT2DxPath* path = NULL;
 
-    /* Check parameters */
-    if (!ext2 || !ino || !entries || !nentries)
+    *found = FALSE;
+
+    if (EXT2_IFERR(err = EXT2ReadInode(ext2, dir_ino, &dir_inode)))
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    *entries = NULL;
-    *nentries = 0;
-
-    /* Open the directory */
-    if (!(dir = EXT2OpenDirIno(ext2, ino)))
+    /* Skip the allocation below for plain directories */
+    if (!(dir_inode.i_flags & EXT2_INDEX_FL))
+    {
+        err = EXT2_ERR_UNSUPPORTED;
+        goto done;
+    }
+
+    if (!(path = (EXT2DxPath*)Calloc(1, sizeof(EXT2DxPath))))
     {
+        err = EXT2_ERR_OUT_OF_MEMORY;
         GOTO(done);
     }
 
-    /* Add entries to array */
-    while ((ent = EXT2ReadDir(dir)))
+    if (EXT2_IFERR(err = _DxLookup(ext2, &dir_inode, name, path, found)))
     {
-        /* Append to buffer */
-        if (EXT2_IFERR(err = BufAppend(
-            &buf,
-            ent,
-            sizeof(EXT2DirEnt))))
-        {
-            GOTO(done);
-        }
+        goto done;
     }
 
-    (*entries) = (EXT2DirEnt*)buf.data;
-    (*nentries) = buf.size / sizeof(EXT2DirEnt);
+    if (*found)
+    {
+        const EXT2DirEntry* ent = 
+            (const EXT2DirEntry*)(path->leaf.data + path->offset);
+
+        Memset(dirent, 0, sizeof(EXT2DirEnt));
+        dirent->d_ino = ent->inode;
+        dirent->d_reclen = sizeof(EXT2DirEnt);
+        dirent->d_type = _FileTypeToDType(ent->file_type);
+        Memcpy(dirent->d_name, ent->name, ent->name_len);
+    }
 
     err = EXT2_ERR_NONE;
 
 done:
 
-    if (EXT2_IFERR(err))
-        BufRelease(&buf);
-
-    /* Close the directory */
-    if (dir)
-        EXT2CloseDir(dir);
+    if (path)
+    {
+        BufU32Release(&path->blknos);
+        Free(path);
+    }
 
     return err;
 }
 
-/*
-**==============================================================================
-**
-** files:
-**
-**==============================================================================
-*/
-
-static EXT2Err _SplitFullPath(
-    const char* path,
-    char dirname[EXT2_PATH_MAX],
-    char basename[EXT2_PATH_MAX])
+/* Store 'blkno' in slot 'index' of the indirect block '*ind' (allocating
+ * the indirect block itself when 'index' is zero) */
+static EXT2Err _DxSetIndirect(
+    EXT2* ext2,
+    EXT2Inode* dir_inode,
+    UINT32* ind,
+    UINT32 index,
+    UINT32 blkno)
 {
-    char* slash;
+    EXT2_DECLARE_ERR(err);
+    EXT2Block block;
 
-    /* Reject paths that are not absolute */
-    if (path[0] != '/')
-        return EXT2_ERR_FAILED;
+    if (index == 0)
+    {
+        if (EXT2_IFERR(err = _GetBlock(ext2, ind)))
+        {
+            GOTO(done);
+        }
 
-    /* Handle root directory up front */
-    if (Strcmp(path, "/") == 0)
+        Memset(block.data, 0, ext2->block_size);
+        block.size = ext2->block_size;
+        dir_inode->i_blocks += ext2->block_size / 512;
+    }
+    else if (EXT2_IFERR(err = EXT2ReadBlock(ext2, *ind, &block)))
     {
-        Strlcpy(dirname, "/", EXT2_PATH_MAX);
-        Strlcpy(basename, "/", EXT2_PATH_MAX);
-        return EXT2_ERR_NONE;
+        GOTO(done);
     }
 
-    /* This cannot fail (prechecked) */
-    if (!(slash = Strrchr(path, '/')))
-        return EXT2_ERR_FAILED;
-
-    /* If path ends with '/' character */
-    if (!slash[1])
-        return EXT2_ERR_FAILED;
+    ((UINT32*)block.data)[index] = blkno;
 
-    /* Split the path */
+    if (EXT2_IFERR(err = EXT2WriteBlock(ext2, *ind, &block)))
     {
-        if (slash == path)
-        {
-            Strlcpy(dirname, "/", EXT2_PATH_MAX);
-        }
-        else
-        {
-            UINTN index = slash - path;
-            Strlcpy(dirname, path, EXT2_PATH_MAX);
-
-            if (index < EXT2_PATH_MAX)
-                dirname[index] = '\0';
-            else
-                dirname[EXT2_PATH_MAX-1] = '\0';
-        }
-
-        Strlcpy(basename, slash + 1, EXT2_PATH_MAX);
+        GOTO(done);
     }
 
-    return EXT2_ERR_NONE;
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
 }
 
-EXT2Err EXT2LoadFileFromInode(
-    const EXT2* ext2,
-    const EXT2Inode* inode,
-    void** data,
-    UINT32* size)
+/* Append a new block to a directory (up to the double indirect blocks);
+ * the caller writes the directory inode */
+static EXT2Err _DxNewBlock(
+    EXT2* ext2,
+    EXT2Inode* dir_inode,
+    EXT2DxPath* path,
+    UINT32* lblkno)
 {
     EXT2_DECLARE_ERR(err);
-    BufU32 blknos = BUF_U32_INITIALIZER;
-    Buf buf = BUF_INITIALIZER;
+    UINT32 n = ext2->block_size / sizeof(UINT32);
+    UINT32 blkno;
     UINT32 i;
 
-    /* Check parameters */
-    if (!EXT2Valid(ext2) || !inode || !data || !size)
+    *lblkno = dir_inode->i_size / ext2->block_size;
+
+    if (*lblkno != path->blknos.size)
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
+        err = EXT2_ERR_SANITY_CHECK_FAILED;
         GOTO(done);
     }
 
-    /* Initialize the output */
-    *data = NULL;
-    *size = 0;
-
-    /* Form a list of block-numbers for this file */
-    if (EXT2_IFERR(err = _LoadBlockNumbersFromInode(
-        ext2, 
-        inode,
-        0, /* include_block_blocks */
-        &blknos)))
+    if (*lblkno >= EXT2_SINGLE_INDIRECT_BLOCK + n + n * n)
     {
+        err = EXT2_ERR_UNSUPPORTED;
         GOTO(done);
     }
 
-    /* Read and append each block */
-    for (i = 0; i < blknos.size; )
+    if (EXT2_IFERR(err = _GetBlock(ext2, &blkno)))
     {
-        UINT32 nblks = 1;
-        UINT32 j;
-        EXT2Block block;
+        GOTO(done);
+    }
 
-        /* Count the number of consecutive blocks: nblks */
-        for (j = i + 1; j < blknos.size; j++)
+    if (*lblkno < EXT2_SINGLE_INDIRECT_BLOCK)
+    {
+        dir_inode->i_block[*lblkno] = blkno;
+    }
+    else if ((i = *lblkno - EXT2_SINGLE_INDIRECT_BLOCK) < n)
+    {
+        if (EXT2_IFERR(err = _DxSetIndirect(
+            ext2, 
+            dir_inode, 
+            &dir_inode->i_block[EXT2_SINGLE_INDIRECT_BLOCK], 
+            i, 
+            blkno)))
         {
-            if (blknos.data[j] != blknos.data[j-1] + 1)
-                break;
-
-            nblks++;
+            GOTO(done);
         }
+    }
+    else
+    {
+        UINT32 ind;
+
+        i -= n;
 
-        if (nblks == 1)
+        if (i % n == 0)
         {
-            /* Read the next block */
-            if (EXT2_IFERR(err = EXT2ReadBlock(ext2, blknos.data[i], &block)))
+            /* Start a new indirect block and hook it in */
+            if (EXT2_IFERR(err = _DxSetIndirect(
+                ext2, dir_inode, &ind, 0, blkno)))
             {
                 GOTO(done);
             }
 
-            /* Append block to end of buffer */
-            if (EXT2_IFERR(err = BufAppend(&buf, block.data, block.size)))
+            if (EXT2_IFERR(err = _DxSetIndirect(
+                ext2, 
+                dir_inode, 
+                &dir_inode->i_block[EXT2_DOUBLE_INDIRECT_BLOCK], 
+                i / n, 
+                ind)))
+            {
                 GOTO(done);
+            }
         }
         else
         {
-            if (EXT2_IFERR(_ReadBlocks(ext2, blknos.data[i], nblks, &buf)))
+            EXT2Block block;
+
+            if (EXT2_IFERR(err = EXT2ReadBlock(
+                ext2, 
+                dir_inode->i_block[EXT2_DOUBLE_INDIRECT_BLOCK], 
+                &block)))
+            {
+                GOTO(done);
+            }
+
+            ind = ((const UINT32*)block.data)[i / n];
+
+            if (EXT2_IFERR(err = _DxSetIndirect(
+                ext2, dir_inode, &ind, i % n, blkno)))
             {
                 GOTO(done);
             }
         }
+    }
 
-        i += nblks;
+    if (BufU32Append(&path->blknos, &blkno, 1) != 0)
+    {
+        err = EXT2_ERR_OUT_OF_MEMORY;
+        GOTO(done);
     }
 
-    *data = buf.data;
-    *size = inode->i_size; /* data may be smaller than block multiple */
+    dir_inode->i_size += ext2->block_size;
+    dir_inode->i_blocks += ext2->block_size / 512;
 
     err = EXT2_ERR_NONE;
 
 done:
-
-    if (EXT2_IFERR(err))
-        BufRelease(&buf);
-
-    BufU32Release(&blknos);
-
     return err;
 }
 
-EXT2Err EXT2LoadFileFromPath(
+/* Initialize an empty interior index node */
+static void _DxInitNode(
     const EXT2* ext2,
-    const char* path,
-    void** data,
-    UINT32* size)
+    EXT2Block* block)
 {
-    EXT2_DECLARE_ERR(err);
-    EXT2Inode inode;
-
-    if (EXT2PathToInode(ext2, path, NULL, &inode) != EXT2_ERR_NONE)
-        goto done;
+    EXT2DirEntry* fake = (EXT2DirEntry*)block->data;
+    EXT2DxCountLimit* cl = (EXT2DxCountLimit*)(block->data + 8);
 
-    if (EXT2LoadFileFromInode(ext2, &inode, data, size) != EXT2_ERR_NONE)
-        goto done;
-
-    err = EXT2_ERR_NONE;
-
-done:
-    return err;
+    Memset(block->data, 0, ext2->block_size);
+    block->size = ext2->block_size;
+    fake->rec_len = ext2->block_size;
+    cl->limit = (ext2->block_size - 8) / sizeof(EXT2DxEntry);
 }
 
-/*
-**==============================================================================
-**
-** EXT2
-**
-**==============================================================================
-*/
-
-EXT2Err EXT2New(
-    Blkdev* dev,
-    EXT2** ext2_out)
+/* Make room for one more slot in the bottom index node, either by moving
+ * the root table down a level or by splitting a full node in two. Writes
+ * the root (the caller writes the bottom frame once it adds its slot). */
+static EXT2Err _DxMakeRoom(
+    EXT2* ext2,
+    EXT2Inode* dir_inode,
+    EXT2DxPath* path)
 {
     EXT2_DECLARE_ERR(err);
-    EXT2* ext2 = NULL;
+    EXT2DxFrame* root = &path->frames[0];
+    EXT2DxFrame* node = &path->frames[1];
+    EXT2DxCountLimit* root_cl = _DxCountLimit(root);
+    EXT2Block* sibling = NULL;
+    UINT32 lblkno;
 
-    /* Check parameters */
-    if (!dev || !ext2_out)
+    if (EXT2_IFERR(err = _DxNewBlock(ext2, dir_inode, path, &lblkno)))
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* Initialize output parameters */
-    *ext2_out = NULL;
-
-    /* Bit endian is not supported */
-    if (_IsBigEndian())
+    if (path->nframes == 1)
     {
-        err = EXT2_ERR_UNSUPPORTED;
-        GOTO(done);
-    }
+        EXT2DxRootInfo* info = (EXT2DxRootInfo*)(root->block.data + 24);
+        UINT16 limit;
 
-    /* Allocate the file system object */
-    if (!(ext2 = (EXT2*)Calloc(1, sizeof(EXT2))))
-    {
-        err = EXT2_ERR_OUT_OF_MEMORY;
-        GOTO(done);
-    }
+        /* Move the whole root table into a new node below the root */
+        _DxInitNode(ext2, &node->block);
+        node->lblkno = lblkno;
+        node->offset = 8;
+        node->index = root->index;
 
-    /* Set the file object */
-    ext2->dev = dev;
+        limit = _DxCountLimit(node)->limit;
+        Memcpy(_DxTable(node), _DxTable(root), 
+            root_cl->count * sizeof(EXT2DxEntry));
+        _DxCountLimit(node)->limit = limit;
 
-    /* Read the superblock */
-    if (EXT2_IFERR(err = _ReadSuperBlock(ext2->dev, &ext2->sb)))
-    {
-        err = EXT2_ERR_FAILED_TO_READ_SUPERBLOCK;
-        GOTO(done);
+        root_cl->count = 1;
+        _DxTable(root)[0].block = lblkno;
+        root->index = 0;
+        info->indirect_levels = 1;
+        path->nframes = 2;
     }
-
-    /* Check the superblock magic number */
-    if (ext2->sb.s_magic != EXT2_S_MAGIC)
+    else
     {
-        err = EXT2_ERR_BAD_MAGIC;
-        GOTO(done);
-    }
+        EXT2DxCountLimit* cl = _DxCountLimit(node);
+        EXT2DxEntry* table = _DxTable(node);
+        UINT32 half = cl->count / 2;
+        UINT32 count = cl->count - half;
+        UINT32 hash = table[half].hash;
+        EXT2DxEntry* root_table = _DxTable(root);
+        UINT32 i;
 
-    /* Reject revision 0 file systems */
-    if (ext2->sb.s_rev_level == EXT2_GOOD_OLD_REV)
-    {
-        /* Revision 0 not supported */
-        err = EXT2_ERR_UNSUPPORTED_REVISION;
-        GOTO(done);
-    }
+        /* Move the upper half of the node into a new sibling */
+        if (!(sibling = (EXT2Block*)Calloc(1, sizeof(EXT2Block))))
+        {
+            err = EXT2_ERR_OUT_OF_MEMORY;
+            GOTO(done);
+        }
 
-    /* Accept revision 1 file systems */
-    if (ext2->sb.s_rev_level < EXT2_DYNAMIC_REV)
-    {
-        /* Revision 1 and up supported */
-        err = EXT2_ERR_UNSUPPORTED_REVISION;
-        GOTO(done);
-    }
+        _DxInitNode(ext2, sibling);
 
-    /* Check inode size */
-    if (ext2->sb.s_inode_size > sizeof(EXT2Inode))
-    {
-        err = EXT2_ERR_UNEXPECTED;
-        GOTO(done);
-    }
+        for (i = 0; i < count; i++)
+        {
+            EXT2DxEntry* dest = (EXT2DxEntry*)(sibling->data + 8) + i;
 
-    /* Calcualte the block size in bytes */
-    ext2->block_size = 1024 << ext2->sb.s_log_block_size;
+            /* Slot 0 keeps its count and limit */
+            if (i != 0)
+                dest->hash = table[half + i].hash;
 
-    /* Calculate the number of block groups */
-    ext2->group_count = 
-        1 + (ext2->sb.s_blocks_count-1) / ext2->sb.s_blocks_per_group;
+            dest->block = table[half + i].block;
+        }
 
-    /* Get the groups list */
-    if (!(ext2->groups = _ReadGroups(ext2)))
-    {
-        err = EXT2_ERR_FAILED_TO_READ_GROUPS;
-        GOTO(done);
+        ((EXT2DxCountLimit*)(sibling->data + 8))->count = count;
+        cl->count = half;
+
+        /* Add a slot for the sibling to the root */
+        for (i = root_cl->count; i > root->index + 1; i--)
+            root_table[i] = root_table[i-1];
+
+        root_table[root->index + 1].hash = hash;
+        root_table[root->index + 1].block = lblkno;
+        root_cl->count++;
+
+        /* Write whichever half the caller is not about to change */
+        if (node->index >= half)
+        {
+            if (EXT2_IFERR(err = EXT2WriteBlock(
+                ext2, 
+                path->blknos.data[node->lblkno], 
+                &node->block)))
+            {
+                GOTO(done);
+            }
+
+            Memcpy(&node->block, sibling, sizeof(EXT2Block));
+            node->lblkno = lblkno;
+            node->index -= half;
+            root->index++;
+        }
+        else
+        {
+            if (EXT2_IFERR(err = EXT2WriteBlock(
+                ext2, 
+                path->blknos.data[lblkno], 
+                sibling)))
+            {
+                GOTO(done);
+            }
+        }
     }
 
-    /* Read the root inode */
-    if (EXT2_IFERR(err = EXT2ReadInode(ext2, EXT2_ROOT_INO, &ext2->root_inode)))
+    if (EXT2_IFERR(err = EXT2WriteBlock(
+        ext2, 
+        path->blknos.data[root->lblkno], 
+        &root->block)))
     {
-        err = EXT2_ERR_FAILED_TO_READ_INODE;
         GOTO(done);
     }
 
@@ -2822,521 +3396,599 @@ EXT2Err EXT2New(
 
 done:
 
-    if (EXT2_IFERR(err))
-    {
-        /* Caller must dispose of this! */
-        ext2->dev = NULL;
-        EXT2Delete(ext2);
-    }
-    else
-        *ext2_out = ext2;
+    if (sibling)
+        Free(sibling);
 
     return err;
 }
 
-void EXT2Delete(EXT2* ext2)
+typedef struct _EXT2DxMapEntry
 {
-    if (ext2)
-    {
-        if (ext2->dev)
-            ext2->dev->Close(ext2->dev);
+    UINT32 hash;
+    UINT32 offset; /* offset within the leaf (block size for the new entry) */
+    UINT32 size;
+}
+EXT2DxMapEntry;
 
-        if (ext2->groups)
-            Free(ext2->groups);
+/* Copy entries (in hash order) into 'block' back to back */
+static void _DxPackEntries(
+    const EXT2* ext2,
+    const EXT2DxPath* path,
+    const EXT2DirEntry* new_ent,
+    const EXT2DxMapEntry* map,
+    UINT32 count,
+    EXT2Block* block)
+{
+    EXT2DirEntry* ent = NULL;
+    UINT32 offset = 0;
+    UINT32 i;
 
-        Free(ext2);
+    Memset(block->data, 0, ext2->block_size);
+    block->size = ext2->block_size;
+
+    for (i = 0; i < count; i++)
+    {
+        const EXT2DirEntry* src = (map[i].offset == ext2->block_size) ?
+            new_ent : (const EXT2DirEntry*)(path->leaf.data + map[i].offset);
+
+        ent = (EXT2DirEntry*)(block->data + offset);
+        Memcpy(ent, src, 8 + src->name_len);
+        ent->rec_len = map[i].size;
+        offset += map[i].size;
     }
+
+    /* The last entry runs to the end of the block */
+    if (ent)
+        ent->rec_len += ext2->block_size - offset;
 }
 
-# if !defined(BUILD_EFI)
-EXT2Err EXT2Dump(
-    const EXT2* ext2)
+/* Split a full leaf in two by hash, adding 'new_ent' to the proper half and
+ * a slot for the new leaf to the bottom index node. Sets 'added' to false
+ * (without changing anything) if the index cannot take another leaf. */
+static EXT2Err _DxSplitLeaf(
+    EXT2* ext2,
+    EXT2Ino dir_ino,
+    EXT2Inode* dir_inode,
+    EXT2DxPath* path,
+    const EXT2DirEntry* new_ent,
+    BOOLEAN* added)
 {
     EXT2_DECLARE_ERR(err);
-    UINT32 grpno;
+    EXT2DxFrame* frame = &path->frames[path->nframes-1];
+    EXT2DxCountLimit* cl = _DxCountLimit(frame);
+    EXT2DxEntry* table;
+    EXT2DxMapEntry* map = NULL;
+    EXT2Block* halves = NULL;
+    BOOLEAN full = (cl->count >= cl->limit);
+    UINT32 n = ext2->block_size / sizeof(UINT32);
+    UINT32 count = 0;
+    UINT32 lo_size = 0;
+    UINT32 hi_size = 0;
+    UINT32 split;
+    UINT32 hash2;
+    UINT32 lblkno;
+    UINT32 offset;
+    UINT32 i;
 
-    /* Print the superblock */
-    EXT2DumpSuperBlock(&ext2->sb);
+    *added = FALSE;
 
-    printf("block_size=%u\n", ext2->block_size);
-    printf("group_count=%u\n", ext2->group_count);
+    /* Index nodes never go more than one level below the root */
+    if (full && path->nframes == EXT2_DX_MAX_LEVELS)
+    {
+        EXT2DxCountLimit* root_cl = _DxCountLimit(&path->frames[0]);
 
-    /* Print the groups */
-    _DumpGroupDescs(ext2->groups, ext2->group_count);
+        if (root_cl->count >= root_cl->limit)
+        {
+            err = EXT2_ERR_NONE;
+            goto done;
+        }
+    }
 
-    /* Print out the bitmaps for the data blocks */
+    /* New blocks go at the end of the directory */
+    lblkno = dir_inode->i_size / ext2->block_size;
+
+    if (lblkno != path->blknos.size ||
+        lblkno + (full ? 2 : 1) > EXT2_SINGLE_INDIRECT_BLOCK + n + n * n)
     {
-        for (grpno = 0; grpno < ext2->group_count; grpno++)
-        {
-            EXT2Block bitmap;
+        err = EXT2_ERR_NONE;
+        goto done;
+    }
 
-            if (EXT2_IFERR(err = EXT2ReadBlockBitmap(ext2, grpno, &bitmap)))
+    /* Map the live entries of the leaf (and the new one) by hash */
+    if (!(map = (EXT2DxMapEntry*)Calloc(
+        ext2->block_size / 8 + 1, sizeof(EXT2DxMapEntry))))
+    {
+        err = EXT2_ERR_OUT_OF_MEMORY;
+        GOTO(done);
+    }
+
+    for (offset = 0; offset < ext2->block_size; )
+    {
+        const EXT2DirEntry* ent = 
+            (const EXT2DirEntry*)(path->leaf.data + offset);
+
+        if (ent->inode)
+        {
+            if (EXT2_IFERR(err = _DxHash(
+                ext2, 
+                path->version, 
+                ent->name, 
+                ent->name_len, 
+                &map[count].hash)))
             {
                 GOTO(done);
             }
 
-            printf("=== block bitmap:\n");
-            _dump_bitmap(&bitmap);
+            map[count].offset = offset;
+            map[count].size = _NextMult(8 + ent->name_len, 4);
+            count++;
         }
+
+        offset += ent->rec_len;
     }
 
-    /* Print the inode bitmaps */
-    for (grpno = 0; grpno < ext2->group_count; grpno++)
+    map[count].hash = path->hash;
+    map[count].offset = ext2->block_size;
+    map[count].size = _NextMult(8 + new_ent->name_len, 4);
+    count++;
+
+    /* Insertion sort (stable, and leaves are small) */
+    for (i = 1; i < count; i++)
     {
-        EXT2Block bitmap;
+        EXT2DxMapEntry tmp = map[i];
+        UINT32 j;
 
-        if (EXT2_IFERR(err = EXT2readReadInodeBitmap(ext2, grpno, &bitmap)))
-        {
-            GOTO(done);
-        }
+        for (j = i; j > 0 && map[j-1].hash > tmp.hash; j--)
+            map[j] = map[j-1];
 
-        printf("=== inode bitmap:\n");
-        _dump_bitmap(&bitmap);
+        map[j] = tmp;
     }
 
-    /* dump the inodes */
+    /* Move about half of the bytes (from the top) to the new leaf */
+    for (split = count; split > 1; split--)
     {
-        UINT32 nbits = 0;
-        UINT32 mbits = 0;
+        if (hi_size + map[split-1].size / 2 > ext2->block_size / 2)
+            break;
 
-        /* Print the inode tables */
-        for (grpno = 0; grpno < ext2->group_count; grpno++)
-        {
-            EXT2Block bitmap;
-            UINT32 lino;
+        hi_size += map[split-1].size;
+    }
 
-            /* Get inode bitmap for this group */
-            if (EXT2_IFERR(err = EXT2readReadInodeBitmap(ext2, grpno, &bitmap)))
-            {
-                GOTO(done);
-            }
+    for (i = 0; i < split; i++)
+        lo_size += map[i].size;
 
-            nbits += _CountBitsN(bitmap.data, bitmap.size);
+    if (split == count || lo_size > ext2->block_size || 
+        hi_size > ext2->block_size)
+    {
+        err = EXT2_ERR_NONE;
+        goto done;
+    }
 
-            /* For each bit set in the bit map */
-            for (lino = 0; lino < ext2->sb.s_inodes_per_group; lino++)
-            {
-                EXT2Inode inode;
-                EXT2Ino ino;
+    /* Mark the slot as a continuation if the split lands on a collision */
+    hash2 = map[split].hash;
 
-                if (!_TestBit(bitmap.data, bitmap.size, lino))
-                    continue;
+    if (hash2 == map[split-1].hash)
+        hash2 |= 1;
 
-                mbits++;
+    /* Build both halves before touching the disk */
+    if (!(halves = (EXT2Block*)Calloc(2, sizeof(EXT2Block))))
+    {
+        err = EXT2_ERR_OUT_OF_MEMORY;
+        GOTO(done);
+    }
 
-                if ((lino+1) < EXT2_FIRST_INO && (lino+1) != EXT2_ROOT_INO)
-                    continue;
+    _DxPackEntries(ext2, path, new_ent, map, split, &halves[0]);
+    _DxPackEntries(ext2, path, new_ent, map + split, count - split, 
+        &halves[1]);
 
-                ino = _MakeIno(ext2, grpno, lino);
+    /* Grow the index first if the bottom node is full */
+    if (full)
+    {
+        if (EXT2_IFERR(err = _DxMakeRoom(ext2, dir_inode, path)))
+        {
+            GOTO(done);
+        }
 
-                if (EXT2_IFERR(err = EXT2ReadInode(ext2, ino, &inode)))
-                {
-                    GOTO(done);
-                }
+        frame = &path->frames[path->nframes-1];
+        cl = _DxCountLimit(frame);
+    }
 
-                printf("INODE{%u}\n", ino);
-                EXT2DumpInode(ext2, &inode);
-            }
-        }
+    /* Allocate the new leaf */
+    if (EXT2_IFERR(err = _DxNewBlock(ext2, dir_inode, path, &lblkno)))
+    {
+        GOTO(done);
+    }
 
-        printf("nbits{%u}\n", nbits);
-        printf("mbits{%u}\n", mbits);
+    if (EXT2_IFERR(err = EXT2WriteBlock(
+        ext2, 
+        path->blknos.data[lblkno], 
+        &halves[1])))
+    {
+        GOTO(done);
     }
 
-    /* dump the root inode */
-    EXT2DumpInode(ext2, &ext2->root_inode);
+    if (EXT2_IFERR(err = EXT2WriteBlock(
+        ext2, 
+        path->blknos.data[path->leaf_lblkno], 
+        &halves[0])))
+    {
+        GOTO(done);
+    }
+
+    /* Insert a slot for the new leaf to the right of the old one */
+    table = _DxTable(frame);
+
+    for (i = cl->count; i > frame->index + 1; i--)
+        table[i] = table[i-1];
+
+    table[frame->index + 1].hash = hash2;
+    table[frame->index + 1].block = lblkno;
+    cl->count++;
+
+    if (EXT2_IFERR(err = EXT2WriteBlock(
+        ext2, 
+        path->blknos.data[frame->lblkno], 
+        &frame->block)))
+    {
+        GOTO(done);
+    }
+
+    if (EXT2_IFERR(err = _WriteInode(ext2, dir_ino, dir_inode)))
+    {
+        GOTO(done);
+    }
 
+    *added = TRUE;
     err = EXT2_ERR_NONE;
 
 done:
+
+    if (map)
+        Free(map);
+
+    if (halves)
+        Free(halves);
+
     return err;
 }
-#endif /* !defined(BUILD_EFI) */
 
-EXT2Err EXT2Check(
-    const EXT2* ext2)
+/* Add an entry to a hashed directory, keeping the index intact. Sets 'added'
+ * to false if the caller must fall back to rewriting the directory. */
+static EXT2Err _DxAddEntry(
+    EXT2* ext2,
+    EXT2Ino dir_ino,
+    EXT2Inode* dir_inode,
+    const EXT2DirEntry* new_ent,
+    BOOLEAN* added)
 {
     EXT2_DECLARE_ERR(err);
+    EXT2DxPath* path = NULL;
+    BOOLEAN found;
+    UINT32 needed = _NextMult(8 + new_ent->name_len, 4);
+    UINT32 offset;
 
-    /* Check the block bitmaps */
-    {
-        UINT32 i;
-        UINT32 n = 0;
-        UINT32 nused = 0;
-        UINT32 nfree = 0;
-
-        for (i = 0; i < ext2->group_count; i++)
-        {
-            EXT2Block bitmap;
-
-            nfree += ext2->groups[i].bg_free_blocks_count;
+    *added = FALSE;
 
-            if (EXT2_IFERR(err = EXT2ReadBlockBitmap(ext2, i, &bitmap)))
-            {
-                GOTO(done);
-            }
+    if (!(dir_inode->i_flags & EXT2_INDEX_FL))
+    {
+        err = EXT2_ERR_NONE;
+        goto done;
+    }
 
-            nused += _CountBitsN(bitmap.data, bitmap.size);
-            n += bitmap.size * 8;
-        }
+    if (!(path = (EXT2DxPath*)Calloc(1, sizeof(EXT2DxPath))))
+    {
+        err = EXT2_ERR_OUT_OF_MEMORY;
+        GOTO(done);
+    }
 
-        if (ext2->sb.s_free_blocks_count != nfree)
-        {
-#if !defined(BUILD_EFI)
-            printf("s_free_blocks_count{%u}, nfree{%u}\n",
-                ext2->sb.s_free_blocks_count, nfree);
-#endif /* !defined(BUILD_EFI) */
-            GOTO(done);
-        }
+    /* An unusable index is handled by the caller */
+    if (EXT2_IFERR(_DxLookup(ext2, dir_inode, new_ent->name, path, &found)))
+    {
+        err = EXT2_ERR_NONE;
+        goto done;
+    }
 
-        if (ext2->sb.s_free_blocks_count != n - nused)
-        {
-            GOTO(done);
-        }
+    if (found)
+    {
+        err = EXT2_ERR_FAILED;
+        GOTO(done);
     }
 
-    /* Check the inode bitmaps */
+    /* Use the first gap in the leaf that is big enough */
+    for (offset = 0; offset < ext2->block_size; )
     {
-        UINT32 i;
-        UINT32 n = 0;
-        UINT32 nused = 0;
-        UINT32 nfree = 0;
+        EXT2DirEntry* ent = (EXT2DirEntry*)(path->leaf.data + offset);
+        UINT32 used = ent->inode ? _NextMult(8 + ent->name_len, 4) : 0;
 
-        /* Check the bitmaps for the inodes */
-        for (i = 0; i < ext2->group_count; i++)
+        if (ent->rec_len - used >= needed)
         {
-            EXT2Block bitmap;
+            EXT2DirEntry* dest = (EXT2DirEntry*)((UINT8*)ent + used);
 
-            nfree += ext2->groups[i].bg_free_inodes_count;
+            if (used)
+            {
+                dest->rec_len = ent->rec_len - used;
+                ent->rec_len = used;
+            }
 
-            if (EXT2_IFERR(err = EXT2readReadInodeBitmap(ext2, i, &bitmap)))
+            dest->inode = new_ent->inode;
+            dest->name_len = new_ent->name_len;
+            dest->file_type = new_ent->file_type;
+            Memcpy(dest->name, new_ent->name, new_ent->name_len);
+
+            if (EXT2_IFERR(err = EXT2WriteBlock(
+                ext2, 
+                path->blknos.data[path->leaf_lblkno], 
+                &path->leaf)))
             {
                 GOTO(done);
             }
 
-            nused += _CountBitsN(bitmap.data, bitmap.size);
-            n += bitmap.size * 8;
+            *added = TRUE;
+            err = EXT2_ERR_NONE;
+            goto done;
         }
 
-        if (ext2->sb.s_free_inodes_count != n - nused)
-        {
-            GOTO(done);
-        }
-
-        if (ext2->sb.s_free_inodes_count != nfree)
-        {
-            GOTO(done);
-        }
+        offset += ent->rec_len;
     }
 
-    /* Check the inodes */
+    /* The leaf is full */
+    if (EXT2_IFERR(err = _DxSplitLeaf(
+        ext2, 
+        dir_ino, 
+        dir_inode, 
+        path, 
+        new_ent, 
+        added)))
     {
-        UINT32 grpno;
-        UINT32 nbits = 0;
-        UINT32 mbits = 0;
-
-        /* Check the inode tables */
-        for (grpno = 0; grpno < ext2->group_count; grpno++)
-        {
-            EXT2Block bitmap;
-            UINT32 lino;
-
-            /* Get inode bitmap for this group */
-            if (EXT2_IFERR(err = EXT2readReadInodeBitmap(ext2, grpno, &bitmap)))
-            {
-                GOTO(done);
-            }
-
-            nbits += _CountBitsN(bitmap.data, bitmap.size);
-
-            /* For each bit set in the bit map */
-            for (lino = 0; lino < ext2->sb.s_inodes_per_group; lino++)
-            {
-                EXT2Inode inode;
-                EXT2Ino ino;
-
-                if (!_TestBit(bitmap.data, bitmap.size, lino))
-                    continue;
-
-                mbits++;
-
-                if ((lino+1) < EXT2_FIRST_INO && (lino+1) != EXT2_ROOT_INO)
-                    continue;
-
-                ino = _MakeIno(ext2, grpno, lino);
-
-                if (EXT2_IFERR(err = EXT2ReadInode(ext2, ino, &inode)))
-                {
-                    GOTO(done);
-                }
-
-                /* Mode can never be zero */
-                if (inode.i_mode == 0)
-                {
-                    GOTO(done);
-                }
-
-                /* If file is not zero size but no blocks, then fail */
-                if (inode.i_size && !inode.i_block[0])
-                {
-                    GOTO(done);
-                }
-            }
-        }
-
-        /* The number of bits in bitmap must match number of active inodes */
-        if (nbits != mbits)
-        {
-            GOTO(done);
-        }
+        GOTO(done);
     }
 
     err = EXT2_ERR_NONE;
 
 done:
+
+    if (path)
+    {
+        BufU32Release(&path->blknos);
+        Free(path);
+    }
+
     return err;
 }
 
-EXT2Err EXT2Trunc(
+/* Remove an entry from a hashed directory, keeping the index intact. Sets
+ * 'removed' to false if the caller must fall back to rewriting it (which it
+ * also does for subdirectories, so the caller can check they are empty). */
+static EXT2Err _DxRemoveEntry(
     EXT2* ext2,
-    const char* path)
+    const EXT2Inode* dir_inode,
+    const char* name,
+    BOOLEAN* removed)
 {
     EXT2_DECLARE_ERR(err);
-    char dirname[EXT2_PATH_MAX];
-    char basename[EXT2_PATH_MAX];
-    EXT2Ino dir_ino;
-    EXT2Inode dir_inode;
-    EXT2Ino file_ino;
-    EXT2Inode file_inode;
-    BufU32 blknos = BUF_U32_INITIALIZER;
-#if !defined(BUILD_EFI)
-    (void)_DumpBlockNumbers;
-#endif /* !defined(BUILD_EFI) */
+    EXT2DxPath* path = NULL;
+    BOOLEAN found;
+    EXT2DirEntry* ent;
 
-    /* Check parameters */
-    if (!ext2 || !path)
-    {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
-    }
+    *removed = FALSE;
 
-    /* Split the path */
-    if (EXT2_IFERR(err = _SplitFullPath(path, dirname, basename)))
+    if (!(dir_inode->i_flags & EXT2_INDEX_FL))
     {
-        GOTO(done);
+        err = EXT2_ERR_NONE;
+        goto done;
     }
 
-    /* Find the inode of the dirname */
-    if (EXT2_IFERR(err = EXT2PathToInode(ext2, dirname, &dir_ino, &dir_inode)))
+    if (!(path = (EXT2DxPath*)Calloc(1, sizeof(EXT2DxPath))))
     {
+        err = EXT2_ERR_OUT_OF_MEMORY;
         GOTO(done);
     }
 
-    /* Find the inode of the basename */
-    if (EXT2_IFERR(err = EXT2PathToInode(
-        ext2, path, &file_ino, &file_inode)))
+    if (EXT2_IFERR(_DxLookup(ext2, dir_inode, name, path, &found)) || !found)
     {
+        err = EXT2_ERR_NONE;
         goto done;
     }
 
-    /* Form a list of block-numbers for this file */
-    if (EXT2_IFERR(err = _LoadBlockNumbersFromInode(
-        ext2, 
-        &file_inode, 
-        1, /* include_block_blocks */
-        &blknos)))
-    {
-        GOTO(done);
-    }
+    ent = (EXT2DirEntry*)(path->leaf.data + path->offset);
 
-    /* If this file is a directory, then fail */
-    if (file_inode.i_mode & EXT2_S_IFDIR)
+    if (ent->file_type == EXT2_FT_DIR)
     {
-        GOTO(done);
+        err = EXT2_ERR_NONE;
+        goto done;
     }
 
-    /* Return the blocks to the free list */
+    /* Merge into the previous entry (or blank the first entry) */
+    if (path->prev != path->offset)
     {
-        if (EXT2_IFERR(err = _PutBlocks(ext2, blknos.data, blknos.size)))
-            GOTO(done);
+        EXT2DirEntry* prev = (EXT2DirEntry*)(path->leaf.data + path->prev);
+        prev->rec_len += ent->rec_len;
     }
-
-    /* Rewrite the inode */
+    else
     {
-        file_inode.i_size = 0;
-        Memset(file_inode.i_block, 0, sizeof(file_inode.i_block));
-
-        if (EXT2_IFERR(err = _WriteInode(ext2, file_ino, &file_inode)))
-        {
-            GOTO(done);
-        }
+        ent->inode = 0;
     }
 
-    /* Update the super block */
-    if (EXT2_IFERR(err = _WriteSuperBlock(ext2)))
+    if (EXT2_IFERR(err = EXT2WriteBlock(
+        ext2, 
+        path->blknos.data[path->leaf_lblkno], 
+        &path->leaf)))
     {
         GOTO(done);
     }
 
+    *removed = TRUE;
     err = EXT2_ERR_NONE;
 
 done:
 
-    BufU32Release(&blknos);
+    if (path)
+    {
+        BufU32Release(&path->blknos);
+        Free(path);
+    }
 
     return err;
 }
 
-static EXT2Err _WriteSingleDirectBlockNumbers(
-    EXT2* ext2,
-    const UINT32* blknos,
-    UINT32 nblknos,
-    UINT32* blkno)
+EXT2Err EXT2PathToIno(
+    const EXT2* ext2,
+    const char* path,
+    EXT2Ino* ino)
 {
     EXT2_DECLARE_ERR(err);
-    EXT2Block block;
+    char buf[EXT2_PATH_MAX];
+    const char* elements[32];
+    const UINT8 NELEMENTS = sizeof(elements) / sizeof(elements[0]);
+    UINT8 nelements = 0;
+    char* p;
+    char* save;
+    UINT8 i;
+    EXT2Ino current_ino = 0;
 
-    /* Check parameters */
-    if (!EXT2Valid(ext2) || !blknos || !nblknos)
+    /* Check for null parameters */
+    if (!ext2 || !path || !ino)
     {
         err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* If no room in a single block for the block numbers */
-    if (nblknos > ext2->block_size / sizeof(UINT32))
-    {
-        err = EXT2_ERR_BUFFER_OVERFLOW;
-        GOTO(done);
-    }
-
-    /* Assign an available block */
-    if (EXT2_IFERR(err = _GetBlock(ext2, blkno)))
-    {
-        GOTO(done);
-    }
-
-    /* Copy block numbers into block */
-    Memset(&block, 0, sizeof(EXT2Block));
-    Memcpy(block.data, blknos, nblknos * sizeof(UINT32));
-    block.size = ext2->block_size;
+    /* Initialize to null inode for now */
+    *ino = 0;
 
-    /* Write the block */
-    if (EXT2_IFERR(err = EXT2WriteBlock(ext2, *blkno, &block)))
+    /* Check path length */
+    if (Strlen(path) >= EXT2_PATH_MAX)
     {
+        err = EXT2_ERR_PATH_TOO_LONG;
         GOTO(done);
     }
 
-    err = EXT2_ERR_NONE;
-
-done:
-    return err;
-}
-
-static EXT2Err _WriteIndirectBlockNumbers(
-    EXT2* ext2,
-    UINT32 indirection, /* level of indirection: 2=double, 3=triple */
-    const UINT32* blknos,
-    UINT32 nblknos,
-    UINT32* blkno)
-{
-    EXT2_DECLARE_ERR(err);
-    EXT2Block block;
-    UINT32 blknos_per_block = ext2->block_size / sizeof(UINT32);
+    /* Copy path */
+    Strlcpy(buf, path, sizeof(buf));
 
-    /* Check parameters */
-    if (!EXT2Valid(ext2) || !blknos || !nblknos || !blkno)
+    /* Be sure path begins with "/" */
+    if (path[0] != '/')
     {
         err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* Check indirection level */
-    if (indirection != 2 && indirection != 3)
-    {
-        err = EXT2_ERR_UNEXPECTED;
-        GOTO(done);
-    }
+    elements[nelements++] = "/";
 
-    /* If double indirection */
-    if (indirection == 2)
+    /* Split the path into components */
+    for (p = Strtok(buf, "/", &save); p; p = Strtok(NULL, "/", &save))
     {
-        /* If too many indirect blocks */
-        if (nblknos > blknos_per_block * blknos_per_block)
+        if (nelements == NELEMENTS)
         {
             err = EXT2_ERR_BUFFER_OVERFLOW;
             GOTO(done);
         }
-    }
 
-    /* Assign an available block */
-    if (EXT2_IFERR(err = _GetBlock(ext2, blkno)))
-    {
-        GOTO(done);
+        elements[nelements++] = p;
     }
 
-    /* Allocate indirect block (to hold block numbers) */
-    Memset(&block, 0, sizeof(EXT2Block));
-    block.size = ext2->block_size;
-
-    /* Write each of the indirect blocks */
+    /* Load each inode along the path until we find it */
+    for (i = 0; i < nelements; i++)
     {
-        const UINT32* p = blknos;
-        UINT32 r = nblknos;
-        UINT32 i;
-
-        /* For each block */
-        for (i = 0; r > 0; i++)
+        if (Strcmp(elements[i], "/") == 0)
         {
-            UINT32 n;
+            current_ino = EXT2_ROOT_INO;
+        }
+        else
+        {
+            EXT2DirEnt* entries = NULL;
+            UINT32 nentries = 0;
+            UINT32 j;
+            EXT2Ino cached_ino;
+            UINT8 cached_type;
+            EXT2DirEnt dirent;
+            BOOLEAN found;
 
-            /* If double indirection */
-            if (indirection == 2)
+            /* Intermediate elements must be directories */
+            if (_GetCachedDentry(
+                ext2, 
+                current_ino, 
+                elements[i], 
+                &cached_ino, 
+                &cached_type))
             {
-                n = _Min(r, blknos_per_block);
-
-                if (EXT2_IFERR(err = _WriteSingleDirectBlockNumbers(
-                    ext2,
-                    p,
-                    n,
-                    (UINT32*)block.data + i)))
+                if (i + 1 == nelements || cached_type == EXT2_DT_DIR)
                 {
-                    GOTO(done);
+                    current_ino = cached_ino;
+                    continue;
                 }
+
+                err = EXT2_ERR_FILE_NOT_FOUND;
+                goto done;
             }
-            else
+
+            /* Hashed directories: read just the blocks on the name's path */
+            if (!EXT2_IFERR(_DxFindDirEnt(
+                ext2, 
+                current_ino, 
+                elements[i], 
+                &dirent, 
+                &found)))
             {
-                n = _Min(r, blknos_per_block * blknos_per_block);
+                if (!found)
+                {
+                    err = EXT2_ERR_FILE_NOT_FOUND;
+                    goto done;
+                }
 
-                /* Write the block numbers for this block */
-                if (EXT2_IFERR(err = _WriteIndirectBlockNumbers(
-                    ext2,
-                    2, /* double indirection */
-                    p,
-                    n,
-                    (UINT32*)block.data + i)))
+                _PutCachedDentry(ext2, current_ino, &dirent);
+
+                if (i + 1 == nelements || dirent.d_type == EXT2_DT_DIR)
                 {
-                    GOTO(done);
+                    current_ino = dirent.d_ino;
+                    continue;
                 }
+
+                err = EXT2_ERR_FILE_NOT_FOUND;
+                goto done;
             }
 
-            p += n;
-            r -= n;
-        }
+            if (EXT2_IFERR(err = EXT2ListDirInode(
+                ext2, 
+                current_ino, 
+                &entries, 
+                &nentries)))
+            {
+                GOTO(done);
+            }
 
-        /* Check that the blocks were exhausted */
-        if (r != 0)
-        {
-            err = EXT2_ERR_EXTRANEOUS_DATA;
-            GOTO(done);
+            /* Cache the whole directory (siblings are often looked up next) */
+            for (j = 0; j < nentries; j++)
+                _PutCachedDentry(ext2, current_ino, &entries[j]);
+
+            current_ino = 0;
+
+            for (j = 0; j < nentries; j++)
+            {
+                const EXT2DirEnt* ent = &entries[j];
+
+                if (i + 1 == nelements || ent->d_type == EXT2_DT_DIR)
+                {
+                    if (Strcmp(ent->d_name, elements[i]) == 0)
+                    {
+                        current_ino = ent->d_ino;
+                        break;
+                    }
+                }
+            }
+
+            if (entries)
+                Free(entries);
+
+            if (!current_ino)
+            {
+                /* Not found case */
+                err = EXT2_ERR_FILE_NOT_FOUND;
+                goto done;
+            }
         }
     }
 
-    /* Write the indirect block */
-    if (EXT2_IFERR(err = EXT2WriteBlock(ext2, *blkno, &block)))
-    {
-        GOTO(done);
-    }
+    *ino = current_ino;
 
     err = EXT2_ERR_NONE;
 
@@ -3344,199 +3996,125 @@ done:
     return err;
 }
 
-static EXT2Err _WriteData(
-    EXT2* ext2,
-    const void* data,
-    UINT32 size,
-    BufU32* blknos)
+EXT2Err EXT2PathToInode(
+    const EXT2* ext2,
+    const char* path,
+    EXT2Ino* ino,
+    EXT2Inode* inode)
 {
     EXT2_DECLARE_ERR(err);
-    UINT32 blksize = ext2->block_size;
-    UINT32 nblks = (size + blksize - 1) / blksize;
-    UINT32 rem = size % blksize;
-    UINT32 i = 0;
-    UINT32 grpno;
+    EXT2Ino tmp_ino;
 
-    for (grpno = 0; grpno < ext2->group_count && i < nblks; grpno++)
+    /* Check parameters */
+    if (!ext2 || !path || !inode)
     {
-        EXT2Block bitmap;
-        EXT2Block block;
-        UINT32 blkno;
-        UINT32 lblkno;
-        int changed = 0;
-    
-        /* Read the bitmap */
-        if (EXT2_IFERR(err = EXT2ReadBlockBitmap(ext2, grpno, &bitmap)))
-        {
-            GOTO(done);
-        }
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
 
-        /* Scan the bitmap, looking for free bit */
-        for (lblkno = 0; lblkno < bitmap.size * 8 && i < nblks; lblkno++)
-        {
-            if (!_TestBit(bitmap.data, bitmap.size, lblkno))
-            {
-                _SetBit(bitmap.data, bitmap.size, lblkno);
-                blkno = MakeBlkno(ext2, grpno, lblkno);
+    /* Find the ino for this path */
+    if (EXT2_IFERR(err = EXT2PathToIno(ext2, path, &tmp_ino)))
+    {
+        /* Not found case */
+        goto done;
+    }
 
-                /* Append this to the array of blocks */
-                if (EXT2_IFERR(err = BufU32Append(blknos, &blkno, 1)))
-                    GOTO(done);
+    /* Read the inode into memory */
+    if (EXT2_IFERR(err = EXT2ReadInode(ext2, tmp_ino, inode)))
+    {
+        GOTO(done);
+    }
 
-                /* If this is the final block */
-                if (i + 1 == nblks && rem)
-                {
-                    Memcpy(block.data, (char*)data + (i * blksize), rem);
-                    block.size = rem;
-                }
-                else
-                {
-                    Memcpy(block.data, (char*)data + (i * blksize), blksize);
-                    block.size = blksize;
-                }
+    if (ino)
+        *ino = tmp_ino;
 
-                /* Write the block */
-                if (EXT2_IFERR(err = EXT2WriteBlock(ext2, blkno, &block)))
-                {
-                    GOTO(done);
-                }
+    err = EXT2_ERR_NONE;
 
-                /* Update the in memory structs. */
-                ext2->sb.s_free_blocks_count--;
-                ext2->groups[grpno].bg_free_blocks_count--;
-                i++;
-                changed = 1;
-            }
-        }
+done:
+    return err;
+}
 
-        if (changed == 1)
-        {
-            /* Write group and bitmap. */
-            if (EXT2_IFERR(err = _WriteGroup(ext2, grpno)))
-            {
-                GOTO(done);
-            }
+/*
+**==============================================================================
+**
+** bitmaps:
+**
+**==============================================================================
+*/
 
-            if (EXT2_IFERR(err = EXT2WriteBlockBitmap(ext2, grpno, &bitmap)))
-            {
-                GOTO(done);
-            }
-        }
+EXT2Err EXT2ReadBlockBitmap(
+    const EXT2* ext2,
+    UINT32 group_index,
+    EXT2Block* block)
+{
+    EXT2_DECLARE_ERR(err);
+    UINT32 bitmap_size_bytes;
+
+    if (!EXT2Valid(ext2) || !block)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
     }
 
-    /* Ran out of disk space. */
-    if (i != nblks)
+    Memset(block, 0, sizeof(EXT2Block));
+
+    bitmap_size_bytes = ext2->sb.s_blocks_per_group / 8;
+
+    if (group_index > ext2->group_count)
     {
+        err = EXT2_ERR_BAD_GRPNO;
         GOTO(done);
     }
 
-    /* Write super block data. */
-    if (EXT2_IFERR(err = _WriteSuperBlock(ext2)))
+    if (EXT2_IFERR(err = EXT2ReadBlock(
+        ext2, 
+        ext2->groups[group_index].bg_block_bitmap, 
+        block)))
     {
         GOTO(done);
     }
 
+    if (block->size > bitmap_size_bytes)
+        block->size = bitmap_size_bytes;
+
     err = EXT2_ERR_NONE;
 
 done:
     return err;
 }
 
-static EXT2Err _UpdateInodeBlockPointers(
-    EXT2* ext2,
-    EXT2Ino ino,
-    EXT2Inode* inode,
-    UINT32 size,
-    const UINT32* blknos,
-    UINT32 nblknos)
+EXT2Err EXT2WriteBlockBitmap(
+    const EXT2* ext2,
+    UINT32 group_index,
+    const EXT2Block* block)
 {
     EXT2_DECLARE_ERR(err);
-    UINT32 i;
-    const UINT32* p = blknos;
-    UINT32 r = nblknos;
-    UINT32 blknos_per_block = ext2->block_size / sizeof(UINT32);
-
-    /* Update the inode size */
-    inode->i_size = size;
+    UINT32 bitmap_size_bytes;
 
-    /* Update the direct inode blocks */
-    if (r)
+    if (!EXT2Valid(ext2) || !block)
     {
-        UINT32 n = _Min(r, EXT2_SINGLE_INDIRECT_BLOCK);
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
 
-        for (i = 0; i < n; i++)
-        {
-            inode->i_block[i] = p[i];
-        }
+    bitmap_size_bytes = ext2->sb.s_blocks_per_group / 8;
 
-        p += n;
-        r -= n;
+    if (block->size != bitmap_size_bytes)
+    {
+        err = EXT2_ERR_BAD_SIZE;
+        GOTO(done);
     }
 
-    /* Write the indirect block numbers */
-    if (r)
+    if (group_index > ext2->group_count)
     {
-        UINT32 n = _Min(r, blknos_per_block);
+        err = EXT2_ERR_BAD_GRPNO;
+        GOTO(done);
+    }
 
-        if (EXT2_IFERR(err = _WriteSingleDirectBlockNumbers(
-            ext2,
-            p,
-            n,
-            &inode->i_block[EXT2_SINGLE_INDIRECT_BLOCK])))
-        {
-            GOTO(done);
-        }
-
-        p += n;
-        r -= n;
-    }
-
-    /* Write the double indirect block numbers */
-    if (r)
-    {
-        UINT32 n = _Min(r, blknos_per_block * blknos_per_block);
-
-        if (EXT2_IFERR(err = _WriteIndirectBlockNumbers(
-            ext2,
-            2, /* double indirection */
-            p,
-            n,
-            &inode->i_block[EXT2_DOUBLE_INDIRECT_BLOCK])))
-        {
-            GOTO(done);
-        }
-
-        p += n;
-        r -= n;
-    }
-
-    /* Write the triple indirect block numbers */
-    if (r)
-    {
-        UINT32 n = r;
-
-        if (EXT2_IFERR(err = _WriteIndirectBlockNumbers(
-            ext2,
-            3, /* triple indirection */
-            p,
-            n,
-            &inode->i_block[EXT2_TRIPLE_INDIRECT_BLOCK])))
-        {
-            GOTO(done);
-        }
-
-        p += n;
-        r -= n;
-    }
-
-    /* Note: triple indirect block numbers not handled! */
-    if (r > 0)
-    {
-        GOTO(done);
-    }
-
-    /* Rewrite the inode */
-    if (EXT2_IFERR(err = _WriteInode(ext2, ino, inode)))
+    if (EXT2_IFERR(err = EXT2WriteBlock(
+        ext2, 
+        ext2->groups[group_index].bg_block_bitmap, 
+        block)))
     {
         GOTO(done);
     }
@@ -3547,146 +4125,110 @@ done:
     return err;
 }
 
-static EXT2Err _UpdateInodeDataBlocks(
-    EXT2* ext2,
-    EXT2Ino ino,
-    EXT2Inode* inode,
-    const void* data,
-    UINT32 size,
-    BOOLEAN is_dir)
+EXT2Err EXT2readReadInodeBitmap(
+    const EXT2* ext2,
+    UINT32 group_index,
+    EXT2Block* block)
 {
     EXT2_DECLARE_ERR(err);
-    BufU32 blknos = BUF_U32_INITIALIZER;
-    UINT32 count = 0;
-    void* tmp_data = NULL;
-
-    if (EXT2_IFERR(err = _WriteData(ext2, data, size, &blknos)))
-        GOTO(done);
-
-    if (is_dir)
-    {
-        if (EXT2_IFERR(err = _CountDirectoryEntries(
-            ext2, data, size, &count)))
-        {
-            GOTO(done);
-        }
-    }
-
-    inode->i_osd1 = count + 1;
+    UINT32 bitmap_size_bytes;
 
-    if (EXT2_IFERR(err = _UpdateInodeBlockPointers(
-        ext2,
-        ino,
-        inode,
-        size,
-        blknos.data,
-        blknos.size)))
+    if (!EXT2Valid(ext2) || !block)
     {
+        err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    err = EXT2_ERR_NONE;
-
-done:
-
-    BufU32Release(&blknos);
-
-    if (tmp_data)
-        Free(tmp_data);
-
-    return err;
-}
-
-EXT2Err EXT2Update(
-    EXT2* ext2,
-    const void* data,
-    UINT32 size,
-    const char* path)
-{
-    EXT2_DECLARE_ERR(err);
-    EXT2Ino ino;
-    EXT2Inode inode;
-#if !defined(BUILD_EFI)
-    (void)_DumpDirectoryEntry;
-#endif /* !defined(BUILD_EFI) */
+    Memset(block, 0, sizeof(EXT2Block));
 
-    /* Check parameters */
-    if (!EXT2Valid(ext2) || !data || !path)
-    {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
-    }
+    bitmap_size_bytes = ext2->sb.s_inodes_per_group / 8;
 
-    /* Truncate the destination file */
-    if (EXT2_IFERR(err = EXT2Trunc(ext2, path)))
+    if (group_index > ext2->group_count)
     {
+        err = EXT2_ERR_BAD_GRPNO;
         GOTO(done);
     }
 
-    /* Read inode for this file */
-    if (EXT2_IFERR(err = EXT2PathToInode(ext2, path, &ino, &inode)))
+    if (EXT2_IFERR(err = EXT2ReadBlock(
+        ext2, 
+        ext2->groups[group_index].bg_inode_bitmap, 
+        block)))
     {
         GOTO(done);
     }
 
-    /* Update the inode blocks */
-    if (EXT2_IFERR(err = _UpdateInodeDataBlocks(
-        ext2,
-        ino,
-        &inode,
-        data,
-        size,
-        0))) /* !is_dir */
-    {
-        GOTO(done);
-    }
+    if (block->size > bitmap_size_bytes)
+        block->size = bitmap_size_bytes;
 
     err = EXT2_ERR_NONE;
 
 done:
-
     return err;
 }
 
-static EXT2Err _CheckDirectoryEntries(
+/*
+**==============================================================================
+**
+** directory:
+**
+**==============================================================================
+*/
+
+# if !defined(BUILD_EFI)
+static void _DumpDirectoryEntry(
+    const EXT2DirEntry* dirent)
+{
+    printf("=== EXT2DirEntry:\n");
+    printf("inode=%u\n", dirent->inode);
+    printf("rec_len=%u\n", dirent->rec_len);
+    printf("name_len=%u\n", dirent->name_len);
+    printf("file_type=%u\n", dirent->file_type);
+    printf("name={%.*s}\n", dirent->name_len, dirent->name);
+}
+# endif /* !defined(BUILD_EFI) */
+
+static EXT2Err _CountDirectoryEntries(
     const EXT2* ext2,
     const void* data,
-    UINT32 size)
+    UINT32 size,
+    UINT32* count)
 {
     EXT2_DECLARE_ERR(err);
     const UINT8* p = (UINT8*)data;
     const UINT8* end = (UINT8*)data + size;
 
+    /* Check parameters */
+    if (!EXT2Valid(ext2) || !data || !size || !count)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Initilize the count */
+    *count = 0;
+
     /* Must be divisiable by block size */
     if ((end - p) % ext2->block_size)
     {
+        err = EXT2_ERR_BAD_MULTIPLE;
         GOTO(done);
     }
 
     while (p < end)
     {
-        UINT32 n;
         const EXT2DirEntry* ent = (const EXT2DirEntry*)p;
-        
-        n = sizeof(EXT2DirEntry) - EXT2_PATH_MAX + ent->name_len;
-        n = _NextMult(n, 4);
 
-        if (n != ent->rec_len)
+        if (ent->name_len)
         {
-            UINT32 offset = ((char*)p - (char*)data) % ext2->block_size;
-            UINT32 rem = ext2->block_size - offset;
-
-            if (rem != ent->rec_len)
-            {
-                GOTO(done);
-            }
+            (*count)++;
         }
-
+        
         p += ent->rec_len;
     }
 
     if (p != end)
     {
+        err = EXT2_ERR_EXTRANEOUS_DATA;
         GOTO(done);
     }
 
@@ -3696,350 +4238,2511 @@ done:
     return err;
 }
 
-#if !defined(BUILD_EFI)
-static void _DumpDirectoryEntries(
+struct _EXT2_DIR
+{
+    void *data;
+    UINT32 size;
+    const void *next;
+    EXT2DirEnt ent;
+};
+
+EXT2_DIR *EXT2OpenDir(
     const EXT2* ext2,
-    const void* data,
-    UINT32 size)
+    const char *path)
 {
-    const UINT8* p = (UINT8*)data;
-    const UINT8* end = (UINT8*)data + size;
+    EXT2_DIR *dir = NULL;
+    EXT2Ino ino;
 
-    while (p < end)
+    /* Check parameters */
+    if (!ext2 || !path)
     {
-        UINT32 n;
-        const EXT2DirEntry* ent = (const EXT2DirEntry*)p;
+        GOTO(done);
+    }
 
-        _DumpDirectoryEntry(ent);
-        
-        n = sizeof(EXT2DirEntry) - EXT2_PATH_MAX + ent->name_len;
-        n = _NextMult(n, 4);
+    /* Find inode number for this directory */
+    if (EXT2_IFERR(EXT2PathToIno(ext2, path, &ino)))
+        GOTO(done);
 
-        if (n != ent->rec_len)
-        {
-            UINT32 gap = ent->rec_len - n;
-            UINT32 offset = ((char*)p - (char*)data) % ext2->block_size;
-            UINT32 rem = ext2->block_size - offset;
+    /* Open directory from this inode */
+    if (!(dir = EXT2OpenDirIno(ext2, ino)))
+        GOTO(done);
 
-            printf("gap: %u\n", gap);
-            printf("offset: %u\n", offset);
-            printf("remaing: %u\n", rem);
-        }
+done:
+    return dir;
+}
 
-        p += ent->rec_len;
+EXT2_DIR *EXT2OpenDirIno(
+    const EXT2* ext2,
+    EXT2Ino ino)
+{
+    EXT2_DIR *dir = NULL;
+    EXT2Inode inode;
+
+    /* Check parameters */
+    if (!ext2 || !ino)
+    {
+        GOTO(done);
+    }
+
+    /* Read the inode into memory */
+    if (EXT2_IFERR(EXT2ReadInode(ext2, ino, &inode)))
+    {
+        GOTO(done);
+    }
+
+    /* Fail if not a directory */
+    if (!(inode.i_mode & EXT2_S_IFDIR))
+    {
+        GOTO(done);
+    }
+
+    /* Allocate directory object */
+    if (!(dir = (EXT2_DIR*)Calloc(1, sizeof(EXT2_DIR))))
+    {
+        GOTO(done);
+    }
+
+    /* Load the blocks for this inode into memory */
+    if (EXT2_IFERR(EXT2LoadFileFromInode(
+        ext2, 
+        &inode, 
+        &dir->data, 
+        &dir->size)))
+    {
+        Free(dir);
+        dir = NULL;
+        GOTO(done);
     }
+
+    /* Set pointer to current directory */
+    dir->next = dir->data;
+
+done:
+    return dir;
 }
-#endif /* !defined(BUILD_EFI) */
 
-static const EXT2DirEntry* _FindDirectoryEntry(
-    const char* name,
-    const void* data,
-    UINT32 size)
+EXT2DirEnt *EXT2ReadDir(
+    EXT2_DIR *dir)
 {
-    const UINT8* p = (UINT8*)data;
-    const UINT8* end = (UINT8*)data + size;
+    EXT2DirEnt *ent = NULL;
 
-    while (p < end)
+    if (!dir || !dir->data || !dir->next)
+        goto done;
+
+    /* Find the next entry (possibly skipping padding entries) */
     {
-        const EXT2DirEntry* ent = (const EXT2DirEntry*)p;
-        char tmp[EXT2_PATH_MAX];
+        const void* end = (void*) ((char*) dir->data + dir->size);
 
+        while (!ent && dir->next < end)
+        {
+            const EXT2DirEntry* de = 
+                (EXT2DirEntry*)dir->next;
 
-        /* Create zero-terminated name */
-        tmp[0] = '\0';
-        Strncat(tmp, sizeof(tmp), ent->name, 
-            _Min(ent->name_len, EXT2_PATH_MAX-1));
+            if (de->rec_len == 0)
+                break;
 
-        if (Strcmp(tmp, name) == 0)
-            return ent;
+            if (de->name_len > 0)
+            {
+                /* Found! */
 
-        p += ent->rec_len;
+                /* Set EXT2DirEnt.d_ino */
+                dir->ent.d_ino = de->inode;
+
+                /* Set EXT2DirEnt.d_off (not used) */
+                dir->ent.d_off = 0;
+
+                /* Set EXT2DirEnt.d_reclen (not used) */
+                dir->ent.d_reclen = sizeof(EXT2DirEnt);
+
+                /* Set EXT2DirEnt.type */
+                dir->ent.d_type = _FileTypeToDType(de->file_type);
+
+                /* Set EXT2DirEnt.d_name */
+                dir->ent.d_name[0] = '\0';
+
+                Strncat(
+                    dir->ent.d_name, 
+                    sizeof(dir->ent.d_name),
+                    de->name, 
+                    _Min(EXT2_PATH_MAX-1, de->name_len));
+
+                /* Success! */
+                ent = &dir->ent;
+            }
+
+            /* Position to the next entry (for next call to readdir) */
+                dir->next = (void*)((char*)dir->next + de->rec_len); 
+        }
     }
 
-    /* Not found */
-    return NULL;
+done:
+    return ent;
 }
 
-static EXT2Err _CountDirectoryEntriesIno(
-    EXT2* ext2,
+EXT2Err EXT2CloseDir(
+    EXT2_DIR* dir)
+{
+    EXT2_DECLARE_ERR(err);
+
+    if (!dir)
+    {
+        GOTO(done);
+    }
+
+    Free(dir->data);
+    Free(dir);
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+EXT2Err EXT2ListDirInode(
+    const EXT2* ext2,
     EXT2Ino ino,
-    UINT32* count)
+    EXT2DirEnt** entries,
+    UINT32* nentries)
 {
     EXT2_DECLARE_ERR(err);
     EXT2_DIR* dir = NULL;
     EXT2DirEnt* ent;
+    Buf buf = BUF_INITIALIZER;
 
     /* Check parameters */
-    if (!EXT2Valid(ext2) || !ino || !count)
+    if (!ext2 || !ino || !entries || !nentries)
     {
         err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* Initialize count */
-    *count = 0;
+    *entries = NULL;
+    *nentries = 0;
 
-    /* Open directory */
+    /* Open the directory */
     if (!(dir = EXT2OpenDirIno(ext2, ino)))
     {
         GOTO(done);
     }
 
-    /* Count the entries (notes that "." and ".." will always be present). */
-    while ((ent = EXT2ReadDir(dir)))
-    {
-        (*count)++;
-    }
-
+    /* Add entries to array */
+    while ((ent = EXT2ReadDir(dir)))
+    {
+        /* Append to buffer */
+        if (EXT2_IFERR(err = BufAppend(
+            &buf,
+            ent,
+            sizeof(EXT2DirEnt))))
+        {
+            GOTO(done);
+        }
+    }
+
+    (*entries) = (EXT2DirEnt*)buf.data;
+    (*nentries) = buf.size / sizeof(EXT2DirEnt);
+
+    err = EXT2_ERR_NONE;
+
+done:
+
+    if (EXT2_IFERR(err))
+        BufRelease(&buf);
+
+    /* Close the directory */
+    if (dir)
+        EXT2CloseDir(dir);
+
+    return err;
+}
+
+/*
+**==============================================================================
+**
+** files:
+**
+**==============================================================================
+*/
+
+static EXT2Err _SplitFullPath(
+    const char* path,
+    char dirname[EXT2_PATH_MAX],
+    char basename[EXT2_PATH_MAX])
+{
+    char* slash;
+
+    /* Reject paths that are not absolute */
+    if (path[0] != '/')
+        return EXT2_ERR_FAILED;
+
+    /* Handle root directory up front */
+    if (Strcmp(path, "/") == 0)
+    {
+        Strlcpy(dirname, "/", EXT2_PATH_MAX);
+        Strlcpy(basename, "/", EXT2_PATH_MAX);
+        return EXT2_ERR_NONE;
+    }
+
+    /* This cannot fail (prechecked) */
+    if (!(slash = Strrchr(path, '/')))
+        return EXT2_ERR_FAILED;
+
+    /* If path ends with '/' character */
+    if (!slash[1])
+        return EXT2_ERR_FAILED;
+
+    /* Split the path */
+    {
+        if (slash == path)
+        {
+            Strlcpy(dirname, "/", EXT2_PATH_MAX);
+        }
+        else
+        {
+            UINTN index = slash - path;
+            Strlcpy(dirname, path, EXT2_PATH_MAX);
+
+            if (index < EXT2_PATH_MAX)
+                dirname[index] = '\0';
+            else
+                dirname[EXT2_PATH_MAX-1] = '\0';
+        }
+
+        Strlcpy(basename, slash + 1, EXT2_PATH_MAX);
+    }
+
+    return EXT2_ERR_NONE;
+}
+
+EXT2Err EXT2LoadFileFromInode(
+    const EXT2* ext2,
+    const EXT2Inode* inode,
+    void** data,
+    UINT32* size)
+{
+    EXT2_DECLARE_ERR(err);
+    Buf extents = BUF_INITIALIZER;
+    Buf buf = BUF_INITIALIZER;
+    Buf segs = BUF_INITIALIZER;
+    const EXT2Extent* p;
+    const EXT2Extent* end;
+    UINT32 nblks;
+    UINT32 next = 0;
+
+    /* Check parameters */
+    if (!EXT2Valid(ext2) || !inode || !data || !size)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Initialize the output */
+    *data = NULL;
+    *size = 0;
+
+    /* Form a list of runs for this file */
+    if (EXT2_IFERR(err = EXT2GetExtents(ext2, inode, &extents)))
+    {
+        GOTO(done);
+    }
+
+    /* Reserve space for every block of the file (holes read as zeros) */
+    nblks = (inode->i_size + ext2->block_size - 1) / ext2->block_size;
+
+    if (BufReserve(&buf, nblks * ext2->block_size) != 0)
+    {
+        err = EXT2_ERR_OUT_OF_MEMORY;
+        GOTO(done);
+    }
+
+    /* Form one segment for each run within the file size */
+    p = (const EXT2Extent*)extents.data;
+    end = p + extents.size / sizeof(EXT2Extent);
+
+    for (; p != end && p->lblkno < nblks; p++)
+    {
+        UINT32 count = _Min(p->count, nblks - p->lblkno);
+        BlkdevSegment seg;
+
+        /* Zero-fill the hole before this run */
+        Memset(
+            (UINT8*)buf.data + next * ext2->block_size, 
+            0, 
+            (p->lblkno - next) * ext2->block_size);
+
+        next = p->lblkno + count;
+
+        if (p->flags & EXT2_EXTENT_UNINIT)
+        {
+            Memset(
+                (UINT8*)buf.data + p->lblkno * ext2->block_size, 
+                0, 
+                count * ext2->block_size);
+            continue;
+        }
+
+        seg.blkno = EXT2BlknoToLBA(ext2, p->blkno);
+        seg.nblocks = count * (ext2->block_size / BlkdevBlockSize(ext2->dev));
+        seg.data = (UINT8*)buf.data + p->lblkno * ext2->block_size;
+
+        if (BufAppend(&segs, &seg, sizeof(seg)) != 0)
+        {
+            err = EXT2_ERR_OUT_OF_MEMORY;
+            GOTO(done);
+        }
+    }
+
+    /* Zero-fill the hole at the end (if any) */
+    if (next < nblks)
+    {
+        Memset(
+            (UINT8*)buf.data + next * ext2->block_size, 
+            0, 
+            (nblks - next) * ext2->block_size);
+    }
+
+    /* Read all the runs with a single request */
+    if (segs.size && BlkdevGetV(
+        ext2->dev, 
+        (const BlkdevSegment*)segs.data, 
+        segs.size / sizeof(BlkdevSegment)) != 0)
+    {
+        err = EXT2_ERR_READ_FAILED;
+        GOTO(done);
+    }
+
+    buf.size = nblks * ext2->block_size;
+
+    *data = buf.data;
+    *size = inode->i_size; /* data may be smaller than block multiple */
+
+    err = EXT2_ERR_NONE;
+
+done:
+
+    if (EXT2_IFERR(err))
+        BufRelease(&buf);
+
+    BufRelease(&extents);
+    BufRelease(&segs);
+
+    return err;
+}
+
+EXT2Err EXT2LoadFileFromPath(
+    const EXT2* ext2,
+    const char* path,
+    void** data,
+    UINT32* size)
+{
+    EXT2_DECLARE_ERR(err);
+    EXT2Inode inode;
+
+    if (EXT2PathToInode(ext2, path, NULL, &inode) != EXT2_ERR_NONE)
+        goto done;
+
+    if (EXT2LoadFileFromInode(ext2, &inode, data, size) != EXT2_ERR_NONE)
+        goto done;
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+/*
+**==============================================================================
+**
+** EXT2
+**
+**==============================================================================
+*/
+
+EXT2Err EXT2New(
+    Blkdev* dev,
+    EXT2** ext2_out)
+{
+    EXT2_DECLARE_ERR(err);
+    EXT2* ext2 = NULL;
+
+    /* Check parameters */
+    if (!dev || !ext2_out)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Initialize output parameters */
+    *ext2_out = NULL;
+
+    /* Bit endian is not supported */
+    if (_IsBigEndian())
+    {
+        err = EXT2_ERR_UNSUPPORTED;
+        GOTO(done);
+    }
+
+    /* Allocate the file system object */
+    if (!(ext2 = (EXT2*)Calloc(1, sizeof(EXT2))))
+    {
+        err = EXT2_ERR_OUT_OF_MEMORY;
+        GOTO(done);
+    }
+
+    /* Set the file object */
+    ext2->dev = dev;
+
+    /* Read the superblock */
+    if (EXT2_IFERR(err = _ReadSuperBlock(ext2->dev, &ext2->sb)))
+    {
+        err = EXT2_ERR_FAILED_TO_READ_SUPERBLOCK;
+        GOTO(done);
+    }
+
+    /* Check the superblock magic number */
+    if (ext2->sb.s_magic != EXT2_S_MAGIC)
+    {
+        err = EXT2_ERR_BAD_MAGIC;
+        GOTO(done);
+    }
+
+    /* Reject revision 0 file systems */
+    if (ext2->sb.s_rev_level == EXT2_GOOD_OLD_REV)
+    {
+        /* Revision 0 not supported */
+        err = EXT2_ERR_UNSUPPORTED_REVISION;
+        GOTO(done);
+    }
+
+    /* Accept revision 1 file systems */
+    if (ext2->sb.s_rev_level < EXT2_DYNAMIC_REV)
+    {
+        /* Revision 1 and up supported */
+        err = EXT2_ERR_UNSUPPORTED_REVISION;
+        GOTO(done);
+    }
+
+    /* Check inode size */
+    if (ext2->sb.s_inode_size > sizeof(EXT2Inode))
+    {
+        err = EXT2_ERR_UNEXPECTED;
+        GOTO(done);
+    }
+
+    /* Calcualte the block size in bytes */
+    ext2->block_size = 1024 << ext2->sb.s_log_block_size;
+
+    /* File system blocks must be whole device blocks (e.g., 4Kn media) */
+    if (ext2->block_size % BlkdevBlockSize(ext2->dev))
+    {
+        err = EXT2_ERR_UNSUPPORTED;
+        GOTO(done);
+    }
+
+    /* Allocate the caches */
+    if (!(ext2->cache = _NewCache(ext2->block_size)))
+    {
+        err = EXT2_ERR_OUT_OF_MEMORY;
+        GOTO(done);
+    }
+
+    /* Calculate the number of block groups */
+    ext2->group_count = 
+        1 + (ext2->sb.s_blocks_count-1) / ext2->sb.s_blocks_per_group;
+
+    /* Get the groups list */
+    if (!(ext2->groups = _ReadGroups(ext2)))
+    {
+        err = EXT2_ERR_FAILED_TO_READ_GROUPS;
+        GOTO(done);
+    }
+
+    /* Read the root inode */
+    if (EXT2_IFERR(err = EXT2ReadInode(ext2, EXT2_ROOT_INO, &ext2->root_inode)))
+    {
+        err = EXT2_ERR_FAILED_TO_READ_INODE;
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+
+    if (EXT2_IFERR(err))
+    {
+        /* Caller must dispose of this! */
+        ext2->dev = NULL;
+        EXT2Delete(ext2);
+    }
+    else
+        *ext2_out = ext2;
+
+    return err;
+}
+
+void EXT2Delete(EXT2* ext2)
+{
+    if (ext2)
+    {
+        if (ext2->dev)
+            ext2->dev->Close(ext2->dev);
+
+        if (ext2->groups)
+            Free(ext2->groups);
+
+        _DeleteCache(ext2->cache);
+
+        Free(ext2);
+    }
+}
+
+# if !defined(BUILD_EFI)
+EXT2Err EXT2Dump(
+    const EXT2* ext2)
+{
+    EXT2_DECLARE_ERR(err);
+    UINT32 grpno;
+
+    /* Print the superblock */
+    EXT2DumpSuperBlock(&ext2->sb);
+
+    printf("block_size=%u\n", ext2->block_size);
+    printf("group_count=%u\n", ext2->group_count);
+
+    /* Print the groups */
+    _DumpGroupDescs(ext2->groups, ext2->group_count);
+
+    /* Print out the bitmaps for the data blocks */
+    {
+        for (grpno = 0; grpno < ext2->group_count; grpno++)
+        {
+            EXT2Block bitmap;
+
+            if (EXT2_IFERR(err = EXT2ReadBlockBitmap(ext2, grpno, &bitmap)))
+            {
+                GOTO(done);
+            }
+
+            printf("=== block bitmap:\n");
+            _dump_bitmap(&bitmap);
+        }
+    }
+
+    /* Print the inode bitmaps */
+    for (grpno = 0; grpno < ext2->group_count; grpno++)
+    {
+        EXT2Block bitmap;
+
+        if (EXT2_IFERR(err = EXT2readReadInodeBitmap(ext2, grpno, &bitmap)))
+        {
+            GOTO(done);
+        }
+
+        printf("=== inode bitmap:\n");
+        _dump_bitmap(&bitmap);
+    }
+
+    /* dump the inodes */
+    {
+        UINT32 nbits = 0;
+        UINT32 mbits = 0;
+
+        /* Print the inode tables */
+        for (grpno = 0; grpno < ext2->group_count; grpno++)
+        {
+            EXT2Block bitmap;
+            UINT32 lino;
+
+            /* Get inode bitmap for this group */
+            if (EXT2_IFERR(err = EXT2readReadInodeBitmap(ext2, grpno, &bitmap)))
+            {
+                GOTO(done);
+            }
+
+            nbits += _CountBitsN(bitmap.data, bitmap.size);
+
+            /* For each bit set in the bit map */
+            for (lino = 0; lino < ext2->sb.s_inodes_per_group; lino++)
+            {
+                EXT2Inode inode;
+                EXT2Ino ino;
+
+                if (!_TestBit(bitmap.data, bitmap.size, lino))
+                    continue;
+
+                mbits++;
+
+                if ((lino+1) < EXT2_FIRST_INO && (lino+1) != EXT2_ROOT_INO)
+                    continue;
+
+                ino = _MakeIno(ext2, grpno, lino);
+
+                if (EXT2_IFERR(err = EXT2ReadInode(ext2, ino, &inode)))
+                {
+                    GOTO(done);
+                }
+
+                printf("INODE{%u}\n", ino);
+                EXT2DumpInode(ext2, &inode);
+            }
+        }
+
+        printf("nbits{%u}\n", nbits);
+        printf("mbits{%u}\n", mbits);
+    }
+
+    /* dump the root inode */
+    EXT2DumpInode(ext2, &ext2->root_inode);
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+#endif /* !defined(BUILD_EFI) */
+
+EXT2Err EXT2Check(
+    const EXT2* ext2)
+{
+    EXT2_DECLARE_ERR(err);
+
+    /* Check the block bitmaps */
+    {
+        UINT32 i;
+        UINT32 n = 0;
+        UINT32 nused = 0;
+        UINT32 nfree = 0;
+
+        for (i = 0; i < ext2->group_count; i++)
+        {
+            EXT2Block bitmap;
+
+            nfree += ext2->groups[i].bg_free_blocks_count;
+
+            if (EXT2_IFERR(err = EXT2ReadBlockBitmap(ext2, i, &bitmap)))
+            {
+                GOTO(done);
+            }
+
+            nused += _CountBitsN(bitmap.data, bitmap.size);
+            n += bitmap.size * 8;
+        }
+
+        if (ext2->sb.s_free_blocks_count != nfree)
+        {
+#if !defined(BUILD_EFI)
+            printf("s_free_blocks_count{%u}, nfree{%u}\n",
+                ext2->sb.s_free_blocks_count, nfree);
+#endif /* !defined(BUILD_EFI) */
+            GOTO(done);
+        }
+
+        if (ext2->sb.s_free_blocks_count != n - nused)
+        {
+            GOTO(done);
+        }
+    }
+
+    /* Check the inode bitmaps */
+    {
+        UINT32 i;
+        UINT32 n = 0;
+        UINT32 nused = 0;
+        UINT32 nfree = 0;
+
+        /* Check the bitmaps for the inodes */
+        for (i = 0; i < ext2->group_count; i++)
+        {
+            EXT2Block bitmap;
+
+            nfree += ext2->groups[i].bg_free_inodes_count;
+
+            if (EXT2_IFERR(err = EXT2readReadInodeBitmap(ext2, i, &bitmap)))
+            {
+                GOTO(done);
+            }
+
+            nused += _CountBitsN(bitmap.data, bitmap.size);
+            n += bitmap.size * 8;
+        }
+
+        if (ext2->sb.s_free_inodes_count != n - nused)
+        {
+            GOTO(done);
+        }
+
+        if (ext2->sb.s_free_inodes_count != nfree)
+        {
+            GOTO(done);
+        }
+    }
+
+    /* Check the inodes */
+    {
+        UINT32 grpno;
+        UINT32 nbits = 0;
+        UINT32 mbits = 0;
+
+        /* Check the inode tables */
+        for (grpno = 0; grpno < ext2->group_count; grpno++)
+        {
+            EXT2Block bitmap;
+            UINT32 lino;
+
+            /* Get inode bitmap for this group */
+            if (EXT2_IFERR(err = EXT2readReadInodeBitmap(ext2, grpno, &bitmap)))
+            {
+                GOTO(done);
+            }
+
+            nbits += _CountBitsN(bitmap.data, bitmap.size);
+
+            /* For each bit set in the bit map */
+            for (lino = 0; lino < ext2->sb.s_inodes_per_group; lino++)
+            {
+                EXT2Inode inode;
+                EXT2Ino ino;
+
+                if (!_TestBit(bitmap.data, bitmap.size, lino))
+                    continue;
+
+                mbits++;
+
+                if ((lino+1) < EXT2_FIRST_INO && (lino+1) != EXT2_ROOT_INO)
+                    continue;
+
+                ino = _MakeIno(ext2, grpno, lino);
+
+                if (EXT2_IFERR(err = EXT2ReadInode(ext2, ino, &inode)))
+                {
+                    GOTO(done);
+                }
+
+                /* Mode can never be zero */
+                if (inode.i_mode == 0)
+                {
+                    GOTO(done);
+                }
+
+                /* If file is not zero size but no blocks, then fail */
+                if (inode.i_size && !inode.i_block[0])
+                {
+                    GOTO(done);
+                }
+            }
+        }
+
+        /* The number of bits in bitmap must match number of active inodes */
+        if (nbits != mbits)
+        {
+            GOTO(done);
+        }
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+EXT2Err EXT2Trunc(
+    EXT2* ext2,
+    const char* path)
+{
+    EXT2_DECLARE_ERR(err);
+    char dirname[EXT2_PATH_MAX];
+    char basename[EXT2_PATH_MAX];
+    EXT2Ino dir_ino;
+    EXT2Inode dir_inode;
+    EXT2Ino file_ino;
+    EXT2Inode file_inode;
+    BufU32 blknos = BUF_U32_INITIALIZER;
+#if !defined(BUILD_EFI)
+    (void)_DumpBlockNumbers;
+#endif /* !defined(BUILD_EFI) */
+
+    /* Check parameters */
+    if (!ext2 || !path)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Only plain EXT2 file systems can be changed */
+    if (EXT2_IFERR(err = _CheckWritable(ext2)))
+    {
+        GOTO(done);
+    }
+
+    /* Split the path */
+    if (EXT2_IFERR(err = _SplitFullPath(path, dirname, basename)))
+    {
+        GOTO(done);
+    }
+
+    /* Find the inode of the dirname */
+    if (EXT2_IFERR(err = EXT2PathToInode(ext2, dirname, &dir_ino, &dir_inode)))
+    {
+        GOTO(done);
+    }
+
+    /* Find the inode of the basename */
+    if (EXT2_IFERR(err = EXT2PathToInode(
+        ext2, path, &file_ino, &file_inode)))
+    {
+        goto done;
+    }
+
+    /* Form a list of block-numbers for this file */
+    if (EXT2_IFERR(err = _LoadBlockNumbersFromInode(
+        ext2, 
+        &file_inode, 
+        1, /* include_block_blocks */
+        &blknos)))
+    {
+        GOTO(done);
+    }
+
+    /* If this file is a directory, then fail */
+    if (file_inode.i_mode & EXT2_S_IFDIR)
+    {
+        GOTO(done);
+    }
+
+    /* Return the blocks to the free list */
+    {
+        if (EXT2_IFERR(err = _PutBlocks(ext2, blknos.data, blknos.size)))
+            GOTO(done);
+    }
+
+    /* Rewrite the inode */
+    {
+        file_inode.i_size = 0;
+        Memset(file_inode.i_block, 0, sizeof(file_inode.i_block));
+
+        if (EXT2_IFERR(err = _WriteInode(ext2, file_ino, &file_inode)))
+        {
+            GOTO(done);
+        }
+    }
+
+    /* Update the super block */
+    if (EXT2_IFERR(err = _WriteSuperBlock(ext2)))
+    {
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+
+    BufU32Release(&blknos);
+
+    return err;
+}
+
+static EXT2Err _WriteSingleDirectBlockNumbers(
+    EXT2* ext2,
+    const UINT32* blknos,
+    UINT32 nblknos,
+    UINT32* blkno)
+{
+    EXT2_DECLARE_ERR(err);
+    EXT2Block block;
+
+    /* Check parameters */
+    if (!EXT2Valid(ext2) || !blknos || !nblknos)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* If no room in a single block for the block numbers */
+    if (nblknos > ext2->block_size / sizeof(UINT32))
+    {
+        err = EXT2_ERR_BUFFER_OVERFLOW;
+        GOTO(done);
+    }
+
+    /* Assign an available block */
+    if (EXT2_IFERR(err = _GetBlock(ext2, blkno)))
+    {
+        GOTO(done);
+    }
+
+    /* Copy block numbers into block */
+    Memset(&block, 0, sizeof(EXT2Block));
+    Memcpy(block.data, blknos, nblknos * sizeof(UINT32));
+    block.size = ext2->block_size;
+
+    /* Write the block */
+    if (EXT2_IFERR(err = EXT2WriteBlock(ext2, *blkno, &block)))
+    {
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+static EXT2Err _WriteIndirectBlockNumbers(
+    EXT2* ext2,
+    UINT32 indirection, /* level of indirection: 2=double, 3=triple */
+    const UINT32* blknos,
+    UINT32 nblknos,
+    UINT32* blkno)
+{
+    EXT2_DECLARE_ERR(err);
+    EXT2Block block;
+    UINT32 blknos_per_block = ext2->block_size / sizeof(UINT32);
+
+    /* Check parameters */
+    if (!EXT2Valid(ext2) || !blknos || !nblknos || !blkno)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Check indirection level */
+    if (indirection != 2 && indirection != 3)
+    {
+        err = EXT2_ERR_UNEXPECTED;
+        GOTO(done);
+    }
+
+    /* If double indirection */
+    if (indirection == 2)
+    {
+        /* If too many indirect blocks */
+        if (nblknos > blknos_per_block * blknos_per_block)
+        {
+            err = EXT2_ERR_BUFFER_OVERFLOW;
+            GOTO(done);
+        }
+    }
+
+    /* Assign an available block */
+    if (EXT2_IFERR(err = _GetBlock(ext2, blkno)))
+    {
+        GOTO(done);
+    }
+
+    /* Allocate indirect block (to hold block numbers) */
+    Memset(&block, 0, sizeof(EXT2Block));
+    block.size = ext2->block_size;
+
+    /* Write each of the indirect blocks */
+    {
+        const UINT32* p = blknos;
+        UINT32 r = nblknos;
+        UINT32 i;
+
+        /* For each block */
+        for (i = 0; r > 0; i++)
+        {
+            UINT32 n;
+
+            /* If double indirection */
+            if (indirection == 2)
+            {
+                n = _Min(r, blknos_per_block);
+
+                if (EXT2_IFERR(err = _WriteSingleDirectBlockNumbers(
+                    ext2,
+                    p,
+                    n,
+                    (UINT32*)block.data + i)))
+                {
+                    GOTO(done);
+                }
+            }
+            else
+            {
+                n = _Min(r, blknos_per_block * blknos_per_block);
+
+                /* Write the block numbers for this block */
+                if (EXT2_IFERR(err = _WriteIndirectBlockNumbers(
+                    ext2,
+                    2, /* double indirection */
+                    p,
+                    n,
+                    (UINT32*)block.data + i)))
+                {
+                    GOTO(done);
+                }
+            }
+
+            p += n;
+            r -= n;
+        }
+
+        /* Check that the blocks were exhausted */
+        if (r != 0)
+        {
+            err = EXT2_ERR_EXTRANEOUS_DATA;
+            GOTO(done);
+        }
+    }
+
+    /* Write the indirect block */
+    if (EXT2_IFERR(err = EXT2WriteBlock(ext2, *blkno, &block)))
+    {
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+static EXT2Err _WriteData(
+    EXT2* ext2,
+    const void* data,
+    UINT32 size,
+    BufU32* blknos)
+{
+    EXT2_DECLARE_ERR(err);
+    UINT32 blksize = ext2->block_size;
+    UINT32 nblks = (size + blksize - 1) / blksize;
+    UINT32 rem = size % blksize;
+    UINT32 i = 0;
+    UINT32 grpno;
+
+    for (grpno = 0; grpno < ext2->group_count && i < nblks; grpno++)
+    {
+        EXT2Block bitmap;
+        EXT2Block block;
+        UINT32 blkno;
+        UINT32 lblkno;
+        int changed = 0;
+    
+        /* Read the bitmap */
+        if (EXT2_IFERR(err = EXT2ReadBlockBitmap(ext2, grpno, &bitmap)))
+        {
+            GOTO(done);
+        }
+
+        /* Scan the bitmap, looking for free bit */
+        for (lblkno = 0; lblkno < bitmap.size * 8 && i < nblks; lblkno++)
+        {
+            if (!_TestBit(bitmap.data, bitmap.size, lblkno))
+            {
+                _SetBit(bitmap.data, bitmap.size, lblkno);
+                blkno = MakeBlkno(ext2, grpno, lblkno);
+
+                /* Append this to the array of blocks */
+                if (EXT2_IFERR(err = BufU32Append(blknos, &blkno, 1)))
+                    GOTO(done);
+
+                /* If this is the final block */
+                if (i + 1 == nblks && rem)
+                {
+                    Memcpy(block.data, (char*)data + (i * blksize), rem);
+                    block.size = rem;
+                }
+                else
+                {
+                    Memcpy(block.data, (char*)data + (i * blksize), blksize);
+                    block.size = blksize;
+                }
+
+                /* Write the block */
+                if (EXT2_IFERR(err = EXT2WriteBlock(ext2, blkno, &block)))
+                {
+                    GOTO(done);
+                }
+
+                /* Update the in memory structs. */
+                ext2->sb.s_free_blocks_count--;
+                ext2->groups[grpno].bg_free_blocks_count--;
+                i++;
+                changed = 1;
+            }
+        }
+
+        if (changed == 1)
+        {
+            /* Write group and bitmap. */
+            if (EXT2_IFERR(err = _WriteGroup(ext2, grpno)))
+            {
+                GOTO(done);
+            }
+
+            if (EXT2_IFERR(err = EXT2WriteBlockBitmap(ext2, grpno, &bitmap)))
+            {
+                GOTO(done);
+            }
+        }
+    }
+
+    /* Ran out of disk space. */
+    if (i != nblks)
+    {
+        GOTO(done);
+    }
+
+    /* Write super block data. */
+    if (EXT2_IFERR(err = _WriteSuperBlock(ext2)))
+    {
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+/* Append an indirect block (and the indirect blocks below it) */
+static EXT2Err _AppendIndirectBlocks(
+    EXT2* ext2,
+    UINT32 indirection, /* level of indirection: 1=single, 2=double, 3=triple */
+    UINT32 blkno,
+    BufU32* buf)
+{
+    EXT2_DECLARE_ERR(err);
+
+    if (BufU32Append(buf, &blkno, 1) != 0)
+    {
+        err = EXT2_ERR_OUT_OF_MEMORY;
+        GOTO(done);
+    }
+
+    if (indirection > 1)
+    {
+        EXT2Block block;
+        const UINT32* p;
+        UINT32 i;
+
+        if (EXT2_IFERR(err = EXT2ReadBlock(ext2, blkno, &block)))
+        {
+            GOTO(done);
+        }
+
+        p = (const UINT32*)block.data;
+
+        for (i = 0; i < block.size / sizeof(UINT32); i++)
+        {
+            if (p[i] && EXT2_IFERR(err = _AppendIndirectBlocks(
+                ext2, 
+                indirection - 1, 
+                p[i], 
+                buf)))
+            {
+                GOTO(done);
+            }
+        }
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+static EXT2Err _UpdateInodeBlockPointers(
+    EXT2* ext2,
+    EXT2Ino ino,
+    EXT2Inode* inode,
+    UINT32 size,
+    const UINT32* blknos,
+    UINT32 nblknos)
+{
+    EXT2_DECLARE_ERR(err);
+    UINT32 i;
+    const UINT32* p = blknos;
+    UINT32 r = nblknos;
+    UINT32 blknos_per_block = ext2->block_size / sizeof(UINT32);
+    BufU32 indirect = BUF_U32_INITIALIZER;
+
+    /* Return the old indirect blocks (new ones are written below) */
+    for (i = 0; i < 3; i++)
+    {
+        UINT32 blkno = inode->i_block[EXT2_SINGLE_INDIRECT_BLOCK + i];
+
+        if (blkno && EXT2_IFERR(err = _AppendIndirectBlocks(
+            ext2, 
+            i + 1, 
+            blkno, 
+            &indirect)))
+        {
+            GOTO(done);
+        }
+    }
+
+    if (indirect.size)
+    {
+        if (EXT2_IFERR(err = _PutBlocks(ext2, indirect.data, indirect.size)))
+        {
+            GOTO(done);
+        }
+    }
+
+    /* Clear the old block pointers (the directory may have shrunk) */
+    Memset(inode->i_block, 0, sizeof(inode->i_block));
+
+    /* Update the inode size */
+    inode->i_size = size;
+
+    /* Update the direct inode blocks */
+    if (r)
+    {
+        UINT32 n = _Min(r, EXT2_SINGLE_INDIRECT_BLOCK);
+
+        for (i = 0; i < n; i++)
+        {
+            inode->i_block[i] = p[i];
+        }
+
+        p += n;
+        r -= n;
+    }
+
+    /* Write the indirect block numbers */
+    if (r)
+    {
+        UINT32 n = _Min(r, blknos_per_block);
+
+        if (EXT2_IFERR(err = _WriteSingleDirectBlockNumbers(
+            ext2,
+            p,
+            n,
+            &inode->i_block[EXT2_SINGLE_INDIRECT_BLOCK])))
+        {
+            GOTO(done);
+        }
+
+        p += n;
+        r -= n;
+    }
+
+    /* Write the double indirect block numbers */
+    if (r)
+    {
+        UINT32 n = _Min(r, blknos_per_block * blknos_per_block);
+
+        if (EXT2_IFERR(err = _WriteIndirectBlockNumbers(
+            ext2,
+            2, /* double indirection */
+            p,
+            n,
+            &inode->i_block[EXT2_DOUBLE_INDIRECT_BLOCK])))
+        {
+            GOTO(done);
+        }
+
+        p += n;
+        r -= n;
+    }
+
+    /* Write the triple indirect block numbers */
+    if (r)
+    {
+        UINT32 n = r;
+
+        if (EXT2_IFERR(err = _WriteIndirectBlockNumbers(
+            ext2,
+            3, /* triple indirection */
+            p,
+            n,
+            &inode->i_block[EXT2_TRIPLE_INDIRECT_BLOCK])))
+        {
+            GOTO(done);
+        }
+
+        p += n;
+        r -= n;
+    }
+
+    /* Note: triple indirect block numbers not handled! */
+    if (r > 0)
+    {
+        GOTO(done);
+    }
+
+    /* Rewrite the inode */
+    if (EXT2_IFERR(err = _WriteInode(ext2, ino, inode)))
+    {
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+
+    BufU32Release(&indirect);
+
+    return err;
+}
+
+static EXT2Err _UpdateInodeDataBlocks(
+    EXT2* ext2,
+    EXT2Ino ino,
+    EXT2Inode* inode,
+    const void* data,
+    UINT32 size,
+    BOOLEAN is_dir)
+{
+    EXT2_DECLARE_ERR(err);
+    BufU32 blknos = BUF_U32_INITIALIZER;
+    UINT32 count = 0;
+    void* tmp_data = NULL;
+
+    if (EXT2_IFERR(err = _WriteData(ext2, data, size, &blknos)))
+        GOTO(done);
+
+    if (is_dir)
+    {
+        if (EXT2_IFERR(err = _CountDirectoryEntries(
+            ext2, data, size, &count)))
+        {
+            GOTO(done);
+        }
+    }
+
+    inode->i_osd1 = count + 1;
+
+    if (EXT2_IFERR(err = _UpdateInodeBlockPointers(
+        ext2,
+        ino,
+        inode,
+        size,
+        blknos.data,
+        blknos.size)))
+    {
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+
+    BufU32Release(&blknos);
+
+    if (tmp_data)
+        Free(tmp_data);
+
+    return err;
+}
+
+EXT2Err EXT2Update(
+    EXT2* ext2,
+    const void* data,
+    UINT32 size,
+    const char* path)
+{
+    EXT2_DECLARE_ERR(err);
+    EXT2Ino ino;
+    EXT2Inode inode;
+#if !defined(BUILD_EFI)
+    (void)_DumpDirectoryEntry;
+#endif /* !defined(BUILD_EFI) */
+
+    /* Check parameters */
+    if (!EXT2Valid(ext2) || !data || !path)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Truncate the destination file */
+    if (EXT2_IFERR(err = EXT2Trunc(ext2, path)))
+    {
+        GOTO(done);
+    }
+
+    /* Read inode for this file */
+    if (EXT2_IFERR(err = EXT2PathToInode(ext2, path, &ino, &inode)))
+    {
+        GOTO(done);
+    }
+
+    /* Update the inode blocks */
+    if (EXT2_IFERR(err = _UpdateInodeDataBlocks(
+        ext2,
+        ino,
+        &inode,
+        data,
+        size,
+        0))) /* !is_dir */
+    {
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+
+    return err;
+}
+
+static EXT2Err _CheckDirectoryEntries(
+    const EXT2* ext2,
+    const void* data,
+    UINT32 size)
+{
+    EXT2_DECLARE_ERR(err);
+    const UINT8* p = (UINT8*)data;
+    const UINT8* end = (UINT8*)data + size;
+
+    /* Must be divisiable by block size */
+    if ((end - p) % ext2->block_size)
+    {
+        GOTO(done);
+    }
+
+    while (p < end)
+    {
+        UINT32 n;
+        const EXT2DirEntry* ent = (const EXT2DirEntry*)p;
+        
+        n = sizeof(EXT2DirEntry) - EXT2_PATH_MAX + ent->name_len;
+        n = _NextMult(n, 4);
+
+        if (n != ent->rec_len)
+        {
+            UINT32 offset = ((char*)p - (char*)data) % ext2->block_size;
+            UINT32 rem = ext2->block_size - offset;
+
+            if (rem != ent->rec_len)
+            {
+                GOTO(done);
+            }
+        }
+
+        p += ent->rec_len;
+    }
+
+    if (p != end)
+    {
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+#if !defined(BUILD_EFI)
+static void _DumpDirectoryEntries(
+    const EXT2* ext2,
+    const void* data,
+    UINT32 size)
+{
+    const UINT8* p = (UINT8*)data;
+    const UINT8* end = (UINT8*)data + size;
+
+    while (p < end)
+    {
+        UINT32 n;
+        const EXT2DirEntry* ent = (const EXT2DirEntry*)p;
+
+        _DumpDirectoryEntry(ent);
+        
+        n = sizeof(EXT2DirEntry) - EXT2_PATH_MAX + ent->name_len;
+        n = _NextMult(n, 4);
+
+        if (n != ent->rec_len)
+        {
+            UINT32 gap = ent->rec_len - n;
+            UINT32 offset = ((char*)p - (char*)data) % ext2->block_size;
+            UINT32 rem = ext2->block_size - offset;
+
+            printf("gap: %u\n", gap);
+            printf("offset: %u\n", offset);
+            printf("remaing: %u\n", rem);
+        }
+
+        p += ent->rec_len;
+    }
+}
+#endif /* !defined(BUILD_EFI) */
+
+static const EXT2DirEntry* _FindDirectoryEntry(
+    const char* name,
+    const void* data,
+    UINT32 size)
+{
+    const UINT8* p = (UINT8*)data;
+    const UINT8* end = (UINT8*)data + size;
+
+    while (p < end)
+    {
+        const EXT2DirEntry* ent = (const EXT2DirEntry*)p;
+        char tmp[EXT2_PATH_MAX];
+
+
+        /* Create zero-terminated name */
+        tmp[0] = '\0';
+        Strncat(tmp, sizeof(tmp), ent->name, 
+            _Min(ent->name_len, EXT2_PATH_MAX-1));
+
+        if (Strcmp(tmp, name) == 0)
+            return ent;
+
+        p += ent->rec_len;
+    }
+
+    /* Not found */
+    return NULL;
+}
+
+static EXT2Err _CountDirectoryEntriesIno(
+    EXT2* ext2,
+    EXT2Ino ino,
+    UINT32* count)
+{
+    EXT2_DECLARE_ERR(err);
+    EXT2_DIR* dir = NULL;
+    EXT2DirEnt* ent;
+
+    /* Check parameters */
+    if (!EXT2Valid(ext2) || !ino || !count)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Initialize count */
+    *count = 0;
+
+    /* Open directory */
+    if (!(dir = EXT2OpenDirIno(ext2, ino)))
+    {
+        GOTO(done);
+    }
+
+    /* Count the entries (notes that "." and ".." will always be present). */
+    while ((ent = EXT2ReadDir(dir)))
+    {
+        (*count)++;
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+
+    if (dir)
+        EXT2CloseDir(dir);
+
+    return err;
+}
+
+EXT2Err EXT2Rm(
+    EXT2* ext2,
+    const char* path)
+{
+    EXT2_DECLARE_ERR(err);
+    char dirname[EXT2_PATH_MAX];
+    char filename[EXT2_PATH_MAX];
+    void* blocks = NULL;
+    UINT32 blocks_size = 0;
+    void* new_blocks = NULL;
+    UINT32 new_blocks_size = 0;
+    BufU32 blknos = BUF_U32_INITIALIZER;
+    EXT2Ino ino;
+    EXT2Inode inode;
+    const EXT2DirEntry* ent = NULL;
+#if !defined(BUILD_EFI)
+    (void)_DumpDirectoryEntries;
+#endif /* !defined(BUILD_EFI) */
+
+    /* Check parameters */
+    if (!EXT2Valid(ext2) && !path)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Truncate the file first */
+    if (EXT2_IFERR(err = EXT2Trunc(ext2, path)))
+    {
+        GOTO(done);
+    }
+
+    /* Split the path */
+    if (EXT2_IFERR(err = _SplitFullPath(path, dirname, filename)))
+    {
+        GOTO(done);
+    }
+
+    /* Load the directory inode */
+    if (EXT2_IFERR(err = EXT2PathToInode(ext2, dirname, &ino, &inode)))
+    {
+        GOTO(done);
+    }
+
+    /* Hashed directories: unlink the entry from its leaf in place */
+    {
+        BOOLEAN removed;
+
+        if (EXT2_IFERR(err = _DxRemoveEntry(ext2, &inode, filename, &removed)))
+        {
+            GOTO(done);
+        }
+
+        if (removed)
+        {
+            err = EXT2_ERR_NONE;
+            goto done;
+        }
+    }
+
+    /* Load the directory file */
+    if (EXT2_IFERR(err = EXT2LoadFileFromInode(
+        ext2, 
+        &inode, 
+        &blocks, 
+        &blocks_size)))
+    {
+        GOTO(done);
+    }
+
+    /* Load the data block numbers (the indirect blocks are returned when
+     * the inode block pointers are rewritten) */
+    if (EXT2_IFERR(err = _LoadBlockNumbersFromInode(
+        ext2,
+        &inode,
+        0, /* include_block_blocks */
+        &blknos)))
+    {
+        GOTO(done);
+    }
+
+    /* Find 'filename' within this directory */
+    if (!(ent = _FindDirectoryEntry(filename, blocks, blocks_size)))
+    {
+        GOTO(done);
+    }
+
+    /* Allow removal of empty directories only */
+    if (ent->file_type == EXT2_FT_DIR)
+    {
+        EXT2Ino dir_ino;
+        EXT2Inode dir_inode;
+        UINT32 count;
+
+        /* Find the inode of the filename */
+        if (EXT2_IFERR(err = EXT2PathToInode(
+            ext2, filename, &dir_ino, &dir_inode)))
+        {
+            GOTO(done);
+        }
+
+        /* Disallow removal if directory is non empty */
+        if (EXT2_IFERR(err = _CountDirectoryEntriesIno(ext2, dir_ino, &count)))
+        {
+            GOTO(done);
+        }
+
+        /* Expect just "." and ".." entries */
+        if (count != 2)
+        {
+            GOTO(done);
+        }
+    }
+
+    /* Convert from 'indexed' to 'linked list' directory format */
+    {
+        new_blocks_size = blocks_size;
+        const char* src = (const char*)blocks;
+        const char* src_end = (const char*)blocks + inode.i_size;
+        char* dest = NULL;
+
+        /* Allocate a buffer to hold 'linked list' directory */
+        if (!(new_blocks = Calloc(new_blocks_size, 1)))
+        {
+            GOTO(done);
+        }
+
+        /* Set current and end pointers to new buffer */
+        dest = (char*)new_blocks;
+
+        /* Copy over directory entries (skipping removed entry) */
+        {
+            EXT2DirEntry* prev = NULL;
+
+            while (src < src_end)
+            {
+                const EXT2DirEntry* curr_ent = 
+                    (const EXT2DirEntry*)src;
+                UINT32 rec_len;
+                UINT32 offset;
+
+                /* Skip the removed directory entry */
+                if (curr_ent == ent || !ent->name)
+                {
+                    src += curr_ent->rec_len;
+                    continue;
+                }
+
+                /* Compute size of the new directory entry */
+                rec_len = sizeof(*curr_ent) - EXT2_PATH_MAX + curr_ent->name_len;
+                rec_len = _NextMult(rec_len, 4);
+
+                /* Compute byte offset into current block */
+                offset = (dest - (char*)new_blocks) % ext2->block_size;
+
+                /* If new entry would overflow the block */
+                if (offset + rec_len > ext2->block_size)
+                {
+                    UINT32 rem = ext2->block_size - offset;
+
+                    if (!prev)
+                    {
+                        GOTO(done);
+                    }
+
+                    /* Adjust previous entry to point to next block */
+                    prev->rec_len += rem;
+                    dest += rem;
+                }
+
+                /* Copy this entry into new buffer */
+                {
+                    EXT2DirEntry* new_ent = 
+                        (EXT2DirEntry*)dest;
+                    Memset(new_ent, 0, rec_len);
+                    Memcpy(new_ent, curr_ent, 
+                        sizeof(*curr_ent) - EXT2_PATH_MAX + curr_ent->name_len);
+
+                    new_ent->rec_len = rec_len;
+                    prev = new_ent;
+                    dest += rec_len;
+                }
+
+                src += curr_ent->rec_len;
+            }
+
+            /* Set final entry to point to end of the block */
+            if (prev)
+            {
+                UINT32 offset;
+                UINT32 rem;
+
+                /* Compute byte offset into current block */
+                offset = (dest - (char*)new_blocks) % ext2->block_size;
+
+                /* Compute remaining bytes */
+                rem = ext2->block_size - offset;
+
+                /* Set record length of final entry to end of block */
+                prev->rec_len += rem;
+
+                /* Advance dest to block boundary */
+                dest += rem;
+            }
+
+            /* Size down the new blocks size */
+            new_blocks_size = (UINT32)(dest - (char*)new_blocks);
+
+            if (EXT2_IFERR(err = _CheckDirectoryEntries(
+                ext2, 
+                new_blocks, 
+                new_blocks_size)))
+            {
+                GOTO(done);
+            }
+        }
+    }
+
+    /* Count directory entries before and after */
+    {
+        UINT32 count;
+        UINT32 new_count;
+
+        if (EXT2_IFERR(err = _CountDirectoryEntries(
+            ext2, 
+            blocks, 
+            blocks_size, 
+            &count)))
+        {
+            GOTO(done);
+        }
+
+        if (EXT2_IFERR(err = _CountDirectoryEntries(
+            ext2, 
+            new_blocks, 
+            new_blocks_size, 
+            &new_count)))
+        {
+            GOTO(done);
+        }
+    }
+
+    /* Return all directory blocks to the free list */
+    if (EXT2_IFERR(err = _PutBlocks(ext2, blknos.data, blknos.size)))
+    {
+        GOTO(done);
+    }
+
+    /* The rewritten directory is no longer indexed */
+    inode.i_flags &= ~EXT2_INDEX_FL;
+
+    /* Update the inode blocks */
+    if (EXT2_IFERR(err = _UpdateInodeDataBlocks(
+        ext2,
+        ino,
+        &inode,
+        new_blocks,
+        new_blocks_size,
+        1))) /* is_dir */
+    {
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+
+    /* The entry is gone (and its inode may be reused) */
+    _DropCachedDentries(ext2);
+
+    if (blocks)
+        Free(blocks);
+
+    if (new_blocks)
+        Free(new_blocks);
+
+    BufU32Release(&blknos);
+
+    return err;
+}
+
+static EXT2Err _CreateFileInode(
+    EXT2* ext2, 
+    const void* data, 
+    UINT32 size, 
+    UINT16 mode,
+    UINT32* blknos, 
+    UINT32 nblknos,
+    UINT32* ino)
+{
+    EXT2_DECLARE_ERR(err);
+    EXT2Inode inode;
+
+    /* Check parameters */
+    if (!EXT2Valid(ext2) || !data || !blknos)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Initialize the inode */
+    {
+        /* Uses posix_time() for EFI */
+        const UINT32 t = time(NULL);
+
+        Memset(&inode, 0, sizeof(EXT2Inode));
+
+        /* Set the mode of the new file */
+        inode.i_mode = mode;
+
+        /* Set the uid and gid to root */
+        inode.i_uid = 0;
+        inode.i_gid = 0;
+
+        /* Set the size of this file */
+        inode.i_size = size;
+
+        /* Set the access, creation, and mtime to the same value */
+        inode.i_atime = t;
+        inode.i_ctime = t;
+        inode.i_mtime = t;
+
+        /* Linux-specific value */
+        inode.i_osd1 = 1;
+
+        /* The number of links is initially 1 */
+        inode.i_links_count = 1;
+
+        /* Set the number of 512 byte blocks */
+        inode.i_blocks = (nblknos * ext2->block_size) / 512;
+    }
+
+    /* Assign an inode number */
+    if (EXT2_IFERR(err = _GetIno(ext2, ino)))
+    {
+        GOTO(done);
+    }
+
+    /* Update the inode block pointers and write the inode to disk */
+    if (EXT2_IFERR(err = _UpdateInodeBlockPointers(
+        ext2,
+        *ino,
+        &inode,
+        size,
+        blknos,
+        nblknos)))
+    {
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+typedef struct _EXT2DirectoryEntBuf
+{
+    EXT2DirEntry base;
+        char buf[EXT2_PATH_MAX];
+}
+EXT2DirectoryEntBuf;
+
+static EXT2Err _CreateDirInodeAndBlock(
+    EXT2* ext2, 
+    EXT2Ino parent_ino,
+    UINT16 mode,
+    EXT2Ino* ino)
+{
+    EXT2_DECLARE_ERR(err);
+    EXT2Inode inode;
+    UINT32 blkno;
+    EXT2Block block;
+
+    /* Check parameters */
+    if (!EXT2Valid(ext2) || !mode || !parent_ino || !ino)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Initialize the inode */
+    {
+        const UINT32 t = time(NULL);
+
+        Memset(&inode, 0, sizeof(EXT2Inode));
+
+        /* Set the mode of the new file */
+        inode.i_mode = mode;
+
+        /* Set the uid and gid to root */
+        inode.i_uid = 0;
+        inode.i_gid = 0;
+
+        /* Set the size of this file */
+        inode.i_size = ext2->block_size;
+
+        /* Set the access, creation, and mtime to the same value */
+        inode.i_atime = t;
+        inode.i_ctime = t;
+        inode.i_mtime = t;
+
+        /* Linux-specific value */
+        inode.i_osd1 = 1;
+
+        /* The number of links is initially 2 */
+        inode.i_links_count = 2;
+
+        /* Set the number of 512 byte blocks */
+        inode.i_blocks = ext2->block_size / 512;
+    }
+
+    /* Assign an inode number */
+    if (EXT2_IFERR(err = _GetIno(ext2, ino)))
+    {
+        GOTO(done);
+    }
+
+    /* Assign a block number */
+    if (EXT2_IFERR(err = _GetBlock(ext2, &blkno)))
+    {
+        GOTO(done);
+    }
+
+    /* Create a block to hold the two directory entries */
+    {
+        EXT2DirectoryEntBuf dot1;
+        EXT2DirectoryEntBuf dot2;
+        EXT2DirEntry* ent;
+
+        /* The "." directory */
+        Memset(&dot1, 0, sizeof(dot1));
+        dot1.base.inode = *ino;
+        dot1.base.name_len = 1;
+        dot1.base.file_type = EXT2_DT_DIR;
+        dot1.base.name[0] = '.';
+        UINT16 d1len = sizeof(EXT2DirEntry) - EXT2_PATH_MAX + dot1.base.name_len;
+        dot1.base.rec_len = _NextMult(d1len, 4);
+
+        /* The ".." directory */
+        Memset(&dot2, 0, sizeof(dot2));
+        dot2.base.inode = parent_ino;
+        dot2.base.name_len = 2;
+        dot2.base.file_type = EXT2_DT_DIR;
+        dot2.base.name[0] = '.';
+        dot2.base.name[1] = '.';
+        UINT16 d2len = sizeof(EXT2DirEntry) - EXT2_PATH_MAX + dot2.base.name_len;
+        dot2.base.rec_len = _NextMult(d2len, 4);
+
+        /* Initialize the directory entries block */
+        Memset(&block, 0, sizeof(EXT2Block));
+        Memcpy(block.data, &dot1, dot1.base.rec_len);
+        Memcpy(block.data + dot1.base.rec_len, &dot2, dot2.base.rec_len);
+        block.size = ext2->block_size;
+
+        /* Adjust dot2.rec_len to point to end of block */
+        ent = (EXT2DirEntry*)(block.data + dot1.base.rec_len);
+
+        ent->rec_len += ext2->block_size - 
+            (dot1.base.rec_len + dot2.base.rec_len);
+
+        /* Write the block */
+        if (EXT2_IFERR(err = EXT2WriteBlock(ext2, blkno, &block)))
+        {
+            GOTO(done);
+        }
+    }
+
+    /* Update the inode block pointers and write the inode to disk */
+    if (EXT2_IFERR(err = _UpdateInodeBlockPointers(
+        ext2,
+        *ino,
+        &inode,
+        ext2->block_size,
+        &blkno,
+        1)))
+    {
+        GOTO(done);
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+static EXT2Err _AppendDirectoryEntry(
+    EXT2* ext2, 
+    void* data,
+    UINT32 size, /* unused */
+    char** current,
+    EXT2DirEntry** prev,
+    const EXT2DirEntry* ent)
+{
+    EXT2_DECLARE_ERR(err);
+    UINT32 rec_len;
+    UINT32 offset;
+    (void)size;
+
+    /* Compute size of the new directory entry */
+    rec_len = sizeof(*ent) - EXT2_PATH_MAX + ent->name_len;
+    rec_len = _NextMult(rec_len, 4);
+
+    /* Compute byte offset into current block */
+    offset = ((char*)(*current) - (char*)data) % ext2->block_size;
+
+    /* If new entry would overflow the block */
+    if (offset + rec_len > ext2->block_size)
+    {
+        UINT32 rem = ext2->block_size - offset;
+
+        if (!(*prev))
+        {
+            GOTO(done);
+        }
+
+        /* Adjust previous entry to point to next block */
+        (*prev)->rec_len += rem;
+        (*current) += rem;
+    }
+
+    /* Copy this entry into new buffer */
+    {
+        EXT2DirEntry* tmp_ent;
+
+        /* Set pointer to next new entry */
+        tmp_ent = (EXT2DirEntry*)(*current);
+
+        /* Copy over new entry */
+        Memset(tmp_ent, 0, rec_len);
+        Memcpy(tmp_ent, ent, sizeof(*ent) - EXT2_PATH_MAX + ent->name_len);
+        tmp_ent->rec_len = rec_len;
+        (*prev) = tmp_ent;
+        (*current) += rec_len;
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+static EXT2Err _IndexDirectoryToLinkedListDirectory(
+    EXT2* ext2,
+    const char* rm_name, /* may be null */
+    EXT2DirEntry* new_ent, /* may be null */
+    const void* data,
+    UINT32 size,
+    void** new_data,
+    UINT32* new_size)
+{
+    EXT2_DECLARE_ERR(err);
+    const char* src = (const char*)data;
+    const char* src_end = (const char*)data + size;
+    char* dest = NULL;
+
+    /* Check parameters */
+    if (!EXT2Valid(ext2) || !data || !size || !new_data || !new_size)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Linked list directory will be smaller than this (though the new
+     * entry may need a block of its own) */
+    *new_size = size + (new_ent ? ext2->block_size : 0);
+
+    /* Allocate a buffer to hold 'linked list' directory */
+    if (!(*new_data = Calloc(*new_size, 1)))
+    {
+        GOTO(done);
+    }
+
+    /* Set current and end pointers to new buffer */
+    dest = (char*)*new_data;
+
+    /* Copy over directory entries (skipping removed entry) */
+    {
+        EXT2DirEntry* prev = NULL;
+
+        while (src < src_end)
+        {
+            const EXT2DirEntry* ent;
+
+            /* Set pointer to current entry */
+            ent = (const EXT2DirEntry*)src;
+
+            /* Skip blank directory entries */
+            if (!ent->name)
+            {
+                src += ent->rec_len;
+                continue;
+            }
+
+            /* Skip optional entry to be removed */
+            if (rm_name && Strncmp(rm_name, ent->name, ent->name_len) == 0)
+            {
+                src += ent->rec_len;
+                continue;
+            }
+
+            if (EXT2_IFERR(err = _AppendDirectoryEntry(
+                ext2,
+                *new_data,
+                *new_size,
+                &dest,
+                &prev,
+                ent)))
+            {
+                GOTO(done);
+            }
+
+            src += ent->rec_len;
+        }
+
+        if (new_ent)
+        {
+            if (EXT2_IFERR(err = _AppendDirectoryEntry(
+                ext2,
+                *new_data,
+                *new_size,
+                &dest,
+                &prev,
+                new_ent)))
+            {
+                GOTO(done);
+            }
+        }
+
+        /* Set final entry to point to end of the block */
+        if (prev)
+        {
+            UINT32 offset;
+            UINT32 rem;
+
+            /* Compute byte offset into current block */
+            offset = (dest - (char*)*new_data) % ext2->block_size;
+
+            /* Compute remaining bytes */
+            rem = ext2->block_size - offset;
+
+            /* Set record length of final entry to end of block */
+            prev->rec_len += rem;
+
+            /* Advance dest to block boundary */
+            dest += rem;
+        }
+
+        /* Size down the new blocks size */
+        *new_size = (UINT32)(dest - (char*)*new_data);
+
+        /* Perform a sanity check on the new entries */
+        if (EXT2_IFERR(err = _CheckDirectoryEntries(
+            ext2, *new_data, *new_size)))
+        {
+            GOTO(done);
+        }
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
+static EXT2Err _AddDirectoryEntry(
+    EXT2* ext2,
+    EXT2Ino dir_ino,
+    EXT2Inode* dir_inode,
+    const char* filename,
+    EXT2DirEntry* new_ent)
+{
+    EXT2_DECLARE_ERR(err);
+    void* blocks = NULL;
+    UINT32 blocks_size = 0;
+    void* new_blocks = NULL;
+    UINT32 new_blocks_size = 0;
+    BufU32 blknos = BUF_U32_INITIALIZER;
+    BOOLEAN added;
+
+    /* Hashed directories: add to the leaf that covers the name in place */
+    if (EXT2_IFERR(err = _DxAddEntry(
+        ext2, 
+        dir_ino, 
+        dir_inode, 
+        new_ent, 
+        &added)))
+    {
+        GOTO(done);
+    }
+
+    if (added)
+    {
+        err = EXT2_ERR_NONE;
+        goto done;
+    }
+
+    /* Load the directory file */
+    if (EXT2_IFERR(err = EXT2LoadFileFromInode(
+        ext2, 
+        dir_inode, 
+        &blocks, 
+        &blocks_size)))
+    {
+        GOTO(done);
+    }
+
+    /* Load the data block numbers (the indirect blocks are returned when
+     * the inode block pointers are rewritten) */
+    if (EXT2_IFERR(err = _LoadBlockNumbersFromInode(
+        ext2,
+        dir_inode,
+        0, /* include_block_blocks */
+        &blknos)))
+    {
+        GOTO(done);
+    }
+
+    /* Find 'filename' within this directory */
+    if ((_FindDirectoryEntry(filename, blocks, blocks_size)))
+    {
+        err = EXT2_ERR_FILE_NOT_FOUND;
+        GOTO(done);
+    }
+
+    /* Convert from 'indexed' to 'linked list' directory format */
+    if (EXT2_IFERR(err = _IndexDirectoryToLinkedListDirectory(
+        ext2,
+        NULL, /* rm_name */
+        new_ent, /* new_entry */
+        blocks,
+        dir_inode->i_size,
+        &new_blocks,
+        &new_blocks_size)))
+    {
+        GOTO(done);
+    }
+
+    /* Count directory entries before and after */
+    {
+        UINT32 count;
+        UINT32 new_count;
+
+        if (EXT2_IFERR(err = _CountDirectoryEntries(
+            ext2, 
+            blocks, 
+            blocks_size, 
+            &count)))
+        {
+            GOTO(done);
+        }
+
+        if (EXT2_IFERR(err = _CountDirectoryEntries(
+            ext2, 
+            new_blocks, 
+            new_blocks_size, 
+            &new_count)))
+        {
+            GOTO(done);
+        }
+
+        if (count + 1 != new_count)
+        {
+            GOTO(done);
+        }
+    }
+
+    /* Return all directory blocks to the free list */
+    if (EXT2_IFERR(err = _PutBlocks(ext2, blknos.data, blknos.size)))
+    {
+        GOTO(done);
+    }
+
+    /* The rewritten directory is no longer indexed */
+    dir_inode->i_flags &= ~EXT2_INDEX_FL;
+
+    /* Update the directory inode blocks */
+    if (EXT2_IFERR(err = _UpdateInodeDataBlocks(
+        ext2,
+        dir_ino,
+        dir_inode,
+        new_blocks,
+        new_blocks_size,
+        1))) /* is_dir */
+    {
+        GOTO(done);
+    }
+
     err = EXT2_ERR_NONE;
 
 done:
 
-    if (dir)
-        EXT2CloseDir(dir);
+    if (blocks)
+        Free(blocks);
+
+    if (new_blocks)
+        Free(new_blocks);
+
+    BufU32Release(&blknos);
 
     return err;
 }
 
-EXT2Err EXT2Rm(
+EXT2Err EXT2Put(
     EXT2* ext2,
-    const char* path)
+    const void* data,
+    UINT32 size,
+    const char* path,
+    UINT16 mode)
 {
     EXT2_DECLARE_ERR(err);
     char dirname[EXT2_PATH_MAX];
     char filename[EXT2_PATH_MAX];
-    void* blocks = NULL;
-    UINT32 blocks_size = 0;
-    void* new_blocks = NULL;
-    UINT32 new_blocks_size = 0;
+    EXT2Ino file_ino;
+    EXT2Inode file_inode;
+    EXT2Ino dir_ino;
+    EXT2Inode dir_inode;
     BufU32 blknos = BUF_U32_INITIALIZER;
-    EXT2Ino ino;
-    EXT2Inode inode;
-    const EXT2DirEntry* ent = NULL;
-#if !defined(BUILD_EFI)
-    (void)_DumpDirectoryEntries;
-#endif /* !defined(BUILD_EFI) */
+    EXT2DirectoryEntBuf ent_buf;
+    EXT2DirEntry* ent = &ent_buf.base;
 
     /* Check parameters */
-    if (!EXT2Valid(ext2) && !path)
+    if (!EXT2Valid(ext2) || !data || !size || !path)
     {
         err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* Truncate the file first */
-    if (EXT2_IFERR(err = EXT2Trunc(ext2, path)))
-    {
-        GOTO(done);
-    }
-
-    /* Split the path */
-    if (EXT2_IFERR(err = _SplitFullPath(path, dirname, filename)))
-    {
-        GOTO(done);
-    }
-
-    /* Load the directory inode */
-    if (EXT2_IFERR(err = EXT2PathToInode(ext2, dirname, &ino, &inode)))
+    /* Only plain EXT2 file systems can be changed */
+    if (EXT2_IFERR(err = _CheckWritable(ext2)))
     {
         GOTO(done);
     }
 
-    /* Load the directory file */
-    if (EXT2_IFERR(err = EXT2LoadFileFromInode(
-        ext2, 
-        &inode, 
-        &blocks, 
-        &blocks_size)))
+    /* Reject attempts to copy directories */
+    if (mode & EXT2_S_IFDIR)
     {
         GOTO(done);
     }
 
-    /* Load the block numbers (including the block blocks) */
-    if (EXT2_IFERR(err = _LoadBlockNumbersFromInode(
-        ext2,
-        &inode,
-        1, /* include_block_blocks */
-        &blknos)))
+    /* Split the path */
+    if (EXT2_IFERR(err = _SplitFullPath(path, dirname, filename)))
     {
         GOTO(done);
     }
 
-    /* Find 'filename' within this directory */
-    if (!(ent = _FindDirectoryEntry(filename, blocks, blocks_size)))
+    /* Read inode for the directory */
+    if (EXT2_IFERR(err = EXT2PathToInode(ext2, dirname, &dir_ino, &dir_inode)))
     {
         GOTO(done);
     }
 
-    /* Allow removal of empty directories only */
-    if (ent->file_type == EXT2_FT_DIR)
+    /* Read inode for the file (if any) */
+    if (!EXT2_IFERR(err = EXT2PathToInode(ext2, path, &file_ino, &file_inode)))
     {
-        EXT2Ino dir_ino;
-        EXT2Inode dir_inode;
-        UINT32 count;
-
-        /* Find the inode of the filename */
-        if (EXT2_IFERR(err = EXT2PathToInode(
-            ext2, filename, &dir_ino, &dir_inode)))
-        {
-            GOTO(done);
-        }
-
-        /* Disallow removal if directory is non empty */
-        if (EXT2_IFERR(err = _CountDirectoryEntriesIno(ext2, dir_ino, &count)))
+        /* Disallow overwriting of directory */
+        if (!(file_inode.i_mode & EXT2_S_IFDIR))
         {
             GOTO(done);
         }
 
-        /* Expect just "." and ".." entries */
-        if (count != 2)
+        /* Delete the file if it exists */
+        if (EXT2_IFERR(err = EXT2Rm(ext2, path)))
         {
             GOTO(done);
         }
     }
 
-    /* Convert from 'indexed' to 'linked list' directory format */
-    {
-        new_blocks_size = blocks_size;
-        const char* src = (const char*)blocks;
-        const char* src_end = (const char*)blocks + inode.i_size;
-        char* dest = NULL;
-
-        /* Allocate a buffer to hold 'linked list' directory */
-        if (!(new_blocks = Calloc(new_blocks_size, 1)))
-        {
-            GOTO(done);
-        }
-
-        /* Set current and end pointers to new buffer */
-        dest = (char*)new_blocks;
-
-        /* Copy over directory entries (skipping removed entry) */
-        {
-            EXT2DirEntry* prev = NULL;
-
-            while (src < src_end)
-            {
-                const EXT2DirEntry* curr_ent = 
-                    (const EXT2DirEntry*)src;
-                UINT32 rec_len;
-                UINT32 offset;
-
-                /* Skip the removed directory entry */
-                if (curr_ent == ent || !ent->name)
-                {
-                    src += curr_ent->rec_len;
-                    continue;
-                }
-
-                /* Compute size of the new directory entry */
-                rec_len = sizeof(*curr_ent) - EXT2_PATH_MAX + curr_ent->name_len;
-                rec_len = _NextMult(rec_len, 4);
-
-                /* Compute byte offset into current block */
-                offset = (dest - (char*)new_blocks) % ext2->block_size;
-
-                /* If new entry would overflow the block */
-                if (offset + rec_len > ext2->block_size)
-                {
-                    UINT32 rem = ext2->block_size - offset;
-
-                    if (!prev)
-                    {
-                        GOTO(done);
-                    }
-
-                    /* Adjust previous entry to point to next block */
-                    prev->rec_len += rem;
-                    dest += rem;
-                }
-
-                /* Copy this entry into new buffer */
-                {
-                    EXT2DirEntry* new_ent = 
-                        (EXT2DirEntry*)dest;
-                    Memset(new_ent, 0, rec_len);
-                    Memcpy(new_ent, curr_ent, 
-                        sizeof(*curr_ent) + curr_ent->name_len);
-
-                    new_ent->rec_len = rec_len;
-                    prev = new_ent;
-                    dest += rec_len;
-                }
-
-                src += curr_ent->rec_len;
-            }
-
-            /* Set final entry to point to end of the block */
-            if (prev)
-            {
-                UINT32 offset;
-                UINT32 rem;
-
-                /* Compute byte offset into current block */
-                offset = (dest - (char*)new_blocks) % ext2->block_size;
-
-                /* Compute remaining bytes */
-                rem = ext2->block_size - offset;
-
-                /* Set record length of final entry to end of block */
-                prev->rec_len += rem;
-
-                /* Advance dest to block boundary */
-                dest += rem;
-            }
-
-            /* Size down the new blocks size */
-            new_blocks_size = (UINT32)(dest - (char*)new_blocks);
+    /* Write the blocks of the file */
+    if (EXT2_IFERR(err = _WriteData(ext2, data, size, &blknos)))
+        GOTO(done);
 
-            if (EXT2_IFERR(err = _CheckDirectoryEntries(
-                ext2, 
-                new_blocks, 
-                new_blocks_size)))
-            {
-                GOTO(done);
-            }
-        }
+    /* Create an inode for this new file */
+    if (EXT2_IFERR(err = _CreateFileInode(
+        ext2, 
+        data, 
+        size, 
+        mode, 
+        blknos.data, 
+        blknos.size,
+        &file_ino)))
+    {
+        GOTO(done);
     }
 
-    /* Count directory entries before and after */
+    /* Initialize the new directory entry */
     {
-        UINT32 count;
-        UINT32 new_count;
+        /* ent->inode */
+        ent->inode = file_ino;
 
-        if (EXT2_IFERR(err = _CountDirectoryEntries(
-            ext2, 
-            blocks, 
-            blocks_size, 
-            &count)))
-        {
-            GOTO(done);
-        }
+        /* ent->name_len */
+        ent->name_len = (UINT32)Strlen(filename);
 
-        if (EXT2_IFERR(err = _CountDirectoryEntries(
-            ext2, 
-            new_blocks, 
-            new_blocks_size, 
-            &new_count)))
-        {
-            GOTO(done);
-        }
-    }
+        /* ent->file_type */
+        ent->file_type = EXT2_FT_REG_FILE;
 
-    /* Return all directory blocks to the free list */
-    if (EXT2_IFERR(err = _PutBlocks(ext2, blknos.data, blknos.size)))
-    {
-        GOTO(done);
+        /* ent->name[] */
+        ent->name[0] = '\0';
+        Strncat(ent->name, sizeof(ent->name), filename, EXT2_PATH_MAX-1);
+
+        /* ent->rec_len */
+        ent->rec_len = 
+            _NextMult(sizeof(*ent)- EXT2_PATH_MAX + ent->name_len, 4);
     }
 
-    /* Update the inode blocks */
-    if (EXT2_IFERR(err = _UpdateInodeDataBlocks(
-        ext2,
-        ino,
-        &inode,
-        new_blocks,
-        new_blocks_size,
-        1))) /* is_dir */
+    /* Create new entry for this file in the directory inode */
+    if (EXT2_IFERR(err = _AddDirectoryEntry(
+        ext2, 
+        dir_ino, 
+        &dir_inode, 
+        filename, 
+        ent)))
     {
         GOTO(done);
     }
@@ -4048,720 +6751,570 @@ EXT2Err EXT2Rm(
 
 done:
 
-    if (blocks)
-        Free(blocks);
-
-    if (new_blocks)
-        Free(new_blocks);
+    _DropCachedDentries(ext2);
 
     BufU32Release(&blknos);
 
     return err;
 }
 
-static EXT2Err _CreateFileInode(
-    EXT2* ext2, 
-    const void* data, 
-    UINT32 size, 
-    UINT16 mode,
-    UINT32* blknos, 
-    UINT32 nblknos,
-    UINT32* ino)
+EXT2Err EXT2MkDir(
+    EXT2* ext2,
+    const char* path,
+    UINT16 mode)
 {
     EXT2_DECLARE_ERR(err);
-    EXT2Inode inode;
+    char dirname[EXT2_PATH_MAX];
+    char basename[EXT2_PATH_MAX];
+    EXT2Ino dir_ino;
+    EXT2Inode dir_inode;
+    EXT2Ino base_ino;
+    EXT2Inode base_inode;
+    EXT2DirectoryEntBuf ent_buf;
+    EXT2DirEntry* ent = &ent_buf.base;
 
     /* Check parameters */
-    if (!EXT2Valid(ext2) || !data || !blknos)
+    if (!EXT2Valid(ext2) || !path || !mode)
     {
         err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* Initialize the inode */
+    /* Only plain EXT2 file systems can be changed */
+    if (EXT2_IFERR(err = _CheckWritable(ext2)))
     {
-        /* Uses posix_time() for EFI */
-        const UINT32 t = time(NULL);
-
-        Memset(&inode, 0, sizeof(EXT2Inode));
-
-        /* Set the mode of the new file */
-        inode.i_mode = mode;
-
-        /* Set the uid and gid to root */
-        inode.i_uid = 0;
-        inode.i_gid = 0;
-
-        /* Set the size of this file */
-        inode.i_size = size;
-
-        /* Set the access, creation, and mtime to the same value */
-        inode.i_atime = t;
-        inode.i_ctime = t;
-        inode.i_mtime = t;
-
-        /* Linux-specific value */
-        inode.i_osd1 = 1;
-
-        /* The number of links is initially 1 */
-        inode.i_links_count = 1;
-
-        /* Set the number of 512 byte blocks */
-        inode.i_blocks = (nblknos * ext2->block_size) / 512;
+        GOTO(done);
     }
 
-    /* Assign an inode number */
-    if (EXT2_IFERR(err = _GetIno(ext2, ino)))
+    /* Reject is not a directory */
+    if (!(mode & EXT2_S_IFDIR))
     {
+        err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* Update the inode block pointers and write the inode to disk */
-    if (EXT2_IFERR(err = _UpdateInodeBlockPointers(
-        ext2,
-        *ino,
-        &inode,
-        size,
-        blknos,
-        nblknos)))
+    /* Split the path */
+    if (EXT2_IFERR(err = _SplitFullPath(path, dirname, basename)))
     {
         GOTO(done);
     }
 
-    err = EXT2_ERR_NONE;
-
-done:
-    return err;
-}
-
-typedef struct _EXT2DirectoryEntBuf
-{
-    EXT2DirEntry base;
-        char buf[EXT2_PATH_MAX];
-}
-EXT2DirectoryEntBuf;
+    /* Read inode for 'dirname' */
+    if (EXT2_IFERR(err = EXT2PathToInode(
+        ext2, dirname, &dir_ino, &dir_inode)))
+    {
+        GOTO(done);
+    }
 
-static EXT2Err _CreateDirInodeAndBlock(
-    EXT2* ext2, 
-    EXT2Ino parent_ino,
-    UINT16 mode,
-    EXT2Ino* ino)
-{
-    EXT2_DECLARE_ERR(err);
-    EXT2Inode inode;
-    UINT32 blkno;
-    EXT2Block block;
+    /* Fail if the directory already exists */
+    if (!EXT2_IFERR(err = EXT2PathToInode(
+        ext2, path, &base_ino, &base_inode)))
+    {
+        GOTO(done);
+    }
 
-    /* Check parameters */
-    if (!EXT2Valid(ext2) || !mode || !parent_ino || !ino)
+    /* Create the directory inode and its one block */
+    if (EXT2_IFERR(err = _CreateDirInodeAndBlock(
+        ext2, 
+        dir_ino,
+        mode,
+        &base_ino)))
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* Initialize the inode */
+    /* Initialize the new directory entry */
     {
-        const UINT32 t = time(NULL);
+        /* ent->inode */
+        ent->inode = base_ino;
 
-        Memset(&inode, 0, sizeof(EXT2Inode));
+        /* ent->name_len */
+        ent->name_len = (UINT32)Strlen(basename);
 
-        /* Set the mode of the new file */
-        inode.i_mode = mode;
+        /* ent->file_type */
+        ent->file_type = EXT2_FT_DIR;
 
-        /* Set the uid and gid to root */
-        inode.i_uid = 0;
-        inode.i_gid = 0;
+        /* ent->name[] */
+        ent->name[0] = '\0';
+        Strncat(ent->name, sizeof(ent->name), basename, EXT2_PATH_MAX-1);
 
-        /* Set the size of this file */
-        inode.i_size = ext2->block_size;
+        /* ent->rec_len */
+        ent->rec_len = 
+            _NextMult(sizeof(*ent) - EXT2_PATH_MAX + ent->name_len, 4);
+    }
 
-        /* Set the access, creation, and mtime to the same value */
-        inode.i_atime = t;
-        inode.i_ctime = t;
-        inode.i_mtime = t;
+    /* Include new child directory in parent directory's i_links_count */
+    dir_inode.i_links_count++;
 
-        /* Linux-specific value */
-        inode.i_osd1 = 1;
+    /* Create new entry for this file in the directory inode */
+    if (EXT2_IFERR(err = _AddDirectoryEntry(
+        ext2, dir_ino, &dir_inode, basename, ent)))
+    {
+        GOTO(done);
+    }
 
-        /* The number of links is initially 2 */
-        inode.i_links_count = 2;
+    err = EXT2_ERR_NONE;
 
-        /* Set the number of 512 byte blocks */
-        inode.i_blocks = ext2->block_size / 512;
-    }
+done:
 
-    /* Assign an inode number */
-    if (EXT2_IFERR(err = _GetIno(ext2, ino)))
+    _DropCachedDentries(ext2);
+
+    return err;
+}
+
+EXT2Err EXT2Lsr(
+    EXT2* ext2,
+    const char* root,
+    StrArr* paths)
+{
+    EXT2_DECLARE_ERR(err);
+    EXT2_DIR* dir = NULL;
+    EXT2DirEnt* ent;
+    char path[EXT2_PATH_MAX];
+    StrArr dirs = STRARR_INITIALIZER;
+
+    /* Check parameters */
+    if (!ext2 || !root || !paths)
     {
+        err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* Assign a block number */
-    if (EXT2_IFERR(err = _GetBlock(ext2, &blkno)))
+    /* Open the directory */
+    if (!(dir = EXT2OpenDir(ext2, root)))
     {
         GOTO(done);
     }
 
-    /* Create a block to hold the two directory entries */
+    /* For each entry */
+    while ((ent = EXT2ReadDir(dir)))
     {
-        EXT2DirectoryEntBuf dot1;
-        EXT2DirectoryEntBuf dot2;
-        EXT2DirEntry* ent;
-
-        /* The "." directory */
-        Memset(&dot1, 0, sizeof(dot1));
-        dot1.base.inode = *ino;
-        dot1.base.name_len = 1;
-        dot1.base.file_type = EXT2_DT_DIR;
-        dot1.base.name[0] = '.';
-        UINT16 d1len = sizeof(EXT2DirEntry) - EXT2_PATH_MAX + dot1.base.name_len;
-        dot1.base.rec_len = _NextMult(d1len, 4);
-
-        /* The ".." directory */
-        Memset(&dot2, 0, sizeof(dot2));
-        dot2.base.inode = parent_ino;
-        dot2.base.name_len = 2;
-        dot2.base.file_type = EXT2_DT_DIR;
-        dot2.base.name[0] = '.';
-        dot2.base.name[1] = '.';
-        UINT16 d2len = sizeof(EXT2DirEntry) - EXT2_PATH_MAX + dot2.base.name_len;
-        dot2.base.rec_len = _NextMult(d2len, 4);
+        if (Strcmp(ent->d_name, ".") == 0 || Strcmp(ent->d_name, "..") == 0)
+            continue;
 
-        /* Initialize the directory entries block */
-        Memset(&block, 0, sizeof(EXT2Block));
-        Memcpy(block.data, &dot1, dot1.base.rec_len);
-        Memcpy(block.data + dot1.base.rec_len, &dot2, dot2.base.rec_len);
-        block.size = ext2->block_size;
+        Strlcpy(path, root, sizeof(path));
 
-        /* Adjust dot2.rec_len to point to end of block */
-        ent = (EXT2DirEntry*)(block.data + dot1.base.rec_len);
+        if (Strcmp(root, "/") != 0)
+            Strlcat(path, "/", sizeof(path));
 
-        ent->rec_len += ext2->block_size - 
-            (dot1.base.rec_len + dot2.base.rec_len);
+        Strlcat(path, ent->d_name, sizeof(path));
 
-        /* Write the block */
-        if (EXT2_IFERR(err = EXT2WriteBlock(ext2, blkno, &block)))
+        /* Append to paths[] array */
+        if (StrArrAppend(paths, path) != 0)
         {
+            err = EXT2_ERR_OUT_OF_MEMORY;
             GOTO(done);
         }
+        
+        /* Append to dirs[] array */
+        if (ent->d_type & EXT2_DT_DIR)
+        {
+            if (StrArrAppend(&dirs, path) != 0)
+            {
+                err = EXT2_ERR_OUT_OF_MEMORY;
+                GOTO(done);
+            }
+        }
     }
-
-    /* Update the inode block pointers and write the inode to disk */
-    if (EXT2_IFERR(err = _UpdateInodeBlockPointers(
-        ext2,
-        *ino,
-        &inode,
-        ext2->block_size,
-        &blkno,
-        1)))
+
+    /* Recurse into child directories */
     {
-        GOTO(done);
+        UINTN i;
+
+        for (i = 0; i < dirs.size; i++)
+        {
+            if (EXT2Lsr(ext2, dirs.data[i], paths) != EXT2_ERR_NONE)
+            {
+                GOTO(done);
+            }
+        }
     }
 
     err = EXT2_ERR_NONE;
 
 done:
+
+    /* Close the directory */
+    if (dir)
+        EXT2CloseDir(dir);
+
+    StrArrRelease(&dirs);
+
+    if (err != EXT2_ERR_NONE)
+    {
+        StrArrRelease(paths);
+        Memset(paths, 0, sizeof(StrArr));
+    }
+
     return err;
 }
 
-static EXT2Err _AppendDirectoryEntry(
-    EXT2* ext2, 
-    void* data,
-    UINT32 size, /* unused */
-    char** current,
-    EXT2DirEntry** prev,
-    const EXT2DirEntry* ent)
-{
-    EXT2_DECLARE_ERR(err);
-    UINT32 rec_len;
-    UINT32 offset;
-    (void)size;
-
-    /* Compute size of the new directory entry */
-    rec_len = sizeof(*ent) - EXT2_PATH_MAX + ent->name_len;
-    rec_len = _NextMult(rec_len, 4);
+/* Largest part of a run hashed from one BlkdevBorrow() (which bounds the
+ * buffer when the device has to copy) */
+#define EXT2_HASH_CHUNK (1024 * 1024)
 
-    /* Compute byte offset into current block */
-    offset = ((char*)(*current) - (char*)data) % ext2->block_size;
+static BOOLEAN _HashUpdate(
+    SHA1Context* sha1Context,
+    SHA256Context* sha256Context,
+    const void* data,
+    UINTN size)
+{
+    if (!SHA1Update(sha1Context, data, size))
+        return FALSE;
 
-    /* If new entry would overflow the block */
-    if (offset + rec_len > ext2->block_size)
-    {
-        UINT32 rem = ext2->block_size - offset;
+    if (!SHA256Update(sha256Context, data, size))
+        return FALSE;
 
-        if (!(*prev))
-        {
-            GOTO(done);
-        }
+    return TRUE;
+}
 
-        /* Adjust previous entry to point to next block */
-        (*prev)->rec_len += rem;
-        (*current) += rem;
-    }
+/* Hash bytes that read as zeros (holes and uninitialized extents) */
+static BOOLEAN _HashZeros(
+    SHA1Context* sha1Context,
+    SHA256Context* sha256Context,
+    UINT64 size)
+{
+    static const UINT8 _zeros[512];
 
-    /* Copy this entry into new buffer */
+    while (size)
     {
-        EXT2DirEntry* tmp_ent;
+        UINTN n = size < sizeof(_zeros) ? (UINTN)size : sizeof(_zeros);
 
-        /* Set pointer to next new entry */
-        tmp_ent = (EXT2DirEntry*)(*current);
+        if (!_HashUpdate(sha1Context, sha256Context, _zeros, n))
+            return FALSE;
 
-        /* Copy over new entry */
-        Memset(tmp_ent, 0, rec_len);
-        Memcpy(tmp_ent, ent, sizeof(*ent) - EXT2_PATH_MAX + ent->name_len);
-        tmp_ent->rec_len = rec_len;
-        (*prev) = tmp_ent;
-        (*current) += rec_len;
+        size -= n;
     }
 
-    err = EXT2_ERR_NONE;
-
-done:
-    return err;
+    return TRUE;
 }
 
-static EXT2Err _IndexDirectoryToLinkedListDirectory(
+/* Hash the contents of a file one run at a time, borrowing the blocks from
+ * the device (no copies where the device holds them in memory) */
+static EXT2Err _HashFile(
     EXT2* ext2,
-    const char* rm_name, /* may be null */
-    EXT2DirEntry* new_ent, /* may be null */
-    const void* data,
-    UINT32 size,
-    void** new_data,
-    UINT32* new_size)
+    const EXT2Inode* inode,
+    SHA1Context* sha1Context,
+    SHA256Context* sha256Context)
 {
     EXT2_DECLARE_ERR(err);
-    const char* src = (const char*)data;
-    const char* src_end = (const char*)data + size;
-    char* dest = NULL;
+    Buf extents = BUF_INITIALIZER;
+    const EXT2Extent* p;
+    const EXT2Extent* end;
+    const UINT64 size = inode->i_size;
+    const UINTN blksize = BlkdevBlockSize(ext2->dev);
+    UINT64 pos = 0; /* bytes hashed so far */
+    const void* data = NULL;
 
-    /* Check parameters */
-    if (!EXT2Valid(ext2) || !data || !size || !new_data || !new_size)
+    /* Form a list of runs for this file */
+    if (EXT2_IFERR(err = EXT2GetExtents(ext2, inode, &extents)))
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* Linked list directory will be smaller than this */
-    *new_size = size;
+    p = (const EXT2Extent*)extents.data;
+    end = p + extents.size / sizeof(EXT2Extent);
 
-    /* Allocate a buffer to hold 'linked list' directory */
-    if (!(*new_data = Calloc(*new_size, 1)))
+    for (; p != end; p++)
     {
-        GOTO(done);
-    }
+        UINT64 start = (UINT64)p->lblkno * ext2->block_size;
+        UINT64 n;
+        UINT64 off;
 
-    /* Set current and end pointers to new buffer */
-    dest = (char*)*new_data;
-
-    /* Copy over directory entries (skipping removed entry) */
-    {
-        EXT2DirEntry* prev = NULL;
+        if (start >= size)
+            break;
 
-        while (src < src_end)
+        /* The hole before this run */
+        if (!_HashZeros(sha1Context, sha256Context, start - pos))
         {
-            const EXT2DirEntry* ent;
+            err = EXT2_ERR_FAILED;
+            GOTO(done);
+        }
 
-            /* Set pointer to current entry */
-            ent = (const EXT2DirEntry*)src;
+        n = (UINT64)p->count * ext2->block_size;
 
-            /* Skip blank directory entries */
-            if (!ent->name)
-            {
-                src += ent->rec_len;
-                continue;
-            }
+        if (n > size - start)
+            n = size - start;
 
-            /* Skip optional entry to be removed */
-            if (rm_name && Strncmp(rm_name, ent->name, ent->name_len) == 0)
-            {
-                src += ent->rec_len;
-                continue;
-            }
+        pos = start + n;
 
-            if (EXT2_IFERR(err = _AppendDirectoryEntry(
-                ext2,
-                *new_data,
-                *new_size,
-                &dest,
-                &prev,
-                ent)))
+        if (p->flags & EXT2_EXTENT_UNINIT)
+        {
+            if (!_HashZeros(sha1Context, sha256Context, n))
             {
+                err = EXT2_ERR_FAILED;
                 GOTO(done);
             }
 
-            src += ent->rec_len;
+            continue;
         }
 
-        if (new_ent)
+        for (off = 0; off < n; off += EXT2_HASH_CHUNK)
         {
-            if (EXT2_IFERR(err = _AppendDirectoryEntry(
-                ext2,
-                *new_data,
-                *new_size,
-                &dest,
-                &prev,
-                new_ent)))
+            UINTN chunk = 
+                (n - off < EXT2_HASH_CHUNK) ? (UINTN)(n - off) : EXT2_HASH_CHUNK;
+
+            if (BlkdevBorrow(
+                ext2->dev, 
+                EXT2BlknoToLBA(ext2, p->blkno) + off / blksize,
+                (chunk + blksize - 1) / blksize,
+                &data) != 0)
             {
+                err = EXT2_ERR_READ_FAILED;
                 GOTO(done);
             }
-        }
-
-        /* Set final entry to point to end of the block */
-        if (prev)
-        {
-            UINT32 offset;
-            UINT32 rem;
-
-            /* Compute byte offset into current block */
-            offset = (dest - (char*)*new_data) % ext2->block_size;
-
-            /* Compute remaining bytes */
-            rem = ext2->block_size - offset;
 
-            /* Set record length of final entry to end of block */
-            prev->rec_len += rem;
+            if (!_HashUpdate(sha1Context, sha256Context, data, chunk))
+            {
+                err = EXT2_ERR_FAILED;
+                GOTO(done);
+            }
 
-            /* Advance dest to block boundary */
-            dest += rem;
+            BlkdevRelease(ext2->dev, data);
+            data = NULL;
         }
+    }
 
-        /* Size down the new blocks size */
-        *new_size = (UINT32)(dest - (char*)*new_data);
-
-        /* Perform a sanity check on the new entries */
-        if (EXT2_IFERR(err = _CheckDirectoryEntries(
-            ext2, *new_data, *new_size)))
-        {
-            GOTO(done);
-        }
+    /* The hole at the end (if any) */
+    if (pos < size && !_HashZeros(sha1Context, sha256Context, size - pos))
+    {
+        err = EXT2_ERR_FAILED;
+        GOTO(done);
     }
 
     err = EXT2_ERR_NONE;
 
 done:
+
+    if (data)
+        BlkdevRelease(ext2->dev, data);
+
+    BufRelease(&extents);
+
     return err;
 }
 
-static EXT2Err _AddDirectoryEntry(
+EXT2Err EXT2HashDir(
     EXT2* ext2,
-    EXT2Ino dir_ino,
-    EXT2Inode* dir_inode,
-    const char* filename,
-    EXT2DirEntry* new_ent)
+    const char* root,
+    SHA1Hash* sha1,
+    SHA256Hash* sha256)
 {
     EXT2_DECLARE_ERR(err);
-    void* blocks = NULL;
-    UINT32 blocks_size = 0;
-    void* new_blocks = NULL;
-    UINT32 new_blocks_size = 0;
-    BufU32 blknos = BUF_U32_INITIALIZER;
+    StrArr paths = STRARR_INITIALIZER;
+    SHA1Context sha1Context;
+    SHA256Context sha256Context;
 
-    /* Load the directory file */
-    if (EXT2_IFERR(err = EXT2LoadFileFromInode(
-        ext2, 
-        dir_inode, 
-        &blocks, 
-        &blocks_size)))
+    /* Check for null parameters */
+    if (!ext2 || !root || !sha1 || !sha256)
     {
+        err = EXT2_ERR_INVALID_PARAMETER;
         GOTO(done);
     }
 
-    /* Load the block numbers (including the block blocks) */
-    if (EXT2_IFERR(err = _LoadBlockNumbersFromInode(
-        ext2,
-        dir_inode,
-        1, /* include_block_blocks */
-        &blknos)))
-    {
-        GOTO(done);
-    }
+    /* Clear the hashes */
 
-    /* Find 'filename' within this directory */
-    if ((_FindDirectoryEntry(filename, blocks, blocks_size)))
-    {
-        err = EXT2_ERR_FILE_NOT_FOUND;
-        GOTO(done);
-    }
+    if (sha1)
+        SHA1Init(&sha1Context);
 
-    /* Convert from 'indexed' to 'linked list' directory format */
-    if (EXT2_IFERR(err = _IndexDirectoryToLinkedListDirectory(
-        ext2,
-        NULL, /* rm_name */
-        new_ent, /* new_entry */
-        blocks,
-        dir_inode->i_size,
-        &new_blocks,
-        &new_blocks_size)))
+    if (sha256)
+        SHA256Init(&sha256Context);
+
+    /* Form an array of paths */
+    if (EXT2_IFERR(err = EXT2Lsr(ext2, root, &paths)))
     {
         GOTO(done);
     }
 
-    /* Count directory entries before and after */
+    /* Sort the path names */
+    StrArrSort(&paths);
+
+    /* Hash the contents of all files in this directory */
     {
-        UINT32 count;
-        UINT32 new_count;
+        UINTN i;
 
-        if (EXT2_IFERR(err = _CountDirectoryEntries(
-            ext2, 
-            blocks, 
-            blocks_size, 
-            &count)))
+        for (i = 0; i < paths.size; i++)
         {
-            GOTO(done);
-        }
+            EXT2Ino ino;
+            EXT2Inode inode;
+
+            if (EXT2_IFERR(err = EXT2PathToInode(
+                ext2, 
+                paths.data[i], 
+                &ino, 
+                &inode)))
+            {
+                GOTO(done);
+            }
 
-        if (EXT2_IFERR(err = _CountDirectoryEntries(
-            ext2, 
-            new_blocks, 
-            new_blocks_size, 
-            &new_count)))
-        {
-            GOTO(done);
-        }
+            /* Skip directories */
+            if (inode.i_mode & EXT2_S_IFDIR)
+                continue;
 
-        if (count + 1 != new_count)
-        {
-            GOTO(done);
+            /* Update the SHA1 and SHA256 hashes */
+            if (EXT2_IFERR(err = _HashFile(
+                ext2, 
+                &inode, 
+                &sha1Context, 
+                &sha256Context)))
+            {
+                GOTO(done);
+            }
         }
     }
 
-    /* Return all directory blocks to the free list */
-    if (EXT2_IFERR(err = _PutBlocks(ext2, blknos.data, blknos.size)))
-    {
-        GOTO(done);
-    }
+    /* Finalize the SHA-1 hash */
+    if (sha1)
+        SHA1Final(&sha1Context, sha1);
 
-    /* Update the directory inode blocks */
-    if (EXT2_IFERR(err = _UpdateInodeDataBlocks(
-        ext2,
-        dir_ino,
-        dir_inode,
-        new_blocks,
-        new_blocks_size,
-        1))) /* is_dir */
-    {
-        GOTO(done);
-    }
+    /* Finalize the SHA-256 hash */
+    if (sha256)
+        SHA256Final(&sha256Context, sha256);
 
     err = EXT2_ERR_NONE;
 
 done:
 
-    if (blocks)
-        Free(blocks);
-
-    if (new_blocks)
-        Free(new_blocks);
-
-    BufU32Release(&blknos);
+    StrArrRelease(&paths);
 
     return err;
 }
 
-EXT2Err EXT2Put(
-    EXT2* ext2,
-    const void* data,
-    UINT32 size,
-    const char* path,
-    UINT16 mode)
-{
-    EXT2_DECLARE_ERR(err);
-    char dirname[EXT2_PATH_MAX];
-    char filename[EXT2_PATH_MAX];
-    EXT2Ino file_ino;
-    EXT2Inode file_inode;
-    EXT2Ino dir_ino;
-    EXT2Inode dir_inode;
-    BufU32 blknos = BUF_U32_INITIALIZER;
-    EXT2DirectoryEntBuf ent_buf;
-    EXT2DirEntry* ent = &ent_buf.base;
+/*
+**==============================================================================
+**
+** EXT2File
+**
+**==============================================================================
+*/
 
-    /* Check parameters */
-    if (!EXT2Valid(ext2) || !data || !size || !path)
-    {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
-    }
+/* Indirect blocks (or extent tree nodes) are cached per open file, one per
+ * depth below the inode, so sequential reads keep hitting the same ones */
+#define EXT2_FILE_MAX_DEPTH EXT4_EXT_MAX_DEPTH
 
-    /* Reject attempts to copy directories */
-    if (mode & EXT2_S_IFDIR)
-    {
-        GOTO(done);
-    }
+typedef struct _EXT2FileNode
+{
+    UINT32 blkno;
+    EXT2Block block;
+}
+EXT2FileNode;
 
-    /* Split the path */
-    if (EXT2_IFERR(err = _SplitFullPath(path, dirname, filename)))
-    {
-        GOTO(done);
-    }
+struct _EXT2File
+{
+    EXT2* ext2;
+    EXT2Inode inode;
+    EXT2FileNode* nodes[EXT2_FILE_MAX_DEPTH]; /* allocated on first use */
+    UINTN offset;
+    BOOLEAN eof;
+};
 
-    /* Read inode for the directory */
-    if (EXT2_IFERR(err = EXT2PathToInode(ext2, dirname, &dir_ino, &dir_inode)))
+/* Read the pointer block (or extent tree node) at this depth, through the
+ * cache of this file */
+static EXT2Err _ReadFileNode(
+    EXT2File* file,
+    UINT32 depth,
+    UINT32 blkno,
+    const EXT2Block** block)
+{
+    EXT2_DECLARE_ERR(err);
+    EXT2FileNode* node;
+
+    if (depth >= EXT2_FILE_MAX_DEPTH || 
+        blkno == 0 || 
+        blkno >= file->ext2->sb.s_blocks_count)
     {
+        err = EXT2_ERR_BAD_BLKNO;
         GOTO(done);
     }
 
-    /* Read inode for the file (if any) */
-    if (!EXT2_IFERR(err = EXT2PathToInode(ext2, path, &file_ino, &file_inode)))
+    if (!(node = file->nodes[depth]))
     {
-        /* Disallow overwriting of directory */
-        if (!(file_inode.i_mode & EXT2_S_IFDIR))
-        {
-            GOTO(done);
-        }
-
-        /* Delete the file if it exists */
-        if (EXT2_IFERR(err = EXT2Rm(ext2, path)))
+        if (!(node = (EXT2FileNode*)Calloc(1, sizeof(EXT2FileNode))))
         {
+            err = EXT2_ERR_OUT_OF_MEMORY;
             GOTO(done);
         }
-    }
 
-    /* Write the blocks of the file */
-    if (EXT2_IFERR(err = _WriteData(ext2, data, size, &blknos)))
-        GOTO(done);
-
-    /* Create an inode for this new file */
-    if (EXT2_IFERR(err = _CreateFileInode(
-        ext2, 
-        data, 
-        size, 
-        mode, 
-        blknos.data, 
-        blknos.size,
-        &file_ino)))
-    {
-        GOTO(done);
+        file->nodes[depth] = node;
     }
 
-    /* Initialize the new directory entry */
+    if (node->blkno != blkno)
     {
-        /* ent->inode */
-        ent->inode = file_ino;
-
-        /* ent->name_len */
-        ent->name_len = (UINT32)Strlen(filename);
-
-        /* ent->file_type */
-        ent->file_type = EXT2_FT_REG_FILE;
+        node->blkno = 0;
 
-        /* ent->name[] */
-        ent->name[0] = '\0';
-        Strncat(ent->name, sizeof(ent->name), filename, EXT2_PATH_MAX-1);
+        if (EXT2_IFERR(err = EXT2ReadBlock(file->ext2, blkno, &node->block)))
+        {
+            GOTO(done);
+        }
 
-        /* ent->rec_len */
-        ent->rec_len = 
-            _NextMult(sizeof(*ent)- EXT2_PATH_MAX + ent->name_len, 4);
+        node->blkno = blkno;
     }
 
-    /* Create new entry for this file in the directory inode */
-    if (EXT2_IFERR(err = _AddDirectoryEntry(
-        ext2, 
-        dir_ino, 
-        &dir_inode, 
-        filename, 
-        ent)))
-    {
-        GOTO(done);
-    }
+    *block = &node->block;
 
     err = EXT2_ERR_NONE;
 
 done:
-
-    BufU32Release(&blknos);
-
     return err;
 }
 
-EXT2Err EXT2MkDir(
-    EXT2* ext2,
-    const char* path,
-    UINT16 mode)
+/* Map one logical block through the direct and indirect block numbers of
+ * the inode (0 for holes) */
+static EXT2Err _MapIndirectBlock(
+    EXT2File* file,
+    UINT32 lblkno,
+    UINT32* blkno)
 {
     EXT2_DECLARE_ERR(err);
-    char dirname[EXT2_PATH_MAX];
-    char basename[EXT2_PATH_MAX];
-    EXT2Ino dir_ino;
-    EXT2Inode dir_inode;
-    EXT2Ino base_ino;
-    EXT2Inode base_inode;
-    EXT2DirectoryEntBuf ent_buf;
-    EXT2DirEntry* ent = &ent_buf.base;
+    const UINT32 n = file->ext2->block_size / sizeof(UINT32);
+    UINT64 span = n;
+    UINT64 index;
+    UINT32 depth;
+    UINT32 level;
+    UINT32 ptr;
 
-    /* Check parameters */
-    if (!EXT2Valid(ext2) || !path || !mode)
-    {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
-    }
+    *blkno = 0;
 
-    /* Reject is not a directory */
-    if (!(mode & EXT2_S_IFDIR))
+    if (lblkno < EXT2_SINGLE_INDIRECT_BLOCK)
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
+        *blkno = file->inode.i_block[lblkno];
+        err = EXT2_ERR_NONE;
+        goto done;
     }
 
-    /* Split the path */
-    if (EXT2_IFERR(err = _SplitFullPath(path, dirname, basename)))
-    {
-        GOTO(done);
-    }
+    /* Find the single, double or triple indirect tree holding the block */
+    index = lblkno - EXT2_SINGLE_INDIRECT_BLOCK;
 
-    /* Read inode for 'dirname' */
-    if (EXT2_IFERR(err = EXT2PathToInode(
-        ext2, dirname, &dir_ino, &dir_inode)))
+    for (depth = 1; index >= span; depth++, span *= n)
     {
-        GOTO(done);
-    }
+        if (depth == 3)
+        {
+            err = EXT2_ERR_BAD_BLKNO;
+            GOTO(done);
+        }
 
-    /* Fail if the directory already exists */
-    if (!EXT2_IFERR(err = EXT2PathToInode(
-        ext2, path, &base_ino, &base_inode)))
-    {
-        GOTO(done);
+        index -= span;
     }
 
-    /* Create the directory inode and its one block */
-    if (EXT2_IFERR(err = _CreateDirInodeAndBlock(
-        ext2, 
-        dir_ino,
-        mode,
-        &base_ino)))
-    {
-        GOTO(done);
-    }
+    ptr = file->inode.i_block[EXT2_SINGLE_INDIRECT_BLOCK + depth - 1];
 
-    /* Initialize the new directory entry */
+    /* Walk down the tree (each level resolves one base-n digit) */
+    for (level = 0; level < depth && ptr; level++)
     {
-        /* ent->inode */
-        ent->inode = base_ino;
-
-        /* ent->name_len */
-        ent->name_len = (UINT32)Strlen(basename);
+        const EXT2Block* block;
 
-        /* ent->file_type */
-        ent->file_type = EXT2_FT_DIR;
+        span /= n;
 
-        /* ent->name[] */
-        ent->name[0] = '\0';
-        Strncat(ent->name, sizeof(ent->name), basename, EXT2_PATH_MAX-1);
+        if (EXT2_IFERR(err = _ReadFileNode(file, level, ptr, &block)))
+        {
+            GOTO(done);
+        }
 
-        /* ent->rec_len */
-        ent->rec_len = 
-            _NextMult(sizeof(*ent) - EXT2_PATH_MAX + ent->name_len, 4);
+        ptr = ((const UINT32*)block->data)[index / span];
+        index %= span;
     }
 
-    /* Include new child directory in parent directory's i_links_count */
-    dir_inode.i_links_count++;
-
-    /* Create new entry for this file in the directory inode */
-    if (EXT2_IFERR(err = _AddDirectoryEntry(
-        ext2, dir_ino, &dir_inode, basename, ent)))
-    {
-        GOTO(done);
-    }
+    *blkno = ptr;
 
     err = EXT2_ERR_NONE;
 
@@ -4769,217 +7322,208 @@ done:
     return err;
 }
 
-EXT2Err EXT2Lsr(
-    EXT2* ext2,
-    const char* root,
-    StrArr* paths)
+/* Map one logical block through the extent tree: sets 'run' to the rest of
+ * the extent holding it, or to the hole it falls in (blkno 0) */
+static EXT2Err _MapExtentBlock(
+    EXT2File* file,
+    UINT32 lblkno,
+    EXT2Extent* run)
 {
-    EXT2_DECLARE_ERR(err);
-    EXT2_DIR* dir = NULL;
-    EXT2DirEnt* ent;
-    char path[EXT2_PATH_MAX];
-    StrArr dirs = STRARR_INITIALIZER;
+    EXT2_DECLARE_ERR(err);
+    const EXT4ExtentHeader* eh = (const EXT4ExtentHeader*)file->inode.i_block;
+    UINT32 node_size = sizeof(file->inode.i_block);
+    UINT32 depth = eh->eh_depth;
+    UINT32 end = 0xFFFFFFFF; /* first block past the subtree searched */
+    UINT32 level = 0;
+    UINT32 lo;
+    UINT32 hi;
 
-    /* Check parameters */
-    if (!ext2 || !root || !paths)
+    for (;;)
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
-    }
+        const EXT4ExtentIdx* ei = (const EXT4ExtentIdx*)(eh + 1);
+        const EXT2Block* block;
 
-    /* Open the directory */
-    if (!(dir = EXT2OpenDir(ext2, root)))
-    {
-        GOTO(done);
-    }
+        /* Check the node header (index and leaf entries are the same size) */
+        if (eh->eh_magic != EXT4_EXT_MAGIC ||
+            eh->eh_depth != depth ||
+            depth > EXT4_EXT_MAX_DEPTH ||
+            sizeof(EXT4ExtentHeader) + eh->eh_entries * sizeof(EXT4Extent) > 
+                node_size)
+        {
+            err = EXT2_ERR_SANITY_CHECK_FAILED;
+            GOTO(done);
+        }
 
-    /* For each entry */
-    while ((ent = EXT2ReadDir(dir)))
-    {
-        if (Strcmp(ent->d_name, ".") == 0 || Strcmp(ent->d_name, "..") == 0)
-            continue;
+        if (depth == 0)
+            break;
 
-        Strlcpy(path, root, sizeof(path));
+        /* Count the entries that start at or before 'lblkno' */
+        for (lo = 0, hi = eh->eh_entries; lo < hi; )
+        {
+            UINT32 mid = (lo + hi) / 2;
 
-        if (Strcmp(root, "/") != 0)
-            Strlcat(path, "/", sizeof(path));
+            if (ei[mid].ei_block > lblkno)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
 
-        Strlcat(path, ent->d_name, sizeof(path));
+        /* In the hole before the first child */
+        if (lo == 0)
+        {
+            run->lblkno = lblkno;
+            run->blkno = 0;
+            run->count = 
+                (eh->eh_entries ? _Min(ei[0].ei_block, end) : end) - lblkno;
+            run->flags = 0;
+            err = EXT2_ERR_NONE;
+            goto done;
+        }
 
-        /* Append to paths[] array */
-        if (StrArrAppend(paths, path) != 0)
+        if (lo < eh->eh_entries)
+            end = _Min(end, ei[lo].ei_block);
+
+        if (ei[lo-1].ei_leaf_hi)
         {
-            err = EXT2_ERR_OUT_OF_MEMORY;
+            err = EXT2_ERR_BAD_BLKNO;
             GOTO(done);
         }
-        
-        /* Append to dirs[] array */
-        if (ent->d_type & EXT2_DT_DIR)
+
+        if (EXT2_IFERR(err = _ReadFileNode(
+            file, 
+            level, 
+            ei[lo-1].ei_leaf_lo, 
+            &block)))
         {
-            if (StrArrAppend(&dirs, path) != 0)
-            {
-                err = EXT2_ERR_OUT_OF_MEMORY;
-                GOTO(done);
-            }
+            GOTO(done);
         }
+
+        eh = (const EXT4ExtentHeader*)block->data;
+        node_size = block->size;
+        depth--;
+        level++;
     }
 
-    /* Recurse into child directories */
+    /* Find the last extent that starts at or before 'lblkno' */
     {
-        UINTN i;
+        const EXT4Extent* ee = (const EXT4Extent*)(eh + 1);
 
-        for (i = 0; i < dirs.size; i++)
+        for (lo = 0, hi = eh->eh_entries; lo < hi; )
         {
-            if (EXT2Lsr(ext2, dirs.data[i], paths) != EXT2_ERR_NONE)
-            {
-                GOTO(done);
-            }
+            UINT32 mid = (lo + hi) / 2;
+
+            if (ee[mid].ee_block > lblkno)
+                hi = mid;
+            else
+                lo = mid + 1;
         }
-    }
 
-    err = EXT2_ERR_NONE;
+        if (lo > 0)
+        {
+            const EXT4Extent* p = &ee[lo-1];
+            UINT32 count = p->ee_len;
+            UINT32 flags = 0;
 
-done:
+            if (count > EXT4_EXT_INIT_MAX_LEN)
+            {
+                count -= EXT4_EXT_INIT_MAX_LEN;
+                flags |= EXT2_EXTENT_UNINIT;
+            }
 
-    /* Close the directory */
-    if (dir)
-        EXT2CloseDir(dir);
+            if (lblkno - p->ee_block < count)
+            {
+                /* The extent must lie on the device */
+                if (p->ee_start_hi || 
+                    p->ee_start_lo == 0 ||
+                    p->ee_start_lo + count > file->ext2->sb.s_blocks_count ||
+                    p->ee_start_lo + count < p->ee_start_lo)
+                {
+                    err = EXT2_ERR_BAD_BLKNO;
+                    GOTO(done);
+                }
 
-    StrArrRelease(&dirs);
+                run->lblkno = lblkno;
+                run->blkno = p->ee_start_lo + (lblkno - p->ee_block);
+                run->count = count - (lblkno - p->ee_block);
+                run->flags = flags;
+                err = EXT2_ERR_NONE;
+                goto done;
+            }
+        }
 
-    if (err != EXT2_ERR_NONE)
-    {
-        StrArrRelease(paths);
-        Memset(paths, 0, sizeof(StrArr));
+        /* In the hole before the next extent (or the end of this subtree) */
+        run->lblkno = lblkno;
+        run->blkno = 0;
+        run->count = (lo < eh->eh_entries ? ee[lo].ee_block : end) - lblkno;
+        run->flags = 0;
     }
 
+    err = EXT2_ERR_NONE;
+
+done:
     return err;
 }
 
-EXT2Err EXT2HashDir(
-    EXT2* ext2,
-    const char* root,
-    SHA1Hash* sha1,
-    SHA256Hash* sha256)
+/* Map the run of blocks of this file that starts at 'lblkno' (at most 'max'
+ * blocks long): consecutive physical blocks, or a hole (blkno 0) */
+static EXT2Err _MapFileRun(
+    EXT2File* file,
+    UINT32 lblkno,
+    UINT32 max,
+    EXT2Extent* run)
 {
     EXT2_DECLARE_ERR(err);
-    StrArr paths = STRARR_INITIALIZER;
-    SHA1Context sha1Context;
-    SHA256Context sha256Context;
-    void* data = NULL;
-    UINT32 size;
 
-    /* Check for null parameters */
-    if (!ext2 || !root || !sha1 || !sha256)
+    if (file->inode.i_flags & EXT4_EXTENTS_FL)
     {
-        err = EXT2_ERR_INVALID_PARAMETER;
-        GOTO(done);
-    }
-
-    /* Clear the hashes */
-
-    if (sha1)
-        SHA1Init(&sha1Context);
-
-    if (sha256)
-        SHA256Init(&sha256Context);
+        if (EXT2_IFERR(err = _MapExtentBlock(file, lblkno, run)))
+        {
+            GOTO(done);
+        }
 
-    /* Form an array of paths */
-    if (EXT2_IFERR(err = EXT2Lsr(ext2, root, &paths)))
-    {
-        GOTO(done);
+        if (run->count > max)
+            run->count = max;
     }
-
-    /* Sort the path names */
-    StrArrSort(&paths);
-
-    /* Hash the contents of all files in this directory */
+    else
     {
-        UINTN i;
+        UINT32 blkno;
 
-        for (i = 0; i < paths.size; i++)
+        if (EXT2_IFERR(err = _MapIndirectBlock(file, lblkno, &blkno)))
         {
-            EXT2Ino ino;
-            EXT2Inode inode;
-
-            if (EXT2_IFERR(err = EXT2PathToInode(
-                ext2, 
-                paths.data[i], 
-                &ino, 
-                &inode)))
-            {
-                GOTO(done);
-            }
+            GOTO(done);
+        }
 
-            /* Skip directories */
-            if (inode.i_mode & EXT2_S_IFDIR)
-                continue;
+        run->lblkno = lblkno;
+        run->blkno = blkno;
+        run->count = 1;
+        run->flags = 0;
 
-            /* Load the file into memory */
-            if (EXT2_IFERR(err = EXT2LoadFileFromInode(
-                ext2, 
-                &inode, 
-                &data, 
-                &size)))
-            {
-                GOTO(done);
-            }
+        /* Extend the run while the blocks stay consecutive (or stay holes) */
+        while (run->count < max)
+        {
+            UINT32 next;
 
-            /* Update the SHA1 hash */
-            if (sha1 && !SHA1Update(&sha1Context, data, size))
+            if (EXT2_IFERR(err = _MapIndirectBlock(
+                file, 
+                lblkno + run->count, 
+                &next)))
             {
                 GOTO(done);
             }
 
-            /* Update the SHA256 hash */
-            if (sha256 && !SHA256Update(&sha256Context, data, size))
-            {
-                GOTO(done);
-            }
+            if (blkno ? (next != blkno + run->count) : (next != 0))
+                break;
 
-            /* Release the file memory */
-            Free(data);
-            data = NULL;
+            run->count++;
         }
     }
 
-    /* Finalize the SHA-1 hash */
-    if (sha1)
-        SHA1Final(&sha1Context, sha1);
-
-    /* Finalize the SHA-256 hash */
-    if (sha256)
-        SHA256Final(&sha256Context, sha256);
-
     err = EXT2_ERR_NONE;
 
 done:
-
-    if (data)
-        Free(data);
-
-    StrArrRelease(&paths);
-
     return err;
 }
 
-/*
-**==============================================================================
-**
-** EXT2File
-**
-**==============================================================================
-*/
-
-struct _EXT2File
-{
-    EXT2* ext2;
-    EXT2Inode inode;
-    BufU32 blknos;
-    UINTN offset;
-    BOOLEAN eof;
-};
-
 EXT2File* EXT2OpenFile(
     EXT2* ext2,
     const char* path,
@@ -4988,7 +7532,6 @@ EXT2File* EXT2OpenFile(
     EXT2File* file = NULL;
     EXT2Ino ino;
     EXT2Inode inode;
-    BufU32 blknos = BUF_U32_INITIALIZER;
 
     /* Reject null parameters */
     if (!ext2 || !path)
@@ -4998,14 +7541,16 @@ EXT2File* EXT2OpenFile(
     if (EXT2PathToInode(ext2, path, &ino, &inode) != EXT2_ERR_NONE)
         goto done;
 
-    /* Load the block numbers for this inode */
-    if (_LoadBlockNumbersFromInode(
-        ext2, 
-        &inode,
-        0, /* include_block_blocks */
-        &blknos) != EXT2_ERR_NONE)
+    /* Check the root of the extent tree (blocks are mapped on demand) */
+    if (inode.i_flags & EXT4_EXTENTS_FL)
     {
-        goto done;
+        const EXT4ExtentHeader* eh = (const EXT4ExtentHeader*)inode.i_block;
+
+        if (eh->eh_magic != EXT4_EXT_MAGIC || 
+            eh->eh_depth > EXT4_EXT_MAX_DEPTH)
+        {
+            goto done;
+        }
     }
 
     /* Allocate and initialize the file object */
@@ -5015,95 +7560,178 @@ EXT2File* EXT2OpenFile(
 
         file->ext2 = ext2;
         file->inode = inode;
-        file->blknos = blknos;
         file->offset = 0;
     }
 
 done:
-    if (!file)
-        BufU32Release(&blknos);
-
     return file;
 }
 
+EXT2Err EXT2MapBlocks(
+    EXT2File* file,
+    UINT32 lblkno,
+    UINT32 count,
+    Buf* extents)
+{
+    EXT2_DECLARE_ERR(err);
+    UINT32 nblocks;
+
+    /* Check parameters */
+    if (!file || !file->ext2 || !extents)
+    {
+        err = EXT2_ERR_INVALID_PARAMETER;
+        GOTO(done);
+    }
+
+    /* Stop at the end of the file */
+    nblocks = (file->inode.i_size + file->ext2->block_size - 1) / 
+        file->ext2->block_size;
+
+    if (lblkno >= nblocks)
+        count = 0;
+    else if (count > nblocks - lblkno)
+        count = nblocks - lblkno;
+
+    while (count > 0)
+    {
+        EXT2Extent run;
+
+        if (EXT2_IFERR(err = _MapFileRun(file, lblkno, count, &run)))
+        {
+            GOTO(done);
+        }
+
+        /* Holes are left out (as with EXT2GetExtents) */
+        if (run.blkno)
+        {
+            if (BufAppend(extents, &run, sizeof(run)) != 0)
+            {
+                err = EXT2_ERR_OUT_OF_MEMORY;
+                GOTO(done);
+            }
+        }
+
+        lblkno += run.count;
+        count -= run.count;
+    }
+
+    err = EXT2_ERR_NONE;
+
+done:
+    return err;
+}
+
 INTN EXT2ReadFile(
     EXT2File* file,
     void* data,
     UINTN size)
 {
     INTN nread = -1;
-    UINT32 first;
-    UINT32 i;
-    UINTN remaining;
     UINT8* end = (UINT8*)data;
+    UINTN remaining;
+    UINT32 block_size;
 
     /* Check parameters */
     if (!file || !file->ext2 || !data)
         goto done;
 
-    /* The index of the first block to read: ext2->blknos[first] */
-    first = file->offset / file->ext2->block_size;
+    block_size = file->ext2->block_size;
 
     /* The number of bytes remaining to be read */
-    remaining = size;
+    remaining = file->eof ? 0 : size;
 
-    /* Read the data block-by-block */
-    for (i = first; i < file->blknos.size && remaining > 0 && !file->eof; i++)
+    /* Reduce remaining to bytes remaining in the file? */
     {
-        EXT2Block block;
-        UINT32 offset;
+        UINTN fileBytesRemaining = 0;
+
+        if (file->offset < file->inode.i_size)
+            fileBytesRemaining = file->inode.i_size - file->offset;
+
+        if (fileBytesRemaining < remaining)
+        {
+            remaining = fileBytesRemaining;
+            file->eof = TRUE;
+        }
+    }
 
-        if (EXT2ReadBlock(
-            file->ext2, 
-            file->blknos.data[i], 
-            &block) != EXT2_ERR_NONE)
+    /* Read the data run-by-run */
+    while (remaining > 0)
+    {
+        UINT32 offset = file->offset % block_size;
+        UINT32 count;
+        UINT32 blkno;
+        UINTN copyBytes;
+        EXT2Extent run;
+
+        /* Map no further than this read goes */
+        if (_MapFileRun(
+            file, 
+            file->offset / block_size, 
+            (UINT32)((offset + remaining + block_size - 1) / block_size),
+            &run) != EXT2_ERR_NONE)
         {
             goto done;
         }
 
-        /* The offset of the data within this block */
-        offset = file->offset % file->ext2->block_size;
+        blkno = (run.flags & EXT2_EXTENT_UNINIT) ? 0 : run.blkno;
+        count = run.count;
 
-        /* Copy the minimum of these to the caller's buffer:
-         *     remaining
-         *     block-bytes-remaining
-         *     file-bytes-remaining
-         */
+        if (offset || remaining < block_size)
         {
-            UINTN copyBytes;
+            /* Partial block: copy through a block buffer */
+            EXT2Block block;
 
-            /* Bytes to copy to user buffer */
-            copyBytes = remaining;
+            copyBytes = _Min(block_size - offset, remaining);
 
-            /* Reduce copyBytes to bytes remaining in the block? */
+            if (blkno == 0)
             {
-                UINTN blockBytesRemaining = file->ext2->block_size - offset;
-
-                if (blockBytesRemaining < copyBytes)
-                    copyBytes = blockBytesRemaining;
+                /* Holes read as zeros */
+                Memset(end, 0, copyBytes);
             }
-
-            /* Reduce copyBytes to bytes remaining in the file? */
+            else
             {
-                UINTN fileBytesRemaining = file->inode.i_size - file->offset;
-
-                if (fileBytesRemaining < copyBytes)
+                if (EXT2ReadBlock(
+                    file->ext2, 
+                    blkno, 
+                    &block) != EXT2_ERR_NONE)
                 {
-                    copyBytes = fileBytesRemaining;
-                    file->eof = TRUE;
+                    goto done;
                 }
+
+                Memcpy(end, block.data + offset, copyBytes);
             }
+        }
+        else
+        {
+            /* Whole blocks: read the run straight into the caller's buffer */
+            UINTN nblks = remaining / block_size;
+
+            if (count < nblks)
+                nblks = count;
+
+            copyBytes = nblks * block_size;
 
-            /* Copy data to user buffer */
-            Memcpy(end, block.data + offset, copyBytes);
-            remaining -= copyBytes;
-            end += copyBytes;
-            file->offset += copyBytes;
+            if (blkno == 0)
+            {
+                Memset(end, 0, copyBytes);
+            }
+            else if (_Read(
+                file->ext2->dev, 
+                BlockOffset(blkno, block_size),
+                end, 
+                copyBytes) != copyBytes)
+            {
+                goto done;
+            }
         }
+
+        remaining -= copyBytes;
+        end += copyBytes;
+        file->offset += copyBytes;
     }
 
     /* Calculate number of bytes read */
-    nread = size - remaining;
+    nread = end - (UINT8*)data;
 
 done:
     return nread;
@@ -5144,8 +7772,16 @@ int EXT2CloseFile(
     if (!file || !file->ext2)
         goto done;
 
-    /* Release the block numbers buffer */
-    BufU32Release(&file->blknos);
+    /* Release the cached blocks */
+    {
+        UINT32 i;
+
+        for (i = 0; i < EXT2_FILE_MAX_DEPTH; i++)
+        {
+            if (file->nodes[i])
+                Free(file->nodes[i]);
+        }
+    }
 
     /* Release the file object */
     Free(file);
@@ -5169,6 +7805,7 @@ int EXT2SeekFile(
         goto done;
 
     file->offset = offset;
+    file->eof = FALSE;
 
     rc = 0;
 
@@ -5303,7 +7940,7 @@ UINTN EXT2BlknoToLBA(
     const EXT2* ext2,
     UINT32 blkno)
 {
-    return BlockOffset(blkno, ext2->block_size) / BLKDEV_BLKSIZE;
+    return BlockOffset(blkno, ext2->block_size) / BlkdevBlockSize(ext2->dev);
 }
 
 EXT2Err EXT2GetFirstBlkno(
@@ -174,6 +174,7 @@ typedef struct _EXT2GroupDesc EXT2GroupDesc;
 typedef struct _EXT2Inode EXT2Inode;
 typedef struct _EXT2DirectoryEntry EXT2DirEntry;
 typedef struct _EXT2_DIR EXT2_DIR;
+typedef struct _EXT2Cache EXT2Cache;
 
 /*
 **==============================================================================
@@ -271,14 +272,39 @@ struct _EXT2SuperBlock
     /* Directory Indexing Support */
     UINT32 s_hash_seed[4];
     UINT8 s_def_hash_version;
-    UINT8 padding[3];
+    UINT8 s_jnl_backup_type;
+    UINT16 s_desc_size; /* group descriptor size (EXT4_FEATURE_INCOMPAT_64BIT) */
 
     /* Other options */
     UINT32 s_default_mount_options;
     UINT32 s_first_meta_bg;
-    UINT8 __unused[760];
+    UINT32 s_mkfs_time;
+    UINT32 s_jnl_blocks[17];
+
+    /* 64bit Support */
+    UINT32 s_blocks_count_hi;
+    UINT32 s_r_blocks_count_hi;
+    UINT32 s_free_blocks_count_hi;
+    UINT16 s_min_extra_isize;
+    UINT16 s_want_extra_isize;
+    UINT32 s_flags; /* EXT2_FLAGS_* */
+    UINT8 __unused[668];
 };
 
+/* Feature flags (file systems with features other than filetype,
+ * sparse_super and large_file are read-only here) */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define EXT3_FEATURE_INCOMPAT_RECOVER 0x0004
+#define EXT4_FEATURE_INCOMPAT_EXTENTS 0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+
+/* Superblock flags (s_flags): signedness of chars in directory hashes */
+#define EXT2_FLAGS_SIGNED_HASH 0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
 void EXT2DumpSuperBlock(
     const EXT2SuperBlock* sb);
 
@@ -360,6 +386,7 @@ struct _EXT2GroupDesc
 #define EXT2_INDEX_FL 0x00001000
 #define EXT2_IMAGIC_FL 0x00002000
 #define EXT3_JOURNAL_DATA_FL 0x00004000
+#define EXT4_EXTENTS_FL 0x00080000
 #define EXT2_RESERVED_FL 0x80000000
 
 struct _EXT2Inode
@@ -411,6 +438,71 @@ EXT2Err EXT2PathToInode(
     EXT2Ino* ino,
     EXT2Inode* inode);
 
+/*
+**==============================================================================
+**
+** extents:
+**
+**==============================================================================
+*/
+
+/* ext4 extent tree (EXT4_EXTENTS_FL): the root node lives in i_block[] */
+
+#define EXT4_EXT_MAGIC 0xF30A
+#define EXT4_EXT_MAX_DEPTH 5
+#define EXT4_EXT_INIT_MAX_LEN 32768
+
+typedef struct _EXT4ExtentHeader
+{
+    UINT16 eh_magic;
+    UINT16 eh_entries;
+    UINT16 eh_max;
+    UINT16 eh_depth; /* 0 for leaf nodes */
+    UINT32 eh_generation;
+}
+EXT4ExtentHeader;
+
+/* Leaf node entry */
+typedef struct _EXT4Extent
+{
+    UINT32 ee_block;
+    UINT16 ee_len; /* above EXT4_EXT_INIT_MAX_LEN if uninitialized */
+    UINT16 ee_start_hi;
+    UINT32 ee_start_lo;
+}
+EXT4Extent;
+
+/* Index node entry */
+typedef struct _EXT4ExtentIdx
+{
+    UINT32 ei_block;
+    UINT32 ei_leaf_lo;
+    UINT16 ei_leaf_hi;
+    UINT16 ei_unused;
+}
+EXT4ExtentIdx;
+
+/* Blocks that read as zeros (preallocated but never written) */
+#define EXT2_EXTENT_UNINIT 0x00000001
+
+/* A run of 'count' blocks at logical block 'lblkno' and physical block
+ * 'blkno' (logical blocks not covered by any run are holes) */
+typedef struct _EXT2Extent
+{
+    UINT32 lblkno;
+    UINT32 blkno;
+    UINT32 count;
+    UINT32 flags;
+}
+EXT2Extent;
+
+/* Get the runs of this inode (an array of EXT2Extent sorted by 'lblkno'),
+ * from its extent tree or by merging its direct/indirect block numbers */
+EXT2Err EXT2GetExtents(
+    const EXT2* ext2,
+    const EXT2Inode* inode,
+    Buf* extents);
+
 /*
 **==============================================================================
 **
@@ -466,6 +558,34 @@ struct _EXT2DirectoryEntry
 #define EXT2_DX_HASH_HALF_MD4 1
 #define EXT2_DX_HASH_TEA 2
 
+/* Hashed (htree) directories: block 0 holds the "." and ".." entries, then
+ * an EXT2DxRootInfo and an EXT2DxEntry table. Interior nodes hold one empty
+ * entry spanning the block, then a table. The first slot of each table holds
+ * an EXT2DxCountLimit in place of its hash. */
+typedef struct _EXT2DxRootInfo
+{
+    UINT32 reserved_zero;
+    UINT8 hash_version;
+    UINT8 info_length;
+    UINT8 indirect_levels;
+    UINT8 unused_flags;
+}
+EXT2DxRootInfo;
+
+typedef struct _EXT2DxEntry
+{
+    UINT32 hash;
+    UINT32 block; /* logical block within the directory */
+}
+EXT2DxEntry;
+
+typedef struct _EXT2DxCountLimit
+{
+    UINT16 limit;
+    UINT16 count;
+}
+EXT2DxCountLimit;
+
 #define EXT2_DT_UNKNOWN 0
 #define EXT2_DT_FIFO 1
 #define EXT2_DT_CHR 2
@@ -547,6 +667,7 @@ struct _EXT2
     UINT32 group_count;
     EXT2GroupDesc* groups;
     EXT2Inode root_inode;
+    EXT2Cache* cache; /* inodes, inode-table blocks and directory entries */
 };
 
 static __inline BOOLEAN EXT2Valid(
@@ -565,6 +686,22 @@ void EXT2Delete(
 EXT2Err EXT2Dump(
     const EXT2* ext2);
 
+/* Hit and miss counts of the caches used by path lookups */
+typedef struct _EXT2CacheStats
+{
+    UINTN inode_hits;
+    UINTN inode_misses;
+    UINTN block_hits; /* inode-table blocks */
+    UINTN block_misses;
+    UINTN dentry_hits;
+    UINTN dentry_misses;
+}
+EXT2CacheStats;
+
+void EXT2GetCacheStats(
+    const EXT2* ext2,
+    EXT2CacheStats* stats);
+
 EXT2Err EXT2Check(
     const EXT2* ext2);
 
@@ -662,6 +799,14 @@ INTN EXT2TellFile(
 INTN EXT2SizeFile(
     EXT2File* file);
 
+/* Append the runs mapping blocks [lblkno, lblkno+count) of this file,
+ * reading only the indirect blocks (or extent tree nodes) needed */
+EXT2Err EXT2MapBlocks(
+    EXT2File* file,
+    UINT32 lblkno,
+    UINT32 count,
+    Buf* extents);
+
 int EXT2FlushFile(
     EXT2File* file);
 
@@ -679,6 +824,7 @@ EXT2Err EXT2GetBlockNumbers(
     const char* path,
     BufU32* blknos);
 
+/* Convert a file system block number to a device block number */
 UINTN EXT2BlknoToLBA(
     const EXT2* ext2,
     UINT32 blkno);
@@ -29,6 +29,7 @@
 */
 #include "gpt.h"
 #include "blkdev.h"
+#include "vhdblkdev.h"
 
 int ReadGPT(
     Blkdev* dev,
@@ -67,7 +68,7 @@ int LoadGPT(
         goto done;
 
     /* Open the raw root partition */
-    if (!(dev = BlkdevOpen(path, BLKDEV_ACCESS_RDONLY, 0)))
+    if (!(dev = BlkdevOpenImage(path, BLKDEV_ACCESS_RDONLY, 0, 0)))
         goto done;
 
     /* Read the GPT into memory */
@@ -137,6 +137,8 @@ static int _InjectFiles(
     UINTN bootkeySize,
     const void* rootkeyData,
     UINTN rootkeySize,
+    const void* rootVolumeKeyData,
+    UINTN rootVolumeKeySize,
     void** cpioDataOut,
     UINTN* cpioSizeOut)
 {
@@ -299,6 +301,52 @@ static int _InjectFiles(
         cpioSize = n;
     }
 
+    /* Remove 'etc/lsvmload/rootvolumekey' if it already exists */
+    if (CPIOIsFile(cpioData, cpioSize, "etc/lsvmload/rootvolumekey") == TRUE)
+    {
+        void* p = NULL;
+        UINTN n;
+
+        if (CPIORemoveFile(
+            cpioData,
+            cpioSize,
+            "etc/lsvmload/rootvolumekey",
+            &p,
+            &n) != 0)
+        {
+            goto done;
+        }
+
+        Free(cpioData);
+        cpioData = p;
+        cpioSize = n;
+    }
+
+    /* Create 'etc/lsvmload/rootvolumekey' file (the raw master key, as
+     * read by 'cryptsetup --volume-key-file') */
+    if (rootVolumeKeyData && rootVolumeKeySize)
+    {
+        void* p = NULL;
+        UINTN n;
+
+        if (CPIOAddFile(
+            cpioData,
+            cpioSize,
+            "etc/lsvmload/rootvolumekey",
+            rootVolumeKeyData,
+            rootVolumeKeySize,
+            CPIO_MODE_IFREG | 0400,
+            &p,
+            &n) != 0)
+        {
+            goto done;
+        }
+
+        Free(cpioData);
+        cpioData = p;
+        cpioSize = n;
+    }
+
     /* Remove 'etc/lsvmload/specialize' if it already exists */
     if (CPIOIsFile(cpioData, cpioSize, "etc/lsvmload/specialize") == TRUE)
     {
@@ -388,6 +436,8 @@ int InitrdMakeArchive(
             bootkeySize,
             rootkeyData, 
             rootkeySize,
+            NULL,
+            0,
             &p,
             &n) != 0)
         {
@@ -433,6 +483,8 @@ int InitrdInjectFiles(
     UINTN bootkeySize,
     const void* rootkeyData,
     UINTN rootkeySize,
+    const void* rootVolumeKeyData,
+    UINTN rootVolumeKeySize,
     void** initrdDataOut,
     UINTN* initrdSizeOut)
 {
@@ -502,6 +554,8 @@ int InitrdInjectFiles(
                 bootkeySize,
                 rootkeyData,
                 rootkeySize,
+                rootVolumeKeyData,
+                rootVolumeKeySize,
                 &newData,
                 &newSize) != 0)
             {
@@ -541,6 +595,8 @@ int InitrdInjectFiles(
                 bootkeySize,
                 rootkeyData,
                 rootkeySize,
+                rootVolumeKeyData,
+                rootVolumeKeySize,
                 &newData,
                 &newSize) != 0)
             {
@@ -601,6 +657,8 @@ int InitrdInjectFiles(
     UINTN bootkeySize,
     const void* rootkeyData,
     UINTN rootkeySize,
+    const void* rootVolumeKeyData,
+    UINTN rootVolumeKeySize,
     void** initrdDataOut,
     UINTN* initrdSizeOut)
 {
@@ -653,6 +711,8 @@ int InitrdInjectFiles(
             bootkeySize,
             rootkeyData,
             rootkeySize,
+            rootVolumeKeyData,
+            rootVolumeKeySize,
             &subfileData,
             &subfileSize) != 0)
         {
@@ -675,18 +735,31 @@ int InitrdInjectFiles(
     }
     else
     {
+        void* cpioData = NULL;
+        UINTN cpioSize;
+
         /* Create a new CPIO archive that contains these keys */
-        if (InitrdMakeArchive(
+        if (CPIONew(&cpioData, &cpioSize) != 0)
+            goto done;
+
+        if (_InjectFiles(
+            cpioData,
+            cpioSize,
             bootkeyData,
             bootkeySize,
             rootkeyData,
             rootkeySize,
+            rootVolumeKeyData,
+            rootVolumeKeySize,
             &subfileData,
             &subfileSize) != 0)
         {
+            Free(cpioData);
             goto done;
         }
 
+        Free(cpioData);
+
         /* Create new initrd image */
         {
             UINTN i;
@@ -43,6 +43,10 @@ int InitrdMakeArchive(
     void** cpioDataOut,
     UINTN* cpioSizeOut);
 
+/* Inject the bootkey and rootkey passphrases into the initrd and, if
+ * 'rootVolumeKeyData' is not null, the unlocked master key of the root
+ * device as 'etc/lsvmload/rootvolumekey' (so that early userspace opens
+ * the root device without any key derivation) */
 int InitrdInjectFiles(
     const void* initrdData,
     UINTN initrdSize,
@@ -50,6 +54,8 @@ int InitrdInjectFiles(
     UINTN bootkeySize,
     const void* rootkeyData,
     UINTN rootkeySize,
+    const void* rootVolumeKeyData,
+    UINTN rootVolumeKeySize,
     void** initrdDataOut,
     UINTN* initrdSizeOut);
 
@@ -193,3 +193,96 @@ int CombineKeys(
     outTmp = _SerializeKey(outTmp, KEYS_ROOTKEY_TYPE, rootkey, rootkeySize);
     return 0;
 }
+
+int GetKeySlotHints(
+    const UINT8* inData,
+    UINTN inSize,
+    KEYS_SLOT_HINTS* hints)
+{
+    const KEYS_SEALED_HEADER* hdr;
+    const KEYS_SEALED_KEY_HEADER* keyHdr;
+    UINTN offset;
+    UINTN i;
+
+    if (!inData || !hints || inSize < KEYS_SEALED_HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    hints->BootSlot = KEYS_SLOT_HINT_NONE;
+    hints->RootSlot = KEYS_SLOT_HINT_NONE;
+
+    /* Skip over the keys */
+    hdr = (const KEYS_SEALED_HEADER*) inData;
+    offset = KEYS_SEALED_HEADER_SIZE;
+
+    for (i = 0; i < hdr->KeyCount; i++)
+    {
+        if (inSize - offset < KEYS_SEALED_KEY_HEADER_SIZE)
+        {
+            return -1;
+        }
+
+        keyHdr = (const KEYS_SEALED_KEY_HEADER*) (inData + offset);
+        offset += KEYS_SEALED_KEY_HEADER_SIZE;
+
+        if (inSize - offset < keyHdr->KeySize)
+        {
+            return -1;
+        }
+
+        offset += keyHdr->KeySize;
+    }
+
+    /* The hints record follows the keys */
+    if (inSize - offset < KEYS_SEALED_KEY_HEADER_SIZE + sizeof(KEYS_SLOT_HINTS))
+    {
+        return -1;
+    }
+
+    keyHdr = (const KEYS_SEALED_KEY_HEADER*) (inData + offset);
+
+    if (keyHdr->KeyType != KEYS_SLOTHINTS_TYPE ||
+        keyHdr->KeySize != sizeof(KEYS_SLOT_HINTS))
+    {
+        return -1;
+    }
+
+    Memcpy(hints, inData + offset + KEYS_SEALED_KEY_HEADER_SIZE, 
+        sizeof(KEYS_SLOT_HINTS));
+    return 0;
+}
+
+int AppendKeySlotHints(
+    const KEYS_SLOT_HINTS* hints,
+    UINT8** data,
+    UINTN* dataSize)
+{
+    UINT8* outTmp;
+    UINTN outSize;
+
+    if (!hints || !data || !*data || !dataSize)
+    {
+        return -1;
+    }
+
+    outSize = *dataSize + KEYS_SEALED_KEY_HEADER_SIZE + sizeof(KEYS_SLOT_HINTS);
+
+    outTmp = (UINT8*) Malloc(outSize);
+    if (outTmp == NULL)
+    {
+        return -1;
+    }
+
+    Memcpy(outTmp, *data, *dataSize);
+    _SerializeKey(
+        outTmp + *dataSize,
+        KEYS_SLOTHINTS_TYPE,
+        (const UINT8*) hints,
+        sizeof(KEYS_SLOT_HINTS));
+
+    Free(*data);
+    *data = outTmp;
+    *dataSize = outSize;
+    return 0;
+}
@@ -35,6 +35,7 @@
 
 #define KEYS_BOOTKEY_TYPE 1
 #define KEYS_ROOTKEY_TYPE 2
+#define KEYS_SLOTHINTS_TYPE 3
 
 #define KEYS_SEALED_HEADER_SIZE 2
 typedef struct _KEYS_SEALED_HEADER {
@@ -47,6 +48,14 @@ typedef struct _KEYS_SEALED_KEY_HEADER {
     UINT16 KeySize;
 } KEYS_SEALED_KEY_HEADER;
 
+/* Optional record after the keys (KeyCount only counts the keys, so older
+ * readers ignore it): the LUKS keyslots that the keys opened last time */
+#define KEYS_SLOT_HINT_NONE 0xFF
+typedef struct _KEYS_SLOT_HINTS {
+    UINT8 BootSlot;
+    UINT8 RootSlot;
+} KEYS_SLOT_HINTS;
+
 int SplitKeys(
     const UINT8* inData,
     UINTN inSize,
@@ -63,4 +72,16 @@ int CombineKeys(
     UINT8** outData,
     UINTN* outDataSize);
 
+/* Find the slot hints record (fails if there is none) */
+int GetKeySlotHints(
+    const UINT8* inData,
+    UINTN inSize,
+    KEYS_SLOT_HINTS* hints);
+
+/* Append a slot hints record to the output of CombineKeys() */
+int AppendKeySlotHints(
+    const KEYS_SLOT_HINTS* hints,
+    UINT8** data,
+    UINTN* dataSize);
+
 #endif /* _utils_keys_h */
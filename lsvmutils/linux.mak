@@ -15,7 +15,7 @@ INCLUDES += $(EFI_INCLUDES)
 INCLUDES += -I$(TOP)/3rdparty
 INCLUDES += -I$(TOP)/3rdparty/openssl/linux/$(OPENSSLPACKAGE)/include
 
-SOURCES = alloc.c buf.c conf.c error.c ext2.c file.c getopt.c peimage.c print.c sha.c strarr.c strings.c tcg2.c tpm2.c tpmbuf.c utils.c blkdev.c linuxblkdev.c luks.c dump.c luksblkdev.c gpt.c guid.c vfat.c memblkdev.c luksopenssl.c uefidb.c cpio.c initrd.c cacheblkdev.c grubcfg.c exec.c pass.c heap.c tpm2crypt.c keys.c uefidbx.c policy.c measure.c vars.c lsvmloadpolicy.c specialize.c
+SOURCES = alloc.c buf.c conf.c error.c ext2.c file.c getopt.c peimage.c print.c sha.c strarr.c strings.c tcg2.c tpm2.c tpmbuf.c utils.c blkdev.c linuxblkdev.c luks.c luks2.c pbkdf2.c dump.c luksblkdev.c gpt.c guid.c vfat.c memblkdev.c luksopenssl.c lukscryptpool.c lukskeyslots.c luksreencrypt.c uefidb.c cpio.c initrd.c cacheblkdev.c uringblkdev.c mmapblkdev.c vhdblkdev.c statsblkdev.c overlayblkdev.c grubcfg.c exec.c pass.c heap.c tpm2crypt.c keys.c uefidbx.c policy.c measure.c vars.c lsvmloadpolicy.c specialize.c
 
 OBJECTS = $(SOURCES:.c=.o)
 
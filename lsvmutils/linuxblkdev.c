@@ -27,6 +27,10 @@
 **
 **==============================================================================
 */
+#if defined(__linux__) && !defined(BUILD_EFI)
+# define _GNU_SOURCE /* for O_DIRECT */
+#endif
+
 #include "blkdev.h"
 #include "stdlib.h"
 #include "alloc.h"
@@ -36,9 +40,29 @@
 #if defined(__linux__) && !defined(BUILD_EFI)
 # include <sys/types.h>
 # include <sys/fcntl.h>
+# include <sys/uio.h>
+# include <sys/stat.h>
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+# include <limits.h>
 # include <unistd.h>
+# include <errno.h>
+# include <stdlib.h>
 #endif
 
+#if !defined(IOV_MAX)
+# define IOV_MAX 1024
+#endif
+
+/* Memory alignment of O_DIRECT buffers */
+#define DIRECT_ALIGN 4096
+
+/* Size of each O_DIRECT bounce buffer */
+#define BOUNCE_SIZE (1024 * 1024)
+
+/* Maximum number of idle bounce buffers kept for reuse */
+#define BOUNCE_POOL_MAX 4
+
 typedef struct _BlkdevImpl BlkdevImpl;
 
 struct _BlkdevImpl
@@ -46,8 +70,39 @@ struct _BlkdevImpl
     Blkdev base;
     UINTN offset;
     int fd;
+
+    /* Opened with O_DIRECT (buffers must be aligned to DIRECT_ALIGN) */
+    BOOLEAN direct;
+
+    /* Idle bounce buffers for unaligned O_DIRECT transfers */
+    void* bounce[BOUNCE_POOL_MAX];
+    UINTN nbounce;
 };
 
+static void* _GetBounce(
+    BlkdevImpl* impl)
+{
+    void* p;
+
+    if (impl->nbounce)
+        return impl->bounce[--impl->nbounce];
+
+    if (posix_memalign(&p, DIRECT_ALIGN, BOUNCE_SIZE) != 0)
+        return NULL;
+
+    return p;
+}
+
+static void _PutBounce(
+    BlkdevImpl* impl,
+    void* p)
+{
+    if (impl->nbounce < BOUNCE_POOL_MAX)
+        impl->bounce[impl->nbounce++] = p;
+    else
+        free(p);
+}
+
 static int _Close(
     Blkdev* dev)
 {
@@ -57,6 +112,9 @@ static int _Close(
     if (!dev)
         goto done;
 
+    while (impl->nbounce)
+        free(impl->bounce[--impl->nbounce]);
+
     close(impl->fd);
     Free(impl);
 
@@ -66,58 +124,98 @@ done:
     return rc;
 }
 
-static ssize_t _Readn(
+/* Perform pread() or pwrite() until all bytes have been transferred */
+static int _Transfer(
     int fd,
     void* data,
-    size_t size)
+    size_t size,
+    off_t offset,
+    BOOLEAN write)
 {
-    unsigned char* p = (unsigned char*)data;
-    size_t r = size;
-
-    if (!data)
-        return -1;
+    UINT8* p = (UINT8*)data;
 
-    while (r)
+    while (size)
     {
-        ssize_t n = read(fd, p, r);
+        ssize_t n;
 
-        if (n > 0)
-        {
-            p += n;
-            r -= n;
-        }
+        if (write)
+            n = pwrite(fd, p, size, offset);
         else
+            n = pread(fd, p, size, offset);
+
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+
             return -1;
+        }
+
+        p += n;
+        size -= n;
+        offset += n;
     }
 
-    return size;
+    return 0;
 }
 
-static ssize_t _Writen(
-    int fd,
-    const void* data,
-    size_t size)
+/* Transfer through aligned bounce buffers (O_DIRECT with unaligned data) */
+static int _TransferBounced(
+    BlkdevImpl* impl,
+    void* data,
+    size_t size,
+    off_t offset,
+    BOOLEAN write)
 {
-    const unsigned char* p = (const unsigned char*)data;
-    size_t r = size;
+    int rc = -1;
+    UINT8* p = (UINT8*)data;
+    void* bounce;
 
-    if (!data)
-        return -1;
+    if (!(bounce = _GetBounce(impl)))
+        goto done;
 
-    while (r)
+    while (size)
     {
-        ssize_t n = write(fd, p, r);
+        size_t n = size < BOUNCE_SIZE ? size : BOUNCE_SIZE;
 
-        if (n > 0)
-        {
-            p += n;
-            r -= n;
-        }
-        else
-            return -1;
+        if (write)
+            Memcpy(bounce, p, n);
+
+        if (_Transfer(impl->fd, bounce, n, offset, write) != 0)
+            goto done;
+
+        if (!write)
+            Memcpy(p, bounce, n);
+
+        p += n;
+        size -= n;
+        offset += n;
     }
 
-    return size;
+    rc = 0;
+
+done:
+
+    if (bounce)
+        _PutBounce(impl, bounce);
+
+    return rc;
+}
+
+static int _TransferBlocks(
+    BlkdevImpl* impl,
+    UINTN blkno,
+    UINTN nblocks,
+    void* data,
+    BOOLEAN write)
+{
+    off_t offset = impl->offset + blkno * impl->base.blksize;
+    size_t size = nblocks * impl->base.blksize;
+
+    if (impl->direct && ((UINTN)data % DIRECT_ALIGN))
+        return _TransferBounced(impl, data, size, offset, write);
+
+    return _Transfer(impl->fd, data, size, offset, write);
 }
 
 static int _GetN(
@@ -128,8 +226,6 @@ static int _GetN(
 {
     int rc = -1;
     BlkdevImpl* impl = (BlkdevImpl*)dev;
-    UINTN offset;
-    UINTN toRead = nblocks * BLKDEV_BLKSIZE;
 
     if (!dev || !data)
         goto done;
@@ -140,12 +236,7 @@ static int _GetN(
         goto done;
     }
 
-    offset = impl->offset + blkno * BLKDEV_BLKSIZE;
-
-    if (lseek(impl->fd, offset, SEEK_SET) != offset)
-        goto done;
-
-    if (_Readn(impl->fd, data, toRead) != toRead)
+    if (_TransferBlocks(impl, blkno, nblocks, data, FALSE) != 0)
         goto done;
 
     rc = 0;
@@ -162,8 +253,6 @@ static int _PutN(
 {
     int rc = -1;
     BlkdevImpl* impl = (BlkdevImpl*)dev;
-    UINTN offset;
-    UINTN toWrite = nblocks * BLKDEV_BLKSIZE;
 
     if (!dev || !data)
         goto done;
@@ -174,12 +263,154 @@ static int _PutN(
         goto done;
     }
 
-    offset = impl->offset + blkno * BLKDEV_BLKSIZE;
+    if (_TransferBlocks(impl, blkno, nblocks, (void*)data, TRUE) != 0)
+        goto done;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+/* Perform preadv() or pwritev() until all iovecs have been transferred */
+static int _Transferv(
+    int fd,
+    struct iovec* iov,
+    int iovcnt,
+    off_t offset,
+    BOOLEAN write)
+{
+    while (iovcnt)
+    {
+        ssize_t n;
+
+        if (write)
+            n = pwritev(fd, iov, iovcnt, offset);
+        else
+            n = preadv(fd, iov, iovcnt, offset);
+
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        offset += n;
+
+        /* Skip over the iovecs that were fully transferred */
+        while (iovcnt && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        /* Adjust the partially transferred iovec */
+        if (iovcnt)
+        {
+            iov->iov_base = (UINT8*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/* Issue one preadv() or pwritev() for each run of contiguous segments */
+static int _TransferSegments(
+    BlkdevImpl* impl,
+    const BlkdevSegment* segments,
+    UINTN nsegments,
+    BOOLEAN write)
+{
+    int rc = -1;
+    struct iovec iov[IOV_MAX];
+    UINTN i;
+
+    if (!impl || (!segments && nsegments))
+        goto done;
+
+    for (i = 0; i < nsegments; )
+    {
+        off_t offset = impl->offset + segments[i].blkno * impl->base.blksize;
+        UINTN next = segments[i].blkno;
+        int iovcnt = 0;
+
+        /* O_DIRECT cannot use unaligned buffers (bounce this segment) */
+        if (impl->direct && ((UINTN)segments[i].data % DIRECT_ALIGN))
+        {
+            if (_TransferBlocks(
+                impl, 
+                segments[i].blkno, 
+                segments[i].nblocks, 
+                segments[i].data, 
+                write) != 0)
+            {
+                goto done;
+            }
+
+            i++;
+            continue;
+        }
+
+        while (i < nsegments && iovcnt < IOV_MAX && 
+            segments[i].blkno == next)
+        {
+            if (impl->direct && ((UINTN)segments[i].data % DIRECT_ALIGN))
+                break;
+
+            if (segments[i].nblocks)
+            {
+                iov[iovcnt].iov_base = segments[i].data;
+                iov[iovcnt].iov_len = segments[i].nblocks * impl->base.blksize;
+                iovcnt++;
+            }
+
+            next += segments[i].nblocks;
+            i++;
+        }
+
+        if (iovcnt == 0)
+            continue;
+
+        if (_Transferv(impl->fd, iov, iovcnt, offset, write) != 0)
+            goto done;
+    }
+
+    rc = 0;
 
-    if (lseek(impl->fd, offset, SEEK_SET) != offset)
+done:
+    return rc;
+}
+
+static int _GetV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    return _TransferSegments((BlkdevImpl*)dev, segments, nsegments, FALSE);
+}
+
+static int _PutV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    return _TransferSegments((BlkdevImpl*)dev, segments, nsegments, TRUE);
+}
+
+static int _Flush(
+    Blkdev* dev)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!dev)
         goto done;
 
-    if (_Writen(impl->fd, data, toWrite) != toWrite)
+    if (fsync(impl->fd) != 0)
         goto done;
 
     rc = 0;
@@ -196,18 +427,70 @@ static int _SetFlags(
     return -1;
 }
 
+/* Whole blocks from the device offset to the end of the file (or device) */
+static int _GetNumBlocks(
+    Blkdev* dev,
+    UINT64* nblocks)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    struct stat st;
+    UINT64 size;
+
+    if (!dev || !nblocks)
+        return -1;
+
+    if (fstat(impl->fd, &st) != 0)
+        return -1;
+
+    if (S_ISBLK(st.st_mode))
+    {
+        if (ioctl(impl->fd, BLKGETSIZE64, &size) != 0)
+            return -1;
+    }
+    else
+        size = (UINT64)st.st_size;
+
+    if (size < impl->offset)
+        return -1;
+
+    *nblocks = (size - impl->offset) / impl->base.blksize;
+    return 0;
+}
+
+/* Use the logical sector size of block devices (files use 512) */
+static UINTN _GetBlockSize(
+    int fd)
+{
+    struct stat st;
+    int size;
+
+    if (fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode))
+        return BLKDEV_BLKSIZE;
+
+    if (ioctl(fd, BLKSSZGET, &size) != 0)
+        return BLKDEV_BLKSIZE;
+
+    return (UINTN)size;
+}
+
 Blkdev* BlkdevOpen(
     const char* path,
     BlkdevAccess access,
-    UINTN offset)
+    UINTN offset,
+    UINT32 openFlags)
 {
     BlkdevImpl* impl = NULL;
     int flags = 0;
-    int fd;
+    int fd = -1;
+    UINTN blksize;
+    BOOLEAN direct = FALSE;
 
     if (!path)
         goto done;
 
+    if (openFlags & ~BLKDEV_OPEN_DIRECT)
+        goto done;
+
     if (access == BLKDEV_ACCESS_RDWR)
         flags = O_RDWR;
     else if (access == BLKDEV_ACCESS_RDONLY)
@@ -215,19 +498,61 @@ Blkdev* BlkdevOpen(
     else if (access == BLKDEV_ACCESS_WRONLY)
         flags = O_WRONLY;
 
-    if ((fd = open(path, flags)) < 0)
+    /* Bypass the page cache if requested (not all file systems allow it) */
+    if (openFlags & BLKDEV_OPEN_DIRECT)
+    {
+        if ((fd = open(path, flags | O_DIRECT)) >= 0)
+            direct = TRUE;
+        else if (errno != EINVAL)
+            goto done;
+    }
+
+    if (fd < 0 && (fd = open(path, flags)) < 0)
+        goto done;
+
+    if (!BlkdevValidBlockSize(blksize = _GetBlockSize(fd)))
+    {
+        close(fd);
         goto done;
+    }
+
+    /* Direct transfers must start on a block boundary */
+    if (direct && offset % blksize)
+    {
+        close(fd);
+        goto done;
+    }
 
     if (!(impl = Calloc(1, sizeof(BlkdevImpl))))
+    {
+        close(fd);
         goto done;
+    }
 
     impl->base.Close = _Close;
     impl->base.GetN = _GetN;
     impl->base.PutN = _PutN;
     impl->base.SetFlags = _SetFlags;
+    impl->base.GetV = _GetV;
+    impl->base.PutV = _PutV;
+    impl->base.Flush = _Flush;
+    impl->base.GetNumBlocks = _GetNumBlocks;
+    impl->base.blksize = blksize;
     impl->offset = offset;
     impl->fd = fd;
+    impl->direct = direct;
 
 done:
     return &impl->base;
 }
+
+int BlkdevFileno(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!dev || dev->Close != _Close)
+        return -1;
+
+    return impl->fd;
+}
@@ -33,6 +33,7 @@
 #include <lsvmutils/alloc.h>
 #include <lsvmutils/print.h>
 #include <lsvmutils/sha.h>
+#include <lsvmutils/pbkdf2.h>
 #include "tpm2.h"
 #include "dump.h"
 #include "gpt.h"
@@ -60,11 +61,12 @@
 #endif
 
 #define LUKS_VERSION 1
-#define LUKS_SLOT_ENABLED 0x00ac71f3
-#define LUKS_SLOT_DISABLED 0x0000dead
 #define LUKS_SECTOR_SIZE 512
 #define LUKS_IV_SIZE 16
 
+/* Number of sectors whose IVs are generated (and crypted) together */
+#define LUKS_BATCH_SECTORS 64
+
 static UINT8 _magic[LUKS_MAGIC_SIZE] = LUKS_MAGIC_INITIALIZER;
 
 void LUKSFixByteOrder(
@@ -158,67 +160,68 @@ static void _DumpKeySlot(
     Print(TCS("\tAF stripes:\t\t%d\n"), slot->af_stripes);
 }
 
-static int _GenIV(
-    const LUKSHeader *header,
-    UINT64 sec, 
-    UINT8 *iv, 
-    const UINT8 *key)
+/* Sector number in the first 'ivBytes' of each IV (the rest is zero) */
+static void _GenPlainIVs(
+    UINT64 sector,
+    UINTN nsectors,
+    UINTN ivBytes,
+    UINT8* ivs)
 {
-    int rc = -1;
-    int ivSize = 8;
-    LUKSCipher* cipher = NULL;
-
-    if (Strcmp("ecb", header->cipher_mode) == 0)
-    {
-        rc = 0;
-        goto done;
-    }
-
-    if (Strcmp("cbc-plain", header->cipher_mode) == 0)
-        ivSize = 4;
-
-    Memcpy(iv, &sec, ivSize);
+    UINTN i;
 
-    if (Strcmp("xts-plain64", header->cipher_mode) == 0)
-    {
-        rc = 0;
-        goto done;
-    }
+    Memset(ivs, 0, nsectors * LUKS_IV_SIZE);
 
-    if (Strcmp("cbc-plain", header->cipher_mode) == 0)
+    for (i = 0; i < nsectors; i++)
     {
-        rc = 0;
-        goto done;
+        UINT64 sec = sector + i;
+        Memcpy(ivs + i * LUKS_IV_SIZE, &sec, ivBytes);
     }
+}
 
-    SHA256Hash sha256;
-    UINT8 temp[LUKS_IV_SIZE] = { 0 };
-    ComputeSHA256(key, header->key_bytes, &sha256);
-    Memcpy(temp, &sec, ivSize);
-
-    if (!(cipher = LUKSGetAES256ECBCipher(sha256.buf, sizeof(sha256))))
-        goto done;
+/* ESSIV: the 64-bit sector numbers encrypted with the ESSIV cipher, all in
+ * a single ECB call */
+static int _GenESSIVs(
+    LUKSCipher* essiv,
+    UINT64 sector,
+    UINTN nsectors,
+    UINT8* ivs)
+{
+    _GenPlainIVs(sector, nsectors, sizeof(UINT64), ivs);
 
     if (LUKSCryptData(
-        cipher,
+        essiv,
         LUKS_CRYPT_MODE_ENCRYPT,
         NULL, /* iv */
         0, /* ivSize */
-        temp,  /* in */
-        LUKS_IV_SIZE, /* inSize */
-        iv) != 0) /* out */
+        ivs, /* in */
+        nsectors * LUKS_IV_SIZE, /* inSize */
+        ivs) != 0) /* out */
     {
-        goto done;
+        return -1;
     }
 
-    rc = 0;
-
-done:
-
-    if (cipher)
-        LUKSReleaseCipher(cipher);
+    return 0;
+}
 
-    return rc;
+static int _GenIVs(
+    LUKSCryptContext* context,
+    UINT64 sector,
+    UINTN nsectors,
+    UINT8* ivs)
+{
+    switch (context->cipherMode)
+    {
+        case LUKS_CIPHER_MODE_CBC_PLAIN:
+            _GenPlainIVs(sector, nsectors, sizeof(UINT32), ivs);
+            return 0;
+        case LUKS_CIPHER_MODE_XTS_PLAIN64:
+            _GenPlainIVs(sector, nsectors, sizeof(UINT64), ivs);
+            return 0;
+        case LUKS_CIPHER_MODE_CBC_ESSIV:
+            return _GenESSIVs(context->essiv, sector, nsectors, ivs);
+        default:
+            return -1;
+    }
 }
 
 static int _DiffuseSHA(
@@ -328,125 +331,57 @@ static int _AFMerge(
     return 0;
 }
 
-static int _UnsealMasterKey(
-    Blkdev* rawdev,
+/*
+**==============================================================================
+**
+** Public definitions:
+**
+**==============================================================================
+*/
+
+int LUKSAFSplit(
     const LUKSHeader *header, 
     const LUKSKeySlot* slot, 
-    const UINT8 *passphrase,
-    UINTN passphraseSize,
-    UINT8 *masterKey)
+    const UINT8 *masterKey,
+    UINT8 *stripes)
 {
     int rc = -1;
-    UINT8 *derivedKey = NULL;
-    UINT8 *encryptedStripes = NULL;
-    UINT8 *decryptedStripes = NULL;
-    UINTN stripesBytes = 0;
-    UINT8 mkDigest[LUKS_DIGEST_SIZE];
-
-    /* Check for null parameters */
-    if (!rawdev || !header || !slot || !passphrase || !masterKey)
-        goto done;
-
-    /* Allocate bytes for the derived key (used to decrypt the stripes) */
-    if (!(derivedKey = (UINT8*)Malloc(header->key_bytes)))
-        goto done;
-
-    /* Compute the derived key from passphrase, salt, and iterations-count */
-    if (LUKSDeriveKey(
-        (const char*) passphrase,
-        passphraseSize,
-        slot->password_salt,
-        LUKS_SALT_SIZE,
-        slot->password_iters,
-        header->hash_spec,
-        header->key_bytes,
-        derivedKey) != 0)
-    {
-        goto done;
-    }
-
-    /* Compute the total size of the stripes */
-    stripesBytes = header->key_bytes * slot->af_stripes;
+    UINT8* d = NULL;
+    UINT32 i;
 
-    /* Allocate space for the encrypted stripes */
-    if (!(encryptedStripes = (UINT8*)Malloc(stripesBytes)))
+    if (!header || !slot || !masterKey || !stripes || !slot->af_stripes)
         goto done;
 
-    /* Allocate space for the decrypted stripes */
-    if (!(decryptedStripes = (UINT8*)Malloc(stripesBytes)))
-        goto done;
-      
-    /* Read the key material (stripes) into memory */
-    if ((BlkdevRead(
-        rawdev,
-        slot->key_material_offset,
-        encryptedStripes, 
-        stripesBytes)) != 0)
-    {
+    if (!(d = (UINT8*)Calloc(1, header->key_bytes)))
         goto done;
-    }
 
-    /* Decrypt the stripes */
-    if (LUKSCrypt(
-        LUKS_CRYPT_MODE_DECRYPT,
-        header,
-        derivedKey, 
-        encryptedStripes,
-        decryptedStripes,
-        stripesBytes, 
-        0) != 0)
+    /* Merge all but the last stripe as _AFMerge() does */
+    for (i = 0; i + 1 < slot->af_stripes; i++)
     {
-        goto done;
-    }
-
-    /* Merge the split stripes into the unsplit master key */
-    if (_AFMerge(header, slot, decryptedStripes, masterKey) != 0)
-        goto done;
+        _ComputeXOR(d, d, stripes + (i * header->key_bytes), 
+            header->key_bytes);
 
-    /* Compute the digest of the master key */
-    if (LUKSDeriveKey(
-        (char*)masterKey,
-        header->key_bytes,
-        header->mk_digest_salt,
-        LUKS_SALT_SIZE,
-        header->mk_digest_iter,
-        header->hash_spec,
-        LUKS_DIGEST_SIZE,
-        mkDigest) != 0)
-    {
-        goto done;
+        if (_Diffuse(header, d, header->key_bytes) != 0)
+            goto done;
     }
 
-    /* Verify that the master key digest matches the one in LUKS header */
-    if (Memcmp(mkDigest, header->mk_digest, LUKS_DIGEST_SIZE) != 0)
-    {
-        goto done;
-    }
+    /* The last stripe makes the merge yield the master key */
+    _ComputeXOR(stripes + (i * header->key_bytes), d, masterKey, 
+        header->key_bytes);
 
     rc = 0;
 
 done:
 
-    if (derivedKey)
-        Free(derivedKey);
-
-    if (encryptedStripes)
-        Free(encryptedStripes);
-
-    if (decryptedStripes)
-        Free(decryptedStripes);
+    if (d)
+    {
+        Memset(d, 0, header->key_bytes);
+        Free(d);
+    }
 
     return rc;
 }
 
-/*
-**==============================================================================
-**
-** Public definitions:
-**
-**==============================================================================
-*/
-
 int LUKSReadHeader(
     Blkdev* rawdev,
     LUKSHeader* header)
@@ -481,12 +416,39 @@ int LUKSReadHeader(
     /* Adjust byte order from big-endian to native */
     LUKSFixByteOrder(header);
 
+    /* LUKS2 headers have the same magic number (see luks2.h) */
+    if (header->version != 1)
+    {
+        rc = -6;
+        goto done;
+    }
+
     rc = 0;
 
 done:
     return rc;
 }
 
+int LUKSWriteHeader(
+    Blkdev* rawdev,
+    const LUKSHeader* header)
+{
+    LUKSHeader tmp;
+    int rc;
+
+    if (!rawdev || !header)
+        return -1;
+
+    /* Adjust byte order from native to big-endian */
+    Memcpy(&tmp, header, sizeof(LUKSHeader));
+    LUKSFixByteOrder(&tmp);
+
+    rc = BlkdevWriteBytes(rawdev, 0, &tmp, sizeof(LUKSHeader));
+    Memset(&tmp, 0, sizeof(tmp));
+
+    return rc;
+}
+
 int LUKSDumpHeader(
     const LUKSHeader* header)
 {
@@ -550,106 +512,681 @@ done:
     return rc;
 }
 
-int LUKSGetMasterKey(
-    Blkdev* rawdev,
+/* Decrypt the key material with the slot key and merge the stripes */
+static int _OpenWithDerivedKey(
     const LUKSHeader *header, 
-    const UINT8 *passphrase,
-    UINTN passphraseSize,
+    const LUKSKeySlot* slot, 
+    const UINT8 *derivedKey,
+    const UINT8* keyMaterial,
     UINT8 *masterKey)
 {
     int rc = -1;
-    int i;
+    UINT8 *decryptedStripes = NULL;
+    UINTN stripesBytes = 0;
 
-    LUKSInitialize();
+    /* Compute the total size of the stripes */
+    stripesBytes = header->key_bytes * slot->af_stripes;
 
-    for (i = 0; i < LUKS_SLOTS_SIZE; i++) 
+    /* Allocate space for the decrypted stripes */
+    if (!(decryptedStripes = (UINT8*)Malloc(stripesBytes)))
+        goto done;
+      
+    /* Decrypt the stripes */
+    if (LUKSCrypt(
+        LUKS_CRYPT_MODE_DECRYPT,
+        header,
+        derivedKey, 
+        keyMaterial,
+        decryptedStripes,
+        stripesBytes, 
+        0) != 0)
     {
-        const LUKSKeySlot* slot = &header->slots[i];
-
-        if (slot->enabled == LUKS_SLOT_DISABLED) 
-            continue;
-
-        if (slot->enabled == LUKS_SLOT_ENABLED) 
-        {
-            rc = _UnsealMasterKey(rawdev, header, slot, passphrase, passphraseSize, masterKey);
-
-            if (rc == 0)
-                goto done;
-        } 
+        goto done;
     }
 
-    /* Not found! */
+    /* Merge the split stripes into the unsplit master key */
+    if (_AFMerge(header, slot, decryptedStripes, masterKey) != 0)
+        goto done;
+
+    rc = 0;
 
 done:
 
+    if (decryptedStripes)
+    {
+        Memset(decryptedStripes, 0, stripesBytes);
+        Free(decryptedStripes);
+    }
+
     return rc;
 }
 
-int LUKSCrypt(
-    LUKSCryptMode mode,
-    const LUKSHeader *header,
-    const UINT8 *key,
-    const UINT8 *dataIn,
-    UINT8 *dataOut,
-    UINTN dataSize,
-    UINT64 sector)
+int LUKSOpenKeyMaterial(
+    const LUKSHeader *header, 
+    const LUKSKeySlot* slot, 
+    const UINT8 *passphrase,
+    UINTN passphraseSize,
+    const UINT8* keyMaterial,
+    UINT8 *masterKey)
 {
-    int rc = -1;
-    LUKSCipher* cipher = NULL;
-    UINT8 iv[LUKS_IV_SIZE];
-    UINT64 i;
+    return LUKSOpenKeyMaterialCancellable(header, slot, passphrase, 
+        passphraseSize, keyMaterial, NULL, masterKey);
+}
 
-    LUKSInitialize();
+int LUKSOpenKeyMaterialCancellable(
+    const LUKSHeader *header, 
+    const LUKSKeySlot* slot, 
+    const UINT8 *passphrase,
+    UINTN passphraseSize,
+    const UINT8* keyMaterial,
+    const volatile BOOLEAN* cancel,
+    UINT8 *masterKey)
+{
+    int rc = -1;
+    UINT8 *derivedKey = NULL;
+    SHAAlgorithm alg;
 
-    /* Get the EVP cipher */
-    if (!(cipher = LUKSGetCipher(header, key, header->key_bytes)))
+    /* Check for null parameters */
+    if (!header || !slot || !passphrase || !keyMaterial || !masterKey)
         goto done;
 
-    UINT64 iters = dataSize / LUKS_SECTOR_SIZE;
-    UINT64 block_len = LUKS_SECTOR_SIZE;
+    /* Allocate bytes for the derived key (used to decrypt the stripes) */
+    if (!(derivedKey = (UINT8*)Malloc(header->key_bytes)))
+        goto done;
 
-    if (Strcmp(header->cipher_mode, "ecb") == 0) 
+    /* Compute the derived key from passphrase, salt, and iterations-count */
+    if (cancel && PBKDF2ParseHash(header->hash_spec, &alg) == 0)
     {
-        iters = 1;
-        block_len = dataSize;
+        /* The native engine polls 'cancel' while it iterates */
+        PBKDF2Job job;
+
+        Memset(&job, 0, sizeof(job));
+        job.pass = passphrase;
+        job.passSize = passphraseSize;
+        job.salt = slot->password_salt;
+        job.saltSize = LUKS_SALT_SIZE;
+        job.iterations = slot->password_iters;
+        job.out = derivedKey;
+        job.outSize = header->key_bytes;
+        job.cancel = cancel;
+
+        if (PBKDF2Batch(alg, &job, 1) != 0)
+            goto done;
     }
-
-    for (i = 0; i < iters; i++) 
+    else if (LUKSDeriveKey(
+        (const char*) passphrase,
+        passphraseSize,
+        slot->password_salt,
+        LUKS_SALT_SIZE,
+        slot->password_iters,
+        header->hash_spec,
+        header->key_bytes,
+        derivedKey) != 0)
     {
-        UINT64 pos;
-
-        Memset(iv, 0, LUKS_IV_SIZE);
-
-        if (_GenIV(header, sector + i, iv, key) == -1)
-            goto done;
+        goto done;
+    }
 
-        pos = i * block_len;
+    if (cancel && *cancel)
+        goto done;
 
-        if(LUKSCryptData(
-            cipher, 
-            mode, 
-            iv, 
-            LUKS_IV_SIZE,
-            dataIn + pos, 
-            block_len,
-            dataOut + pos) == -1)
-        {
-            goto done;
-        }
+    if (_OpenWithDerivedKey(header, slot, derivedKey, keyMaterial, 
+        masterKey) != 0)
+    {
+        goto done;
     }
 
     rc = 0;
 
 done:
+
+    if (derivedKey)
+    {
+        Memset(derivedKey, 0, header->key_bytes);
+        Free(derivedKey);
+    }
+
     return rc;
 }
 
-int LUKSGetPayloadSector(
-    Blkdev* rawdev,
-    const LUKSHeader *header, 
-    const UINT8* masterKey,
-    UINTN sectorNumber,
-    UINT8 sector[LUKS_SECTOR_SIZE])
+int LUKSDeriveSlotKeys(
+    LUKSSlotKey* keys,
+    UINTN nkeys,
+    const UINT8 *passphrase,
+    UINTN passphraseSize)
+{
+    static const SHAAlgorithm _algs[] = { SHA1_ALG, SHA256_ALG };
+    int rc = -1;
+    PBKDF2Job* jobs = NULL;
+    UINTN i;
+    UINTN j;
+
+    if (!keys || !passphrase)
+        goto done;
+
+    for (i = 0; i < nkeys; i++)
+    {
+        if (!keys[i].header || !keys[i].slot ||
+            keys[i].header->key_bytes > LUKS_MAX_KEY_BYTES)
+        {
+            goto done;
+        }
+    }
+
+    if (!(jobs = (PBKDF2Job*)Calloc(nkeys ? nkeys : 1, sizeof(PBKDF2Job))))
+        goto done;
+
+    /* Batch the keyslots of each supported hash together */
+    for (j = 0; j < sizeof(_algs) / sizeof(_algs[0]); j++)
+    {
+        UINTN njobs = 0;
+
+        for (i = 0; i < nkeys && nkeys > 1; i++)
+        {
+            const LUKSHeader* header = keys[i].header;
+            const LUKSKeySlot* slot = keys[i].slot;
+            SHAAlgorithm alg;
+
+            if (PBKDF2ParseHash(header->hash_spec, &alg) != 0 || 
+                alg != _algs[j])
+            {
+                continue;
+            }
+
+            jobs[njobs].pass = passphrase;
+            jobs[njobs].passSize = passphraseSize;
+            jobs[njobs].salt = slot->password_salt;
+            jobs[njobs].saltSize = LUKS_SALT_SIZE;
+            jobs[njobs].iterations = slot->password_iters;
+            jobs[njobs].out = keys[i].derivedKey;
+            jobs[njobs].outSize = header->key_bytes;
+            njobs++;
+        }
+
+        if (njobs && PBKDF2Batch(_algs[j], jobs, njobs) != 0)
+            goto done;
+    }
+
+    /* Derive the rest one at a time */
+    for (i = 0; i < nkeys; i++)
+    {
+        const LUKSHeader* header = keys[i].header;
+        const LUKSKeySlot* slot = keys[i].slot;
+        SHAAlgorithm alg;
+
+        if (nkeys > 1 && PBKDF2ParseHash(header->hash_spec, &alg) == 0)
+            continue;
+
+        if (LUKSDeriveKey(
+            (const char*)passphrase,
+            passphraseSize,
+            slot->password_salt,
+            LUKS_SALT_SIZE,
+            slot->password_iters,
+            header->hash_spec,
+            header->key_bytes,
+            keys[i].derivedKey) != 0)
+        {
+            goto done;
+        }
+    }
+
+    rc = 0;
+
+done:
+
+    if (jobs)
+        Free(jobs);
+
+    return rc;
+}
+
+int LUKSOpenSlotKey(
+    Blkdev* rawdev,
+    const LUKSSlotKey* key,
+    UINT8 *masterKey)
+{
+    int rc = -1;
+    UINT8* keyMaterial = NULL;
+    UINTN keyMaterialSize;
+
+    if (!key || !masterKey)
+        goto done;
+
+    if (LUKSReadKeyMaterial(rawdev, key->header, key->slot, &keyMaterial, 
+        &keyMaterialSize) != 0)
+    {
+        goto done;
+    }
+
+    if (_OpenWithDerivedKey(key->header, key->slot, key->derivedKey, 
+        keyMaterial, masterKey) != 0)
+    {
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+
+    if (keyMaterial)
+        Free(keyMaterial);
+
+    return rc;
+}
+
+int LUKSReadKeyMaterial(
+    Blkdev* rawdev,
+    const LUKSHeader *header, 
+    const LUKSKeySlot* slot, 
+    UINT8** keyMaterial,
+    UINTN* keyMaterialSize)
+{
+    int rc = -1;
+    UINT8* data = NULL;
+    UINTN size;
+
+    if (!rawdev || !header || !slot || !keyMaterial || !keyMaterialSize)
+        goto done;
+
+    size = header->key_bytes * slot->af_stripes;
+
+    if (!(data = (UINT8*)Malloc(size)))
+        goto done;
+
+    /* Read the key material (stripes) into memory */
+    if ((BlkdevReadBytes(
+        rawdev,
+        (UINT64)slot->key_material_offset * LUKS_SECTOR_SIZE,
+        data, 
+        size)) != 0)
+    {
+        Free(data);
+        goto done;
+    }
+
+    *keyMaterial = data;
+    *keyMaterialSize = size;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+int LUKSOpenKeySlot(
+    Blkdev* rawdev,
+    const LUKSHeader *header, 
+    const LUKSKeySlot* slot, 
+    const UINT8 *passphrase,
+    UINTN passphraseSize,
+    UINT8 *masterKey)
+{
+    int rc = -1;
+    UINT8* keyMaterial = NULL;
+    UINTN keyMaterialSize;
+
+    if (LUKSReadKeyMaterial(rawdev, header, slot, &keyMaterial, 
+        &keyMaterialSize) != 0)
+    {
+        goto done;
+    }
+
+    if (LUKSOpenKeyMaterial(header, slot, passphrase, passphraseSize,
+        keyMaterial, masterKey) != 0)
+    {
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+
+    if (keyMaterial)
+        Free(keyMaterial);
+
+    return rc;
+}
+
+int LUKSVerifyMasterKey(
+    const LUKSHeader *header, 
+    const UINT8 *masterKey)
+{
+    int rc = -1;
+    UINT8 mkDigest[LUKS_DIGEST_SIZE];
+
+    if (!header || !masterKey)
+        goto done;
+
+    /* Compute the digest of the master key */
+    if (LUKSDeriveKey(
+        (char*)masterKey,
+        header->key_bytes,
+        header->mk_digest_salt,
+        LUKS_SALT_SIZE,
+        header->mk_digest_iter,
+        header->hash_spec,
+        LUKS_DIGEST_SIZE,
+        mkDigest) != 0)
+    {
+        goto done;
+    }
+
+    /* Verify that the master key digest matches the one in LUKS header */
+    if (Memcmp(mkDigest, header->mk_digest, LUKS_DIGEST_SIZE) != 0)
+    {
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+int LUKSGetMasterKeyWithHint(
+    Blkdev* rawdev,
+    const LUKSHeader *header,
+    const UINT8 *passphrase,
+    UINTN passphraseSize,
+    UINTN slotHint,
+    UINT8 *masterKey,
+    UINTN* slotIndex)
+{
+    int rc = -1;
+    LUKSSlotKey keys[LUKS_SLOTS_SIZE];
+    UINTN nkeys = 0;
+    UINTN i;
+
+    if (!rawdev || !header || !passphrase || !masterKey)
+        return -1;
+
+    LUKSInitialize();
+
+    Memset(keys, 0, sizeof(keys));
+
+    /* Try the hinted slot first (it usually opens) */
+    if (slotHint < LUKS_SLOTS_SIZE && 
+        header->slots[slotHint].enabled == LUKS_SLOT_ENABLED &&
+        LUKSOpenKeySlot(rawdev, header, &header->slots[slotHint], 
+            passphrase, passphraseSize, masterKey) == 0 &&
+        LUKSVerifyMasterKey(header, masterKey) == 0)
+    {
+        if (slotIndex)
+            *slotIndex = slotHint;
+
+        rc = 0;
+        goto done;
+    }
+
+    /* Derive the keys of the other slots together, then try them in order */
+    for (i = 0; i < LUKS_SLOTS_SIZE; i++) 
+    {
+        if (i == slotHint || header->slots[i].enabled != LUKS_SLOT_ENABLED) 
+            continue;
+
+        keys[nkeys].header = header;
+        keys[nkeys].slot = &header->slots[i];
+        nkeys++;
+    }
+
+    if (LUKSDeriveSlotKeys(keys, nkeys, passphrase, passphraseSize) != 0)
+        goto done;
+
+    for (i = 0; i < nkeys; i++) 
+    {
+        if (LUKSOpenSlotKey(rawdev, &keys[i], masterKey) == 0 &&
+            LUKSVerifyMasterKey(header, masterKey) == 0)
+        {
+            if (slotIndex)
+                *slotIndex = keys[i].slot - header->slots;
+
+            rc = 0;
+            goto done;
+        }
+    }
+
+done:
+
+    /* Not found! */
+    if (rc != 0)
+        Memset(masterKey, 0, header->key_bytes);
+
+    Memset(keys, 0, sizeof(keys));
+    return rc;
+}
+
+int LUKSGetMasterKey(
+    Blkdev* rawdev,
+    const LUKSHeader *header, 
+    const UINT8 *passphrase,
+    UINTN passphraseSize,
+    UINT8 *masterKey)
+{
+    return LUKSGetMasterKeyWithHint(rawdev, header, passphrase, 
+        passphraseSize, LUKS_SLOT_HINT_NONE, masterKey, NULL);
+}
+
+LUKSCipherMode LUKSParseCipherMode(
+    const char* cipherMode)
+{
+    if (!cipherMode)
+        return LUKS_CIPHER_MODE_NONE;
+
+    if (Strcmp(cipherMode, "ecb") == 0)
+        return LUKS_CIPHER_MODE_ECB;
+
+    if (Strcmp(cipherMode, "cbc-plain") == 0)
+        return LUKS_CIPHER_MODE_CBC_PLAIN;
+
+    if (Strcmp(cipherMode, "xts-plain64") == 0)
+        return LUKS_CIPHER_MODE_XTS_PLAIN64;
+
+    /* ESSIV always hashes the master key with SHA-256 */
+    if (Strcmp(cipherMode, "cbc-essiv:sha256") == 0 ||
+        Strcmp(cipherMode, "cbc-essiv:") == 0)
+    {
+        return LUKS_CIPHER_MODE_CBC_ESSIV;
+    }
+
+    return LUKS_CIPHER_MODE_NONE;
+}
+
+int LUKSInitCryptContext(
+    LUKSCryptContext* context,
+    const LUKSHeader *header,
+    const UINT8 *key)
+{
+    int rc = -1;
+
+    if (context)
+        Memset(context, 0, sizeof(LUKSCryptContext));
+
+    if (!context || !header || !key)
+        goto done;
+
+    LUKSInitialize();
+
+    context->header = header;
+    context->sectorSize = LUKS_SECTOR_SIZE;
+
+    if (!(context->cipherMode = LUKSParseCipherMode(header->cipher_mode)))
+        goto done;
+
+    /* Get the EVP cipher */
+    if (!(context->cipher = LUKSGetCipher(header, key, header->key_bytes)))
+        goto done;
+
+    /* ESSIV encrypts sector numbers with the SHA-256 of the master key */
+    if (context->cipherMode == LUKS_CIPHER_MODE_CBC_ESSIV)
+    {
+        SHA256Hash sha256;
+        ComputeSHA256(key, header->key_bytes, &sha256);
+        context->essiv = LUKSGetAES256ECBCipher(sha256.buf, sizeof(sha256));
+        Memset(&sha256, 0, sizeof(sha256));
+
+        if (!context->essiv)
+            goto done;
+    }
+
+    rc = 0;
+
+done:
+
+    if (rc != 0)
+        LUKSFreeCryptContext(context);
+
+    return rc;
+}
+
+int LUKSSetCryptSectorSize(
+    LUKSCryptContext* context,
+    UINT32 sectorSize,
+    UINT64 ivTweak)
+{
+    /* Powers of two from 512 to 4096 bytes */
+    if (!context || sectorSize < LUKS_SECTOR_SIZE || sectorSize > 4096 ||
+        (sectorSize & (sectorSize - 1)) ||
+        (ivTweak * LUKS_SECTOR_SIZE) % sectorSize)
+    {
+        return -1;
+    }
+
+    context->sectorSize = sectorSize;
+    context->ivTweak = ivTweak;
+
+    return 0;
+}
+
+void LUKSFreeCryptContext(
+    LUKSCryptContext* context)
+{
+    if (!context)
+        return;
+
+    if (context->cipher)
+        LUKSReleaseCipher(context->cipher);
+
+    if (context->essiv)
+        LUKSReleaseCipher(context->essiv);
+
+    Memset(context, 0, sizeof(LUKSCryptContext));
+}
+
+int LUKSCryptWithContext(
+    LUKSCryptContext* context,
+    LUKSCryptMode mode,
+    const UINT8 *dataIn,
+    UINT8 *dataOut,
+    UINTN dataSize,
+    UINT64 sector)
+{
+    int rc = -1;
+    UINT8 ivs[LUKS_BATCH_SECTORS * LUKS_IV_SIZE];
+    UINTN sectorSize;
+    UINTN nsectors;
+    UINT64 first;
+    UINTN i;
+    UINTN n;
+
+    if (!context || !context->cipher)
+        goto done;
+
+    /* ECB has no IVs: crypt the whole buffer at once */
+    if (context->cipherMode == LUKS_CIPHER_MODE_ECB)
+    {
+        if (LUKSCryptData(
+            context->cipher, 
+            mode, 
+            NULL, 
+            0,
+            dataIn, 
+            dataSize,
+            dataOut) == -1)
+        {
+            goto done;
+        }
+
+        rc = 0;
+        goto done;
+    }
+
+    /* 'sector' counts LUKS sectors; IVs count encryption sectors */
+    sectorSize = context->sectorSize;
+
+    if ((sector * LUKS_SECTOR_SIZE) % sectorSize)
+        goto done;
+
+    nsectors = dataSize / sectorSize;
+    first = ((sector + context->ivTweak) * LUKS_SECTOR_SIZE) / sectorSize;
+
+    /* Generate the IVs for a batch of sectors, then crypt the batch */
+    for (i = 0; i < nsectors; i += n)
+    {
+        UINTN pos = i * sectorSize;
+
+        n = nsectors - i;
+
+        if (n > LUKS_BATCH_SECTORS)
+            n = LUKS_BATCH_SECTORS;
+
+        if (_GenIVs(context, first + i, n, ivs) != 0)
+            goto done;
+
+        if (LUKSCryptSectors(
+            context->cipher,
+            mode,
+            ivs,
+            LUKS_IV_SIZE,
+            dataIn + pos,
+            dataOut + pos,
+            sectorSize,
+            n) != 0)
+        {
+            goto done;
+        }
+    }
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+int LUKSCrypt(
+    LUKSCryptMode mode,
+    const LUKSHeader *header,
+    const UINT8 *key,
+    const UINT8 *dataIn,
+    UINT8 *dataOut,
+    UINTN dataSize,
+    UINT64 sector)
+{
+    int rc = -1;
+    LUKSCryptContext context;
+
+    if (LUKSInitCryptContext(&context, header, key) != 0)
+        goto done;
+
+    rc = LUKSCryptWithContext(
+        &context, 
+        mode, 
+        dataIn, 
+        dataOut, 
+        dataSize, 
+        sector);
+
+    LUKSFreeCryptContext(&context);
+
+done:
+    return rc;
+}
+
+int LUKSGetPayloadSector(
+    Blkdev* rawdev,
+    const LUKSHeader *header, 
+    const UINT8* masterKey,
+    UINTN sectorNumber,
+    UINT8 sector[LUKS_SECTOR_SIZE])
 {
     int rc = -1;
     UINT8 data[LUKS_SECTOR_SIZE];
@@ -661,9 +1198,9 @@ int LUKSGetPayloadSector(
         goto done;
 
     /* Read the encrypted sector */
-    if (BlkdevRead(
+    if (BlkdevReadBytes(
         rawdev,
-        header->payload_offset + sectorNumber,
+        (UINT64)(header->payload_offset + sectorNumber) * LUKS_SECTOR_SIZE,
         data,
         LUKS_SECTOR_SIZE) != 0)
     {
@@ -720,9 +1257,9 @@ int LUKSPutPayloadSector(
     }
 
     /* Write the encrypted sector */
-    if (BlkdevWrite(
+    if (BlkdevWriteBytes(
         rawdev,
-        header->payload_offset + sectorNumber,
+        (UINT64)(header->payload_offset + sectorNumber) * LUKS_SECTOR_SIZE,
         data,
         LUKS_SECTOR_SIZE) != 0)
     {
@@ -852,7 +1389,7 @@ int LUKSFindBootDevice(
         /** Create object chain: [ext2] -> [luksdev] -> [dev] **/
 
         /* Open this block device */
-        if (!(dev = BlkdevOpen(devname, BLKDEV_ACCESS_RDWR, 0)))
+        if (!(dev = BlkdevOpen(devname, BLKDEV_ACCESS_RDWR, 0, 0)))
             goto done;
 
         /* Try to open as a LUKS device */
@@ -44,6 +44,12 @@
 #define LUKS_DIGEST_SIZE 20
 #define LUKS_UUID_STRING_SIZE 40
 #define LUKS_SLOTS_SIZE 8
+#define LUKS_MAX_KEY_BYTES 64
+#define LUKS_SLOT_ENABLED 0x00ac71f3
+#define LUKS_SLOT_DISABLED 0x0000dead
+
+/* No keyslot hint: try the keyslots in order */
+#define LUKS_SLOT_HINT_NONE ((UINTN)-1)
 
 typedef enum _LUKSCryptMode
 {
@@ -52,6 +58,17 @@ typedef enum _LUKSCryptMode
 }
 LUKSCryptMode;
 
+/* Supported values of LUKSHeader.cipher_mode */
+typedef enum _LUKSCipherMode
+{
+    LUKS_CIPHER_MODE_NONE = 0, /* unsupported */
+    LUKS_CIPHER_MODE_ECB,
+    LUKS_CIPHER_MODE_CBC_PLAIN,
+    LUKS_CIPHER_MODE_CBC_ESSIV, /* "cbc-essiv:sha256" */
+    LUKS_CIPHER_MODE_XTS_PLAIN64
+}
+LUKSCipherMode;
+
 typedef struct
 {
     UINT32 enabled;
@@ -79,16 +96,112 @@ typedef struct
 } 
 LUKSHeader;
 
+typedef struct _LUKSCipher LUKSCipher;
+
+/* Ciphers derived from the master key once and reused for every sector */
+typedef struct _LUKSCryptContext
+{
+    const LUKSHeader* header; /* must outlive the context */
+    LUKSCipherMode cipherMode;
+    UINT32 sectorSize; /* encryption sector size (LUKS_SECTOR_SIZE for LUKS1) */
+    UINT64 ivTweak; /* LUKS sectors added before computing IVs */
+    LUKSCipher* cipher; /* data cipher */
+    LUKSCipher* essiv; /* IV cipher (cbc-essiv only) */
+}
+LUKSCryptContext;
+
+LUKSCipherMode LUKSParseCipherMode(
+    const char* cipherMode);
+
 int LUKSReadHeader(
     Blkdev* rawdev,
     LUKSHeader* header);
 
+/* Write the header (in native byte order) to the start of 'rawdev' */
+int LUKSWriteHeader(
+    Blkdev* rawdev,
+    const LUKSHeader* header);
+
 void LUKSFixByteOrder(
     LUKSHeader *header);
 
 int LUKSDumpHeader(
     const LUKSHeader* header);
 
+/* Read the encrypted key material of a keyslot (caller frees it) */
+int LUKSReadKeyMaterial(
+    Blkdev* rawdev,
+    const LUKSHeader *header, 
+    const LUKSKeySlot* slot, 
+    UINT8** keyMaterial,
+    UINTN* keyMaterialSize);
+
+/* Derive the slot key from the passphrase, decrypt the key material read
+ * by LUKSReadKeyMaterial() and merge its stripes into 'masterKey' (without
+ * checking the result) */
+int LUKSOpenKeyMaterial(
+    const LUKSHeader *header, 
+    const LUKSKeySlot* slot, 
+    const UINT8 *passphrase,
+    UINTN passphraseSize,
+    const UINT8* keyMaterial,
+    UINT8 *masterKey);
+
+/* LUKSOpenKeyMaterial() that fails once '*cancel' becomes TRUE. SHA-1 and
+ * SHA-256 keyslots poll it while deriving the slot key; other hashes only
+ * check it once the key is derived. */
+int LUKSOpenKeyMaterialCancellable(
+    const LUKSHeader *header, 
+    const LUKSKeySlot* slot, 
+    const UINT8 *passphrase,
+    UINTN passphraseSize,
+    const UINT8* keyMaterial,
+    const volatile BOOLEAN* cancel,
+    UINT8 *masterKey);
+
+/* A keyslot and the key derived for it from the passphrase */
+typedef struct _LUKSSlotKey
+{
+    const LUKSHeader* header;
+    const LUKSKeySlot* slot;
+    UINT8 derivedKey[LUKS_MAX_KEY_BYTES];
+}
+LUKSSlotKey;
+
+/* Derive the keys of several keyslots at once (SHA-1 and SHA-256 keyslots
+ * share the vector lanes of one PBKDF2 run, so this costs about as much
+ * as deriving a single key). Callers wipe 'keys' when done. */
+int LUKSDeriveSlotKeys(
+    LUKSSlotKey* keys,
+    UINTN nkeys,
+    const UINT8 *passphrase,
+    UINTN passphraseSize);
+
+/* Open a keyslot whose key LUKSDeriveSlotKeys() derived (without checking
+ * the master key) */
+int LUKSOpenSlotKey(
+    Blkdev* rawdev,
+    const LUKSSlotKey* key,
+    UINT8 *masterKey);
+
+/* Split 'masterKey' into the anti-forensic stripes of a keyslot (the
+ * inverse of the merge done when opening it): the caller fills all but
+ * the last stripe with random data and the last one is computed */
+int LUKSAFSplit(
+    const LUKSHeader *header, 
+    const LUKSKeySlot* slot, 
+    const UINT8 *masterKey,
+    UINT8 *stripes);
+
+/* LUKSReadKeyMaterial() followed by LUKSOpenKeyMaterial() */
+int LUKSOpenKeySlot(
+    Blkdev* rawdev,
+    const LUKSHeader *header, 
+    const LUKSKeySlot* slot, 
+    const UINT8 *passphrase,
+    UINTN passphraseSize,
+    UINT8 *masterKey);
+
 int LUKSGetMasterKey(
     Blkdev* rawdev,
     const LUKSHeader *header, 
@@ -96,6 +209,23 @@ int LUKSGetMasterKey(
     UINTN passphraseSize,
     UINT8 *masterKey);
 
+/* Check the master key against the digest in the header */
+int LUKSVerifyMasterKey(
+    const LUKSHeader *header, 
+    const UINT8 *masterKey);
+
+/* Like LUKSGetMasterKey() but try keyslot 'slotHint' first (on its own)
+ * and return the keyslot that opened in 'slotIndex' (if not null). The
+ * keys of the other keyslots are derived together. */
+int LUKSGetMasterKeyWithHint(
+    Blkdev* rawdev,
+    const LUKSHeader *header, 
+    const UINT8 *passphrase,
+    UINTN passphraseSize,
+    UINTN slotHint,
+    UINT8 *masterKey,
+    UINTN* slotIndex);
+
 int LUKSCrypt(
     LUKSCryptMode mode,
     const LUKSHeader *header, 
@@ -105,6 +235,31 @@ int LUKSCrypt(
     UINTN dataSize, 
     UINT64 sectorNumber);
 
+int LUKSInitCryptContext(
+    LUKSCryptContext* context,
+    const LUKSHeader *header, 
+    const UINT8 *key);
+
+/* Use encryption sectors of 'sectorSize' bytes (LUKS2): as in dm-crypt,
+ * 'ivTweak' LUKS sectors are added to the position, and the IV of a sector
+ * is then its index in 'sectorSize' units */
+int LUKSSetCryptSectorSize(
+    LUKSCryptContext* context,
+    UINT32 sectorSize,
+    UINT64 ivTweak);
+
+/* Release the ciphers and wipe the key material they hold */
+void LUKSFreeCryptContext(
+    LUKSCryptContext* context);
+
+int LUKSCryptWithContext(
+    LUKSCryptContext* context,
+    LUKSCryptMode mode,
+    const UINT8 *dataIn, 
+    UINT8 *dataOut, 
+    UINTN dataSize, 
+    UINT64 sectorNumber);
+
 int LUKSGetPayloadSector(
     Blkdev* rawdev,
     const LUKSHeader *header,
@@ -145,8 +300,6 @@ int LUKSFindBootDevice(
 **==============================================================================
 */
 
-typedef struct _LUKSCipher LUKSCipher;
-
 void LUKSInitialize();
 
 void LUKSShutdown();
@@ -172,6 +325,18 @@ int LUKSCryptData(
     UINTN inSize,
     UINT8 *out);
 
+/* Crypt 'nsectors' sectors of 'sectorSize' bytes each, where sector i uses
+ * the IV at ivs + i * ivSize */
+int LUKSCryptSectors(
+    LUKSCipher* cipher,
+    LUKSCryptMode mode,
+    const UINT8 *ivs,
+    UINTN ivSize,
+    const UINT8 *in,
+    UINT8 *out,
+    UINTN sectorSize,
+    UINTN nsectors);
+
 int LUKSDeriveKey(
     const char *pass, 
     int passlen,
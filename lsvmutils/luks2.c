@@ -0,0 +1,999 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#include "luks2.h"
+#include "alloc.h"
+#include "strings.h"
+#include "byteorder.h"
+#include "sha.h"
+
+/* Most JSON tokens accepted (each keyslot takes about 30) */
+#define JSON_MAX_TOKENS 4096
+
+/* Deepest nesting accepted (LUKS2 metadata is four levels deep) */
+#define JSON_MAX_DEPTH 16
+
+/* Token 0 is unused so that lookups can return 0 for 'not found' */
+#define JSON_ROOT 1
+
+static UINT8 _magic[LUKS_MAGIC_SIZE] = LUKS_MAGIC_INITIALIZER;
+
+/*
+**==============================================================================
+**
+** JSON: a flat array of tokens where each object or array is followed by its
+** members (objects alternate key and value tokens) and 'next' is the index
+** of the token following the whole subtree.
+**
+**==============================================================================
+*/
+
+typedef enum _JSONType
+{
+    JSON_OBJECT,
+    JSON_ARRAY,
+    JSON_STRING,
+    JSON_PRIMITIVE
+}
+JSONType;
+
+typedef struct _JSONToken
+{
+    JSONType type;
+    const char* str; /* strings exclude the quotes */
+    UINTN len;
+    UINTN size; /* members of an object or array */
+    UINTN next;
+}
+JSONToken;
+
+typedef struct _JSON
+{
+    const char* text;
+    UINTN length;
+    UINTN pos;
+    JSONToken* tokens;
+    UINTN ntokens;
+}
+JSON;
+
+static void _SkipSpace(
+    JSON* json)
+{
+    while (json->pos < json->length && Isspace(json->text[json->pos]))
+        json->pos++;
+}
+
+static BOOLEAN _Expect(
+    JSON* json,
+    char c)
+{
+    _SkipSpace(json);
+
+    if (json->pos >= json->length || json->text[json->pos] != c)
+        return FALSE;
+
+    json->pos++;
+    return TRUE;
+}
+
+static int _ParseValue(
+    JSON* json,
+    UINTN depth)
+{
+    JSONToken* token;
+    UINTN index;
+    char c;
+
+    _SkipSpace(json);
+
+    if (json->pos >= json->length || depth > JSON_MAX_DEPTH ||
+        json->ntokens == JSON_MAX_TOKENS)
+    {
+        return -1;
+    }
+
+    index = json->ntokens++;
+    token = &json->tokens[index];
+    Memset(token, 0, sizeof(JSONToken));
+    token->str = json->text + json->pos;
+    c = json->text[json->pos];
+
+    if (c == '{' || c == '[')
+    {
+        char close = (c == '{') ? '}' : ']';
+
+        token->type = (c == '{') ? JSON_OBJECT : JSON_ARRAY;
+        json->pos++;
+        _SkipSpace(json);
+
+        if (json->pos < json->length && json->text[json->pos] == close)
+        {
+            json->pos++;
+        }
+        else
+        {
+            for (;;)
+            {
+                if (token->type == JSON_OBJECT)
+                {
+                    _SkipSpace(json);
+
+                    if (json->pos >= json->length || 
+                        json->text[json->pos] != '"')
+                    {
+                        return -1;
+                    }
+
+                    if (_ParseValue(json, depth + 1) != 0 ||
+                        !_Expect(json, ':'))
+                    {
+                        return -1;
+                    }
+                }
+
+                if (_ParseValue(json, depth + 1) != 0)
+                    return -1;
+
+                token->size++;
+
+                if (_Expect(json, ','))
+                    continue;
+
+                if (!_Expect(json, close))
+                    return -1;
+
+                break;
+            }
+        }
+    }
+    else if (c == '"')
+    {
+        token->type = JSON_STRING;
+        token->str++;
+        json->pos++;
+
+        while (json->pos < json->length && json->text[json->pos] != '"')
+        {
+            /* Skip escaped characters */
+            if (json->text[json->pos] == '\\')
+                json->pos++;
+
+            json->pos++;
+        }
+
+        if (json->pos >= json->length)
+            return -1;
+
+        token->len = json->text + json->pos - token->str;
+        json->pos++;
+    }
+    else
+    {
+        token->type = JSON_PRIMITIVE;
+
+        while (json->pos < json->length && 
+            !Isspace(json->text[json->pos]) &&
+            json->text[json->pos] != ',' &&
+            json->text[json->pos] != '}' &&
+            json->text[json->pos] != ']')
+        {
+            json->pos++;
+        }
+
+        token->len = json->text + json->pos - token->str;
+
+        if (token->len == 0)
+            return -1;
+    }
+
+    token->next = json->ntokens;
+    return 0;
+}
+
+static int _ParseJSON(
+    JSON* json,
+    const char* text,
+    UINTN length)
+{
+    Memset(json, 0, sizeof(JSON));
+    json->text = text;
+    json->length = length;
+
+    if (!(json->tokens = (JSONToken*)Malloc(
+        JSON_MAX_TOKENS * sizeof(JSONToken))))
+    {
+        return -1;
+    }
+
+    Memset(&json->tokens[0], 0, sizeof(JSONToken));
+    json->ntokens = JSON_ROOT;
+
+    if (_ParseValue(json, 0) != 0 || 
+        json->tokens[JSON_ROOT].type != JSON_OBJECT)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static BOOLEAN _Equal(
+    const JSONToken* token,
+    const char* str)
+{
+    UINTN len = Strlen(str);
+    return token->len == len && Memcmp(token->str, str, len) == 0;
+}
+
+/* Return the value of the member named 'key' (or 0 if none) */
+static UINTN _Member(
+    const JSON* json,
+    UINTN obj,
+    const char* key)
+{
+    const JSONToken* tokens = json->tokens;
+    UINTN i = obj + 1;
+    UINTN k;
+
+    if (!obj || tokens[obj].type != JSON_OBJECT)
+        return 0;
+
+    for (k = 0; k < tokens[obj].size; k++)
+    {
+        if (tokens[i].type == JSON_STRING && _Equal(&tokens[i], key))
+            return i + 1;
+
+        i = tokens[i + 1].next;
+    }
+
+    return 0;
+}
+
+static int _GetString(
+    const JSON* json,
+    UINTN obj,
+    const char* key,
+    char* buf,
+    UINTN size)
+{
+    UINTN value = _Member(json, obj, key);
+    const JSONToken* token = &json->tokens[value];
+
+    if (!value || token->type != JSON_STRING || token->len >= size)
+        return -1;
+
+    Memcpy(buf, token->str, token->len);
+    buf[token->len] = '\0';
+
+    return 0;
+}
+
+/* 64-bit values are strings in LUKS2 metadata, smaller ones are numbers */
+static int _GetU64(
+    const JSON* json,
+    UINTN obj,
+    const char* key,
+    UINT64* result)
+{
+    UINTN value = _Member(json, obj, key);
+    const JSONToken* token = &json->tokens[value];
+    UINT64 x = 0;
+    UINTN i;
+
+    if (!value || token->len == 0 || token->len > 20 ||
+        (token->type != JSON_STRING && token->type != JSON_PRIMITIVE))
+    {
+        return -1;
+    }
+
+    for (i = 0; i < token->len; i++)
+    {
+        if (!Isdigit(token->str[i]))
+            return -1;
+
+        x = x * 10 + (token->str[i] - '0');
+    }
+
+    *result = x;
+    return 0;
+}
+
+static int _GetU32(
+    const JSON* json,
+    UINTN obj,
+    const char* key,
+    UINT32* result)
+{
+    UINT64 x;
+
+    if (_GetU64(json, obj, key, &x) != 0 || x > 0xFFFFFFFF)
+        return -1;
+
+    *result = (UINT32)x;
+    return 0;
+}
+
+/* Return TRUE if the array of strings contains the given string token */
+static BOOLEAN _ArrayHas(
+    const JSON* json,
+    UINTN array,
+    const JSONToken* str)
+{
+    const JSONToken* tokens = json->tokens;
+    UINTN i = array + 1;
+    UINTN k;
+
+    if (!array || tokens[array].type != JSON_ARRAY)
+        return FALSE;
+
+    for (k = 0; k < tokens[array].size; k++)
+    {
+        if (tokens[i].len == str->len && 
+            Memcmp(tokens[i].str, str->str, str->len) == 0)
+        {
+            return TRUE;
+        }
+
+        i = tokens[i].next;
+    }
+
+    return FALSE;
+}
+
+static int _Base64Value(
+    char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+
+    if (c == '+')
+        return 62;
+
+    if (c == '/')
+        return 63;
+
+    return -1;
+}
+
+static int _GetBase64(
+    const JSON* json,
+    UINTN obj,
+    const char* key,
+    UINT8* data,
+    UINTN maxSize,
+    UINTN* size)
+{
+    UINTN value = _Member(json, obj, key);
+    const JSONToken* token = &json->tokens[value];
+    UINT32 bits = 0;
+    UINTN nbits = 0;
+    UINTN n = 0;
+    UINTN i;
+
+    if (!value || token->type != JSON_STRING)
+        return -1;
+
+    for (i = 0; i < token->len && token->str[i] != '='; i++)
+    {
+        int x;
+
+        if ((x = _Base64Value(token->str[i])) < 0)
+            return -1;
+
+        bits = (bits << 6) | x;
+        nbits += 6;
+
+        if (nbits >= 8)
+        {
+            nbits -= 8;
+
+            if (n == maxSize)
+                return -1;
+
+            data[n++] = (UINT8)(bits >> nbits);
+        }
+    }
+
+    *size = n;
+    return 0;
+}
+
+/*
+**==============================================================================
+**
+** Metadata:
+**
+**==============================================================================
+*/
+
+/* Split "aes-xts-plain64" into "aes" and "xts-plain64" */
+static int _SetCipher(
+    LUKSHeader* header,
+    const char* encryption)
+{
+    const char* dash = Strchr(encryption, '-');
+    UINTN len;
+
+    if (!dash || (len = dash - encryption) >= LUKS_CIPHER_NAME_SIZE)
+        return -1;
+
+    Memcpy(header->cipher_name, encryption, len);
+    header->cipher_name[len] = '\0';
+
+    if (Strlcpy(header->cipher_mode, dash + 1, LUKS_CIPHER_MODE_SIZE) >= 
+        LUKS_CIPHER_MODE_SIZE)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Find the data segment: the crypt segment with the lowest id */
+static UINTN _FindSegment(
+    const JSON* json,
+    UINTN segments,
+    UINTN* idOut)
+{
+    const JSONToken* tokens = json->tokens;
+    UINTN result = 0;
+    UINT64 best = 0;
+    UINTN i = segments + 1;
+    UINTN k;
+
+    if (!segments || tokens[segments].type != JSON_OBJECT)
+        return 0;
+
+    for (k = 0; k < tokens[segments].size; k++)
+    {
+        UINTN value = i + 1;
+        char type[16];
+        UINT64 id = 0;
+        UINTN j;
+
+        for (j = 0; j < tokens[i].len && Isdigit(tokens[i].str[j]); j++)
+            id = id * 10 + (tokens[i].str[j] - '0');
+
+        if (_GetString(json, value, "type", type, sizeof(type)) == 0 &&
+            Strcmp(type, "crypt") == 0 &&
+            (!result || id < best))
+        {
+            result = value;
+            best = id;
+            *idOut = i;
+        }
+
+        i = tokens[value].next;
+    }
+
+    return result;
+}
+
+static int _ParseSegment(
+    const JSON* json,
+    UINTN segment,
+    LUKS2Header* header)
+{
+    char encryption[LUKS_CIPHER_NAME_SIZE + LUKS_CIPHER_MODE_SIZE];
+    UINT64 offset;
+    UINT32 sectorSize;
+
+    if (_GetU64(json, segment, "offset", &offset) != 0 ||
+        _GetU64(json, segment, "iv_tweak", &header->ivTweak) != 0 ||
+        _GetU32(json, segment, "sector_size", &sectorSize) != 0 ||
+        _GetString(json, segment, "encryption", encryption, 
+            sizeof(encryption)) != 0)
+    {
+        return -1;
+    }
+
+    if (offset % sectorSize || offset % LUKS_SECTOR_SIZE ||
+        offset / LUKS_SECTOR_SIZE > 0xFFFFFFFF)
+    {
+        return -1;
+    }
+
+    header->header.payload_offset = (UINT32)(offset / LUKS_SECTOR_SIZE);
+    header->sectorSize = sectorSize;
+
+    return _SetCipher(&header->header, encryption);
+}
+
+/* Find the PBKDF2 digest that covers the given segment */
+static UINTN _FindDigest(
+    const JSON* json,
+    UINTN digests,
+    UINTN segmentId)
+{
+    const JSONToken* tokens = json->tokens;
+    UINTN i = digests + 1;
+    UINTN k;
+
+    if (!digests || tokens[digests].type != JSON_OBJECT)
+        return 0;
+
+    for (k = 0; k < tokens[digests].size; k++)
+    {
+        UINTN value = i + 1;
+        char type[16];
+
+        if (_GetString(json, value, "type", type, sizeof(type)) == 0 &&
+            Strcmp(type, "pbkdf2") == 0 &&
+            _ArrayHas(json, _Member(json, value, "segments"), 
+                &tokens[segmentId]))
+        {
+            return value;
+        }
+
+        i = tokens[value].next;
+    }
+
+    return 0;
+}
+
+static int _ParseDigest(
+    const JSON* json,
+    UINTN digest,
+    LUKS2Header* header)
+{
+    if (_GetString(json, digest, "hash", header->digestHash,
+            sizeof(header->digestHash)) != 0 ||
+        _GetU32(json, digest, "iterations", &header->digestIterations) != 0 ||
+        _GetBase64(json, digest, "salt", header->digestSalt, 
+            sizeof(header->digestSalt), &header->digestSaltSize) != 0 ||
+        _GetBase64(json, digest, "digest", header->digest, 
+            sizeof(header->digest), &header->digestSize) != 0 ||
+        header->digestSize == 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Describe a PBKDF2 keyslot in LUKS1 terms (returns 1 to skip others) */
+static int _ParseKeySlot(
+    const JSON* json,
+    UINTN keyslot,
+    LUKS2KeySlot* ks)
+{
+    UINTN af = _Member(json, keyslot, "af");
+    UINTN area = _Member(json, keyslot, "area");
+    UINTN kdf = _Member(json, keyslot, "kdf");
+    char type[16];
+    char kdfHash[LUKS_HASH_SPEC_SIZE];
+    char encryption[LUKS_CIPHER_NAME_SIZE + LUKS_CIPHER_MODE_SIZE];
+    UINT32 areaKeySize;
+    UINT64 offset;
+    UINTN saltSize;
+
+    if (_GetString(json, keyslot, "type", type, sizeof(type)) != 0 ||
+        _GetU32(json, keyslot, "key_size", &ks->header.key_bytes) != 0)
+    {
+        return -1;
+    }
+
+    /* Only "luks2" keyslots with PBKDF2 (not Argon2) are supported */
+    if (Strcmp(type, "luks2") != 0)
+        return 1;
+
+    if (_GetString(json, kdf, "type", type, sizeof(type)) != 0 ||
+        Strcmp(type, "pbkdf2") != 0)
+    {
+        return 1;
+    }
+
+    if (_GetString(json, kdf, "hash", kdfHash, sizeof(kdfHash)) != 0 ||
+        _GetU32(json, kdf, "iterations", &ks->slot.password_iters) != 0 ||
+        _GetBase64(json, kdf, "salt", ks->slot.password_salt, 
+            sizeof(ks->slot.password_salt), &saltSize) != 0 ||
+        saltSize != LUKS_SALT_SIZE)
+    {
+        return -1;
+    }
+
+    if (_GetString(json, af, "type", type, sizeof(type)) != 0 ||
+        Strcmp(type, "luks1") != 0 ||
+        _GetString(json, af, "hash", ks->header.hash_spec, 
+            sizeof(ks->header.hash_spec)) != 0 ||
+        _GetU32(json, af, "stripes", &ks->slot.af_stripes) != 0)
+    {
+        return -1;
+    }
+
+    if (_GetString(json, area, "type", type, sizeof(type)) != 0 ||
+        Strcmp(type, "raw") != 0 ||
+        _GetU64(json, area, "offset", &offset) != 0 ||
+        _GetU32(json, area, "key_size", &areaKeySize) != 0 ||
+        _GetString(json, area, "encryption", encryption, 
+            sizeof(encryption)) != 0 ||
+        _SetCipher(&ks->header, encryption) != 0)
+    {
+        return -1;
+    }
+
+    /* LUKS1 keyslots use one hash and one key size for everything */
+    if (Strcmp(kdfHash, ks->header.hash_spec) != 0 ||
+        areaKeySize != ks->header.key_bytes ||
+        offset % LUKS_SECTOR_SIZE)
+    {
+        return 1;
+    }
+
+    ks->slot.key_material_offset = (UINT32)(offset / LUKS_SECTOR_SIZE);
+
+    return 0;
+}
+
+static int _ParseMetadata(
+    const JSON* json,
+    LUKS2Header* header)
+{
+    const JSONToken* tokens = json->tokens;
+    UINTN segmentId = 0;
+    UINTN segment;
+    UINTN digest;
+    UINTN keyslots;
+    UINTN i;
+    UINTN k;
+
+    /* The data segment */
+    if (!(segment = _FindSegment(json, _Member(json, JSON_ROOT, "segments"), 
+        &segmentId)))
+    {
+        return -1;
+    }
+
+    if (_ParseSegment(json, segment, header) != 0)
+        return -1;
+
+    /* The digest of the volume key */
+    if (!(digest = _FindDigest(json, _Member(json, JSON_ROOT, "digests"), segmentId)))
+        return -1;
+
+    if (_ParseDigest(json, digest, header) != 0)
+        return -1;
+
+    Strlcpy(header->header.hash_spec, header->digestHash, 
+        sizeof(header->header.hash_spec));
+
+    /* The keyslots that unlock that volume key */
+    if (!(keyslots = _Member(json, JSON_ROOT, "keyslots")) ||
+        tokens[keyslots].type != JSON_OBJECT)
+    {
+        return -1;
+    }
+
+    for (i = keyslots + 1, k = 0; k < tokens[keyslots].size; k++)
+    {
+        UINTN value = i + 1;
+        UINT64 id = 0;
+        UINTN j;
+
+        if (_ArrayHas(json, _Member(json, digest, "keyslots"), &tokens[i]) &&
+            header->nkeyslots < LUKS2_MAX_KEYSLOTS)
+        {
+            LUKS2KeySlot* ks = &header->keyslots[header->nkeyslots];
+            int r;
+
+            for (j = 0; j < tokens[i].len && Isdigit(tokens[i].str[j]); j++)
+                id = id * 10 + (tokens[i].str[j] - '0');
+
+            Memset(ks, 0, sizeof(LUKS2KeySlot));
+            ks->id = (UINT32)id;
+
+            if ((r = _ParseKeySlot(json, value, ks)) < 0)
+                return -1;
+
+            /* The volume key is as large as any of its keyslot keys */
+            header->header.key_bytes = ks->header.key_bytes;
+
+            if (r == 0)
+                header->nkeyslots++;
+        }
+
+        i = tokens[value].next;
+    }
+
+    if (header->header.key_bytes == 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+**==============================================================================
+**
+** Public definitions:
+**
+**==============================================================================
+*/
+
+BOOLEAN IsRawLUKS2Device(
+    Blkdev* rawdev)
+{
+    union
+    {
+        LUKSHeader header;
+        UINT8 sectors[LUKS_SECTOR_SIZE];
+    }
+    u;
+
+    if (!rawdev || BlkdevRead(rawdev, 0, &u, sizeof(u)) != 0)
+        return FALSE;
+
+    return Memcmp(u.header.magic, _magic, LUKS_MAGIC_SIZE) == 0 &&
+        ByteSwapU16(u.header.version) == 2;
+}
+
+int LUKS2ReadHeader(
+    Blkdev* rawdev,
+    LUKS2Header* header)
+{
+    int rc = -1;
+    LUKS2BinaryHeader* bin = NULL;
+    UINT8* data = NULL;
+    UINT64 size = 0;
+    JSON json;
+
+    Memset(&json, 0, sizeof(json));
+
+    if (!rawdev || !header)
+        goto done;
+
+    Memset(header, 0, sizeof(LUKS2Header));
+
+    /* Read the binary header */
+    if (!(bin = (LUKS2BinaryHeader*)Malloc(sizeof(LUKS2BinaryHeader))))
+        goto done;
+
+    if (BlkdevReadBytes(rawdev, 0, bin, sizeof(LUKS2BinaryHeader)) != 0)
+        goto done;
+
+    if (Memcmp(bin->magic, _magic, LUKS_MAGIC_SIZE) != 0 ||
+        ByteSwapU16(bin->version) != 2)
+    {
+        goto done;
+    }
+
+    size = ByteSwapU64(bin->hdr_size);
+
+    if (size <= LUKS2_BINARY_HEADER_SIZE || size > LUKS2_MAX_HEADER_SIZE ||
+        size % LUKS2_BINARY_HEADER_SIZE)
+    {
+        goto done;
+    }
+
+    /* Read the binary header with the JSON area */
+    if (!(data = (UINT8*)Malloc(size)))
+        goto done;
+
+    if (BlkdevReadBytes(rawdev, 0, data, size) != 0)
+        goto done;
+
+    /* Verify the checksum (computed with the checksum field zeroed) */
+    {
+        LUKS2BinaryHeader* h = (LUKS2BinaryHeader*)data;
+        SHA256Hash sha256;
+
+        if (Strncmp(h->checksum_alg, "sha256", sizeof(h->checksum_alg)) != 0)
+            goto done;
+
+        Memset(h->csum, 0, sizeof(h->csum));
+
+        if (!ComputeSHA256(data, size, &sha256))
+            goto done;
+
+        if (Memcmp(sha256.buf, bin->csum, sizeof(sha256.buf)) != 0)
+            goto done;
+    }
+
+    /* Parse the JSON text (NUL-padded to the end of the area) */
+    {
+        const char* text = (const char*)data + LUKS2_BINARY_HEADER_SIZE;
+        UINTN max = size - LUKS2_BINARY_HEADER_SIZE;
+        UINTN length = 0;
+
+        while (length < max && text[length])
+            length++;
+
+        if (_ParseJSON(&json, text, length) != 0)
+            goto done;
+    }
+
+    if (_ParseMetadata(&json, header) != 0)
+        goto done;
+
+    /* Fill in the rest of the LUKS1 view of the data segment */
+    Memcpy(header->header.magic, _magic, LUKS_MAGIC_SIZE);
+    header->header.version = 2;
+    Memcpy(header->header.uuid, bin->uuid, LUKS_UUID_STRING_SIZE);
+    header->header.uuid[LUKS_UUID_STRING_SIZE - 1] = '\0';
+
+    rc = 0;
+
+done:
+
+    if (json.tokens)
+        Free(json.tokens);
+
+    if (data)
+        Free(data);
+
+    if (bin)
+        Free(bin);
+
+    return rc;
+}
+
+int LUKS2VerifyMasterKey(
+    const LUKS2Header* header,
+    const UINT8* masterKey)
+{
+    int rc = -1;
+    UINT8 digest[LUKS2_MAX_DIGEST_SIZE];
+
+    if (!header || !masterKey)
+        goto done;
+
+    if (LUKSDeriveKey(
+        (const char*)masterKey,
+        header->header.key_bytes,
+        header->digestSalt,
+        header->digestSaltSize,
+        header->digestIterations,
+        header->digestHash,
+        header->digestSize,
+        digest) != 0)
+    {
+        goto done;
+    }
+
+    if (Memcmp(digest, header->digest, header->digestSize) != 0)
+        goto done;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+int LUKS2GetMasterKeyWithHint(
+    Blkdev* rawdev,
+    const LUKS2Header* header,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    UINTN slotHint,
+    UINT8* masterKey,
+    UINTN* slotId)
+{
+    int rc = -1;
+    LUKSSlotKey keys[LUKS2_MAX_KEYSLOTS];
+    UINT32 ids[LUKS2_MAX_KEYSLOTS];
+    UINTN nkeys = 0;
+    const LUKS2KeySlot* ks;
+    UINTN i;
+
+    if (!rawdev || !header || !passphrase || !masterKey)
+        return -1;
+
+    LUKSInitialize();
+
+    Memset(keys, 0, sizeof(keys));
+
+    /* Try the hinted keyslot first (it usually opens) */
+    if ((ks = LUKS2FindKeySlot(header, slotHint)) &&
+        LUKSOpenKeySlot(
+            rawdev,
+            &ks->header,
+            &ks->slot,
+            passphrase,
+            passphraseSize,
+            masterKey) == 0 &&
+        LUKS2VerifyMasterKey(header, masterKey) == 0)
+    {
+        if (slotId)
+            *slotId = ks->id;
+
+        rc = 0;
+        goto done;
+    }
+
+    /* Derive the keys of the others together, then try them in order */
+    for (i = 0; i < header->nkeyslots; i++)
+    {
+        if ((ks = &header->keyslots[i])->id == slotHint)
+            continue;
+
+        keys[nkeys].header = &ks->header;
+        keys[nkeys].slot = &ks->slot;
+        ids[nkeys] = ks->id;
+        nkeys++;
+    }
+
+    if (LUKSDeriveSlotKeys(keys, nkeys, passphrase, passphraseSize) != 0)
+        goto done;
+
+    for (i = 0; i < nkeys; i++)
+    {
+        if (LUKSOpenSlotKey(rawdev, &keys[i], masterKey) == 0 &&
+            LUKS2VerifyMasterKey(header, masterKey) == 0)
+        {
+            if (slotId)
+                *slotId = ids[i];
+
+            rc = 0;
+            goto done;
+        }
+    }
+
+done:
+
+    if (rc != 0)
+        Memset(masterKey, 0, header->header.key_bytes);
+
+    Memset(keys, 0, sizeof(keys));
+    return rc;
+}
+
+int LUKS2GetMasterKey(
+    Blkdev* rawdev,
+    const LUKS2Header* header,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    UINT8* masterKey)
+{
+    return LUKS2GetMasterKeyWithHint(rawdev, header, passphrase, 
+        passphraseSize, LUKS_SLOT_HINT_NONE, masterKey, NULL);
+}
+
+const LUKS2KeySlot* LUKS2FindKeySlot(
+    const LUKS2Header* header,
+    UINTN id)
+{
+    UINTN i;
+
+    if (!header)
+        return NULL;
+
+    for (i = 0; i < header->nkeyslots; i++)
+    {
+        if (header->keyslots[i].id == id)
+            return &header->keyslots[i];
+    }
+
+    return NULL;
+}
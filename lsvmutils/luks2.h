@@ -0,0 +1,140 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#ifndef _luks2_h
+#define _luks2_h
+
+#include "config.h"
+#include <lsvmutils/luks.h>
+#include <lsvmutils/blkdev.h>
+
+#define LUKS2_BINARY_HEADER_SIZE 4096
+
+/* Largest metadata area accepted (binary header plus JSON) */
+#define LUKS2_MAX_HEADER_SIZE (4 * 1024 * 1024)
+
+#define LUKS2_MAX_KEYSLOTS 32
+#define LUKS2_MAX_SALT_SIZE 64
+#define LUKS2_MAX_DIGEST_SIZE 64
+
+/* On-disk binary header (big-endian), followed by the JSON metadata */
+typedef struct _LUKS2BinaryHeader
+{
+    UINT8 magic[LUKS_MAGIC_SIZE];
+    UINT16 version;
+    UINT64 hdr_size;
+    UINT64 seqid;
+    char label[48];
+    char checksum_alg[32];
+    UINT8 salt[64];
+    char uuid[LUKS_UUID_STRING_SIZE];
+    char subsystem[48];
+    UINT64 hdr_offset;
+    UINT8 padding[184];
+    UINT8 csum[64];
+    UINT8 padding4096[7 * 512];
+}
+PACKED
+LUKS2BinaryHeader;
+
+/* A PBKDF2 keyslot described in LUKS1 terms: 'header' holds the area
+ * cipher, the hash and the key size; 'slot' holds the KDF salt and
+ * iterations and the area offset (in LUKS sectors) and stripes */
+typedef struct _LUKS2KeySlot
+{
+    UINT32 id;
+    LUKSHeader header;
+    LUKSKeySlot slot;
+}
+LUKS2KeySlot;
+
+typedef struct _LUKS2Header
+{
+    /* The data segment in LUKS1 terms (cipher, key size, payload offset,
+     * UUID), usable wherever a LUKSHeader is expected for crypting */
+    LUKSHeader header;
+
+    /* Encryption sector size of the data segment and its first IV */
+    UINT32 sectorSize;
+    UINT64 ivTweak;
+
+    /* PBKDF2 keyslots (other KDFs are skipped) */
+    LUKS2KeySlot keyslots[LUKS2_MAX_KEYSLOTS];
+    UINTN nkeyslots;
+
+    /* Digest that verifies the volume key */
+    char digestHash[LUKS_HASH_SPEC_SIZE];
+    UINT32 digestIterations;
+    UINT8 digestSalt[LUKS2_MAX_SALT_SIZE];
+    UINTN digestSaltSize;
+    UINT8 digest[LUKS2_MAX_DIGEST_SIZE];
+    UINTN digestSize;
+}
+LUKS2Header;
+
+/* Return TRUE if the raw device starts with a LUKS2 header */
+BOOLEAN IsRawLUKS2Device(
+    Blkdev* rawdev);
+
+/* Read and verify the primary header and parse its JSON metadata */
+int LUKS2ReadHeader(
+    Blkdev* rawdev,
+    LUKS2Header* header);
+
+/* Check the volume key against the digest */
+int LUKS2VerifyMasterKey(
+    const LUKS2Header* header,
+    const UINT8* masterKey);
+
+/* Try each keyslot with the passphrase ('masterKey' has room for
+ * header->header.key_bytes bytes) */
+int LUKS2GetMasterKey(
+    Blkdev* rawdev,
+    const LUKS2Header* header,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    UINT8* masterKey);
+
+/* Like LUKS2GetMasterKey() but try the keyslot with id 'slotHint' first
+ * and return the id of the keyslot that opened in 'slotId' (if not null) */
+int LUKS2GetMasterKeyWithHint(
+    Blkdev* rawdev,
+    const LUKS2Header* header,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    UINTN slotHint,
+    UINT8* masterKey,
+    UINTN* slotId);
+
+/* Return the usable keyslot with the given id (or null) */
+const LUKS2KeySlot* LUKS2FindKeySlot(
+    const LUKS2Header* header,
+    UINTN id);
+
+#endif /* _luks2_h */
@@ -29,12 +29,20 @@
 */
 #include "luksblkdev.h"
 #include "luks.h"
+#include "luks2.h"
+#if !defined(BUILD_EFI)
+# include "lukskeyslots.h"
+#endif
 #include "alloc.h"
 #include "strings.h"
 #include "print.h"
 
 #define LUKSBLKDEV_MAGIC 0x5acdeed9
 
+/* Large reads are split into chunks of this size so that the next chunk
+ * can be read while the current one is being decrypted */
+#define PIPELINE_BYTES (256 * 1024)
+
 typedef struct _BlkdevImpl BlkdevImpl;
 
 struct _BlkdevImpl
@@ -44,8 +52,56 @@ struct _BlkdevImpl
     LUKSHeader header;
     Blkdev* rawdev; /* underlying raw LUKS device */
     UINT8* masterkey; /* size is header->key_bytes */
+    LUKSCryptContext crypt; /* ciphers derived from the master key */
+
+    /* Blocks of this device are the larger of the raw device block size
+     * and the encryption sector size (512 for LUKS1, up to 4K for LUKS2) */
+    UINTN sectorsPerBlock; /* LUKS sectors per block */
+    UINTN rawBlocksPerBlock; /* raw device blocks per block */
+    UINTN payloadBlkno; /* raw device block where the payload starts */
 };
 
+/* Match the block size of the raw device (4Kn media keep 4K blocks) */
+static int _InitGeometry(
+    BlkdevImpl* impl,
+    Blkdev* rawdev,
+    UINT32 sectorSize)
+{
+    UINTN rawblksize = BlkdevBlockSize(rawdev);
+    UINTN blksize = rawblksize;
+    UINTN sectorsPerRawBlock;
+
+    if (!rawblksize || rawblksize % LUKS_SECTOR_SIZE)
+        return -1;
+
+    if (sectorSize > blksize)
+        blksize = sectorSize;
+
+    if (blksize % rawblksize || blksize % sectorSize)
+        return -1;
+
+    impl->base.blksize = blksize;
+    impl->sectorsPerBlock = blksize / LUKS_SECTOR_SIZE;
+    impl->rawBlocksPerBlock = blksize / rawblksize;
+    sectorsPerRawBlock = rawblksize / LUKS_SECTOR_SIZE;
+
+    /* The payload must start on a block boundary */
+    if (impl->header.payload_offset % impl->sectorsPerBlock)
+        return -1;
+
+    impl->payloadBlkno = impl->header.payload_offset / sectorsPerRawBlock;
+
+    return 0;
+}
+
+/* Raw device block that holds the given block */
+static UINTN _RawBlkno(
+    const BlkdevImpl* impl,
+    UINTN blkno)
+{
+    return impl->payloadBlkno + blkno * impl->rawBlocksPerBlock;
+}
+
 static BOOLEAN _ValidLUKSBlkdev(
     Blkdev* dev)
 {
@@ -62,12 +118,18 @@ static int _Close(
     if (!_ValidLUKSBlkdev(dev))
         goto done;
 
+    LUKSFreeCryptContext(&impl->crypt);
+
     if (impl->masterkey)
+    {
+        Memset(impl->masterkey, 0, impl->header.key_bytes);
         Free(impl->masterkey);
+    }
 
     if (impl->rawdev)
         impl->rawdev->Close(impl->rawdev);
 
+    Memset(impl, 0, sizeof(BlkdevImpl));
     Free(impl);
 
     rc = 0;
@@ -76,6 +138,102 @@ done:
     return rc;
 }
 
+static void _InitRead(
+    BlkdevRequest* req,
+    UINTN blkno,
+    UINTN nblocks,
+    void* data)
+{
+    Memset(req, 0, sizeof(BlkdevRequest));
+    req->blkno = blkno;
+    req->nblocks = nblocks;
+    req->data = data;
+}
+
+/* Read into 'tmp' and decrypt into 'data' one chunk at a time, keeping a
+ * read of the following chunk in flight on the raw device */
+static int _ReadDecrypt(
+    BlkdevImpl* impl,
+    UINTN blkno,
+    UINTN nblocks,
+    UINT8* tmp,
+    UINT8* data)
+{
+    int rc = -1;
+    Blkdev* rawdev = impl->rawdev;
+    UINTN blksize = impl->base.blksize;
+    UINTN chunk = PIPELINE_BYTES / blksize;
+    BlkdevRequest req[2];
+    BOOLEAN busy[2] = { FALSE, FALSE };
+    UINTN cur = 0;
+    UINTN i;
+    UINTN n;
+
+    for (i = 0; i < nblocks; i += n)
+    {
+        n = (nblocks - i < chunk) ? nblocks - i : chunk;
+
+        /* Start the first read */
+        if (i == 0)
+        {
+            _InitRead(&req[cur], _RawBlkno(impl, blkno), 
+                n * impl->rawBlocksPerBlock, tmp);
+
+            if (BlkdevSubmit(rawdev, &req[cur]) != 0)
+                goto done;
+
+            busy[cur] = TRUE;
+        }
+
+        /* Start reading the next chunk */
+        if (i + n < nblocks)
+        {
+            UINTN next = i + n;
+            UINTN m = (nblocks - next < chunk) ? nblocks - next : chunk;
+
+            _InitRead(&req[cur ^ 1], _RawBlkno(impl, blkno + next), 
+                m * impl->rawBlocksPerBlock, tmp + next * blksize);
+
+            if (BlkdevSubmit(rawdev, &req[cur ^ 1]) != 0)
+                goto done;
+
+            busy[cur ^ 1] = TRUE;
+        }
+
+        /* Wait for this chunk and decrypt it */
+        busy[cur] = FALSE;
+
+        if (BlkdevComplete(rawdev, &req[cur]) != 0)
+            goto done;
+
+        if (LUKSCryptWithContext(
+            &impl->crypt,
+            LUKS_CRYPT_MODE_DECRYPT,
+            tmp + i * blksize,
+            data + i * blksize,
+            n * blksize,
+            (blkno + i) * impl->sectorsPerBlock) != 0)
+        {
+            goto done;
+        }
+
+        cur ^= 1;
+    }
+
+    rc = 0;
+
+done:
+
+    /* Never return with a read still targeting 'tmp' */
+    for (i = 0; i < 2; i++)
+    {
+        if (busy[i])
+            BlkdevComplete(rawdev, &req[i]);
+    }
+
+    return rc;
+}
+
 static int _GetN(
     Blkdev* dev,
     UINTN blkno,
@@ -84,7 +242,7 @@ static int _GetN(
 {
     int rc = -1;
     BlkdevImpl* impl = (BlkdevImpl*)dev;
-    UINTN toRead = nblocks * BLKDEV_BLKSIZE;
+    UINTN toRead;
     UINT8* tmp = NULL;
     Blkdev* rawdev;
     UINTN startBlkno;
@@ -92,6 +250,8 @@ static int _GetN(
     if (!_ValidLUKSBlkdev(dev) || !data || !impl->rawdev || !impl->masterkey)
         goto done;
 
+    toRead = nblocks * impl->base.blksize;
+
     if (!nblocks)
     {
         rc = 0;
@@ -104,20 +264,32 @@ static int _GetN(
         goto done;
 
     rawdev = impl->rawdev;
-    startBlkno = impl->header.payload_offset + blkno;
+    startBlkno = _RawBlkno(impl, blkno);
+
+    /* Overlap reading and decryption if the raw device is asynchronous */
+    if (rawdev->Submit && toRead > PIPELINE_BYTES)
+    {
+        if (_ReadDecrypt(impl, blkno, nblocks, tmp, (UINT8*)data) != 0)
+            goto done;
 
-    if (rawdev->GetN(rawdev, startBlkno, nblocks, tmp) != 0)
+        rc = 0;
+        goto done;
+    }
+
+    if (rawdev->GetN(rawdev, startBlkno, nblocks * impl->rawBlocksPerBlock, 
+        tmp) != 0)
+    {
         goto done;
+    }
 
     /* Call LUKS function to decrypt the data. */
-    if (LUKSCrypt(
+    if (LUKSCryptWithContext(
+        &impl->crypt,
         LUKS_CRYPT_MODE_DECRYPT,
-        &impl->header,
-        impl->masterkey,
         tmp,
         data,
         toRead,
-        blkno) != 0)
+        blkno * impl->sectorsPerBlock) != 0)
     {
         goto done;
     }
@@ -139,7 +311,7 @@ static int _PutN(
 {
     int rc = -1;
     BlkdevImpl* impl = (BlkdevImpl*)dev;
-    UINTN toWrite = nblocks * BLKDEV_BLKSIZE;
+    UINTN toWrite;
     UINT8* tmp = NULL;
     Blkdev* rawdev;
     UINTN startBlkno;
@@ -149,6 +321,8 @@ static int _PutN(
         goto done;
     }
 
+    toWrite = nblocks * impl->base.blksize;
+
     if (!nblocks)
     {
         rc = 0;
@@ -160,23 +334,25 @@ static int _PutN(
     if (!tmp)
         goto done;
 
-    if (LUKSCrypt(
+    if (LUKSCryptWithContext(
+        &impl->crypt,
         LUKS_CRYPT_MODE_ENCRYPT,
-        &impl->header,
-        impl->masterkey,
         data,
         tmp,
         toWrite,
-        blkno) != 0)
+        blkno * impl->sectorsPerBlock) != 0)
     {
         goto done;
     }
 
     /* Write the encrypted data to the device. */
     rawdev = impl->rawdev;
-    startBlkno = impl->header.payload_offset + blkno;
-    if (rawdev->PutN(rawdev, startBlkno, nblocks, tmp) != 0)
+    startBlkno = _RawBlkno(impl, blkno);
+    if (rawdev->PutN(rawdev, startBlkno, nblocks * impl->rawBlocksPerBlock, 
+        tmp) != 0)
+    {
         goto done;
+    }
 
     rc = 0;
 
@@ -187,6 +363,187 @@ done:
     return rc;
 }
 
+/* Form the raw device segments that correspond to the given segments */
+static BlkdevSegment* _MakeRawSegments(
+    BlkdevImpl* impl,
+    const BlkdevSegment* segments,
+    UINTN nsegments,
+    UINT8** tmpOut)
+{
+    BlkdevSegment* rawsegs = NULL;
+    UINT8* tmp = NULL;
+    UINTN total = 0;
+    UINTN i;
+
+    for (i = 0; i < nsegments; i++)
+        total += segments[i].nblocks;
+
+    if (!(rawsegs = (BlkdevSegment*)Malloc(nsegments * sizeof(BlkdevSegment))))
+        goto done;
+
+    if (!(tmp = (UINT8*)Malloc(total * impl->base.blksize)))
+        goto done;
+
+    /* Lay out the segments back-to-back in the temporary buffer */
+    total = 0;
+
+    for (i = 0; i < nsegments; i++)
+    {
+        rawsegs[i].blkno = _RawBlkno(impl, segments[i].blkno);
+        rawsegs[i].nblocks = segments[i].nblocks * impl->rawBlocksPerBlock;
+        rawsegs[i].data = tmp + total * impl->base.blksize;
+        total += segments[i].nblocks;
+    }
+
+    *tmpOut = tmp;
+    tmp = NULL;
+
+done:
+
+    if (tmp)
+    {
+        Free(tmp);
+        Free(rawsegs);
+        rawsegs = NULL;
+    }
+
+    return rawsegs;
+}
+
+static int _GetV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    BlkdevSegment* rawsegs = NULL;
+    UINT8* tmp = NULL;
+    UINTN i;
+
+    if (!_ValidLUKSBlkdev(dev) || !impl->rawdev || !impl->masterkey)
+        goto done;
+
+    if (!nsegments)
+    {
+        rc = 0;
+        goto done;
+    }
+
+    if (!segments)
+        goto done;
+
+    if (!(rawsegs = _MakeRawSegments(impl, segments, nsegments, &tmp)))
+        goto done;
+
+    /* Read all the segments from the raw device at once. */
+    if (BlkdevGetV(impl->rawdev, rawsegs, nsegments) != 0)
+        goto done;
+
+    /* Decrypt each segment into the caller's buffer. */
+    for (i = 0; i < nsegments; i++)
+    {
+        if (LUKSCryptWithContext(
+            &impl->crypt,
+            LUKS_CRYPT_MODE_DECRYPT,
+            rawsegs[i].data,
+            segments[i].data,
+            segments[i].nblocks * impl->base.blksize,
+            segments[i].blkno * impl->sectorsPerBlock) != 0)
+        {
+            goto done;
+        }
+    }
+
+    rc = 0;
+
+done:
+
+    if (tmp)
+        Free(tmp);
+
+    if (rawsegs)
+        Free(rawsegs);
+
+    return rc;
+}
+
+static int _PutV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    BlkdevSegment* rawsegs = NULL;
+    UINT8* tmp = NULL;
+    UINTN i;
+
+    if (!_ValidLUKSBlkdev(dev) || !impl->rawdev || !impl->masterkey)
+        goto done;
+
+    if (!nsegments)
+    {
+        rc = 0;
+        goto done;
+    }
+
+    if (!segments)
+        goto done;
+
+    if (!(rawsegs = _MakeRawSegments(impl, segments, nsegments, &tmp)))
+        goto done;
+
+    /* Encrypt each segment into the temporary buffer. */
+    for (i = 0; i < nsegments; i++)
+    {
+        if (LUKSCryptWithContext(
+            &impl->crypt,
+            LUKS_CRYPT_MODE_ENCRYPT,
+            segments[i].data,
+            rawsegs[i].data,
+            segments[i].nblocks * impl->base.blksize,
+            segments[i].blkno * impl->sectorsPerBlock) != 0)
+        {
+            goto done;
+        }
+    }
+
+    /* Write all the encrypted segments to the raw device at once. */
+    if (BlkdevPutV(impl->rawdev, rawsegs, nsegments) != 0)
+        goto done;
+
+    rc = 0;
+
+done:
+
+    if (tmp)
+        Free(tmp);
+
+    if (rawsegs)
+        Free(rawsegs);
+
+    return rc;
+}
+
+static int _Flush(
+    Blkdev* dev)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidLUKSBlkdev(dev) || !impl->rawdev)
+        goto done;
+
+    if (BlkdevFlush(impl->rawdev) != 0)
+        goto done;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
 static int _SetFlags(
     Blkdev* dev,
     UINT32 flags)
@@ -195,22 +552,87 @@ static int _SetFlags(
     return -1;
 }
 
+/* Create the device (takes ownership of the master key) */
+static Blkdev* _New(
+    Blkdev* rawdev,
+    const LUKSHeader* header,
+    UINT32 sectorSize,
+    UINT64 ivTweak,
+    UINT8* masterkey)
+{
+    BlkdevImpl* impl = NULL;
+
+    /* Allocate the block device */
+    if (!(impl = (BlkdevImpl*)Calloc(1, sizeof(BlkdevImpl))))
+        goto done;
+
+    /* Initialize the block device */
+    impl->base.Close = _Close;
+    impl->base.GetN = _GetN;
+    impl->base.PutN = _PutN;
+    impl->base.SetFlags = _SetFlags;
+    impl->base.GetV = _GetV;
+    impl->base.PutV = _PutV;
+    impl->base.Flush = _Flush;
+    impl->magic = LUKSBLKDEV_MAGIC;
+    impl->header = *header;
+    impl->rawdev = rawdev;
+
+    if (_InitGeometry(impl, rawdev, sectorSize) != 0 ||
+        LUKSInitCryptContext(&impl->crypt, &impl->header, masterkey) != 0)
+    {
+        Free(impl);
+        impl = NULL;
+        goto done;
+    }
+
+    if (LUKSSetCryptSectorSize(&impl->crypt, sectorSize, ivTweak) != 0)
+    {
+        LUKSFreeCryptContext(&impl->crypt);
+        Free(impl);
+        impl = NULL;
+        goto done;
+    }
+
+    impl->masterkey = masterkey;
+
+done:
+    return &impl->base;
+}
+
 Blkdev* LUKSBlkdevFromMasterkey(
     Blkdev* rawdev,
     const UINT8* masterkey,
     UINT32 masterkeyBytes)
 {
-    BlkdevImpl* impl = NULL;
+    Blkdev* dev = NULL;
     UINT8* masterkeyClone = NULL;
+    LUKS2Header* luks2 = NULL;
     LUKSHeader header;
+    UINT32 sectorSize = LUKS_SECTOR_SIZE;
+    UINT64 ivTweak = 0;
 
     /* Check parameters */
     if (!rawdev || !masterkey)
         goto done;
 
     /* Read the LUKS header */
-    if (LUKSReadHeader(rawdev, &header) != 0)
+    if (IsRawLUKS2Device(rawdev))
+    {
+        if (!(luks2 = (LUKS2Header*)Malloc(sizeof(LUKS2Header))))
+            goto done;
+
+        if (LUKS2ReadHeader(rawdev, luks2) != 0)
+            goto done;
+
+        header = luks2->header;
+        sectorSize = luks2->sectorSize;
+        ivTweak = luks2->ivTweak;
+    }
+    else if (LUKSReadHeader(rawdev, &header) != 0)
+    {
         goto done;
+    }
 
     /* If masterkey size is wrong */
     if (masterkeyBytes != header.key_bytes)
@@ -223,78 +645,123 @@ Blkdev* LUKSBlkdevFromMasterkey(
     /* Clone the master key */
     Memcpy(masterkeyClone, masterkey, header.key_bytes);
 
-    /* Allocate the block device */
-    if (!(impl = (BlkdevImpl*)Calloc(1, sizeof(BlkdevImpl))))
-        goto done;
-
-    /* Initialize the block device */
-    impl->base.Close = _Close;
-    impl->base.PutN = _PutN;
-    impl->base.GetN = _GetN;
-    impl->rawdev = rawdev;
-    impl->magic = LUKSBLKDEV_MAGIC;
-    impl->header = header;
-    impl->masterkey = masterkeyClone;
+    dev = _New(rawdev, &header, sectorSize, ivTweak, masterkeyClone);
 
 done:
 
-    if (!impl)
+    if (!dev)
     {
         if (masterkeyClone)
+        {
+            Memset(masterkeyClone, 0, header.key_bytes);
             Free(masterkeyClone);
+        }
     }
 
-    return &impl->base;
+    if (luks2)
+        Free(luks2);
+
+    return dev;
 }
 
-Blkdev* LUKSBlkdevFromRawBytes(
+Blkdev* LUKSBlkdevFromRawBytesWithHint(
     Blkdev* rawdev,
     const UINT8* passphrase,
-    UINTN passphraseSize)
+    UINTN passphraseSize,
+    UINTN slotHint,
+    UINTN* slot)
 {
-    BlkdevImpl* impl = NULL;
+    Blkdev* dev = NULL;
     UINT8* masterkey = NULL;
+    LUKS2Header* luks2 = NULL;
     LUKSHeader header;
+    UINT32 sectorSize = LUKS_SECTOR_SIZE;
+    UINT64 ivTweak = 0;
 
     /* Check parameters */
     if (!rawdev || !passphrase)
         goto done;
 
     /* Read the LUKS header */
-    if (LUKSReadHeader(rawdev, &header) != 0)
+    if (IsRawLUKS2Device(rawdev))
+    {
+        if (!(luks2 = (LUKS2Header*)Malloc(sizeof(LUKS2Header))))
+            goto done;
+
+        if (LUKS2ReadHeader(rawdev, luks2) != 0)
+            goto done;
+
+        header = luks2->header;
+        sectorSize = luks2->sectorSize;
+        ivTweak = luks2->ivTweak;
+    }
+    else if (LUKSReadHeader(rawdev, &header) != 0)
+    {
         goto done;
+    }
     
     /* Allocate the master key */
     if (!(masterkey = (UINT8*)Calloc(1, header.key_bytes)))
         goto done;
 
-    /* Use passphrase to unlock the master key */
-    if (LUKSGetMasterKey(rawdev, &header, passphrase, passphraseSize, masterkey) != 0)
+    /* Use passphrase to unlock the master key (trying the keyslots in
+     * parallel where threads are available) */
+#if defined(BUILD_EFI)
+    if (luks2)
+    {
+        if (LUKS2GetMasterKeyWithHint(rawdev, luks2, passphrase, 
+            passphraseSize, slotHint, masterkey, slot) != 0)
+        {
+            goto done;
+        }
+    }
+    else if (LUKSGetMasterKeyWithHint(rawdev, &header, passphrase, 
+        passphraseSize, slotHint, masterkey, slot) != 0)
+    {
         goto done;
-
-    /* Allocate the block device */
-    if (!(impl = (BlkdevImpl*)Calloc(1, sizeof(BlkdevImpl))))
+    }
+#else
+    if (luks2)
+    {
+        if (LUKS2GetMasterKeyParallel(rawdev, luks2, passphrase, 
+            passphraseSize, slotHint, masterkey, slot) != 0)
+        {
+            goto done;
+        }
+    }
+    else if (LUKSGetMasterKeyParallel(rawdev, &header, passphrase, 
+        passphraseSize, slotHint, masterkey, slot) != 0)
+    {
         goto done;
+    }
+#endif
 
-    /* Initialize the block device */
-    impl->base.Close = _Close;
-    impl->base.GetN = _GetN;
-    impl->base.PutN = _PutN;
-    impl->base.SetFlags = _SetFlags;
-    impl->magic = LUKSBLKDEV_MAGIC;
-    impl->header = header;
-    impl->rawdev = rawdev;
-    impl->masterkey = masterkey;
+    dev = _New(rawdev, &header, sectorSize, ivTweak, masterkey);
 
 done:
 
-    if (!impl)
+    if (!dev)
     {
         if (masterkey)
+        {
+            Memset(masterkey, 0, header.key_bytes);
             Free(masterkey);
+        }
     }
 
-    return &impl->base;
+    if (luks2)
+        Free(luks2);
+
+    return dev;
+}
+
+Blkdev* LUKSBlkdevFromRawBytes(
+    Blkdev* rawdev,
+    const UINT8* passphrase,
+    UINTN passphraseSize)
+{
+    return LUKSBlkdevFromRawBytesWithHint(rawdev, passphrase, passphraseSize,
+        LUKS_SLOT_HINT_NONE, NULL);
 }
 
 BOOLEAN IsRawLUKSDevice(
@@ -46,6 +46,15 @@ Blkdev* LUKSBlkdevFromRawBytes(
     const UINT8* passphraseData,
     UINTN passphraseBytes);
 
+/* Try keyslot 'slotHint' first (a LUKS2 keyslot id for LUKS2) and return
+ * the keyslot that opened in 'slot' (if not null) */
+Blkdev* LUKSBlkdevFromRawBytesWithHint(
+    Blkdev* rawdev,
+    const UINT8* passphraseData,
+    UINTN passphraseBytes,
+    UINTN slotHint,
+    UINTN* slot);
+
 Blkdev* LUKSBlkdevFromPassphrase(
     Blkdev* rawdev,
     const char *passphrase);
@@ -0,0 +1,430 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#include "lukscryptpool.h"
+#include <pthread.h>
+#include <unistd.h>
+#include "alloc.h"
+#include "strings.h"
+
+/* Bytes crypted by one task (a multiple of LUKS_SECTOR_SIZE) */
+#define CHUNK_BYTES (1024 * 1024)
+
+/* Tasks in flight per worker (bounds the memory held by LUKSCryptPoolCopy) */
+#define TASKS_PER_THREAD 2
+
+typedef enum _TaskState
+{
+    TASK_FREE,
+    TASK_QUEUED,
+    TASK_DONE
+}
+TaskState;
+
+typedef struct _Task Task;
+
+struct _Task
+{
+    LUKSCryptMode mode;
+    const UINT8* in;
+    UINT8* out;
+    UINTN size;
+    UINT64 sector;
+    TaskState state;
+    int status;
+    Task* next;
+};
+
+typedef struct _Worker
+{
+    LUKSCryptPool* pool;
+    pthread_t thread;
+    LUKSCryptContext context; /* keyed EVP contexts cannot be shared */
+}
+Worker;
+
+struct _LUKSCryptPool
+{
+    LUKSHeader header; /* referenced by the worker contexts */
+    Worker workers[LUKSCRYPTPOOL_MAX_THREADS];
+    UINTN nthreads;
+
+    /* Queue of tasks waiting for a worker */
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    Task* head;
+    Task* tail;
+    BOOLEAN stop;
+};
+
+static void* _Work(
+    void* arg)
+{
+    Worker* worker = (Worker*)arg;
+    LUKSCryptPool* pool = worker->pool;
+
+    for (;;)
+    {
+        Task* task;
+
+        pthread_mutex_lock(&pool->lock);
+
+        while (!pool->head && !pool->stop)
+            pthread_cond_wait(&pool->queued, &pool->lock);
+
+        if (!(task = pool->head))
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        if (!(pool->head = task->next))
+            pool->tail = NULL;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        task->status = LUKSCryptWithContext(
+            &worker->context,
+            task->mode,
+            task->in,
+            task->out,
+            task->size,
+            task->sector);
+
+        pthread_mutex_lock(&pool->lock);
+        task->state = TASK_DONE;
+        pthread_cond_broadcast(&pool->finished);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+static void _Submit(
+    LUKSCryptPool* pool,
+    Task* task)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    task->state = TASK_QUEUED;
+    task->next = NULL;
+
+    if (pool->tail)
+        pool->tail->next = task;
+    else
+        pool->head = task;
+
+    pool->tail = task;
+
+    pthread_cond_signal(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static int _Wait(
+    LUKSCryptPool* pool,
+    Task* task)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    while (task->state != TASK_DONE)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+
+    task->state = TASK_FREE;
+    pthread_mutex_unlock(&pool->lock);
+
+    return task->status;
+}
+
+static UINTN _NumTasks(
+    LUKSCryptPool* pool)
+{
+    return pool->nthreads * TASKS_PER_THREAD;
+}
+
+LUKSCryptPool* LUKSCryptPoolNew(
+    const LUKSHeader* header,
+    const UINT8* key,
+    UINTN nthreads)
+{
+    LUKSCryptPool* pool = NULL;
+    UINTN i;
+
+    if (!header || !key)
+        goto done;
+
+    if (nthreads == 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = n > 0 ? (UINTN)n : 1;
+    }
+
+    if (nthreads > LUKSCRYPTPOOL_MAX_THREADS)
+        nthreads = LUKSCRYPTPOOL_MAX_THREADS;
+
+    if (!(pool = (LUKSCryptPool*)Calloc(1, sizeof(LUKSCryptPool))))
+        goto done;
+
+    Memcpy(&pool->header, header, sizeof(LUKSHeader));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    for (i = 0; i < nthreads; i++)
+    {
+        Worker* worker = &pool->workers[i];
+
+        worker->pool = pool;
+
+        if (LUKSInitCryptContext(&worker->context, &pool->header, key) != 0)
+            break;
+
+        if (pthread_create(&worker->thread, NULL, _Work, worker) != 0)
+        {
+            LUKSFreeCryptContext(&worker->context);
+            break;
+        }
+
+        pool->nthreads++;
+    }
+
+    /* Fail only if no worker could be started */
+    if (pool->nthreads == 0)
+    {
+        LUKSCryptPoolDelete(pool);
+        pool = NULL;
+    }
+
+done:
+    return pool;
+}
+
+void LUKSCryptPoolDelete(
+    LUKSCryptPool* pool)
+{
+    UINTN i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = TRUE;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+        LUKSFreeCryptContext(&pool->workers[i].context);
+    }
+
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->queued);
+    pthread_mutex_destroy(&pool->lock);
+
+    Memset(pool, 0, sizeof(LUKSCryptPool));
+    Free(pool);
+}
+
+UINTN LUKSCryptPoolThreads(
+    LUKSCryptPool* pool)
+{
+    return pool ? pool->nthreads : 0;
+}
+
+int LUKSCryptPoolCrypt(
+    LUKSCryptPool* pool,
+    LUKSCryptMode mode,
+    const UINT8* in,
+    UINT8* out,
+    UINTN size,
+    UINT64 sector)
+{
+    int rc = 0;
+    Task* tasks = NULL;
+    UINTN ntasks;
+    UINTN chunk;
+    UINTN offset = 0;
+    UINTN first = 0;
+    UINTN inflight = 0;
+
+    if (!pool || !in || !out)
+        return -1;
+
+    /* ECB has no per-sector state to split on */
+    if (LUKSParseCipherMode(pool->header.cipher_mode) == LUKS_CIPHER_MODE_ECB)
+    {
+        return LUKSCryptWithContext(
+            &pool->workers[0].context, mode, in, out, size, sector);
+    }
+
+    ntasks = _NumTasks(pool);
+
+    if (!(tasks = (Task*)Calloc(ntasks, sizeof(Task))))
+        return -1;
+
+    /* Give every worker a share of small requests */
+    chunk = size / pool->nthreads;
+    chunk -= chunk % LUKS_SECTOR_SIZE;
+
+    if (chunk < LUKS_SECTOR_SIZE)
+        chunk = LUKS_SECTOR_SIZE;
+    else if (chunk > CHUNK_BYTES)
+        chunk = CHUNK_BYTES;
+
+    while (offset < size || inflight)
+    {
+        /* Queue chunks while there are free tasks */
+        while (offset < size && inflight < ntasks)
+        {
+            Task* task = &tasks[(first + inflight) % ntasks];
+            UINTN n = (size - offset < chunk) ? size - offset : chunk;
+
+            task->mode = mode;
+            task->in = in + offset;
+            task->out = out + offset;
+            task->size = n;
+            task->sector = sector + offset / LUKS_SECTOR_SIZE;
+            _Submit(pool, task);
+
+            offset += n;
+            inflight++;
+        }
+
+        /* Wait for the oldest chunk */
+        if (_Wait(pool, &tasks[first]) != 0)
+            rc = -1;
+
+        first = (first + 1) % ntasks;
+        inflight--;
+    }
+
+    Free(tasks);
+    return rc;
+}
+
+int LUKSCryptPoolCopy(
+    LUKSCryptPool* pool,
+    LUKSCryptMode mode,
+    Blkdev* src,
+    UINT64 srcOffset,
+    Blkdev* dest,
+    UINT64 destOffset,
+    UINT64 size,
+    UINT64 sector)
+{
+    int rc = 0;
+    Task* tasks = NULL;
+    UINT8* bufs = NULL;
+    UINTN ntasks;
+    UINT64 offset = 0;
+    UINTN first = 0;
+    UINTN inflight = 0;
+
+    if (!pool || !src || !dest || size % LUKS_SECTOR_SIZE)
+        return -1;
+
+    ntasks = _NumTasks(pool);
+
+    if (!(tasks = (Task*)Calloc(ntasks, sizeof(Task))) ||
+        !(bufs = (UINT8*)Malloc(ntasks * CHUNK_BYTES)))
+    {
+        rc = -1;
+        goto done;
+    }
+
+    /* Read into free buffers, crypt in place, write back in order */
+    while ((offset < size && rc == 0) || inflight)
+    {
+        while (offset < size && inflight < ntasks && rc == 0)
+        {
+            UINTN index = (first + inflight) % ntasks;
+            Task* task = &tasks[index];
+            UINT8* buf = bufs + index * CHUNK_BYTES;
+            UINTN n = (size - offset < CHUNK_BYTES) ? 
+                (UINTN)(size - offset) : CHUNK_BYTES;
+
+            if (BlkdevReadBytes(src, srcOffset + offset, buf, n) != 0)
+            {
+                rc = -1;
+                break;
+            }
+
+            task->mode = mode;
+            task->in = buf;
+            task->out = buf;
+            task->size = n;
+            task->sector = sector + offset / LUKS_SECTOR_SIZE;
+            _Submit(pool, task);
+
+            offset += n;
+            inflight++;
+        }
+
+        if (!inflight)
+            break;
+
+        /* Wait for the oldest buffer and write it (after an error, only
+         * wait so that no worker still uses the buffers) */
+        {
+            Task* task = &tasks[first];
+
+            if (_Wait(pool, task) != 0)
+                rc = -1;
+
+            if (rc == 0 && BlkdevWriteBytes(
+                dest, 
+                destOffset + (task->sector - sector) * LUKS_SECTOR_SIZE, 
+                task->out, 
+                task->size) != 0)
+            {
+                rc = -1;
+            }
+
+            first = (first + 1) % ntasks;
+            inflight--;
+        }
+    }
+
+    if (rc == 0 && BlkdevFlush(dest) != 0)
+        rc = -1;
+
+done:
+
+    if (bufs)
+    {
+        Memset(bufs, 0, ntasks * CHUNK_BYTES);
+        Free(bufs);
+    }
+
+    if (tasks)
+        Free(tasks);
+
+    return rc;
+}
@@ -0,0 +1,80 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#ifndef _lukscryptpool_h
+#define _lukscryptpool_h
+
+#include "config.h"
+#include <lsvmutils/luks.h>
+#include <lsvmutils/blkdev.h>
+
+/* Upper bound on the number of worker threads */
+#define LUKSCRYPTPOOL_MAX_THREADS 64
+
+typedef struct _LUKSCryptPool LUKSCryptPool;
+
+/* Start 'nthreads' workers (0 means one per online CPU), each with its own
+ * ciphers derived from 'key' (of header->key_bytes bytes) */
+LUKSCryptPool* LUKSCryptPoolNew(
+    const LUKSHeader* header,
+    const UINT8* key,
+    UINTN nthreads);
+
+/* Stop the workers and wipe their key material */
+void LUKSCryptPoolDelete(
+    LUKSCryptPool* pool);
+
+UINTN LUKSCryptPoolThreads(
+    LUKSCryptPool* pool);
+
+/* Like LUKSCrypt(): crypt 'size' bytes starting at LUKS sector 'sector',
+ * split into sector-aligned chunks that are crypted in parallel */
+int LUKSCryptPoolCrypt(
+    LUKSCryptPool* pool,
+    LUKSCryptMode mode,
+    const UINT8* in,
+    UINT8* out,
+    UINTN size,
+    UINT64 sector);
+
+/* Read 'size' bytes from 'src' at 'srcOffset', crypt them (the first byte
+ * being in LUKS sector 'sector') and write them to 'dest' at 'destOffset'.
+ * Reads and writes overlap with crypting through a bounded set of buffers.
+ * The size must be a multiple of LUKS_SECTOR_SIZE. */
+int LUKSCryptPoolCopy(
+    LUKSCryptPool* pool,
+    LUKSCryptMode mode,
+    Blkdev* src,
+    UINT64 srcOffset,
+    Blkdev* dest,
+    UINT64 destOffset,
+    UINT64 size,
+    UINT64 sector);
+
+#endif /* _lukscryptpool_h */
@@ -0,0 +1,421 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#include "lukskeyslots.h"
+#include <pthread.h>
+#include "alloc.h"
+#include "strings.h"
+
+/* Largest master key accepted (LUKS keys are at most 512 bits) */
+#define MAX_KEY_BYTES 128
+
+typedef struct _Trial Trial;
+
+/* One keyslot to try, described in LUKS1 terms */
+typedef struct _Candidate
+{
+    Trial* trial;
+    UINTN id;
+    LUKSHeader header;
+    LUKSKeySlot slot;
+    UINT8* keyMaterial;
+    UINTN keyMaterialSize;
+}
+Candidate;
+
+/* Shared by the caller and the threads, freed by whoever leaves last */
+struct _Trial
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    UINTN refs;
+    UINTN pending;
+
+    /* Set under 'lock' but also polled without it during key derivation */
+    volatile BOOLEAN cancelled;
+    BOOLEAN found;
+
+    /* What verifies a master key (the LUKS1 header or the LUKS2 digest) */
+    LUKSHeader header;
+    LUKS2Header* luks2;
+
+    UINT8* passphrase;
+    UINTN passphraseSize;
+    UINTN keyBytes;
+
+    Candidate candidates[LUKS2_MAX_KEYSLOTS];
+    UINTN ncandidates;
+
+    /* Result */
+    UINT8 masterKey[MAX_KEY_BYTES];
+    UINTN id;
+};
+
+static Trial* _NewTrial(
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    UINTN keyBytes)
+{
+    Trial* trial;
+
+    if (keyBytes > MAX_KEY_BYTES)
+        return NULL;
+
+    if (!(trial = (Trial*)Calloc(1, sizeof(Trial))))
+        return NULL;
+
+    if (!(trial->passphrase = (UINT8*)Malloc(passphraseSize + 1)))
+    {
+        Free(trial);
+        return NULL;
+    }
+
+    Memcpy(trial->passphrase, passphrase, passphraseSize);
+    trial->passphraseSize = passphraseSize;
+    trial->keyBytes = keyBytes;
+    trial->refs = 1;
+    pthread_mutex_init(&trial->lock, NULL);
+    pthread_cond_init(&trial->done, NULL);
+
+    return trial;
+}
+
+static void _ReleaseTrial(
+    Trial* trial)
+{
+    UINTN refs;
+    UINTN i;
+
+    pthread_mutex_lock(&trial->lock);
+    refs = --trial->refs;
+    pthread_mutex_unlock(&trial->lock);
+
+    if (refs)
+        return;
+
+    for (i = 0; i < trial->ncandidates; i++)
+    {
+        if (trial->candidates[i].keyMaterial)
+            Free(trial->candidates[i].keyMaterial);
+    }
+
+    if (trial->luks2)
+        Free(trial->luks2);
+
+    Memset(trial->passphrase, 0, trial->passphraseSize);
+    Free(trial->passphrase);
+    pthread_mutex_destroy(&trial->lock);
+    pthread_cond_destroy(&trial->done);
+    Memset(trial, 0, sizeof(Trial));
+    Free(trial);
+}
+
+/* Read the key material of a keyslot so the threads never use 'rawdev' */
+static int _AddCandidate(
+    Trial* trial,
+    Blkdev* rawdev,
+    UINTN id,
+    const LUKSHeader* header,
+    const LUKSKeySlot* slot)
+{
+    Candidate* c = &trial->candidates[trial->ncandidates];
+
+    if (trial->ncandidates == LUKS2_MAX_KEYSLOTS)
+        return -1;
+
+    c->trial = trial;
+    c->id = id;
+    c->header = *header;
+    c->slot = *slot;
+
+    if (LUKSReadKeyMaterial(rawdev, header, slot, &c->keyMaterial, 
+        &c->keyMaterialSize) != 0)
+    {
+        return -1;
+    }
+
+    trial->ncandidates++;
+    return 0;
+}
+
+static BOOLEAN _Cancelled(
+    Trial* trial)
+{
+    BOOLEAN cancelled;
+
+    pthread_mutex_lock(&trial->lock);
+    cancelled = trial->cancelled;
+    pthread_mutex_unlock(&trial->lock);
+
+    return cancelled;
+}
+
+static void* _Try(
+    void* arg)
+{
+    Candidate* c = (Candidate*)arg;
+    Trial* trial = c->trial;
+    UINT8 masterKey[MAX_KEY_BYTES];
+    int r = -1;
+
+    if (!_Cancelled(trial))
+    {
+        r = LUKSOpenKeyMaterialCancellable(
+            &c->header,
+            &c->slot,
+            trial->passphrase,
+            trial->passphraseSize,
+            c->keyMaterial,
+            &trial->cancelled,
+            masterKey);
+    }
+
+    /* Checking the master key costs another key derivation */
+    if (r == 0 && !_Cancelled(trial))
+    {
+        if (trial->luks2)
+            r = LUKS2VerifyMasterKey(trial->luks2, masterKey);
+        else
+            r = LUKSVerifyMasterKey(&trial->header, masterKey);
+    }
+    else
+    {
+        r = -1;
+    }
+
+    pthread_mutex_lock(&trial->lock);
+
+    if (r == 0 && !trial->found)
+    {
+        Memcpy(trial->masterKey, masterKey, trial->keyBytes);
+        trial->id = c->id;
+        trial->found = TRUE;
+        trial->cancelled = TRUE;
+    }
+
+    trial->pending--;
+    pthread_cond_broadcast(&trial->done);
+    pthread_mutex_unlock(&trial->lock);
+
+    Memset(masterKey, 0, sizeof(masterKey));
+    _ReleaseTrial(trial);
+
+    return NULL;
+}
+
+/* Try every candidate on its own thread and wait for the first success
+ * (or for all of them to fail). The other threads are then cancelled and
+ * joined, so none outlives the call: SHA-1 and SHA-256 keyslots stop within
+ * PBKDF2_CANCEL_INTERVAL iterations, but keyslots of other hashes finish
+ * their key derivation first. */
+static int _Run(
+    Trial* trial,
+    UINT8* masterKey,
+    UINTN* id)
+{
+    int rc = -1;
+    pthread_t threads[LUKS2_MAX_KEYSLOTS];
+    BOOLEAN started[LUKS2_MAX_KEYSLOTS];
+    UINTN i;
+
+    trial->pending = trial->ncandidates;
+
+    for (i = 0; i < trial->ncandidates; i++)
+    {
+        pthread_mutex_lock(&trial->lock);
+        trial->refs++;
+        pthread_mutex_unlock(&trial->lock);
+
+        started[i] = pthread_create(&threads[i], NULL, _Try, 
+            &trial->candidates[i]) == 0;
+
+        /* Out of threads: try this keyslot here */
+        if (!started[i])
+            _Try(&trial->candidates[i]);
+    }
+
+    pthread_mutex_lock(&trial->lock);
+
+    while (!trial->found && trial->pending)
+        pthread_cond_wait(&trial->done, &trial->lock);
+
+    if (trial->found)
+    {
+        Memcpy(masterKey, trial->masterKey, trial->keyBytes);
+        Memset(trial->masterKey, 0, sizeof(trial->masterKey));
+
+        if (id)
+            *id = trial->id;
+
+        rc = 0;
+    }
+
+    trial->cancelled = TRUE;
+    pthread_mutex_unlock(&trial->lock);
+
+    for (i = 0; i < trial->ncandidates; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+
+    return rc;
+}
+
+int LUKSGetMasterKeyParallel(
+    Blkdev* rawdev,
+    const LUKSHeader* header,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    UINTN slotHint,
+    UINT8* masterKey,
+    UINTN* slotIndex)
+{
+    int rc = -1;
+    Trial* trial = NULL;
+    UINTN i;
+
+    if (!rawdev || !header || !passphrase || !masterKey)
+        goto done;
+
+    LUKSInitialize();
+
+    /* The hinted keyslot alone costs a single key derivation */
+    if (slotHint < LUKS_SLOTS_SIZE &&
+        header->slots[slotHint].enabled == LUKS_SLOT_ENABLED &&
+        LUKSOpenKeySlot(rawdev, header, &header->slots[slotHint], 
+            passphrase, passphraseSize, masterKey) == 0 &&
+        LUKSVerifyMasterKey(header, masterKey) == 0)
+    {
+        if (slotIndex)
+            *slotIndex = slotHint;
+
+        rc = 0;
+        goto done;
+    }
+
+    if (!(trial = _NewTrial(passphrase, passphraseSize, header->key_bytes)))
+        goto done;
+
+    trial->header = *header;
+
+    for (i = 0; i < LUKS_SLOTS_SIZE; i++)
+    {
+        if (i == slotHint || header->slots[i].enabled != LUKS_SLOT_ENABLED)
+            continue;
+
+        if (_AddCandidate(trial, rawdev, i, header, &header->slots[i]) != 0)
+            goto done;
+    }
+
+    if (_Run(trial, masterKey, slotIndex) != 0)
+        goto done;
+
+    rc = 0;
+
+done:
+
+    if (trial)
+        _ReleaseTrial(trial);
+
+    if (rc != 0 && header && masterKey)
+        Memset(masterKey, 0, header->key_bytes);
+
+    return rc;
+}
+
+int LUKS2GetMasterKeyParallel(
+    Blkdev* rawdev,
+    const LUKS2Header* header,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    UINTN slotHint,
+    UINT8* masterKey,
+    UINTN* slotId)
+{
+    int rc = -1;
+    Trial* trial = NULL;
+    const LUKS2KeySlot* ks;
+    UINTN i;
+
+    if (!rawdev || !header || !passphrase || !masterKey)
+        goto done;
+
+    LUKSInitialize();
+
+    /* The hinted keyslot alone costs a single key derivation */
+    if ((ks = LUKS2FindKeySlot(header, slotHint)) &&
+        LUKSOpenKeySlot(rawdev, &ks->header, &ks->slot, passphrase, 
+            passphraseSize, masterKey) == 0 &&
+        LUKS2VerifyMasterKey(header, masterKey) == 0)
+    {
+        if (slotId)
+            *slotId = slotHint;
+
+        rc = 0;
+        goto done;
+    }
+
+    if (!(trial = _NewTrial(passphrase, passphraseSize, 
+        header->header.key_bytes)))
+    {
+        goto done;
+    }
+
+    if (!(trial->luks2 = (LUKS2Header*)Malloc(sizeof(LUKS2Header))))
+        goto done;
+
+    *trial->luks2 = *header;
+
+    for (i = 0; i < header->nkeyslots; i++)
+    {
+        ks = &header->keyslots[i];
+
+        if (ks->id == slotHint)
+            continue;
+
+        if (_AddCandidate(trial, rawdev, ks->id, &ks->header, &ks->slot) != 0)
+            goto done;
+    }
+
+    if (_Run(trial, masterKey, slotId) != 0)
+        goto done;
+
+    rc = 0;
+
+done:
+
+    if (trial)
+        _ReleaseTrial(trial);
+
+    if (rc != 0 && header && masterKey)
+        Memset(masterKey, 0, header->header.key_bytes);
+
+    return rc;
+}
@@ -0,0 +1,65 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#ifndef _lukskeyslots_h
+#define _lukskeyslots_h
+
+#include "config.h"
+#include <lsvmutils/luks.h>
+#include <lsvmutils/luks2.h>
+#include <lsvmutils/blkdev.h>
+
+/* Like LUKSGetMasterKeyWithHint() but, if the hinted keyslot does not
+ * open, try all the other enabled keyslots at once (one thread each) so
+ * that unlocking costs one key derivation rather than one per keyslot.
+ * The first keyslot that opens wins and the remaining threads are
+ * cancelled and joined before returning: SHA-1 and SHA-256 keyslots stop
+ * within PBKDF2_CANCEL_INTERVAL iterations, other hashes once their key is
+ * derived. The threads never touch 'rawdev' (key material is read before
+ * they start). */
+int LUKSGetMasterKeyParallel(
+    Blkdev* rawdev,
+    const LUKSHeader* header,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    UINTN slotHint,
+    UINT8* masterKey,
+    UINTN* slotIndex);
+
+/* LUKS2 counterpart ('slotHint' and 'slotId' are keyslot ids) */
+int LUKS2GetMasterKeyParallel(
+    Blkdev* rawdev,
+    const LUKS2Header* header,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    UINTN slotHint,
+    UINT8* masterKey,
+    UINTN* slotId);
+
+#endif /* _lukskeyslots_h */
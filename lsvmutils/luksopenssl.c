@@ -33,6 +33,7 @@
 #include <lsvmutils/alloc.h>
 #include <lsvmutils/print.h>
 #include <lsvmutils/sha.h>
+#include <lsvmutils/pbkdf2.h>
 
 #if defined(HAVE_OPENSSL)
 # include <openssl/evp.h>
@@ -54,6 +55,9 @@ struct _LUKSCipher
     const EVP_CIPHER* evp;
     UINT8* key;
     UINTN keySize;
+
+    /* Keyed contexts indexed by LUKSCryptMode (created on first use) */
+    EVP_CIPHER_CTX* ctx[2];
 };
 
 static int _initialized = 0;
@@ -86,6 +90,8 @@ LUKSCipher* LUKSGetAES256ECBCipher(
     LUKSCipher tmp;
     LUKSCipher* cipher = NULL;
 
+    Memset(&tmp, 0, sizeof(tmp));
+
     /* Obtain cipher from OpenSSL */
     if (!(tmp.evp = EVP_aes_256_ecb()))
         goto done;
@@ -129,6 +135,8 @@ LUKSCipher* LUKSGetCipher(
     const char* cipherMode = NULL;
     UINT32 keyBits;
 
+    Memset(&tmp, 0, sizeof(tmp));
+
     /* Check for null parameters */
     if (!header)
         goto done;
@@ -143,19 +151,22 @@ LUKSCipher* LUKSGetCipher(
         keyBits = header->key_bytes * 8;
 
         /* Determine the cipher mode */
-        if (Strcmp(header->cipher_mode, "ecb") == 0) 
-            cipherMode = "ECB";
-        else if (Strcmp(header->cipher_mode, "cbc-plain") == 0)
-            cipherMode = "CBC";
-        else if (Strcmp(header->cipher_mode, "cbc-essiv:") == 0)
-            cipherMode = "CBC";
-        else if (Strcmp(header->cipher_mode, "xts-plain64") == 0)
+        switch (LUKSParseCipherMode(header->cipher_mode))
         {
-            cipherMode = "XTS";
-            keyBits /= 2;
+            case LUKS_CIPHER_MODE_ECB:
+                cipherMode = "ECB";
+                break;
+            case LUKS_CIPHER_MODE_CBC_PLAIN:
+            case LUKS_CIPHER_MODE_CBC_ESSIV:
+                cipherMode = "CBC";
+                break;
+            case LUKS_CIPHER_MODE_XTS_PLAIN64:
+                cipherMode = "XTS";
+                keyBits /= 2;
+                break;
+            default:
+                goto done;
         }
-        else 
-            goto done;
 
         /* Form the string to pass to EVP_get_cipherbyname() */
         {
@@ -206,15 +217,55 @@ done:
 void LUKSReleaseCipher(
     LUKSCipher* cipher)
 {
+    UINTN i;
+
     if (!cipher)
         return;
 
+    for (i = 0; i < ARRSIZE(cipher->ctx); i++)
+    {
+        if (cipher->ctx[i])
+            EVP_CIPHER_CTX_free(cipher->ctx[i]);
+    }
+
     if (cipher->key)
+    {
+        Memset(cipher->key, 0, cipher->keySize);
         Free(cipher->key);
+    }
 
+    Memset(cipher, 0, sizeof(LUKSCipher));
     Free(cipher);
 }
 
+/* Expand the key once per direction; later calls only set the IV */
+static EVP_CIPHER_CTX* _GetContext(
+    LUKSCipher* cipher,
+    LUKSCryptMode mode)
+{
+    EVP_CIPHER_CTX *ctx;
+
+    if (!cipher || (UINTN)mode >= ARRSIZE(cipher->ctx))
+        return NULL;
+
+    if ((ctx = cipher->ctx[mode]))
+        return ctx;
+
+    if (!(ctx = EVP_CIPHER_CTX_new()))
+        return NULL;
+
+    if (!EVP_CipherInit_ex(ctx, cipher->evp, NULL, cipher->key, NULL, mode))
+    {
+        EVP_CIPHER_CTX_free(ctx);
+        return NULL;
+    }
+
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    cipher->ctx[mode] = ctx;
+
+    return ctx;
+}
+
 int LUKSCryptData(
     LUKSCipher* cipher,
     LUKSCryptMode mode,
@@ -226,29 +277,63 @@ int LUKSCryptData(
 {
     int rc = -1;
     int len;
-    EVP_CIPHER_CTX *ctx = NULL;
+    EVP_CIPHER_CTX *ctx;
 
-    if (!(ctx = EVP_CIPHER_CTX_new()))
+    if (!(ctx = _GetContext(cipher, mode)))
         goto done;
 
-    EVP_CIPHER_CTX_set_padding(ctx, 0);
-
-    if (!EVP_CipherInit_ex(ctx, cipher->evp, NULL, cipher->key, iv, mode))
+    if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1))
         goto done;
 
     if (!EVP_CipherUpdate(ctx, out, &len, in, inSize)) 
         goto done;
 
-    if (!EVP_CipherFinal_ex(ctx, (UINT8*)in + len, &len))
+    if (!EVP_CipherFinal_ex(ctx, out + len, &len))
         goto done;
 
     rc = len;
 
 done:
+    return rc;
+}
 
-    if (ctx)
-        EVP_CIPHER_CTX_free(ctx);
+/* Sizes are multiples of the AES block size and padding is off, so each
+ * sector is a single update (there is nothing left for a final call) */
+int LUKSCryptSectors(
+    LUKSCipher* cipher,
+    LUKSCryptMode mode,
+    const UINT8 *ivs,
+    UINTN ivSize,
+    const UINT8 *in,
+    UINT8 *out,
+    UINTN sectorSize,
+    UINTN nsectors)
+{
+    int rc = -1;
+    EVP_CIPHER_CTX *ctx;
+    UINTN i;
+
+    if (!(ctx = _GetContext(cipher, mode)))
+        goto done;
+
+    for (i = 0; i < nsectors; i++)
+    {
+        UINTN pos = i * sectorSize;
+        int len;
+
+        if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, ivs + i * ivSize, -1))
+            goto done;
 
+        if (!EVP_CipherUpdate(ctx, out + pos, &len, in + pos, sectorSize) ||
+            (UINTN)len != sectorSize)
+        {
+            goto done;
+        }
+    }
+
+    rc = 0;
+
+done:
     return rc;
 }
 
@@ -263,6 +348,26 @@ int LUKSDeriveKey(
     unsigned char* out)
 {
     int rc = -1;
+    SHAAlgorithm alg;
+
+    /* The native engine wins for SHA-1 (PKCS5_PBKDF2_HMAC() spends as
+     * much on HMAC context copies as on hashing) and whenever the key
+     * spans several blocks, which it derives in parallel */
+    if (PBKDF2ParseHash(hashspec, &alg) == 0 &&
+        (alg == SHA1_ALG || keylen > __SHA256_SIZE))
+    {
+        if (passlen < 0 || saltlen < 0 || iter <= 0 || keylen < 0)
+            goto done;
+
+        if (PBKDF2(alg, (const UINT8*)pass, passlen, salt, saltlen, iter, 
+            out, keylen) != 0)
+        {
+            goto done;
+        }
+
+        rc = 0;
+        goto done;
+    }
 
     if (!PKCS5_PBKDF2_HMAC(
         pass,
@@ -0,0 +1,805 @@
+/*
+**==============================================================================
+**
+** LSVMTools
+**
+** MIT License
+**
+** Copyright (c) Microsoft Corporation. All rights reserved.
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#include "luksreencrypt.h"
+#include <pthread.h>
+#include <openssl/rand.h>
+#include "lukscryptpool.h"
+#include "memblkdev.h"
+#include "alloc.h"
+#include "strings.h"
+
+/* Bytes re-encrypted (and journaled) at a time */
+#define BATCH_BYTES (16 * 1024 * 1024)
+
+/* Batches in flight: one being written while the next is read and crypted */
+#define NUM_BATCHES 2
+
+#define RECORD_MAGIC_INITIALIZER { 'L', 'S', 'V', 'M', 'R', 'E', 'N', 'C' }
+#define RECORD_VERSION 1
+
+/*
+**==============================================================================
+**
+** Checkpoint layout (in LUKS sectors):
+**
+**     [0]                  Record
+**     [1, 1 + H)           new header area (H = payload_offset)
+**     [1 + H, ...)         journal (up to BATCH_BYTES)
+**
+** Every batch is written in this order, each step flushed before the next:
+**
+**     (1) record: 'done' advanced to the batch, journal invalid
+**     (2) journal: original ciphertext of the batch
+**     (3) record: journal valid for the batch
+**     (4) device: re-encrypted batch
+**
+** After a crash, a valid journal is written back over its batch (undoing
+** a partial step 4) and the run continues from 'done'.
+**
+**==============================================================================
+*/
+
+typedef struct _Record
+{
+    UINT8 magic[8];
+    UINT32 version;
+    UINT32 headerSectors;
+    UINT64 payloadSize;
+    UINT64 done; /* payload bytes re-encrypted */
+    UINT64 journalOffset; /* payload offset of the journaled batch */
+    UINT64 journalSize; /* 0 if the journal is not valid */
+    char uuid[LUKS_UUID_STRING_SIZE];
+    UINT8 padding[LUKS_SECTOR_SIZE - 48 - LUKS_UUID_STRING_SIZE];
+}
+Record;
+
+static const UINT8 _magic[] = RECORD_MAGIC_INITIALIZER;
+
+static int _PutRecord(
+    Blkdev* checkpoint,
+    const Record* record)
+{
+    if (BlkdevWriteBytes(checkpoint, 0, record, sizeof(Record)) != 0)
+        return -1;
+
+    return BlkdevFlush(checkpoint);
+}
+
+/* Read the record of an earlier run (fails if there is none) */
+static int _GetRecord(
+    Blkdev* checkpoint,
+    Record* record)
+{
+    if (BlkdevReadBytes(checkpoint, 0, record, sizeof(Record)) != 0 ||
+        Memcmp(record->magic, _magic, sizeof(_magic)) != 0 ||
+        record->version != RECORD_VERSION)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static UINT64 _JournalOffset(
+    const Record* record)
+{
+    return (1 + (UINT64)record->headerSectors) * LUKS_SECTOR_SIZE;
+}
+
+/*
+**==============================================================================
+**
+** New header:
+**
+**==============================================================================
+*/
+
+static int _Random(
+    void* data,
+    UINTN size)
+{
+    return RAND_bytes((unsigned char*)data, (int)size) == 1 ? 0 : -1;
+}
+
+/* Build the header area (header and key material) for a new master key */
+static int _MakeHeaderArea(
+    const LUKSHeader* oldHeader,
+    UINTN slotIndex,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    const char* cipherMode,
+    const UINT8* masterKey,
+    UINT8* area,
+    UINTN areaSize)
+{
+    int rc = -1;
+    LUKSHeader header;
+    LUKSKeySlot* slot;
+    UINT8* stripes = NULL;
+    UINT8* derivedKey = NULL;
+    UINTN stripesBytes = 0;
+    Blkdev* dev = NULL;
+    UINTN i;
+
+    Memcpy(&header, oldHeader, sizeof(LUKSHeader));
+
+    if (cipherMode)
+        Strlcpy(header.cipher_mode, cipherMode, sizeof(header.cipher_mode));
+
+    /* Digest of the new master key */
+    if (_Random(header.mk_digest_salt, LUKS_SALT_SIZE) != 0 ||
+        LUKSComputeMKDigest(&header, masterKey, header.mk_digest) != 0)
+    {
+        goto done;
+    }
+
+    /* Disable all keyslots but the one being carried over */
+    for (i = 0; i < LUKS_SLOTS_SIZE; i++)
+    {
+        if (i == slotIndex)
+            continue;
+
+        header.slots[i].enabled = LUKS_SLOT_DISABLED;
+        header.slots[i].password_iters = 0;
+        Memset(header.slots[i].password_salt, 0, LUKS_SALT_SIZE);
+    }
+
+    slot = &header.slots[slotIndex];
+    stripesBytes = header.key_bytes * slot->af_stripes;
+
+    if ((UINT64)slot->key_material_offset * LUKS_SECTOR_SIZE + stripesBytes >
+        areaSize)
+    {
+        goto done;
+    }
+
+    if (!(stripes = (UINT8*)Malloc(stripesBytes)) ||
+        !(derivedKey = (UINT8*)Malloc(header.key_bytes)))
+    {
+        goto done;
+    }
+
+    /* Split the master key and encrypt the stripes with the slot key */
+    if (_Random(slot->password_salt, LUKS_SALT_SIZE) != 0 ||
+        _Random(stripes, stripesBytes) != 0 ||
+        LUKSAFSplit(&header, slot, masterKey, stripes) != 0)
+    {
+        goto done;
+    }
+
+    if (LUKSDeriveKey(
+        (const char*)passphrase,
+        passphraseSize,
+        slot->password_salt,
+        LUKS_SALT_SIZE,
+        slot->password_iters,
+        header.hash_spec,
+        header.key_bytes,
+        derivedKey) != 0)
+    {
+        goto done;
+    }
+
+    Memset(area, 0, areaSize);
+
+    if (LUKSCrypt(
+        LUKS_CRYPT_MODE_ENCRYPT,
+        &header,
+        derivedKey,
+        stripes,
+        area + (UINTN)slot->key_material_offset * LUKS_SECTOR_SIZE,
+        stripesBytes,
+        0) != 0)
+    {
+        goto done;
+    }
+
+    if (!(dev = BlkdevFromMemory(area, areaSize)) ||
+        LUKSWriteHeader(dev, &header) != 0)
+    {
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+
+    if (dev)
+        dev->Close(dev);
+
+    if (stripes)
+    {
+        Memset(stripes, 0, stripesBytes);
+        Free(stripes);
+    }
+
+    if (derivedKey)
+    {
+        Memset(derivedKey, 0, header.key_bytes);
+        Free(derivedKey);
+    }
+
+    Memset(&header, 0, sizeof(header));
+    return rc;
+}
+
+/*
+**==============================================================================
+**
+** Writer: journals and writes batches while the next one is crypted
+**
+**==============================================================================
+*/
+
+typedef struct _Batch
+{
+    UINT8* old; /* original ciphertext (journaled) */
+    UINT8* new; /* re-encrypted */
+    UINT64 offset;
+    UINTN size;
+    BOOLEAN full;
+}
+Batch;
+
+typedef struct _Writer
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Batch batches[NUM_BATCHES];
+    BOOLEAN stop;
+    int status;
+    Blkdev* rawdev;
+    UINT64 payloadOffset;
+    Blkdev* checkpoint;
+    Record* record;
+}
+Writer;
+
+static int _WriteBatch(
+    Writer* writer,
+    const Batch* batch)
+{
+    Record* record = writer->record;
+
+    /* (1) The previous batch is on the device */
+    record->done = batch->offset;
+    record->journalSize = 0;
+
+    if (_PutRecord(writer->checkpoint, record) != 0)
+        return -1;
+
+    /* (2) Journal the original ciphertext */
+    if (BlkdevWriteBytes(writer->checkpoint, _JournalOffset(record),
+        batch->old, batch->size) != 0 ||
+        BlkdevFlush(writer->checkpoint) != 0)
+    {
+        return -1;
+    }
+
+    /* (3) Make the journal valid */
+    record->journalOffset = batch->offset;
+    record->journalSize = batch->size;
+
+    if (_PutRecord(writer->checkpoint, record) != 0)
+        return -1;
+
+    /* (4) Overwrite the batch */
+    if (BlkdevWriteBytes(writer->rawdev,
+        writer->payloadOffset + batch->offset, batch->new, batch->size) != 0 ||
+        BlkdevFlush(writer->rawdev) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void* _Write(
+    void* arg)
+{
+    Writer* writer = (Writer*)arg;
+    UINTN next = 0;
+
+    for (;;)
+    {
+        Batch* batch = &writer->batches[next];
+        int status;
+
+        pthread_mutex_lock(&writer->lock);
+
+        while (!batch->full && !writer->stop)
+            pthread_cond_wait(&writer->cond, &writer->lock);
+
+        if (!batch->full)
+        {
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+
+        pthread_mutex_unlock(&writer->lock);
+
+        status = _WriteBatch(writer, batch);
+
+        pthread_mutex_lock(&writer->lock);
+        batch->full = FALSE;
+
+        if (status != 0)
+        {
+            writer->status = -1;
+            writer->stop = TRUE;
+        }
+
+        pthread_cond_broadcast(&writer->cond);
+        pthread_mutex_unlock(&writer->lock);
+
+        if (status != 0)
+            break;
+
+        next = (next + 1) % NUM_BATCHES;
+    }
+
+    return NULL;
+}
+
+/* Re-encrypt the payload from record->done to the end */
+static int _Run(
+    Blkdev* rawdev,
+    const LUKSHeader* oldHeader,
+    const UINT8* oldKey,
+    const LUKSHeader* newHeader,
+    const UINT8* newKey,
+    Blkdev* checkpoint,
+    Record* record,
+    UINTN nthreads)
+{
+    int rc = -1;
+    Writer writer;
+    LUKSCryptPool* oldPool = NULL;
+    LUKSCryptPool* newPool = NULL;
+    BOOLEAN started = FALSE;
+    UINT64 offset;
+    UINTN k;
+
+    Memset(&writer, 0, sizeof(writer));
+    pthread_mutex_init(&writer.lock, NULL);
+    pthread_cond_init(&writer.cond, NULL);
+    writer.rawdev = rawdev;
+    writer.payloadOffset = (UINT64)oldHeader->payload_offset * LUKS_SECTOR_SIZE;
+    writer.checkpoint = checkpoint;
+    writer.record = record;
+
+    for (k = 0; k < NUM_BATCHES; k++)
+    {
+        if (!(writer.batches[k].old = (UINT8*)Malloc(BATCH_BYTES)) ||
+            !(writer.batches[k].new = (UINT8*)Malloc(BATCH_BYTES)))
+        {
+            goto done;
+        }
+    }
+
+    if (!(oldPool = LUKSCryptPoolNew(oldHeader, oldKey, nthreads)) ||
+        !(newPool = LUKSCryptPoolNew(newHeader, newKey, nthreads)))
+    {
+        goto done;
+    }
+
+    if (pthread_create(&writer.thread, NULL, _Write, &writer) != 0)
+        goto done;
+
+    started = TRUE;
+
+    for (offset = record->done, k = 0; offset < record->payloadSize; k++)
+    {
+        Batch* batch = &writer.batches[k % NUM_BATCHES];
+        UINT64 sector = offset / LUKS_SECTOR_SIZE;
+        UINTN n = BATCH_BYTES;
+
+        if (record->payloadSize - offset < n)
+            n = (UINTN)(record->payloadSize - offset);
+
+        /* Wait for the writer to release this batch */
+        pthread_mutex_lock(&writer.lock);
+
+        while (batch->full && !writer.stop)
+            pthread_cond_wait(&writer.cond, &writer.lock);
+
+        pthread_mutex_unlock(&writer.lock);
+
+        if (writer.status != 0)
+            goto done;
+
+        if (BlkdevReadBytes(rawdev, writer.payloadOffset + offset,
+            batch->old, n) != 0)
+        {
+            goto done;
+        }
+
+        if (LUKSCryptPoolCrypt(oldPool, LUKS_CRYPT_MODE_DECRYPT,
+                batch->old, batch->new, n, sector) != 0 ||
+            LUKSCryptPoolCrypt(newPool, LUKS_CRYPT_MODE_ENCRYPT,
+                batch->new, batch->new, n, sector) != 0)
+        {
+            goto done;
+        }
+
+        pthread_mutex_lock(&writer.lock);
+        batch->offset = offset;
+        batch->size = n;
+        batch->full = TRUE;
+        pthread_cond_broadcast(&writer.cond);
+        pthread_mutex_unlock(&writer.lock);
+
+        offset += n;
+    }
+
+    rc = 0;
+
+done:
+
+    /* Let the writer finish the batches it has and stop */
+    if (started)
+    {
+        pthread_mutex_lock(&writer.lock);
+        writer.stop = TRUE;
+        pthread_cond_broadcast(&writer.cond);
+        pthread_mutex_unlock(&writer.lock);
+        pthread_join(writer.thread, NULL);
+
+        if (writer.status != 0)
+            rc = -1;
+    }
+
+    /* The whole payload is on the device */
+    if (rc == 0)
+    {
+        record->done = record->payloadSize;
+        record->journalSize = 0;
+
+        if (_PutRecord(checkpoint, record) != 0)
+            rc = -1;
+    }
+
+    if (oldPool)
+        LUKSCryptPoolDelete(oldPool);
+
+    if (newPool)
+        LUKSCryptPoolDelete(newPool);
+
+    for (k = 0; k < NUM_BATCHES; k++)
+    {
+        if (writer.batches[k].old)
+        {
+            Memset(writer.batches[k].old, 0, BATCH_BYTES);
+            Free(writer.batches[k].old);
+        }
+
+        if (writer.batches[k].new)
+        {
+            Memset(writer.batches[k].new, 0, BATCH_BYTES);
+            Free(writer.batches[k].new);
+        }
+    }
+
+    pthread_cond_destroy(&writer.cond);
+    pthread_mutex_destroy(&writer.lock);
+
+    return rc;
+}
+
+/*
+**==============================================================================
+**
+** Public definitions:
+**
+**==============================================================================
+*/
+
+int LUKSReencrypt(
+    Blkdev* rawdev,
+    UINT64 rawdevSize,
+    Blkdev* checkpoint,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    const char* cipherMode,
+    UINTN nthreads,
+    UINT64* resumedAt,
+    Error* err)
+{
+    int rc = -1;
+    Record record;
+    LUKSHeader oldHeader;
+    LUKSHeader newHeader;
+    BOOLEAN haveOldHeader;
+    BOOLEAN resume;
+    UINT8* area = NULL;
+    UINTN areaSize = 0;
+    Blkdev* areadev = NULL;
+    UINT8 oldKey[LUKS_MAX_KEY_BYTES];
+    UINT8 newKey[LUKS_MAX_KEY_BYTES];
+    UINT64 payloadSize;
+
+    Memset(oldKey, 0, sizeof(oldKey));
+    Memset(newKey, 0, sizeof(newKey));
+    ClearErr(err);
+
+    if (!rawdev || !checkpoint || !passphrase)
+    {
+        SetErr(err, "null parameter");
+        goto done;
+    }
+
+    if (cipherMode && (LUKSParseCipherMode(cipherMode) ==
+        LUKS_CIPHER_MODE_NONE || Strlen(cipherMode) >= LUKS_CIPHER_MODE_SIZE))
+    {
+        SetErr(err, "unsupported cipher mode: %s", cipherMode);
+        goto done;
+    }
+
+    haveOldHeader = LUKSReadHeader(rawdev, &oldHeader) == 0;
+
+    /* An earlier run left a checkpoint for this device? */
+    resume = _GetRecord(checkpoint, &record) == 0;
+
+    if (resume)
+    {
+        areaSize = (UINTN)record.headerSectors * LUKS_SECTOR_SIZE;
+
+        if (!(area = (UINT8*)Malloc(areaSize)) ||
+            BlkdevReadBytes(checkpoint, LUKS_SECTOR_SIZE, area, areaSize) != 0 ||
+            !(areadev = BlkdevFromMemory(area, areaSize)) ||
+            LUKSReadHeader(areadev, &newHeader) != 0 ||
+            Memcmp(newHeader.uuid, record.uuid, LUKS_UUID_STRING_SIZE) != 0)
+        {
+            SetErr(err, "failed to read the new header from the checkpoint");
+            goto done;
+        }
+
+        /* Only the header was left to write: the original is not needed */
+        if (record.done == record.payloadSize)
+        {
+            if (resumedAt)
+                *resumedAt = record.done;
+
+            goto commit;
+        }
+
+        if (!haveOldHeader ||
+            Memcmp(oldHeader.uuid, record.uuid, LUKS_UUID_STRING_SIZE) != 0 ||
+            oldHeader.payload_offset != record.headerSectors)
+        {
+            SetErr(err, "the checkpoint belongs to another device");
+            goto done;
+        }
+    }
+    else
+    {
+        if (!haveOldHeader)
+        {
+            SetErr(err, "not a LUKS1 device");
+            goto done;
+        }
+
+        areaSize = (UINTN)oldHeader.payload_offset * LUKS_SECTOR_SIZE;
+
+        if (!(area = (UINT8*)Malloc(areaSize)) ||
+            !(areadev = BlkdevFromMemory(area, areaSize)))
+        {
+            SetErr(err, "out of memory");
+            goto done;
+        }
+    }
+
+    if (oldHeader.key_bytes > LUKS_MAX_KEY_BYTES)
+    {
+        SetErr(err, "unsupported key size: %u bytes", oldHeader.key_bytes);
+        goto done;
+    }
+
+    if (rawdevSize < areaSize + LUKS_SECTOR_SIZE)
+    {
+        SetErr(err, "the device has no payload");
+        goto done;
+    }
+
+    payloadSize = rawdevSize - areaSize;
+    payloadSize -= payloadSize % LUKS_SECTOR_SIZE;
+
+    if (resume)
+    {
+        if (record.payloadSize != payloadSize)
+        {
+            SetErr(err, "the checkpoint belongs to another device");
+            goto done;
+        }
+
+        /* Open both the original and the new keyslot */
+        if (LUKSGetMasterKey(rawdev, &oldHeader, passphrase, passphraseSize,
+                oldKey) != 0 ||
+            LUKSGetMasterKey(areadev, &newHeader, passphrase, passphraseSize,
+                newKey) != 0)
+        {
+            SetErr(err, "bad passphrase (no keyslot opens)");
+            goto done;
+        }
+
+        /* Undo a partial write of the journaled batch */
+        if (record.journalSize)
+        {
+            UINT8* data;
+
+            if (record.journalSize > BATCH_BYTES ||
+                !(data = (UINT8*)Malloc((UINTN)record.journalSize)))
+            {
+                SetErr(err, "bad journal in the checkpoint");
+                goto done;
+            }
+
+            if (BlkdevReadBytes(checkpoint, _JournalOffset(&record), data,
+                    (UINTN)record.journalSize) != 0 ||
+                BlkdevWriteBytes(rawdev, areaSize + record.journalOffset, data,
+                    (UINTN)record.journalSize) != 0 ||
+                BlkdevFlush(rawdev) != 0)
+            {
+                SetErr(err, "failed to write the journal back to the device");
+                Free(data);
+                goto done;
+            }
+
+            Free(data);
+            record.done = record.journalOffset;
+        }
+    }
+    else
+    {
+        UINTN slotIndex;
+
+        /* Keyslots keep their offsets, so the key size cannot change */
+        if (_Random(newKey, oldHeader.key_bytes) != 0)
+        {
+            SetErr(err, "failed to generate the new master key");
+            goto done;
+        }
+
+        /* The new cipher mode must work with that key size (checked before
+         * the costly key derivation) */
+        {
+            LUKSCryptContext context;
+
+            Memcpy(&newHeader, &oldHeader, sizeof(LUKSHeader));
+
+            if (cipherMode)
+            {
+                Strlcpy(newHeader.cipher_mode, cipherMode, 
+                    sizeof(newHeader.cipher_mode));
+            }
+
+            if (LUKSInitCryptContext(&context, &newHeader, newKey) != 0)
+            {
+                SetErr(err, "cipher mode %s does not support %u-byte keys",
+                    newHeader.cipher_mode, newHeader.key_bytes);
+                goto done;
+            }
+
+            LUKSFreeCryptContext(&context);
+        }
+
+        if (LUKSGetMasterKeyWithHint(rawdev, &oldHeader, passphrase,
+            passphraseSize, LUKS_SLOT_HINT_NONE, oldKey, &slotIndex) != 0)
+        {
+            SetErr(err, "bad passphrase (no keyslot opens)");
+            goto done;
+        }
+
+        if (_MakeHeaderArea(&oldHeader, slotIndex, passphrase, passphraseSize,
+                cipherMode, newKey, area, areaSize) != 0 ||
+            LUKSReadHeader(areadev, &newHeader) != 0)
+        {
+            SetErr(err, "failed to create the new header");
+            goto done;
+        }
+
+        /* Save the new header before touching the payload */
+        Memset(&record, 0, sizeof(record));
+        Memcpy(record.magic, _magic, sizeof(_magic));
+        record.version = RECORD_VERSION;
+        record.headerSectors = oldHeader.payload_offset;
+        record.payloadSize = payloadSize;
+        Memcpy(record.uuid, oldHeader.uuid, LUKS_UUID_STRING_SIZE);
+
+        if (BlkdevWriteBytes(checkpoint, LUKS_SECTOR_SIZE, area,
+                areaSize) != 0 ||
+            _PutRecord(checkpoint, &record) != 0)
+        {
+            SetErr(err, "failed to write the checkpoint");
+            goto done;
+        }
+    }
+
+    if (resumedAt)
+        *resumedAt = record.done;
+
+    if (_Run(rawdev, &oldHeader, oldKey, &newHeader, newKey, checkpoint,
+        &record, nthreads) != 0)
+    {
+        SetErr(err, "failed to re-encrypt the payload");
+        goto done;
+    }
+
+commit:
+
+    /* Replace the header area (wiping the old key material) */
+    if (BlkdevWriteBytes(rawdev, 0, area, areaSize) != 0 ||
+        BlkdevFlush(rawdev) != 0)
+    {
+        SetErr(err, "failed to write the new header");
+        goto done;
+    }
+
+    /* The checkpoint is no longer needed */
+    Memset(&record, 0, sizeof(record));
+
+    if (_PutRecord(checkpoint, &record) != 0)
+    {
+        SetErr(err, "failed to clear the checkpoint");
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+
+    if (areadev)
+        areadev->Close(areadev);
+
+    if (area)
+    {
+        Memset(area, 0, areaSize);
+        Free(area);
+    }
+
+    Memset(oldKey, 0, sizeof(oldKey));
+    Memset(newKey, 0, sizeof(newKey));
+    Memset(&oldHeader, 0, sizeof(oldHeader));
+    Memset(&newHeader, 0, sizeof(newHeader));
+
+    return rc;
+}
+
+BOOLEAN LUKSReencryptHasCheckpoint(
+    Blkdev* checkpoint)
+{
+    Record record;
+
+    if (!checkpoint)
+        return FALSE;
+
+    return _GetRecord(checkpoint, &record) == 0;
+}
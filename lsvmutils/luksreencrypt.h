@@ -0,0 +1,73 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#ifndef _luksreencrypt_h
+#define _luksreencrypt_h
+
+#include "config.h"
+#include <lsvmutils/luks.h>
+#include <lsvmutils/blkdev.h>
+#include <lsvmutils/error.h>
+
+/*
+**==============================================================================
+**
+** Offline in-place re-encryption of a LUKS1 payload under a new master key
+** (and optionally another cipher mode with the same key size).
+**
+** The checkpoint device (usually a file) holds the progress, the new
+** header area and a journal with the original ciphertext of the batch
+** being rewritten. An interrupted run resumes where it stopped when called
+** again with the same checkpoint. The device keeps its original header
+** until the whole payload is re-encrypted, so the checkpoint must not be
+** lost in between.
+**
+** Only the keyslot that the passphrase opens is carried over (same slot,
+** fresh salt); the other keyslots are disabled.
+**
+**==============================================================================
+*/
+
+int LUKSReencrypt(
+    Blkdev* rawdev,
+    UINT64 rawdevSize, /* bytes (the payload runs to the end) */
+    Blkdev* checkpoint,
+    const UINT8* passphrase,
+    UINTN passphraseSize,
+    const char* cipherMode, /* null keeps the current mode */
+    UINTN nthreads, /* per direction (0 means one per online CPU) */
+    UINT64* resumedAt, /* payload bytes already done (if not null) */
+    Error* err); /* why it failed (if not null) */
+
+/* Whether 'checkpoint' holds the progress of an interrupted run (only then
+ * is it needed to resume) */
+BOOLEAN LUKSReencryptHasCheckpoint(
+    Blkdev* checkpoint);
+
+#endif /* _luksreencrypt_h */
@@ -56,13 +56,16 @@ static int _GetN(
 {
     int rc = -1;
     BlkdevImpl* impl = (BlkdevImpl*)dev;
-    UINTN offset = blkno * BLKDEV_BLKSIZE;
-    UINTN toRead = nblocks * BLKDEV_BLKSIZE;
+    UINTN offset;
+    UINTN toRead;
 
     if (!dev || !data)
         goto done;
 
-    if (offset + toRead >= impl->size)
+    offset = blkno * impl->base.blksize;
+    toRead = nblocks * impl->base.blksize;
+
+    if (offset + toRead > impl->size)
         goto done;
 
     Memcpy(data, (const UINT8*)impl->data + offset, toRead);
@@ -80,13 +83,16 @@ static int _PutN(
 {
     int rc = -1;
     BlkdevImpl* impl = (BlkdevImpl*)dev;
-    UINTN offset = blkno * BLKDEV_BLKSIZE;
-    UINTN toWrite = nblocks * BLKDEV_BLKSIZE;
+    UINTN offset;
+    UINTN toWrite;
 
     if (!dev || !data)
         goto done;
 
-    if (offset + toWrite >= impl->size)
+    offset = blkno * impl->base.blksize;
+    toWrite = nblocks * impl->base.blksize;
+
+    if (offset + toWrite > impl->size)
         goto done;
 
     Memcpy((UINT8*)impl->data + offset, data, toWrite);
@@ -96,6 +102,94 @@ done:
     return rc;
 }
 
+static int _GetV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    int rc = -1;
+    UINTN i;
+
+    if (!dev || (!segments && nsegments))
+        goto done;
+
+    for (i = 0; i < nsegments; i++)
+    {
+        const BlkdevSegment* seg = &segments[i];
+
+        if (_GetN(dev, seg->blkno, seg->nblocks, seg->data) != 0)
+            goto done;
+    }
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+static int _PutV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    int rc = -1;
+    UINTN i;
+
+    if (!dev || (!segments && nsegments))
+        goto done;
+
+    for (i = 0; i < nsegments; i++)
+    {
+        const BlkdevSegment* seg = &segments[i];
+
+        if (_PutN(dev, seg->blkno, seg->nblocks, seg->data) != 0)
+            goto done;
+    }
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+static int _Flush(
+    Blkdev* dev)
+{
+    /* Nothing to flush */
+    return 0;
+}
+
+/* The blocks are already in memory, so lend them out directly */
+static int _Borrow(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    const void** data)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINTN offset;
+    UINTN size;
+
+    if (!dev || !data)
+        return -1;
+
+    offset = blkno * impl->base.blksize;
+    size = nblocks * impl->base.blksize;
+
+    if (offset + size > impl->size)
+        return -1;
+
+    *data = (const UINT8*)impl->data + offset;
+    return 0;
+}
+
+static int _Release(
+    Blkdev* dev,
+    const void* data)
+{
+    return 0;
+}
+
 static int _SetFlags(
     Blkdev* dev,
     UINT32 flags)
@@ -104,15 +198,32 @@ static int _SetFlags(
     return -1;
 }
 
-Blkdev* BlkdevFromMemory(
+static int _GetNumBlocks(
+    Blkdev* dev,
+    UINT64* nblocks)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!dev || !nblocks)
+        return -1;
+
+    *nblocks = impl->size / impl->base.blksize;
+    return 0;
+}
+
+Blkdev* BlkdevFromMemoryWithBlockSize(
     void* data,
-    UINTN size)
+    UINTN size,
+    UINTN blksize)
 {
     BlkdevImpl* impl = NULL;
 
     if (!data || !size)
         goto done;
 
+    if (!BlkdevValidBlockSize(blksize))
+        goto done;
+
     if (!(impl = Calloc(1, sizeof(BlkdevImpl))))
         goto done;
 
@@ -120,9 +231,23 @@ Blkdev* BlkdevFromMemory(
     impl->base.GetN = _GetN;
     impl->base.PutN = _PutN;
     impl->base.SetFlags = _SetFlags;
+    impl->base.GetV = _GetV;
+    impl->base.PutV = _PutV;
+    impl->base.Flush = _Flush;
+    impl->base.Borrow = _Borrow;
+    impl->base.Release = _Release;
+    impl->base.GetNumBlocks = _GetNumBlocks;
+    impl->base.blksize = blksize;
     impl->data = data;
     impl->size = size;
 
 done:
     return &impl->base;
 }
+
+Blkdev* BlkdevFromMemory(
+    void* data,
+    UINTN size)
+{
+    return BlkdevFromMemoryWithBlockSize(data, size, BLKDEV_BLKSIZE);
+}
@@ -38,4 +38,10 @@ Blkdev* BlkdevFromMemory(
     void* data,
     UINTN size);
 
+/* Present memory as a device with 'blksize' byte blocks (e.g., 4096) */
+Blkdev* BlkdevFromMemoryWithBlockSize(
+    void* data,
+    UINTN size,
+    UINTN blksize);
+
 #endif /* _memblkdev_h */
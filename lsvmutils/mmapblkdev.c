@@ -0,0 +1,315 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#include "mmapblkdev.h"
+#include "alloc.h"
+#include "strings.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MMAPBLKDEV_MAGIC 0x8c31d7e4
+
+typedef struct _BlkdevImpl BlkdevImpl;
+
+struct _BlkdevImpl
+{
+    Blkdev base;
+    UINT32 magic;
+    int fd;
+    UINT8* data;
+    UINTN size; /* whole blocks only */
+    UINTN mapSize;
+    BOOLEAN writable;
+
+    /* Number of BlkdevBorrow() pointers not yet released */
+    UINTN borrowed;
+};
+
+static BOOLEAN _ValidMmapBlkdev(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    return impl != NULL && impl->magic == MMAPBLKDEV_MAGIC;
+}
+
+/* Locate a range of blocks within the mapping */
+static UINT8* _Locate(
+    BlkdevImpl* impl,
+    UINTN blkno,
+    UINTN nblocks)
+{
+    UINTN offset = blkno * impl->base.blksize;
+    UINTN size = nblocks * impl->base.blksize;
+
+    if (blkno > impl->size / impl->base.blksize || 
+        offset + size > impl->size ||
+        offset + size < offset)
+    {
+        return NULL;
+    }
+
+    return impl->data + offset;
+}
+
+static int _Close(
+    Blkdev* dev)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidMmapBlkdev(dev))
+        goto done;
+
+    /* Borrowed pointers would dangle after unmapping */
+    if (impl->borrowed)
+        goto done;
+
+    munmap(impl->data, impl->mapSize);
+    close(impl->fd);
+    Free(impl);
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+static int _GetN(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    void* data)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    const UINT8* p;
+
+    if (!_ValidMmapBlkdev(dev) || !data)
+        goto done;
+
+    if (!(p = _Locate(impl, blkno, nblocks)))
+        goto done;
+
+    Memcpy(data, p, nblocks * impl->base.blksize);
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+static int _PutN(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    const void* data)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINT8* p;
+
+    if (!_ValidMmapBlkdev(dev) || !data || !impl->writable)
+        goto done;
+
+    if (!(p = _Locate(impl, blkno, nblocks)))
+        goto done;
+
+    Memcpy(p, data, nblocks * impl->base.blksize);
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+static int _SetFlags(
+    Blkdev* dev,
+    UINT32 flags)
+{
+    /* No flags supported */
+    return -1;
+}
+
+static int _Flush(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidMmapBlkdev(dev))
+        return -1;
+
+    if (!impl->writable)
+        return 0;
+
+    return msync(impl->data, impl->mapSize, MS_SYNC) == 0 ? 0 : -1;
+}
+
+static int _Borrow(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    const void** data)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    const UINT8* p;
+
+    if (!_ValidMmapBlkdev(dev) || !data)
+        return -1;
+
+    if (!(p = _Locate(impl, blkno, nblocks)))
+        return -1;
+
+    *data = p;
+    impl->borrowed++;
+
+    return 0;
+}
+
+static int _Release(
+    Blkdev* dev,
+    const void* data)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidMmapBlkdev(dev) || !data)
+        return -1;
+
+    /* Not a pointer into the mapping (so not lent by this device) */
+    if ((const UINT8*)data < impl->data || 
+        (const UINT8*)data >= impl->data + impl->size)
+    {
+        return -1;
+    }
+
+    if (impl->borrowed)
+        impl->borrowed--;
+
+    return 0;
+}
+
+static int _GetNumBlocks(
+    Blkdev* dev,
+    UINT64* nblocks)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidMmapBlkdev(dev) || !nblocks)
+        return -1;
+
+    *nblocks = impl->size / impl->base.blksize;
+    return 0;
+}
+
+Blkdev* MmapBlkdevOpen(
+    const char* path,
+    BlkdevAccess access,
+    UINT32 flags)
+{
+    BlkdevImpl* impl = NULL;
+    int fd = -1;
+    int openFlags;
+    int prot;
+    int mapFlags = MAP_SHARED;
+    struct stat st;
+    void* data = MAP_FAILED;
+
+    if (!path || (flags & ~MMAPBLKDEV_SEQUENTIAL))
+        goto done;
+
+    if (access == BLKDEV_ACCESS_RDONLY)
+    {
+        openFlags = O_RDONLY;
+        prot = PROT_READ;
+    }
+    else
+    {
+        /* Mappings cannot be write-only */
+        openFlags = O_RDWR;
+        prot = PROT_READ | PROT_WRITE;
+    }
+
+    if ((fd = open(path, openFlags)) < 0)
+        goto done;
+
+    /* Only regular files have a size that can be mapped */
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        goto done;
+
+    if (st.st_size < BLKDEV_BLKSIZE || (UINT64)st.st_size != (size_t)st.st_size)
+        goto done;
+
+    /* Prefault the whole image ahead of a sequential scan */
+    if (flags & MMAPBLKDEV_SEQUENTIAL)
+        mapFlags |= MAP_POPULATE;
+
+    if ((data = mmap(NULL, st.st_size, prot, mapFlags, fd, 0)) == MAP_FAILED)
+        goto done;
+
+    if (flags & MMAPBLKDEV_SEQUENTIAL)
+    {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        madvise(data, st.st_size, MADV_WILLNEED);
+    }
+
+    if (!(impl = (BlkdevImpl*)Calloc(1, sizeof(BlkdevImpl))))
+        goto done;
+
+    impl->base.Close = _Close;
+    impl->base.GetN = _GetN;
+    impl->base.PutN = _PutN;
+    impl->base.SetFlags = _SetFlags;
+    impl->base.Flush = _Flush;
+    impl->base.Borrow = _Borrow;
+    impl->base.Release = _Release;
+    impl->base.GetNumBlocks = _GetNumBlocks;
+    impl->base.blksize = BLKDEV_BLKSIZE;
+    impl->magic = MMAPBLKDEV_MAGIC;
+    impl->fd = fd;
+    impl->data = (UINT8*)data;
+    impl->mapSize = st.st_size;
+    impl->size = st.st_size - (st.st_size % BLKDEV_BLKSIZE);
+    impl->writable = (prot & PROT_WRITE) ? TRUE : FALSE;
+
+    fd = -1;
+    data = MAP_FAILED;
+
+done:
+
+    if (data != MAP_FAILED)
+        munmap(data, st.st_size);
+
+    if (fd >= 0)
+        close(fd);
+
+    return &impl->base;
+}
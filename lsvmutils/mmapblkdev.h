@@ -0,0 +1,47 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#ifndef _mmapblkdev_h
+#define _mmapblkdev_h
+
+#include "config.h"
+#include <lsvmutils/blkdev.h>
+
+/* MmapBlkdevOpen() flag: the image will be scanned from start to end */
+#define MMAPBLKDEV_SEQUENTIAL 1
+
+/* Map an image file into memory. GetN() and PutN() copy to and from the 
+ * mapping, and BlkdevBorrow() returns pointers into it without copying.
+ * Trailing bytes that do not fill a whole block are not accessible. */
+Blkdev* MmapBlkdevOpen(
+    const char* path,
+    BlkdevAccess access,
+    UINT32 flags); /* MMAPBLKDEV_* */
+
+#endif /* _mmapblkdev_h */
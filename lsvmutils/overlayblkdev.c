@@ -0,0 +1,740 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#include "overlayblkdev.h"
+#include "alloc.h"
+#include "strings.h"
+
+#define OVERLAYBLKDEV_MAGIC 0x0e7a1b4d
+
+/* Initial number of hash chains (doubled as the delta grows) */
+#define INITIAL_CHAINS 1024
+
+/* Maximum number of blocks written to the base device at once on commit */
+#define COMMIT_BLOCKS 256
+
+/* The list of changed blocks is kept in the store after the last block of
+ * the base device: this header followed by 'count' block numbers */
+#define LIST_MAGIC "LSVMDLTA"
+
+typedef struct _ListHeader
+{
+    char magic[8];
+    UINT64 count;
+}
+ListHeader;
+
+typedef struct _Delta Delta;
+
+struct _Delta
+{
+    UINTN blkno;
+    Delta* chain;
+
+    /* Block contents (NULL when the block is kept in the store) */
+    UINT8* data;
+};
+
+typedef struct _BlkdevImpl BlkdevImpl;
+
+struct _BlkdevImpl
+{
+    Blkdev base;
+    UINT32 magic;
+    Blkdev* child;
+
+    /* Holds the changed blocks (or NULL to keep them in memory) */
+    Blkdev* store;
+
+    /* Hash table of changed blocks */
+    Delta** chains;
+    UINTN nchains;
+    UINTN count;
+
+    /* Block number of the list of changed blocks within the store */
+    UINTN listBlkno;
+
+    /* The list in the store no longer matches the hash table */
+    BOOLEAN listDirty;
+};
+
+static BOOLEAN _ValidOverlayBlkdev(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    return impl != NULL && impl->magic == OVERLAYBLKDEV_MAGIC;
+}
+
+static Delta* _Find(
+    BlkdevImpl* impl,
+    UINTN blkno)
+{
+    Delta* p;
+
+    for (p = impl->chains[blkno % impl->nchains]; p; p = p->chain)
+    {
+        if (p->blkno == blkno)
+            return p;
+    }
+
+    return NULL;
+}
+
+/* Double the number of chains (the delta stays usable if this fails) */
+static void _Grow(
+    BlkdevImpl* impl)
+{
+    UINTN nchains = impl->nchains * 2;
+    Delta** chains;
+    UINTN i;
+
+    if (!(chains = (Delta**)Calloc(nchains, sizeof(Delta*))))
+        return;
+
+    for (i = 0; i < impl->nchains; i++)
+    {
+        Delta* p = impl->chains[i];
+
+        while (p)
+        {
+            Delta* next = p->chain;
+            UINTN index = p->blkno % nchains;
+            p->chain = chains[index];
+            chains[index] = p;
+            p = next;
+        }
+    }
+
+    Free(impl->chains);
+    impl->chains = chains;
+    impl->nchains = nchains;
+}
+
+/* Find the delta for this block or add a new one */
+static Delta* _Insert(
+    BlkdevImpl* impl,
+    UINTN blkno)
+{
+    Delta* p;
+    UINTN index;
+
+    if ((p = _Find(impl, blkno)))
+        return p;
+
+    if (impl->count >= impl->nchains * 2)
+        _Grow(impl);
+
+    impl->listDirty = TRUE;
+
+    if (impl->store)
+    {
+        if (!(p = (Delta*)Calloc(1, sizeof(Delta))))
+            return NULL;
+    }
+    else
+    {
+        if (!(p = (Delta*)Calloc(1, sizeof(Delta) + impl->base.blksize)))
+            return NULL;
+
+        p->data = (UINT8*)(p + 1);
+    }
+
+    p->blkno = blkno;
+    index = blkno % impl->nchains;
+    p->chain = impl->chains[index];
+    impl->chains[index] = p;
+    impl->count++;
+
+    return p;
+}
+
+static void _Clear(
+    BlkdevImpl* impl)
+{
+    UINTN i;
+
+    for (i = 0; i < impl->nchains; i++)
+    {
+        Delta* p = impl->chains[i];
+
+        while (p)
+        {
+            Delta* next = p->chain;
+
+            /* Do not leave written data behind in freed memory */
+            if (p->data)
+                Memset(p->data, 0, impl->base.blksize);
+
+            Free(p);
+            p = next;
+        }
+
+        impl->chains[i] = NULL;
+    }
+
+    impl->count = 0;
+    impl->listDirty = TRUE;
+}
+
+static void _SortBlknos(
+    UINTN* blknos,
+    UINTN nblknos)
+{
+    UINTN gap;
+    UINTN i;
+
+    for (gap = nblknos / 2; gap > 0; gap /= 2)
+    {
+        for (i = gap; i < nblknos; i++)
+        {
+            UINTN tmp = blknos[i];
+            UINTN j;
+
+            for (j = i; j >= gap && blknos[j-gap] > tmp; j -= gap)
+                blknos[j] = blknos[j-gap];
+
+            blknos[j] = tmp;
+        }
+    }
+}
+
+/* Write the list of changed blocks to the store (if it changed). Whole
+ * blocks are written since the store may end before the list. */
+static int _SaveList(
+    BlkdevImpl* impl)
+{
+    int rc = -1;
+    UINTN* blknos = NULL;
+    UINTN nblknos;
+    UINT8* buf = NULL;
+    UINTN nblocks;
+    ListHeader* header;
+    UINT64* list;
+    UINTN i;
+
+    if (!impl->store || !impl->listDirty)
+        return 0;
+
+    if (OverlayBlkdevGetChanges(&impl->base, &blknos, &nblknos) != 0)
+        goto done;
+
+    nblocks = (sizeof(ListHeader) + nblknos * sizeof(UINT64) + 
+        impl->base.blksize - 1) / impl->base.blksize;
+
+    if (!(buf = (UINT8*)Calloc(nblocks, impl->base.blksize)))
+        goto done;
+
+    header = (ListHeader*)buf;
+    Memcpy(header->magic, LIST_MAGIC, sizeof(header->magic));
+    header->count = nblknos;
+
+    list = (UINT64*)(buf + sizeof(ListHeader));
+
+    for (i = 0; i < nblknos; i++)
+        list[i] = blknos[i];
+
+    if (impl->store->PutN(impl->store, impl->listBlkno, nblocks, buf) != 0)
+        goto done;
+
+    impl->listDirty = FALSE;
+
+    rc = 0;
+
+done:
+
+    if (buf)
+        Free(buf);
+
+    if (blknos)
+        Free(blknos);
+
+    return rc;
+}
+
+/* Load the list of changed blocks saved in the store by an earlier overlay
+ * of the same base device (a new store holds no changes) */
+static int _LoadList(
+    BlkdevImpl* impl)
+{
+    int rc = -1;
+    ListHeader header;
+    UINT64 nblocks;
+    UINT64* list = NULL;
+    UINTN count;
+    UINTN i;
+
+    if (BlkdevGetNumBlocks(impl->child, &nblocks) != 0)
+        goto done;
+
+    impl->listBlkno = (UINTN)nblocks;
+
+    /* A new store ends before the list (or has a hole there) */
+    if (BlkdevReadBytes(
+        impl->store, 
+        (UINT64)impl->listBlkno * impl->base.blksize, 
+        &header, 
+        sizeof(header)) != 0 || header.magic[0] == '\0')
+    {
+        rc = 0;
+        goto done;
+    }
+
+    if (Memcmp(header.magic, LIST_MAGIC, sizeof(header.magic)) != 0 ||
+        header.count > nblocks)
+    {
+        goto done;
+    }
+
+    count = (UINTN)header.count;
+
+    if (count)
+    {
+        if (!(list = (UINT64*)Malloc(count * sizeof(UINT64))))
+            goto done;
+
+        if (BlkdevReadBytes(
+            impl->store, 
+            (UINT64)impl->listBlkno * impl->base.blksize + 
+                sizeof(ListHeader), 
+            list, 
+            count * sizeof(UINT64)) != 0)
+        {
+            goto done;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (list[i] >= nblocks || !_Insert(impl, (UINTN)list[i]))
+        {
+            _Clear(impl);
+            goto done;
+        }
+    }
+
+    impl->listDirty = FALSE;
+
+    rc = 0;
+
+done:
+
+    if (list)
+        Free(list);
+
+    return rc;
+}
+
+static int _Close(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    int rc = 0;
+
+    if (!_ValidOverlayBlkdev(dev))
+        return -1;
+
+    if (_SaveList(impl) != 0)
+        rc = -1;
+
+    _Clear(impl);
+    Free(impl->chains);
+
+    if (impl->store && impl->store->Close(impl->store) != 0)
+        rc = -1;
+
+    if (impl->child->Close(impl->child) != 0)
+        rc = -1;
+
+    Memset(impl, 0, sizeof(BlkdevImpl));
+    Free(impl);
+
+    return rc;
+}
+
+static int _GetN(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    void* data)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINTN blksize;
+    UINT8* ptr = (UINT8*)data;
+    UINTN i = 0;
+
+    if (!_ValidOverlayBlkdev(dev) || !data)
+        return -1;
+
+    blksize = impl->base.blksize;
+
+    /* Read runs of unchanged blocks from the base device */
+    while (i < nblocks)
+    {
+        Delta* p = _Find(impl, blkno + i);
+        UINTN n = 1;
+
+        if (p && p->data)
+        {
+            Memcpy(ptr, p->data, blksize);
+        }
+        else if (p)
+        {
+            while (i + n < nblocks && _Find(impl, blkno + i + n))
+                n++;
+
+            if (impl->store->GetN(impl->store, blkno + i, n, ptr) != 0)
+                return -1;
+        }
+        else
+        {
+            while (i + n < nblocks && !_Find(impl, blkno + i + n))
+                n++;
+
+            if (impl->child->GetN(impl->child, blkno + i, n, ptr) != 0)
+                return -1;
+        }
+
+        ptr += n * blksize;
+        i += n;
+    }
+
+    return 0;
+}
+
+/* Check that blocks [blkno, blkno + nblocks) lie within the base device
+ * (writes past it would overwrite the list saved in the store) */
+static BOOLEAN _InRange(
+    BlkdevImpl* impl,
+    UINTN blkno,
+    UINTN nblocks)
+{
+    UINT64 limit;
+
+    if (impl->store)
+        limit = impl->listBlkno;
+    else if (BlkdevGetNumBlocks(impl->child, &limit) != 0)
+        return TRUE;
+
+    return blkno <= limit && nblocks <= limit - blkno;
+}
+
+static int _PutN(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    const void* data)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINTN blksize;
+    UINTN i;
+
+    if (!_ValidOverlayBlkdev(dev) || !data)
+        return -1;
+
+    if (!_InRange(impl, blkno, nblocks))
+        return -1;
+
+    blksize = impl->base.blksize;
+
+    if (impl->store)
+    {
+        if (impl->store->PutN(impl->store, blkno, nblocks, data) != 0)
+            return -1;
+    }
+
+    for (i = 0; i < nblocks; i++)
+    {
+        Delta* p;
+
+        if (!(p = _Insert(impl, blkno + i)))
+            return -1;
+
+        if (p->data)
+            Memcpy(p->data, (const UINT8*)data + i * blksize, blksize);
+    }
+
+    return 0;
+}
+
+static int _SetFlags(
+    Blkdev* dev,
+    UINT32 flags)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidOverlayBlkdev(dev))
+        return -1;
+
+    return impl->child->SetFlags(impl->child, flags);
+}
+
+/* The base device is never written, so only the store needs flushing
+ * (along with the list of changed blocks) */
+static int _Flush(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidOverlayBlkdev(dev))
+        return -1;
+
+    if (!impl->store)
+        return 0;
+
+    if (_SaveList(impl) != 0)
+        return -1;
+
+    return BlkdevFlush(impl->store);
+}
+
+/* The overlay has the geometry of the base device */
+static int _GetNumBlocks(
+    Blkdev* dev,
+    UINT64* nblocks)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidOverlayBlkdev(dev))
+        return -1;
+
+    return BlkdevGetNumBlocks(impl->child, nblocks);
+}
+
+static Blkdev* _NewOverlayBlkdev(
+    Blkdev* base,
+    Blkdev* store)
+{
+    BlkdevImpl* impl = NULL;
+
+    if (!base)
+        goto done;
+
+    /* Changed blocks are stored at their own block numbers */
+    if (store && BlkdevBlockSize(store) != BlkdevBlockSize(base))
+        goto done;
+
+    if (!(impl = (BlkdevImpl*)Calloc(1, sizeof(BlkdevImpl))))
+        goto done;
+
+    if (!(impl->chains = (Delta**)Calloc(INITIAL_CHAINS, sizeof(Delta*))))
+    {
+        Free(impl);
+        impl = NULL;
+        goto done;
+    }
+
+    impl->base.Close = _Close;
+    impl->base.GetN = _GetN;
+    impl->base.PutN = _PutN;
+    impl->base.SetFlags = _SetFlags;
+    impl->base.Flush = _Flush;
+
+    if (base->GetNumBlocks)
+        impl->base.GetNumBlocks = _GetNumBlocks;
+
+    impl->base.blksize = BlkdevBlockSize(base);
+    impl->magic = OVERLAYBLKDEV_MAGIC;
+    impl->child = base;
+    impl->store = store;
+    impl->nchains = INITIAL_CHAINS;
+
+    /* Resume the changes saved in the store (if any) */
+    if (store && _LoadList(impl) != 0)
+    {
+        Free(impl->chains);
+        Free(impl);
+        impl = NULL;
+        goto done;
+    }
+
+done:
+    return &impl->base;
+}
+
+Blkdev* NewOverlayBlkdev(
+    Blkdev* base)
+{
+    return _NewOverlayBlkdev(base, NULL);
+}
+
+Blkdev* NewOverlayBlkdevWithStore(
+    Blkdev* base,
+    Blkdev* store)
+{
+    if (!store)
+        return NULL;
+
+    return _NewOverlayBlkdev(base, store);
+}
+
+BOOLEAN IsOverlayBlkdev(
+    Blkdev* dev)
+{
+    return _ValidOverlayBlkdev(dev);
+}
+
+UINTN OverlayBlkdevCount(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidOverlayBlkdev(dev))
+        return 0;
+
+    return impl->count;
+}
+
+int OverlayBlkdevGetChanges(
+    Blkdev* dev,
+    UINTN** blknosOut,
+    UINTN* nblknosOut)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINTN* blknos = NULL;
+    UINTN n = 0;
+    UINTN i;
+
+    if (blknosOut)
+        *blknosOut = NULL;
+
+    if (nblknosOut)
+        *nblknosOut = 0;
+
+    if (!_ValidOverlayBlkdev(dev) || !blknosOut || !nblknosOut)
+        return -1;
+
+    if (impl->count == 0)
+        return 0;
+
+    if (!(blknos = (UINTN*)Malloc(impl->count * sizeof(UINTN))))
+        return -1;
+
+    for (i = 0; i < impl->nchains; i++)
+    {
+        Delta* p;
+
+        for (p = impl->chains[i]; p; p = p->chain)
+            blknos[n++] = p->blkno;
+    }
+
+    _SortBlknos(blknos, n);
+
+    *blknosOut = blknos;
+    *nblknosOut = n;
+
+    return 0;
+}
+
+int OverlayBlkdevCommit(
+    Blkdev* dev)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINTN* blknos = NULL;
+    UINTN nblknos;
+    UINT8* buf = NULL;
+    UINTN blksize;
+    UINTN i = 0;
+
+    if (!_ValidOverlayBlkdev(dev))
+        goto done;
+
+    blksize = impl->base.blksize;
+
+    if (OverlayBlkdevGetChanges(dev, &blknos, &nblknos) != 0)
+        goto done;
+
+    if (nblknos && !(buf = (UINT8*)Malloc(COMMIT_BLOCKS * blksize)))
+        goto done;
+
+    /* Write runs of consecutive changed blocks */
+    while (i < nblknos)
+    {
+        UINTN n = 1;
+        UINTN j;
+
+        while (i + n < nblknos && n < COMMIT_BLOCKS &&
+            blknos[i + n] == blknos[i] + n)
+        {
+            n++;
+        }
+
+        if (impl->store)
+        {
+            if (impl->store->GetN(impl->store, blknos[i], n, buf) != 0)
+                goto done;
+        }
+        else
+        {
+            for (j = 0; j < n; j++)
+            {
+                Delta* p = _Find(impl, blknos[i + j]);
+                Memcpy(buf + j * blksize, p->data, blksize);
+            }
+        }
+
+        if (impl->child->PutN(impl->child, blknos[i], n, buf) != 0)
+            goto done;
+
+        i += n;
+    }
+
+    if (BlkdevFlush(impl->child) != 0)
+        goto done;
+
+    _Clear(impl);
+
+    rc = 0;
+
+done:
+
+    if (buf)
+    {
+        Memset(buf, 0, COMMIT_BLOCKS * blksize);
+        Free(buf);
+    }
+
+    if (blknos)
+        Free(blknos);
+
+    return rc;
+}
+
+int OverlayBlkdevDiscard(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidOverlayBlkdev(dev))
+        return -1;
+
+    _Clear(impl);
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#ifndef _overlayblkdev_h
+#define _overlayblkdev_h
+
+#include "config.h"
+#include <lsvmutils/blkdev.h>
+
+/* Create a copy-on-write overlay of 'base': reads pass through to 'base'
+ * until a block is written; writes go to a delta kept in memory. The base
+ * device is never written (except by OverlayBlkdevCommit). Closing the
+ * overlay closes 'base'. */
+Blkdev* NewOverlayBlkdev(
+    Blkdev* base);
+
+/* Like NewOverlayBlkdev() but keep the delta in 'store' (typically a sparse
+ * file), where each changed block is written at its own block number. The
+ * list of changed blocks is kept in memory and saved in the store after the
+ * last block of 'base' on Flush() and Close(), so that a later overlay on 
+ * the same store resumes these changes ('base' must know its size, see 
+ * BlkdevGetNumBlocks()). Closing the overlay closes both 'base' and 
+ * 'store'. */
+Blkdev* NewOverlayBlkdevWithStore(
+    Blkdev* base,
+    Blkdev* store);
+
+BOOLEAN IsOverlayBlkdev(
+    Blkdev* dev);
+
+/* Get the number of blocks written through the overlay */
+UINTN OverlayBlkdevCount(
+    Blkdev* dev);
+
+/* Get the sorted list of changed block numbers (caller frees with Free) */
+int OverlayBlkdevGetChanges(
+    Blkdev* dev,
+    UINTN** blknos,
+    UINTN* nblknos);
+
+/* Write the changed blocks to the base device and empty the delta */
+int OverlayBlkdevCommit(
+    Blkdev* dev);
+
+/* Forget all changes (reads see the base device again). The blocks left in
+ * a store are ignored once the (now empty) list is saved. */
+int OverlayBlkdevDiscard(
+    Blkdev* dev);
+
+#endif /* _overlayblkdev_h */
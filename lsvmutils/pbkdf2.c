@@ -0,0 +1,735 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#include "config.h"
+#include "pbkdf2.h"
+#include "alloc.h"
+#include "strings.h"
+
+/*
+**==============================================================================
+**
+** Vector lanes:
+**
+**     Written with GCC vector extensions rather than intrinsics so that the
+**     same source builds under -nostdinc (EFI), where no intrinsic headers
+**     are available. On x86-64 this compiles to SSE2, which is part of the
+**     base ISA and which UEFI requires firmware to enable, so no CPU
+**     feature checks are needed.
+**
+**==============================================================================
+*/
+
+#define LANES 4
+#define BLOCK_SIZE 64
+#define MAX_WORDS 8
+
+typedef UINT32 V4 __attribute__((vector_size(16)));
+
+INLINE V4 _Splat(UINT32 x)
+{
+    V4 v = { x, x, x, x };
+    return v;
+}
+
+#define ROTL(X, N) (((X) << _Splat(N)) | ((X) >> _Splat(32 - (N))))
+#define SHR(X, N) ((X) >> _Splat(N))
+
+INLINE UINTN _Words(SHAAlgorithm alg)
+{
+    return alg == SHA1_ALG ? 5 : 8;
+}
+
+INLINE UINT32 _GetBE32(const UINT8* p)
+{
+    return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | 
+        ((UINT32)p[2] << 8) | (UINT32)p[3];
+}
+
+INLINE void _PutBE32(UINT8* p, UINT32 x)
+{
+    p[0] = (UINT8)(x >> 24);
+    p[1] = (UINT8)(x >> 16);
+    p[2] = (UINT8)(x >> 8);
+    p[3] = (UINT8)x;
+}
+
+/* Write the first 'size' bytes of a big-endian digest */
+static void _PutWords(
+    UINT8* out, 
+    const UINT32* words, 
+    UINTN size)
+{
+    UINT8 buf[MAX_WORDS * sizeof(UINT32)];
+    UINTN i;
+
+    for (i = 0; i < MAX_WORDS; i++)
+        _PutBE32(&buf[i * sizeof(UINT32)], words[i]);
+
+    Memcpy(out, buf, size);
+    Memset(buf, 0, sizeof(buf));
+}
+
+/*
+**==============================================================================
+**
+** SHA-1 and SHA-256 compression of four independent blocks:
+**
+**==============================================================================
+*/
+
+#define SHA1_ROUND(A, B, C, D, E, F, K, I) \
+    do \
+    { \
+        if ((I) >= 16) \
+        { \
+            V4 x_ = w[((I) + 13) & 15] ^ w[((I) + 8) & 15] ^ \
+                w[((I) + 2) & 15] ^ w[(I) & 15]; \
+            w[(I) & 15] = ROTL(x_, 1); \
+        } \
+        E += ROTL(A, 5) + (F) + _Splat(K) + w[(I) & 15]; \
+        B = ROTL(B, 30); \
+    } \
+    while (0)
+
+#define SHA1_CH(B, C, D) ((D) ^ ((B) & ((C) ^ (D))))
+#define SHA1_PARITY(B, C, D) ((B) ^ (C) ^ (D))
+#define SHA1_MAJ(B, C, D) (((B) & (C)) | ((D) & ((B) | (C))))
+
+#define SHA1_ROUND5(FN, K, I) \
+    do \
+    { \
+        SHA1_ROUND(a, b, c, d, e, FN(b, c, d), K, (I)); \
+        SHA1_ROUND(e, a, b, c, d, FN(a, b, c), K, (I) + 1); \
+        SHA1_ROUND(d, e, a, b, c, FN(e, a, b), K, (I) + 2); \
+        SHA1_ROUND(c, d, e, a, b, FN(d, e, a), K, (I) + 3); \
+        SHA1_ROUND(b, c, d, e, a, FN(c, d, e), K, (I) + 4); \
+    } \
+    while (0)
+
+static void _SHA1x4(
+    V4 h[MAX_WORDS],
+    V4 w[16])
+{
+    V4 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    UINTN i;
+
+    for (i = 0; i < 20; i += 5)
+        SHA1_ROUND5(SHA1_CH, 0x5A827999, i);
+
+    for (; i < 40; i += 5)
+        SHA1_ROUND5(SHA1_PARITY, 0x6ED9EBA1, i);
+
+    for (; i < 60; i += 5)
+        SHA1_ROUND5(SHA1_MAJ, 0x8F1BBCDC, i);
+
+    for (; i < 80; i += 5)
+        SHA1_ROUND5(SHA1_PARITY, 0xCA62C1D6, i);
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+static const UINT32 _sha256K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(X, N) ROTL(X, 32 - (N))
+#define SHA256_S0(X) (ROTR(X, 2) ^ ROTR(X, 13) ^ ROTR(X, 22))
+#define SHA256_S1(X) (ROTR(X, 6) ^ ROTR(X, 11) ^ ROTR(X, 25))
+#define SHA256_s0(X) (ROTR(X, 7) ^ ROTR(X, 18) ^ SHR(X, 3))
+#define SHA256_s1(X) (ROTR(X, 17) ^ ROTR(X, 19) ^ SHR(X, 10))
+
+#define SHA256_ROUND(A, B, C, D, E, F, G, H, I) \
+    do \
+    { \
+        V4 t_; \
+        if ((I) >= 16) \
+        { \
+            w[(I) & 15] += SHA256_s1(w[((I) + 14) & 15]) + \
+                w[((I) + 9) & 15] + SHA256_s0(w[((I) + 1) & 15]); \
+        } \
+        t_ = H + SHA256_S1(E) + ((G) ^ ((E) & ((F) ^ (G)))) + \
+            _Splat(_sha256K[I]) + w[(I) & 15]; \
+        D += t_; \
+        H = t_ + SHA256_S0(A) + (((A) & (B)) | ((C) & ((A) | (B)))); \
+    } \
+    while (0)
+
+static void _SHA256x4(
+    V4 h[MAX_WORDS],
+    V4 w[16])
+{
+    V4 a = h[0], b = h[1], c = h[2], d = h[3];
+    V4 e = h[4], f = h[5], g = h[6], hh = h[7];
+    UINTN i;
+
+    for (i = 0; i < 64; i += 8)
+    {
+        SHA256_ROUND(a, b, c, d, e, f, g, hh, i);
+        SHA256_ROUND(hh, a, b, c, d, e, f, g, i + 1);
+        SHA256_ROUND(g, hh, a, b, c, d, e, f, i + 2);
+        SHA256_ROUND(f, g, hh, a, b, c, d, e, i + 3);
+        SHA256_ROUND(e, f, g, hh, a, b, c, d, i + 4);
+        SHA256_ROUND(d, e, f, g, hh, a, b, c, i + 5);
+        SHA256_ROUND(c, d, e, f, g, hh, a, b, i + 6);
+        SHA256_ROUND(b, c, d, e, f, g, hh, a, i + 7);
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+}
+
+INLINE void _Compress(
+    SHAAlgorithm alg,
+    V4 h[MAX_WORDS],
+    V4 w[16])
+{
+    if (alg == SHA1_ALG)
+        _SHA1x4(h, w);
+    else
+        _SHA256x4(h, w);
+}
+
+/*
+**==============================================================================
+**
+** Single-stream hashing (key setup and the first PBKDF2 iteration only):
+**
+**==============================================================================
+*/
+
+typedef struct _HashContext
+{
+    SHAAlgorithm alg;
+    UINT32 h[MAX_WORDS];
+    UINT8 block[BLOCK_SIZE];
+    UINTN blockSize;
+    UINT64 total;
+}
+HashContext;
+
+static const UINT32 _sha1IV[MAX_WORDS] =
+{
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+static const UINT32 _sha256IV[MAX_WORDS] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/* Compress one block (the same block in every lane) */
+static void _CompressBlock(
+    HashContext* ctx)
+{
+    V4 h[MAX_WORDS];
+    V4 w[16];
+    UINTN i;
+
+    for (i = 0; i < MAX_WORDS; i++)
+        h[i] = _Splat(ctx->h[i]);
+
+    for (i = 0; i < 16; i++)
+        w[i] = _Splat(_GetBE32(&ctx->block[i * sizeof(UINT32)]));
+
+    _Compress(ctx->alg, h, w);
+
+    for (i = 0; i < MAX_WORDS; i++)
+        ctx->h[i] = h[i][0];
+
+    Memset(w, 0, sizeof(w));
+}
+
+/* Start from 'state' (or the IV) with 'total' bytes already hashed */
+static void _HashInit(
+    HashContext* ctx,
+    SHAAlgorithm alg,
+    const UINT32* state,
+    UINT64 total)
+{
+    Memset(ctx, 0, sizeof(HashContext));
+    ctx->alg = alg;
+    ctx->total = total;
+
+    if (!state)
+        state = (alg == SHA1_ALG) ? _sha1IV : _sha256IV;
+
+    Memcpy(ctx->h, state, sizeof(ctx->h));
+}
+
+static void _HashUpdate(
+    HashContext* ctx,
+    const UINT8* data,
+    UINTN size)
+{
+    while (size)
+    {
+        UINTN n = BLOCK_SIZE - ctx->blockSize;
+
+        if (n > size)
+            n = size;
+
+        Memcpy(&ctx->block[ctx->blockSize], data, n);
+        ctx->blockSize += n;
+        ctx->total += n;
+        data += n;
+        size -= n;
+
+        if (ctx->blockSize == BLOCK_SIZE)
+        {
+            _CompressBlock(ctx);
+            ctx->blockSize = 0;
+        }
+    }
+}
+
+static void _HashFinal(
+    HashContext* ctx,
+    UINT32 digest[MAX_WORDS])
+{
+    UINT64 bits = ctx->total * 8;
+    UINTN i;
+
+    ctx->block[ctx->blockSize++] = 0x80;
+
+    if (ctx->blockSize > BLOCK_SIZE - sizeof(UINT64))
+    {
+        Memset(&ctx->block[ctx->blockSize], 0, BLOCK_SIZE - ctx->blockSize);
+        _CompressBlock(ctx);
+        ctx->blockSize = 0;
+    }
+
+    Memset(&ctx->block[ctx->blockSize], 0, BLOCK_SIZE - ctx->blockSize);
+
+    for (i = 0; i < sizeof(UINT64); i++)
+        ctx->block[BLOCK_SIZE - 1 - i] = (UINT8)(bits >> (i * 8));
+
+    _CompressBlock(ctx);
+
+    Memset(digest, 0, MAX_WORDS * sizeof(UINT32));
+    Memcpy(digest, ctx->h, _Words(ctx->alg) * sizeof(UINT32));
+    Memset(ctx, 0, sizeof(HashContext));
+}
+
+/* Compute the HMAC inner and outer states (after one key block) */
+static void _HMACInit(
+    SHAAlgorithm alg,
+    const UINT8* pass,
+    UINTN passSize,
+    UINT32 inner[MAX_WORDS],
+    UINT32 outer[MAX_WORDS])
+{
+    HashContext ctx;
+    UINT8 key[BLOCK_SIZE];
+    UINT8 pad[BLOCK_SIZE];
+    UINTN i;
+
+    Memset(key, 0, sizeof(key));
+
+    /* Keys longer than a block are hashed first */
+    if (passSize > BLOCK_SIZE)
+    {
+        UINT32 digest[MAX_WORDS];
+
+        _HashInit(&ctx, alg, NULL, 0);
+        _HashUpdate(&ctx, pass, passSize);
+        _HashFinal(&ctx, digest);
+        _PutWords(key, digest, _Words(alg) * sizeof(UINT32));
+        Memset(digest, 0, sizeof(digest));
+    }
+    else
+    {
+        Memcpy(key, pass, passSize);
+    }
+
+    for (i = 0; i < BLOCK_SIZE; i++)
+        pad[i] = key[i] ^ 0x36;
+
+    _HashInit(&ctx, alg, NULL, 0);
+    _HashUpdate(&ctx, pad, BLOCK_SIZE);
+    Memcpy(inner, ctx.h, MAX_WORDS * sizeof(UINT32));
+
+    for (i = 0; i < BLOCK_SIZE; i++)
+        pad[i] = key[i] ^ 0x5C;
+
+    _HashInit(&ctx, alg, NULL, 0);
+    _HashUpdate(&ctx, pad, BLOCK_SIZE);
+    Memcpy(outer, ctx.h, MAX_WORDS * sizeof(UINT32));
+
+    Memset(&ctx, 0, sizeof(ctx));
+    Memset(key, 0, sizeof(key));
+    Memset(pad, 0, sizeof(pad));
+}
+
+/*
+**==============================================================================
+**
+** PBKDF2:
+**
+**     Each lane holds one output block: T = U1 ^ U2 ^ ... ^ Uc, where
+**     U1 = HMAC(P, S || INT(i)) and Uj = HMAC(P, Uj-1). U1 is computed
+**     up front; the remaining iterations run four lanes at a time.
+**
+**==============================================================================
+*/
+
+typedef struct _Lane
+{
+    UINT32 inner[MAX_WORDS];
+    UINT32 outer[MAX_WORDS];
+    UINT32 t[MAX_WORDS];
+    UINT32 u[MAX_WORDS];
+    UINT32 iterations;
+    UINT8* out;
+    UINTN outSize;
+    const volatile BOOLEAN* cancel;
+}
+Lane;
+
+/* Set up a message block that holds one digest (after the key block) */
+INLINE void _DigestBlock(
+    SHAAlgorithm alg,
+    V4 w[16],
+    const V4 digest[MAX_WORDS])
+{
+    UINTN words = _Words(alg);
+    UINTN i;
+
+    for (i = 0; i < words; i++)
+        w[i] = digest[i];
+
+    w[i++] = _Splat(0x80000000);
+
+    for (; i < 15; i++)
+        w[i] = _Splat(0);
+
+    w[15] = _Splat((BLOCK_SIZE + words * sizeof(UINT32)) * 8);
+}
+
+/* Check whether the job of any lane was cancelled */
+static BOOLEAN _Cancelled(
+    const Lane* lanes,
+    UINTN nlanes)
+{
+    UINTN j;
+
+    for (j = 0; j < nlanes; j++)
+    {
+        if (lanes[j].cancel && *lanes[j].cancel)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int _RunLanes(
+    SHAAlgorithm alg,
+    Lane* lanes,
+    UINTN nlanes)
+{
+    int rc = -1;
+    V4 inner[MAX_WORDS];
+    V4 outer[MAX_WORDS];
+    V4 t[MAX_WORDS];
+    V4 u[MAX_WORDS];
+    V4 h[MAX_WORDS];
+    V4 w[16];
+    UINT32 iterations[LANES];
+    UINT32 max = 0;
+    UINT32 c;
+    UINTN i;
+    UINTN j;
+
+    /* Idle lanes repeat the first lane (and are never stored) */
+    for (j = 0; j < LANES; j++)
+    {
+        const Lane* lane = &lanes[j < nlanes ? j : 0];
+
+        for (i = 0; i < MAX_WORDS; i++)
+        {
+            inner[i][j] = lane->inner[i];
+            outer[i][j] = lane->outer[i];
+            t[i][j] = lane->t[i];
+            u[i][j] = lane->u[i];
+        }
+
+        iterations[j] = j < nlanes ? lane->iterations : 1;
+
+        if (iterations[j] > max)
+            max = iterations[j];
+    }
+
+    for (c = 1; c < max; c++)
+    {
+        V4 mask;
+
+        if (c % PBKDF2_CANCEL_INTERVAL == 0 && _Cancelled(lanes, nlanes))
+            goto done;
+
+        for (j = 0; j < LANES; j++)
+            mask[j] = c < iterations[j] ? 0xFFFFFFFF : 0;
+
+        /* U = HMAC(P, U) */
+        Memcpy(h, inner, sizeof(h));
+        _DigestBlock(alg, w, u);
+        _Compress(alg, h, w);
+
+        Memcpy(u, outer, sizeof(u));
+        _DigestBlock(alg, w, h);
+        _Compress(alg, u, w);
+
+        for (i = 0; i < MAX_WORDS; i++)
+            t[i] ^= u[i] & mask;
+    }
+
+    for (j = 0; j < nlanes; j++)
+    {
+        UINT32 words[MAX_WORDS];
+
+        for (i = 0; i < MAX_WORDS; i++)
+            words[i] = t[i][j];
+
+        _PutWords(lanes[j].out, words, lanes[j].outSize);
+        Memset(words, 0, sizeof(words));
+    }
+
+    rc = 0;
+
+done:
+
+    Memset(inner, 0, sizeof(inner));
+    Memset(outer, 0, sizeof(outer));
+    Memset(t, 0, sizeof(t));
+    Memset(u, 0, sizeof(u));
+    Memset(h, 0, sizeof(h));
+    Memset(w, 0, sizeof(w));
+
+    return rc;
+}
+
+int PBKDF2ParseHash(
+    const char* hashspec,
+    SHAAlgorithm* alg)
+{
+    if (!hashspec || !alg)
+        return -1;
+
+    if (Strcmp(hashspec, "sha1") == 0)
+    {
+        *alg = SHA1_ALG;
+        return 0;
+    }
+
+    if (Strcmp(hashspec, "sha256") == 0)
+    {
+        *alg = SHA256_ALG;
+        return 0;
+    }
+
+    return -1;
+}
+
+int PBKDF2Batch(
+    SHAAlgorithm alg,
+    const PBKDF2Job* jobs,
+    UINTN njobs)
+{
+    int rc = -1;
+    Lane* lanes = NULL;
+    UINTN nlanes = 0;
+    UINTN digestSize;
+    UINTN i;
+    UINTN j;
+
+    if (alg != SHA1_ALG && alg != SHA256_ALG)
+        goto done;
+
+    if (!jobs && njobs)
+        goto done;
+
+    digestSize = _Words(alg) * sizeof(UINT32);
+
+    /* One lane per output block */
+    for (i = 0; i < njobs; i++)
+    {
+        const PBKDF2Job* job = &jobs[i];
+
+        if ((!job->pass && job->passSize) || (!job->salt && job->saltSize) ||
+            (!job->out && job->outSize) || job->iterations == 0)
+        {
+            goto done;
+        }
+
+        nlanes += (job->outSize + digestSize - 1) / digestSize;
+    }
+
+    if (nlanes == 0)
+    {
+        rc = 0;
+        goto done;
+    }
+
+    if (!(lanes = (Lane*)Calloc(nlanes, sizeof(Lane))))
+        goto done;
+
+    /* Compute the HMAC key states and U1 for every lane */
+    for (i = 0, nlanes = 0; i < njobs; i++)
+    {
+        const PBKDF2Job* job = &jobs[i];
+        UINT32 inner[MAX_WORDS];
+        UINT32 outer[MAX_WORDS];
+        UINTN offset;
+
+        if (job->outSize == 0)
+            continue;
+
+        _HMACInit(alg, job->pass, job->passSize, inner, outer);
+
+        for (offset = 0, j = 1; offset < job->outSize; j++)
+        {
+            Lane* lane = &lanes[nlanes++];
+            HashContext ctx;
+            UINT8 index[sizeof(UINT32)];
+            UINT8 digest[MAX_WORDS * sizeof(UINT32)];
+
+            Memcpy(lane->inner, inner, sizeof(inner));
+            Memcpy(lane->outer, outer, sizeof(outer));
+            lane->iterations = job->iterations;
+            lane->out = job->out + offset;
+            lane->outSize = job->outSize - offset;
+            lane->cancel = job->cancel;
+
+            if (lane->outSize > digestSize)
+                lane->outSize = digestSize;
+
+            offset += lane->outSize;
+
+            /* U1 = HMAC(P, S || INT(j)) */
+            _PutBE32(index, (UINT32)j);
+            _HashInit(&ctx, alg, inner, BLOCK_SIZE);
+            _HashUpdate(&ctx, job->salt, job->saltSize);
+            _HashUpdate(&ctx, index, sizeof(index));
+            _HashFinal(&ctx, lane->u);
+
+            _PutWords(digest, lane->u, digestSize);
+            _HashInit(&ctx, alg, outer, BLOCK_SIZE);
+            _HashUpdate(&ctx, digest, digestSize);
+            _HashFinal(&ctx, lane->u);
+
+            Memcpy(lane->t, lane->u, sizeof(lane->t));
+            Memset(digest, 0, sizeof(digest));
+        }
+
+        Memset(inner, 0, sizeof(inner));
+        Memset(outer, 0, sizeof(outer));
+    }
+
+    /* Sort by iteration count so that lanes run together finish together */
+    for (i = 1; i < nlanes; i++)
+    {
+        for (j = i; j > 0 && lanes[j - 1].iterations < lanes[j].iterations; j--)
+        {
+            Lane tmp = lanes[j];
+            lanes[j] = lanes[j - 1];
+            lanes[j - 1] = tmp;
+            Memset(&tmp, 0, sizeof(tmp));
+        }
+    }
+
+    for (i = 0; i < nlanes; i += LANES)
+    {
+        UINTN n = nlanes - i < LANES ? nlanes - i : LANES;
+
+        if (_RunLanes(alg, &lanes[i], n) != 0)
+            goto done;
+    }
+
+    rc = 0;
+
+done:
+
+    if (lanes)
+    {
+        Memset(lanes, 0, nlanes * sizeof(Lane));
+        Free(lanes);
+    }
+
+    return rc;
+}
+
+int PBKDF2(
+    SHAAlgorithm alg,
+    const UINT8* pass,
+    UINTN passSize,
+    const UINT8* salt,
+    UINTN saltSize,
+    UINT32 iterations,
+    UINT8* out,
+    UINTN outSize)
+{
+    PBKDF2Job job;
+
+    job.pass = pass;
+    job.passSize = passSize;
+    job.salt = salt;
+    job.saltSize = saltSize;
+    job.iterations = iterations;
+    job.out = out;
+    job.outSize = outSize;
+    job.cancel = NULL;
+
+    return PBKDF2Batch(alg, &job, 1);
+}
@@ -0,0 +1,91 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#ifndef _pbkdf2_h
+#define _pbkdf2_h
+
+#include "config.h"
+#include "eficommon.h"
+#include "sha.h"
+
+/*
+**==============================================================================
+**
+** PBKDF2-HMAC (RFC 2898) for SHA-1 and SHA-256.
+**
+** Every output block of every job is an independent chain of HMAC
+** computations, so the chains are packed into the lanes of a vector unit
+** and advanced together: four SHA compressions cost about as much as one.
+** A single job benefits when its output spans several hash blocks (e.g.,
+** a 32-byte key with SHA-1); PBKDF2Batch() also packs blocks from several
+** jobs (e.g., one per LUKS keyslot) into the same lanes.
+**
+**==============================================================================
+*/
+
+typedef struct _PBKDF2Job
+{
+    const UINT8* pass;
+    UINTN passSize;
+    const UINT8* salt;
+    UINTN saltSize;
+    UINT32 iterations;
+    UINT8* out;
+    UINTN outSize;
+
+    /* If not NULL: polled every PBKDF2_CANCEL_INTERVAL iterations, and the
+     * derivation fails once it becomes TRUE */
+    const volatile BOOLEAN* cancel;
+}
+PBKDF2Job;
+
+#define PBKDF2_CANCEL_INTERVAL 1024
+
+/* Map a LUKS hash-spec ("sha1", "sha256") to an algorithm */
+int PBKDF2ParseHash(
+    const char* hashspec,
+    SHAAlgorithm* alg);
+
+int PBKDF2(
+    SHAAlgorithm alg,
+    const UINT8* pass,
+    UINTN passSize,
+    const UINT8* salt,
+    UINTN saltSize,
+    UINT32 iterations,
+    UINT8* out,
+    UINTN outSize);
+
+/* Derive all the jobs at once (they must all use the same algorithm) */
+int PBKDF2Batch(
+    SHAAlgorithm alg,
+    const PBKDF2Job* jobs,
+    UINTN njobs);
+
+#endif /* _pbkdf2_h */
@@ -0,0 +1,616 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#include "statsblkdev.h"
+#include "alloc.h"
+#include "strings.h"
+
+#if !defined(BUILD_EFI)
+# include <stdio.h>
+# include <time.h>
+#endif
+
+#define STATSBLKDEV_MAGIC 0x53a7b1d3
+
+typedef struct _BlkdevImpl BlkdevImpl;
+
+struct _BlkdevImpl
+{
+    Blkdev base;
+    UINT32 magic;
+    Blkdev* child;
+    const char* name;
+    StatsBlkdevCounters counters;
+
+    /* Block following the last one transferred (to detect sequential I/O) */
+    UINTN nextBlkno;
+
+    /* Set by StatsBlkdevWrap(): the name is owned and printed on Close() */
+    BOOLEAN printOnClose;
+};
+
+/*
+**==============================================================================
+**
+** Clock: the TSC under EFI (calibrated against Stall()), otherwise the 
+** monotonic clock.
+**
+**==============================================================================
+*/
+
+#if defined(BUILD_EFI)
+
+static UINT64 _ticksPerMicrosecond;
+
+static UINT64 _Now(void)
+{
+    UINT32 lo;
+    UINT32 hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((UINT64)hi << 32) | lo;
+}
+
+static void _InitClock(void)
+{
+    UINT64 start;
+
+    if (_ticksPerMicrosecond)
+        return;
+
+    start = _Now();
+    uefi_call_wrapper(BS->Stall, 1, 1000);
+    _ticksPerMicrosecond = (_Now() - start) / 1000;
+
+    if (_ticksPerMicrosecond == 0)
+        _ticksPerMicrosecond = 1;
+}
+
+static UINT64 _Microseconds(
+    UINT64 start, 
+    UINT64 end)
+{
+    return (end - start) / _ticksPerMicrosecond;
+}
+
+#else /* defined(BUILD_EFI) */
+
+static UINT64 _Now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return 0;
+
+    return (UINT64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void _InitClock(void)
+{
+}
+
+static UINT64 _Microseconds(
+    UINT64 start, 
+    UINT64 end)
+{
+    return (end - start) / 1000;
+}
+
+#endif /* !defined(BUILD_EFI) */
+
+/* Return the index of the highest bit set (0 for 0 and 1) */
+static UINTN _Log2(
+    UINT64 x)
+{
+    UINTN n = 0;
+
+    while (x >>= 1)
+        n++;
+
+    return n;
+}
+
+static BOOLEAN _ValidStatsBlkdev(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    return impl != NULL && impl->magic == STATSBLKDEV_MAGIC;
+}
+
+static void _Count(
+    BlkdevImpl* impl,
+    StatsBlkdevOpCounters* op,
+    UINTN blkno,
+    UINTN nblocks)
+{
+    UINTN bucket = _Log2(nblocks);
+
+    op->requests++;
+    op->blocks += nblocks;
+    op->bytes += (UINT64)nblocks * impl->base.blksize;
+
+    if (blkno == impl->nextBlkno)
+        op->sequential++;
+    else
+        op->random++;
+
+    if (bucket >= STATSBLKDEV_SIZE_BUCKETS)
+        bucket = STATSBLKDEV_SIZE_BUCKETS - 1;
+
+    op->sizes[bucket]++;
+    impl->nextBlkno = blkno + nblocks;
+}
+
+static void _Time(
+    StatsBlkdevOpCounters* op,
+    UINT64 start,
+    int rc)
+{
+    UINT64 usec = _Microseconds(start, _Now());
+    UINTN bucket = _Log2(usec);
+
+    if (bucket >= STATSBLKDEV_LATENCY_BUCKETS)
+        bucket = STATSBLKDEV_LATENCY_BUCKETS - 1;
+
+    op->latencies[bucket]++;
+    op->totalMicroseconds += usec;
+
+    if (usec > op->maxMicroseconds)
+        op->maxMicroseconds = usec;
+
+    if (rc != 0)
+        op->errors++;
+}
+
+/* Count a vector as one request (its first segment decides sequentiality) */
+static void _CountV(
+    BlkdevImpl* impl,
+    StatsBlkdevOpCounters* op,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    UINTN nblocks = 0;
+    UINTN i;
+
+    if (!segments || !nsegments)
+        return;
+
+    for (i = 0; i < nsegments; i++)
+        nblocks += segments[i].nblocks;
+
+    _Count(impl, op, segments[0].blkno, nblocks);
+    impl->nextBlkno = segments[nsegments-1].blkno + 
+        segments[nsegments-1].nblocks;
+}
+
+static int _Close(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    int rc;
+
+    if (!_ValidStatsBlkdev(dev))
+        return -1;
+
+#if !defined(BUILD_EFI)
+    /* Print before closing the child so outer layers come first */
+    if (impl->printOnClose)
+        StatsBlkdevPrint(dev);
+#endif /* !defined(BUILD_EFI) */
+
+    rc = impl->child->Close(impl->child);
+
+    if (impl->printOnClose)
+        Free((char*)impl->name);
+
+    Free(impl);
+
+    return rc;
+}
+
+static int _GetN(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    void* data)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINT64 start;
+    int rc;
+
+    if (!_ValidStatsBlkdev(dev))
+        return -1;
+
+    _Count(impl, &impl->counters.reads, blkno, nblocks);
+    start = _Now();
+    rc = impl->child->GetN(impl->child, blkno, nblocks, data);
+    _Time(&impl->counters.reads, start, rc);
+
+    return rc;
+}
+
+static int _PutN(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    const void* data)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINT64 start;
+    int rc;
+
+    if (!_ValidStatsBlkdev(dev))
+        return -1;
+
+    _Count(impl, &impl->counters.writes, blkno, nblocks);
+    start = _Now();
+    rc = impl->child->PutN(impl->child, blkno, nblocks, data);
+    _Time(&impl->counters.writes, start, rc);
+
+    return rc;
+}
+
+static int _GetV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINT64 start;
+    int rc;
+
+    if (!_ValidStatsBlkdev(dev))
+        return -1;
+
+    _CountV(impl, &impl->counters.reads, segments, nsegments);
+    start = _Now();
+    rc = BlkdevGetV(impl->child, segments, nsegments);
+    _Time(&impl->counters.reads, start, rc);
+
+    return rc;
+}
+
+static int _PutV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINT64 start;
+    int rc;
+
+    if (!_ValidStatsBlkdev(dev))
+        return -1;
+
+    _CountV(impl, &impl->counters.writes, segments, nsegments);
+    start = _Now();
+    rc = BlkdevPutV(impl->child, segments, nsegments);
+    _Time(&impl->counters.writes, start, rc);
+
+    return rc;
+}
+
+static int _SetFlags(
+    Blkdev* dev,
+    UINT32 flags)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidStatsBlkdev(dev))
+        return -1;
+
+    return impl->child->SetFlags(impl->child, flags);
+}
+
+static int _Flush(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidStatsBlkdev(dev))
+        return -1;
+
+    impl->counters.flushes++;
+
+    return BlkdevFlush(impl->child);
+}
+
+/* Asynchronous requests are counted but not timed */
+static int _Submit(
+    Blkdev* dev,
+    BlkdevRequest* req)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidStatsBlkdev(dev) || !req)
+        return -1;
+
+    if (req->write)
+        _Count(impl, &impl->counters.writes, req->blkno, req->nblocks);
+    else
+        _Count(impl, &impl->counters.reads, req->blkno, req->nblocks);
+
+    return BlkdevSubmit(impl->child, req);
+}
+
+static int _Complete(
+    Blkdev* dev,
+    BlkdevRequest* req)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidStatsBlkdev(dev))
+        return -1;
+
+    return BlkdevComplete(impl->child, req);
+}
+
+static int _Borrow(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    const void** data)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidStatsBlkdev(dev))
+        return -1;
+
+    _Count(impl, &impl->counters.reads, blkno, nblocks);
+
+    return BlkdevBorrow(impl->child, blkno, nblocks, data);
+}
+
+static int _Release(
+    Blkdev* dev,
+    const void* data)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidStatsBlkdev(dev))
+        return -1;
+
+    return BlkdevRelease(impl->child, data);
+}
+
+static int _GetNumBlocks(
+    Blkdev* dev,
+    UINT64* nblocks)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidStatsBlkdev(dev))
+        return -1;
+
+    return BlkdevGetNumBlocks(impl->child, nblocks);
+}
+
+Blkdev* NewStatsBlkdev(
+    Blkdev* dev,
+    const char* name)
+{
+    BlkdevImpl* impl = NULL;
+
+    if (!dev || !name)
+        goto done;
+
+    if (!(impl = (BlkdevImpl*)Calloc(1, sizeof(BlkdevImpl))))
+        goto done;
+
+    _InitClock();
+
+    impl->base.Close = _Close;
+    impl->base.GetN = _GetN;
+    impl->base.PutN = _PutN;
+    impl->base.SetFlags = _SetFlags;
+    impl->base.GetV = _GetV;
+    impl->base.PutV = _PutV;
+    impl->base.Flush = _Flush;
+    impl->base.blksize = BlkdevBlockSize(dev);
+
+    /* Only offer what the child offers (callers test for these methods) */
+    if (dev->Submit)
+    {
+        impl->base.Submit = _Submit;
+        impl->base.Complete = _Complete;
+    }
+
+    if (dev->Borrow)
+    {
+        impl->base.Borrow = _Borrow;
+        impl->base.Release = _Release;
+    }
+
+    if (dev->GetNumBlocks)
+        impl->base.GetNumBlocks = _GetNumBlocks;
+
+    impl->magic = STATSBLKDEV_MAGIC;
+    impl->child = dev;
+    impl->name = name;
+    impl->nextBlkno = (UINTN)-1;
+
+done:
+    return &impl->base;
+}
+
+BOOLEAN IsStatsBlkdev(
+    Blkdev* dev)
+{
+    return _ValidStatsBlkdev(dev);
+}
+
+const char* StatsBlkdevName(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidStatsBlkdev(dev))
+        return NULL;
+
+    return impl->name;
+}
+
+void StatsBlkdevGetCounters(
+    Blkdev* dev,
+    StatsBlkdevCounters* counters)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidStatsBlkdev(dev) || !counters)
+        return;
+
+    Memcpy(counters, &impl->counters, sizeof(StatsBlkdevCounters));
+}
+
+UINT64 StatsBlkdevPercentile(
+    const StatsBlkdevOpCounters* op,
+    UINTN percent)
+{
+    UINTN total = 0;
+    UINTN n = 0;
+    UINTN i;
+
+    if (!op)
+        return 0;
+
+    for (i = 0; i < STATSBLKDEV_LATENCY_BUCKETS; i++)
+        total += op->latencies[i];
+
+    if (total == 0)
+        return 0;
+
+    for (i = 0; i < STATSBLKDEV_LATENCY_BUCKETS; i++)
+    {
+        n += op->latencies[i];
+
+        if (n * 100 >= total * percent)
+            break;
+    }
+
+    if (i >= STATSBLKDEV_LATENCY_BUCKETS)
+        i = STATSBLKDEV_LATENCY_BUCKETS - 1;
+
+    return (UINT64)2 << i;
+}
+
+#if !defined(BUILD_EFI)
+static void _PrintOp(
+    const char* what,
+    const StatsBlkdevOpCounters* op)
+{
+    UINTN i;
+
+    if (op->requests == 0)
+        return;
+
+    printf("  %s: requests=%lu blocks=%lu bytes=%llu sequential=%lu "
+        "random=%lu errors=%lu\n",
+        what,
+        (unsigned long)op->requests,
+        (unsigned long)op->blocks,
+        (unsigned long long)op->bytes,
+        (unsigned long)op->sequential,
+        (unsigned long)op->random,
+        (unsigned long)op->errors);
+
+    printf("  %s: total=%lluus max=%lluus p50<%lluus p99<%lluus\n",
+        what,
+        (unsigned long long)op->totalMicroseconds,
+        (unsigned long long)op->maxMicroseconds,
+        (unsigned long long)StatsBlkdevPercentile(op, 50),
+        (unsigned long long)StatsBlkdevPercentile(op, 99));
+
+    printf("  %s: sizes(blocks):", what);
+
+    for (i = 0; i < STATSBLKDEV_SIZE_BUCKETS; i++)
+    {
+        if (op->sizes[i])
+            printf(" %lu:%lu", 1UL << i, (unsigned long)op->sizes[i]);
+    }
+
+    printf("\n");
+
+    printf("  %s: latency(us):", what);
+
+    for (i = 0; i < STATSBLKDEV_LATENCY_BUCKETS; i++)
+    {
+        if (op->latencies[i])
+            printf(" <%lu:%lu", 2UL << i, (unsigned long)op->latencies[i]);
+    }
+
+    printf("\n");
+}
+
+void StatsBlkdevPrint(
+    Blkdev* dev)
+{
+    StatsBlkdevCounters c;
+
+    if (!_ValidStatsBlkdev(dev))
+        return;
+
+    StatsBlkdevGetCounters(dev, &c);
+
+    printf("=== I/O statistics: %s\n", StatsBlkdevName(dev));
+    _PrintOp("reads", &c.reads);
+    _PrintOp("writes", &c.writes);
+    printf("  flushes=%lu\n", (unsigned long)c.flushes);
+}
+
+static BOOLEAN _enabled;
+
+void StatsBlkdevEnable(
+    BOOLEAN enable)
+{
+    _enabled = enable;
+}
+
+Blkdev* StatsBlkdevWrap(
+    Blkdev* dev,
+    const char* name)
+{
+    BlkdevImpl* impl;
+    char* copy;
+
+    if (!dev || !name || !_enabled)
+        return dev;
+
+    if (!(copy = Strdup(name)))
+        return dev;
+
+    if (!(impl = (BlkdevImpl*)NewStatsBlkdev(dev, copy)))
+    {
+        Free(copy);
+        return dev;
+    }
+
+    impl->printOnClose = TRUE;
+
+    return &impl->base;
+}
+#endif /* !defined(BUILD_EFI) */
@@ -0,0 +1,116 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#ifndef _statsblkdev_h
+#define _statsblkdev_h
+
+#include "config.h"
+#include <lsvmutils/blkdev.h>
+
+/* Request sizes: bucket i counts requests of [2^i, 2^(i+1)) blocks */
+#define STATSBLKDEV_SIZE_BUCKETS 16
+
+/* Latencies: bucket i counts requests taking [2^i, 2^(i+1)) microseconds
+ * (bucket 0 counts everything under 2 microseconds) */
+#define STATSBLKDEV_LATENCY_BUCKETS 24
+
+typedef struct _StatsBlkdevOpCounters
+{
+    /* Number of requests and the blocks they transferred */
+    UINTN requests;
+    UINTN blocks;
+    UINT64 bytes;
+
+    /* Requests that started where the previous request ended (or not) */
+    UINTN sequential;
+    UINTN random;
+
+    /* Number of requests that failed */
+    UINTN errors;
+
+    /* Total and worst time spent in the child device (microseconds) */
+    UINT64 totalMicroseconds;
+    UINT64 maxMicroseconds;
+
+    UINTN sizes[STATSBLKDEV_SIZE_BUCKETS];
+    UINTN latencies[STATSBLKDEV_LATENCY_BUCKETS];
+}
+StatsBlkdevOpCounters;
+
+typedef struct _StatsBlkdevCounters
+{
+    StatsBlkdevOpCounters reads;
+    StatsBlkdevOpCounters writes;
+
+    /* Number of Flush() calls */
+    UINTN flushes;
+}
+StatsBlkdevCounters;
+
+/* Pass every request through to 'dev' while counting it. The name (which
+ * is not copied) identifies this layer in reports. Closing the stats device
+ * closes 'dev'. */
+Blkdev* NewStatsBlkdev(
+    Blkdev* dev,
+    const char* name);
+
+BOOLEAN IsStatsBlkdev(
+    Blkdev* dev);
+
+const char* StatsBlkdevName(
+    Blkdev* dev);
+
+void StatsBlkdevGetCounters(
+    Blkdev* dev,
+    StatsBlkdevCounters* counters);
+
+/* Return the smallest latency (in microseconds) that at least 'percent'
+ * of the requests did not exceed (as an upper bound of a bucket) */
+UINT64 StatsBlkdevPercentile(
+    const StatsBlkdevOpCounters* op,
+    UINTN percent);
+
+#if !defined(BUILD_EFI)
+/* Print a summary of the counters to standard output */
+void StatsBlkdevPrint(
+    Blkdev* dev);
+
+/* Turn StatsBlkdevWrap() on or off for the whole process (--iostats) */
+void StatsBlkdevEnable(
+    BOOLEAN enable);
+
+/* If enabled, count the I/O of 'dev' and print a summary when the returned
+ * device is closed (the name is copied). Otherwise (or on failure) return
+ * 'dev' itself. */
+Blkdev* StatsBlkdevWrap(
+    Blkdev* dev,
+    const char* name);
+#endif /* !defined(BUILD_EFI) */
+
+#endif /* _statsblkdev_h */
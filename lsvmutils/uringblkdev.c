@@ -0,0 +1,665 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#define _GNU_SOURCE /* for O_DIRECT */
+
+#include "uringblkdev.h"
+#include "alloc.h"
+#include "strings.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+
+#define URINGBLKDEV_MAGIC 0x2f6b1a9c
+
+/* Largest transfer issued as a single queue entry (bigger ones are split so
+ * that a single request can use the whole queue) */
+#define OP_MAX_BYTES (128 * 1024)
+
+/* Memory alignment required of O_DIRECT buffers */
+#define DIRECT_ALIGN 4096
+
+typedef struct _BlkdevImpl BlkdevImpl;
+typedef struct _Op Op;
+
+/* One queue entry: part (or all) of a request */
+struct _Op
+{
+    BlkdevRequest* req;
+    BOOLEAN write;
+    struct iovec iov;
+    UINT64 offset;
+    Op* next;
+};
+
+struct _BlkdevImpl
+{
+    Blkdev base;
+    UINT32 magic;
+
+    /* Synchronous device on the same file (for Flush and unaligned I/O) */
+    Blkdev* child;
+    int fd;
+    UINTN offset;
+    BOOLEAN direct;
+
+    /* The io_uring instance and its mapped rings */
+    int ringfd;
+    void* sqmap;
+    size_t sqmapSize;
+    void* cqmap;
+    size_t cqmapSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    UINT32* sqHead;
+    UINT32* sqTail;
+    UINT32* sqArray;
+    UINT32 sqMask;
+    UINT32* cqHead;
+    UINT32* cqTail;
+    struct io_uring_cqe* cqes;
+    UINT32 cqMask;
+
+    /* Number of entries queued but not yet passed to the kernel */
+    UINT32 unsubmitted;
+
+    /* One Op per queue slot (unused ones are on the free list) */
+    Op* ops;
+    Op* free;
+    UINTN depth;
+    UINTN inflight;
+};
+
+static BOOLEAN _ValidUringBlkdev(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    return impl != NULL && impl->magic == URINGBLKDEV_MAGIC;
+}
+
+static void _Teardown(
+    BlkdevImpl* impl)
+{
+    if (impl->sqes)
+        munmap(impl->sqes, impl->sqesSize);
+
+    if (impl->cqmap && impl->cqmap != impl->sqmap)
+        munmap(impl->cqmap, impl->cqmapSize);
+
+    if (impl->sqmap)
+        munmap(impl->sqmap, impl->sqmapSize);
+
+    if (impl->ringfd >= 0)
+        close(impl->ringfd);
+
+    if (impl->ops)
+        Free(impl->ops);
+}
+
+static void* _Map(
+    int ringfd,
+    size_t size,
+    off_t offset)
+{
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, 
+        MAP_SHARED | MAP_POPULATE, ringfd, offset);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static int _Setup(
+    BlkdevImpl* impl,
+    UINTN depth)
+{
+    int rc = -1;
+    struct io_uring_params params;
+    UINT8* sq;
+    UINT8* cq;
+    UINTN i;
+
+    Memset(&params, 0, sizeof(params));
+
+    impl->ringfd = syscall(__NR_io_uring_setup, (unsigned)depth, &params);
+
+    if (impl->ringfd < 0)
+        goto done;
+
+    impl->sqmapSize = params.sq_off.array + 
+        params.sq_entries * sizeof(UINT32);
+    impl->cqmapSize = params.cq_off.cqes + 
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    impl->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Newer kernels map both rings with a single mmap() */
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (impl->cqmapSize > impl->sqmapSize)
+            impl->sqmapSize = impl->cqmapSize;
+    }
+
+    if (!(impl->sqmap = _Map(impl->ringfd, impl->sqmapSize, 
+        IORING_OFF_SQ_RING)))
+    {
+        goto done;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        impl->cqmap = impl->sqmap;
+    }
+    else if (!(impl->cqmap = _Map(impl->ringfd, impl->cqmapSize, 
+        IORING_OFF_CQ_RING)))
+    {
+        goto done;
+    }
+
+    if (!(impl->sqes = _Map(impl->ringfd, impl->sqesSize, IORING_OFF_SQES)))
+        goto done;
+
+    sq = (UINT8*)impl->sqmap;
+    impl->sqHead = (UINT32*)(sq + params.sq_off.head);
+    impl->sqTail = (UINT32*)(sq + params.sq_off.tail);
+    impl->sqArray = (UINT32*)(sq + params.sq_off.array);
+    impl->sqMask = *(UINT32*)(sq + params.sq_off.ring_mask);
+
+    cq = (UINT8*)impl->cqmap;
+    impl->cqHead = (UINT32*)(cq + params.cq_off.head);
+    impl->cqTail = (UINT32*)(cq + params.cq_off.tail);
+    impl->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    impl->cqMask = *(UINT32*)(cq + params.cq_off.ring_mask);
+
+    /* Never have more requests in flight than submission queue entries */
+    if (depth > params.sq_entries)
+        depth = params.sq_entries;
+
+    if (!(impl->ops = (Op*)Calloc(depth, sizeof(Op))))
+        goto done;
+
+    for (i = 0; i < depth; i++)
+    {
+        impl->ops[i].next = impl->free;
+        impl->free = &impl->ops[i];
+    }
+
+    impl->depth = depth;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+/* Pass queued entries to the kernel and optionally wait for a completion */
+static int _Enter(
+    BlkdevImpl* impl,
+    BOOLEAN wait)
+{
+    for (;;)
+    {
+        unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        long n;
+
+        if (!impl->unsubmitted && !wait)
+            return 0;
+
+        n = syscall(__NR_io_uring_enter, impl->ringfd, impl->unsubmitted, 
+            wait ? 1 : 0, flags, NULL, 0);
+
+        if (n < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+
+            return -1;
+        }
+
+        impl->unsubmitted -= (UINT32)n;
+
+        if (!impl->unsubmitted || wait)
+            return 0;
+    }
+}
+
+static void _QueueOp(
+    BlkdevImpl* impl,
+    Op* op)
+{
+    UINT32 tail = *impl->sqTail;
+    UINT32 index = tail & impl->sqMask;
+    struct io_uring_sqe* sqe = &impl->sqes[index];
+
+    Memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = impl->fd;
+    sqe->addr = (UINT64)(UINTN)&op->iov;
+    sqe->len = 1;
+    sqe->off = op->offset;
+    sqe->user_data = (UINT64)(UINTN)op;
+
+    impl->sqArray[index] = index;
+    __atomic_store_n(impl->sqTail, tail + 1, __ATOMIC_RELEASE);
+    impl->unsubmitted++;
+}
+
+static void _FinishOp(
+    BlkdevImpl* impl,
+    Op* op,
+    int res)
+{
+    BlkdevRequest* req = op->req;
+
+    /* Retry interrupted transfers and continue short ones */
+    if (res == -EINTR || res == -EAGAIN)
+    {
+        _QueueOp(impl, op);
+        return;
+    }
+
+    if (res > 0 && (size_t)res < op->iov.iov_len)
+    {
+        op->iov.iov_base = (UINT8*)op->iov.iov_base + res;
+        op->iov.iov_len -= res;
+        op->offset += res;
+        _QueueOp(impl, op);
+        return;
+    }
+
+    if (res <= 0)
+        req->status = -1;
+
+    if (--req->pending == 0)
+        req->done = TRUE;
+
+    op->next = impl->free;
+    impl->free = op;
+    impl->inflight--;
+}
+
+/* Process completions (waiting for at least one if 'wait' is TRUE) */
+static int _Reap(
+    BlkdevImpl* impl,
+    BOOLEAN wait)
+{
+    UINT32 head;
+    UINT32 tail;
+
+    if (_Enter(impl, wait) != 0)
+        return -1;
+
+    head = *impl->cqHead;
+    tail = __atomic_load_n(impl->cqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        struct io_uring_cqe* cqe = &impl->cqes[head & impl->cqMask];
+        _FinishOp(impl, (Op*)(UINTN)cqe->user_data, cqe->res);
+        head++;
+    }
+
+    __atomic_store_n(impl->cqHead, head, __ATOMIC_RELEASE);
+
+    /* Resubmit any retried entries */
+    return _Enter(impl, FALSE);
+}
+
+static int _Drain(
+    BlkdevImpl* impl)
+{
+    while (impl->inflight)
+    {
+        if (_Reap(impl, TRUE) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int _Submit(
+    Blkdev* dev,
+    BlkdevRequest* req)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINT8* p;
+    UINTN size;
+    UINT64 offset;
+
+    if (!_ValidUringBlkdev(dev) || !req || !req->data)
+        goto done;
+
+    /* Let the synchronous device bounce unaligned O_DIRECT buffers */
+    if (impl->direct && ((UINTN)req->data % DIRECT_ALIGN))
+    {
+        rc = BlkdevGenericSubmit(impl->child, req);
+        goto done;
+    }
+
+    p = (UINT8*)req->data;
+    size = req->nblocks * impl->base.blksize;
+    offset = impl->offset + (UINT64)req->blkno * impl->base.blksize;
+
+    /* Hold an extra reference so that early completions cannot finish the
+     * request before all of its entries are queued */
+    req->status = 0;
+    req->pending = 1;
+
+    while (size)
+    {
+        UINTN n = size < OP_MAX_BYTES ? size : OP_MAX_BYTES;
+        Op* op;
+
+        /* Wait for a free queue slot */
+        while (!impl->free)
+        {
+            if (_Reap(impl, TRUE) != 0)
+            {
+                req->status = -1;
+                break;
+            }
+        }
+
+        if (!(op = impl->free))
+            break;
+
+        impl->free = op->next;
+        impl->inflight++;
+
+        op->req = req;
+        op->write = req->write;
+        op->iov.iov_base = p;
+        op->iov.iov_len = n;
+        op->offset = offset;
+        req->pending++;
+        _QueueOp(impl, op);
+
+        p += n;
+        size -= n;
+        offset += n;
+    }
+
+    if (--req->pending == 0)
+        req->done = TRUE;
+
+    if (_Enter(impl, FALSE) != 0)
+        req->status = -1;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+static int _Complete(
+    Blkdev* dev,
+    BlkdevRequest* req)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidUringBlkdev(dev) || !req)
+        return -1;
+
+    while (!req->done)
+    {
+        if (_Reap(impl, TRUE) != 0)
+            return -1;
+    }
+
+    return req->status;
+}
+
+static int _Transfer(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    void* data,
+    BOOLEAN write)
+{
+    BlkdevRequest req;
+
+    if (!_ValidUringBlkdev(dev) || !data)
+        return -1;
+
+    Memset(&req, 0, sizeof(req));
+    req.write = write;
+    req.blkno = blkno;
+    req.nblocks = nblocks;
+    req.data = data;
+
+    if (BlkdevSubmit(dev, &req) != 0)
+        return -1;
+
+    return BlkdevComplete(dev, &req);
+}
+
+static int _GetN(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    void* data)
+{
+    return _Transfer(dev, blkno, nblocks, data, FALSE);
+}
+
+static int _PutN(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    const void* data)
+{
+    return _Transfer(dev, blkno, nblocks, (void*)data, TRUE);
+}
+
+/* Submit every segment before waiting for any of them */
+static int _TransferSegments(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments,
+    BOOLEAN write)
+{
+    int rc = -1;
+    BlkdevRequest* reqs = NULL;
+    UINTN nsubmitted = 0;
+    UINTN i;
+
+    if (!_ValidUringBlkdev(dev) || (!segments && nsegments))
+        goto done;
+
+    if (!nsegments)
+    {
+        rc = 0;
+        goto done;
+    }
+
+    if (!(reqs = (BlkdevRequest*)Calloc(nsegments, sizeof(BlkdevRequest))))
+        goto done;
+
+    for (i = 0; i < nsegments; i++)
+    {
+        reqs[i].write = write;
+        reqs[i].blkno = segments[i].blkno;
+        reqs[i].nblocks = segments[i].nblocks;
+        reqs[i].data = segments[i].data;
+
+        if (BlkdevSubmit(dev, &reqs[i]) != 0)
+            break;
+
+        nsubmitted++;
+    }
+
+    rc = (nsubmitted == nsegments) ? 0 : -1;
+
+    /* Wait for everything submitted (even after a failure) */
+    for (i = 0; i < nsubmitted; i++)
+    {
+        if (BlkdevComplete(dev, &reqs[i]) != 0)
+            rc = -1;
+    }
+
+done:
+
+    if (reqs)
+        Free(reqs);
+
+    return rc;
+}
+
+static int _GetV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    return _TransferSegments(dev, segments, nsegments, FALSE);
+}
+
+static int _PutV(
+    Blkdev* dev,
+    const BlkdevSegment* segments,
+    UINTN nsegments)
+{
+    return _TransferSegments(dev, segments, nsegments, TRUE);
+}
+
+static int _Flush(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidUringBlkdev(dev))
+        return -1;
+
+    if (_Drain(impl) != 0)
+        return -1;
+
+    return BlkdevFlush(impl->child);
+}
+
+static int _SetFlags(
+    Blkdev* dev,
+    UINT32 flags)
+{
+    /* No flags supported */
+    return -1;
+}
+
+static int _GetNumBlocks(
+    Blkdev* dev,
+    UINT64* nblocks)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidUringBlkdev(dev))
+        return -1;
+
+    return BlkdevGetNumBlocks(impl->child, nblocks);
+}
+
+static int _Close(
+    Blkdev* dev)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidUringBlkdev(dev))
+        goto done;
+
+    _Drain(impl);
+    _Teardown(impl);
+    impl->child->Close(impl->child);
+    Free(impl);
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+Blkdev* UringBlkdevOpen(
+    const char* path,
+    BlkdevAccess access,
+    UINTN offset,
+    UINT32 flags,
+    UINTN depth)
+{
+    BlkdevImpl* impl = NULL;
+    Blkdev* child;
+    int fd;
+
+    if (!path || !depth)
+        return NULL;
+
+    if (!(child = BlkdevOpen(path, access, offset, flags)))
+        return NULL;
+
+    if ((fd = BlkdevFileno(child)) < 0)
+        return child;
+
+    if (!(impl = (BlkdevImpl*)Calloc(1, sizeof(BlkdevImpl))))
+        return child;
+
+    impl->ringfd = -1;
+
+    /* Fall back on synchronous I/O if the kernel lacks io_uring */
+    if (_Setup(impl, depth) != 0)
+    {
+        _Teardown(impl);
+        Free(impl);
+        return child;
+    }
+
+    impl->base.Close = _Close;
+    impl->base.GetN = _GetN;
+    impl->base.PutN = _PutN;
+    impl->base.SetFlags = _SetFlags;
+    impl->base.GetV = _GetV;
+    impl->base.PutV = _PutV;
+    impl->base.Flush = _Flush;
+    impl->base.Submit = _Submit;
+    impl->base.Complete = _Complete;
+    impl->base.GetNumBlocks = _GetNumBlocks;
+    impl->base.blksize = BlkdevBlockSize(child);
+    impl->magic = URINGBLKDEV_MAGIC;
+    impl->child = child;
+    impl->fd = fd;
+    impl->offset = offset;
+    impl->direct = (fcntl(fd, F_GETFL) & O_DIRECT) ? TRUE : FALSE;
+
+    return &impl->base;
+}
+
+BOOLEAN IsUringBlkdev(
+    Blkdev* dev)
+{
+    return _ValidUringBlkdev(dev);
+}
@@ -0,0 +1,54 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#ifndef _uringblkdev_h
+#define _uringblkdev_h
+
+#include "config.h"
+#include <lsvmutils/blkdev.h>
+
+/* Default number of requests kept in flight */
+#define URINGBLKDEV_DEFAULT_DEPTH 32
+
+/* Open a file or device with an io_uring submission queue of 'depth' 
+ * entries. GetN(), PutN(), GetV() and PutV() split transfers across the 
+ * queue, and BlkdevSubmit() returns without waiting. If io_uring is not
+ * available, this returns a synchronous device from BlkdevOpen(). */
+Blkdev* UringBlkdevOpen(
+    const char* path,
+    BlkdevAccess access,
+    UINTN offset,
+    UINT32 flags, /* BLKDEV_OPEN_* */
+    UINTN depth);
+
+/* Return TRUE if UringBlkdevOpen() did not fall back to BlkdevOpen() */
+BOOLEAN IsUringBlkdev(
+    Blkdev* dev);
+
+#endif /* _uringblkdev_h */
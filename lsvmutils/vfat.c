@@ -755,6 +755,9 @@ int LoadFileFromDirectoryEntry(
 {
     int rc = -1;
     UINT32 clustno;
+    BufU32 clusters = BUF_U32_INITIALIZER;
+    Buf segs = BUF_INITIALIZER;
+    UINTN i;
 
     /* Check parameters */
     if (!vfat || !ent || !buf)
@@ -766,17 +769,53 @@ int LoadFileFromDirectoryEntry(
     /* Form the 32-bit cluster number */
     clustno = ((UINT32)ent->fstClusHI << 16) | (UINT32)ent->fstClusLO;
 
-    /* For each cluster */
+    /* Gather the cluster chain */
     while (clustno && !IsEOF(vfat, clustno))
     {
-        /* Read this cluster */
-        if (ReadCluster(vfat, clustno, buf) != 0)
+        if (BufU32Append(&clusters, &clustno, 1) != 0)
             GOTO(done);
 
         /* Advance to the next cluster */
         clustno = GetFATEntry(vfat, clustno);
     }
 
+    /* Reserve space for all the clusters */
+    if (BufReserve(buf, clusters.size * vfat->ClusterSize) != 0)
+        GOTO(done);
+
+    /* Form one segment for each run of consecutive clusters */
+    for (i = 0; i < clusters.size; )
+    {
+        UINTN n = 1;
+        BlkdevSegment seg;
+
+        while (i + n < clusters.size && 
+            clusters.data[i + n] == clusters.data[i + n - 1] + 1)
+        {
+            n++;
+        }
+
+        seg.blkno = _FirstSectorOfCluster(vfat, clusters.data[i]);
+        seg.nblocks = n * vfat->bpb.SecPerClus;
+        seg.data = (UINT8*)buf->data + i * vfat->ClusterSize;
+
+        if (BufAppend(&segs, &seg, sizeof(seg)) != 0)
+            GOTO(done);
+
+        i += n;
+    }
+
+    /* Read all the clusters with a single request */
+    if (BlkdevGetV(
+        vfat->dev, 
+        (const BlkdevSegment*)segs.data,
+        segs.size / sizeof(BlkdevSegment)) != 0)
+    {
+        GOTO(done);
+    }
+
+    buf->size = clusters.size * vfat->ClusterSize;
+
     /* If not able to read enough bytes */
     if (buf->size < ent->fileSize)
         GOTO(done);
@@ -788,6 +827,10 @@ int LoadFileFromDirectoryEntry(
     rc = 0;
 
 done:
+
+    BufU32Release(&clusters);
+    BufRelease(&segs);
+
     return rc;
 }
 
@@ -986,6 +1029,10 @@ int VFATInit(
             GOTO(done);
     }
 
+    /* Reject sector sizes other than the device block size (512 or 4096) */
+    if (vfat->bpb.BytsPerSec != BlkdevBlockSize(dev))
+        GOTO(done);
+
     /* See if there is an FSI (FAT32 only) */
     if (GetFATType(&vfat->bpb) == FAT32)
     {
@@ -1007,10 +1054,6 @@ int VFATInit(
     /* Set the block device */
     vfat->dev = dev;
 
-    /* Reject sector sizes that are not 512 */
-    if (vfat->bpb.BytsPerSec != VFAT_SECTOR_SIZE)
-        GOTO(done);
-
     /* Precompute some useful values */
     {
         /* Compute VFAT.FATSz */
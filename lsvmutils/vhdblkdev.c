@@ -0,0 +1,649 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#include "vhdblkdev.h"
+#include "mmapblkdev.h"
+#include "statsblkdev.h"
+#include "alloc.h"
+#include "strings.h"
+#include "byteorder.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define VHDBLKDEV_MAGIC 0x76686462
+
+/* Largest BAT accepted (enough for a 2 TB disk of 2 MB blocks) */
+#define VHD_MAX_BAT_ENTRIES (1024 * 1024)
+
+/* Size of the buffer used to zero newly allocated blocks */
+#define ZERO_CHUNK (64 * 1024)
+
+typedef struct _BlkdevImpl BlkdevImpl;
+
+struct _BlkdevImpl
+{
+    Blkdev base;
+    UINT32 magic;
+
+    /* The VHD file itself */
+    Blkdev* file;
+    UINT64 fileSize;
+    BOOLEAN writable;
+
+    /* The footer as read from disk (big-endian) */
+    VHDFooter footer;
+
+    /* Virtual disk size and the first sector of this device within it */
+    UINT64 nsectors;
+    UINT64 first;
+
+    /* Dynamic VHD only: the block allocation table (host byte order) */
+    BOOLEAN dynamic;
+    UINT32* bat;
+    UINT32 batEntries;
+    UINT64 batOffset;
+    UINT32 blockSectors;
+    UINT32 bitmapSectors;
+};
+
+static BOOLEAN _ValidVHDBlkdev(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    return impl != NULL && impl->magic == VHDBLKDEV_MAGIC;
+}
+
+/* One's complement of the byte sum, not counting the stored checksum */
+static UINT32 _Checksum(
+    const void* data,
+    UINTN size,
+    UINT32 checksum)
+{
+    const UINT8* p = (const UINT8*)data;
+    UINT32 sum = 0;
+    UINTN i;
+
+    for (i = 0; i < size; i++)
+        sum += p[i];
+
+    sum -= (checksum & 0xFF) + ((checksum >> 8) & 0xFF) + 
+        ((checksum >> 16) & 0xFF) + ((checksum >> 24) & 0xFF);
+
+    return ~sum;
+}
+
+static int _ReadFooter(
+    Blkdev* file,
+    UINT64 fileSize,
+    VHDFooter* footer)
+{
+    if (fileSize < sizeof(VHDFooter) || fileSize % VHD_SECTOR_SIZE)
+        return -1;
+
+    if (BlkdevReadBytes(
+        file, 
+        fileSize - sizeof(VHDFooter), 
+        footer, 
+        sizeof(VHDFooter)) != 0)
+    {
+        return -1;
+    }
+
+    if (Memcmp(footer->cookie, VHD_FOOTER_COOKIE, sizeof(footer->cookie)))
+        return -1;
+
+    if (ByteSwapU32(footer->checksum) != 
+        _Checksum(footer, sizeof(VHDFooter), footer->checksum))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static UINT64 _FileSize(
+    Blkdev* file)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = BlkdevFileno(file)) < 0)
+        return 0;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return 0;
+
+    return (UINT64)st.st_size;
+}
+
+static int _LoadDynamic(
+    BlkdevImpl* impl)
+{
+    int rc = -1;
+    VHDDynamicHeader header;
+    UINT64 headerOffset = ByteSwapU64(impl->footer.dataOffset);
+    UINT32 blockSize;
+    UINT64 nblocks;
+    UINT32 i;
+
+    if (BlkdevReadBytes(
+        impl->file, 
+        headerOffset, 
+        &header, 
+        sizeof(header)) != 0)
+    {
+        goto done;
+    }
+
+    if (Memcmp(header.cookie, VHD_DYNAMIC_COOKIE, sizeof(header.cookie)))
+        goto done;
+
+    if (ByteSwapU32(header.checksum) != 
+        _Checksum(&header, sizeof(header), header.checksum))
+    {
+        goto done;
+    }
+
+    blockSize = ByteSwapU32(header.blockSize);
+
+    if (blockSize == 0 || blockSize % VHD_SECTOR_SIZE)
+        goto done;
+
+    impl->blockSectors = blockSize / VHD_SECTOR_SIZE;
+
+    /* One bit per sector, rounded up to whole sectors */
+    impl->bitmapSectors = 
+        (impl->blockSectors / 8 + VHD_SECTOR_SIZE - 1) / VHD_SECTOR_SIZE;
+
+    impl->batEntries = ByteSwapU32(header.maxTableEntries);
+    impl->batOffset = ByteSwapU64(header.tableOffset);
+    nblocks = (impl->nsectors + impl->blockSectors - 1) / impl->blockSectors;
+
+    if (impl->batEntries > VHD_MAX_BAT_ENTRIES || nblocks > impl->batEntries)
+        goto done;
+
+    if (!(impl->bat = (UINT32*)Malloc(impl->batEntries * sizeof(UINT32))))
+        goto done;
+
+    if (BlkdevReadBytes(
+        impl->file, 
+        impl->batOffset, 
+        impl->bat, 
+        impl->batEntries * sizeof(UINT32)) != 0)
+    {
+        goto done;
+    }
+
+    for (i = 0; i < impl->batEntries; i++)
+        impl->bat[i] = ByteSwapU32(impl->bat[i]);
+
+    impl->dynamic = TRUE;
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+/* Resolve a virtual sector to a file sector and get the number of sectors
+ * that follow it contiguously (up to 'n'). Return FALSE if unallocated. */
+static BOOLEAN _Map(
+    BlkdevImpl* impl,
+    UINT64 sector,
+    UINT64 n,
+    UINT64* fileSector,
+    UINT64* count)
+{
+    UINT64 block;
+    UINT64 within;
+    UINT32 entry;
+
+    if (!impl->dynamic)
+    {
+        *fileSector = sector;
+        *count = n;
+        return TRUE;
+    }
+
+    block = sector / impl->blockSectors;
+    within = sector % impl->blockSectors;
+
+    if (n > impl->blockSectors - within)
+        n = impl->blockSectors - within;
+
+    *count = n;
+    entry = impl->bat[block];
+
+    if (entry == VHD_BAT_UNUSED)
+        return FALSE;
+
+    *fileSector = (UINT64)entry + impl->bitmapSectors + within;
+    return TRUE;
+}
+
+static BOOLEAN _IsZero(
+    const UINT8* data,
+    UINTN size)
+{
+    UINTN i;
+
+    for (i = 0; i < size; i++)
+    {
+        if (data[i])
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Append a new block where the footer is now and move the footer after it */
+static int _AllocBlock(
+    BlkdevImpl* impl,
+    UINT64 block)
+{
+    int rc = -1;
+    UINT8* buf = NULL;
+    UINT64 start = impl->fileSize - sizeof(VHDFooter);
+    UINT64 offset = start;
+    UINT64 end;
+    UINT32 entry;
+    UINTN size;
+
+    if (start / VHD_SECTOR_SIZE >= VHD_BAT_UNUSED)
+        goto done;
+
+    if (!(buf = (UINT8*)Malloc(ZERO_CHUNK)))
+        goto done;
+
+    /* The sector bitmap: every sector of the block is present */
+    Memset(buf, 0xFF, ZERO_CHUNK);
+    size = impl->bitmapSectors * VHD_SECTOR_SIZE;
+
+    while (size)
+    {
+        UINTN n = size < ZERO_CHUNK ? size : ZERO_CHUNK;
+
+        if (BlkdevWriteBytes(impl->file, offset, buf, n) != 0)
+            goto done;
+
+        offset += n;
+        size -= n;
+    }
+
+    /* The block data starts out zero-filled */
+    Memset(buf, 0, ZERO_CHUNK);
+    size = impl->blockSectors * VHD_SECTOR_SIZE;
+
+    while (size)
+    {
+        UINTN n = size < ZERO_CHUNK ? size : ZERO_CHUNK;
+
+        if (BlkdevWriteBytes(impl->file, offset, buf, n) != 0)
+            goto done;
+
+        offset += n;
+        size -= n;
+    }
+
+    /* Rewrite the footer at the new end of the file */
+    end = offset;
+
+    if (BlkdevWriteBytes(
+        impl->file, 
+        end, 
+        &impl->footer, 
+        sizeof(VHDFooter)) != 0)
+    {
+        goto done;
+    }
+
+    impl->fileSize = end + sizeof(VHDFooter);
+
+    /* Only now point the BAT at the block */
+    entry = ByteSwapU32((UINT32)(start / VHD_SECTOR_SIZE));
+
+    if (BlkdevWriteBytes(
+        impl->file, 
+        impl->batOffset + block * sizeof(UINT32), 
+        &entry, 
+        sizeof(entry)) != 0)
+    {
+        goto done;
+    }
+
+    impl->bat[block] = (UINT32)(start / VHD_SECTOR_SIZE);
+
+    rc = 0;
+
+done:
+
+    if (buf)
+        Free(buf);
+
+    return rc;
+}
+
+static int _Close(
+    Blkdev* dev)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidVHDBlkdev(dev))
+        goto done;
+
+    impl->file->Close(impl->file);
+
+    if (impl->bat)
+        Free(impl->bat);
+
+    Free(impl);
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+static int _GetN(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    void* data)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    UINT8* p = (UINT8*)data;
+    UINT64 sector;
+
+    if (!_ValidVHDBlkdev(dev) || !data)
+        goto done;
+
+    sector = impl->first + blkno;
+
+    if (sector + nblocks > impl->nsectors)
+        goto done;
+
+    while (nblocks)
+    {
+        UINT64 n;
+        UINT64 fileSector;
+
+        /* Sparse blocks read as zeros without any I/O */
+        if (!_Map(impl, sector, nblocks, &fileSector, &n))
+            Memset(p, 0, n * VHD_SECTOR_SIZE);
+        else if (impl->file->GetN(impl->file, fileSector, n, p) != 0)
+            goto done;
+
+        p += n * VHD_SECTOR_SIZE;
+        sector += n;
+        nblocks -= n;
+    }
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+static int _PutN(
+    Blkdev* dev,
+    UINTN blkno,
+    UINTN nblocks,
+    const void* data)
+{
+    int rc = -1;
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+    const UINT8* p = (const UINT8*)data;
+    UINT64 sector;
+
+    if (!_ValidVHDBlkdev(dev) || !data || !impl->writable)
+        goto done;
+
+    sector = impl->first + blkno;
+
+    if (sector + nblocks > impl->nsectors)
+        goto done;
+
+    while (nblocks)
+    {
+        UINT64 n;
+        UINT64 fileSector;
+
+        if (!_Map(impl, sector, nblocks, &fileSector, &n))
+        {
+            /* Writing zeros to a sparse block changes nothing */
+            if (_IsZero(p, n * VHD_SECTOR_SIZE))
+                goto next;
+
+            if (_AllocBlock(impl, sector / impl->blockSectors) != 0)
+                goto done;
+
+            _Map(impl, sector, nblocks, &fileSector, &n);
+        }
+
+        if (impl->file->PutN(impl->file, fileSector, n, p) != 0)
+            goto done;
+
+next:
+        p += n * VHD_SECTOR_SIZE;
+        sector += n;
+        nblocks -= n;
+    }
+
+    rc = 0;
+
+done:
+    return rc;
+}
+
+static int _SetFlags(
+    Blkdev* dev,
+    UINT32 flags)
+{
+    /* No flags supported */
+    return -1;
+}
+
+static int _Flush(
+    Blkdev* dev)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidVHDBlkdev(dev))
+        return -1;
+
+    return BlkdevFlush(impl->file);
+}
+
+/* The virtual disk size (not the size of the VHD file) */
+static int _GetNumBlocks(
+    Blkdev* dev,
+    UINT64* nblocks)
+{
+    BlkdevImpl* impl = (BlkdevImpl*)dev;
+
+    if (!_ValidVHDBlkdev(dev) || !nblocks)
+        return -1;
+
+    *nblocks = impl->nsectors - impl->first;
+    return 0;
+}
+
+BOOLEAN IsVHDFile(
+    const char* path)
+{
+    Blkdev* file;
+    VHDFooter footer;
+    BOOLEAN result = FALSE;
+
+    if (!path)
+        return FALSE;
+
+    if (!(file = BlkdevOpen(path, BLKDEV_ACCESS_RDONLY, 0, 0)))
+        return FALSE;
+
+    if (_ReadFooter(file, _FileSize(file), &footer) == 0)
+        result = TRUE;
+
+    file->Close(file);
+
+    return result;
+}
+
+Blkdev* VHDBlkdevOpen(
+    const char* path,
+    BlkdevAccess access,
+    UINTN offset,
+    UINT32 flags)
+{
+    BlkdevImpl* impl = NULL;
+    UINT32 diskType;
+
+    if (!path || offset % VHD_SECTOR_SIZE)
+        goto done;
+
+    /* The VHD file cannot be mapped (dynamic VHDs grow as blocks are 
+     * allocated) but it may be opened with O_DIRECT */
+    if (flags & ~BLKDEV_OPEN_DIRECT)
+        goto done;
+
+    /* Dynamic blocks are allocated with read-modify-write cycles */
+    if (access == BLKDEV_ACCESS_WRONLY)
+        access = BLKDEV_ACCESS_RDWR;
+
+    if (!(impl = (BlkdevImpl*)Calloc(1, sizeof(BlkdevImpl))))
+        goto done;
+
+    if (!(impl->file = BlkdevOpen(path, access, 0, flags)))
+        goto failed;
+
+    if (BlkdevBlockSize(impl->file) != VHD_SECTOR_SIZE)
+        goto failed;
+
+    impl->fileSize = _FileSize(impl->file);
+
+    if (_ReadFooter(impl->file, impl->fileSize, &impl->footer) != 0)
+        goto failed;
+
+    impl->nsectors = ByteSwapU64(impl->footer.currentSize) / VHD_SECTOR_SIZE;
+    impl->first = offset / VHD_SECTOR_SIZE;
+    impl->writable = (access != BLKDEV_ACCESS_RDONLY);
+
+    if (impl->first > impl->nsectors)
+        goto failed;
+
+    diskType = ByteSwapU32(impl->footer.diskType);
+
+    if (diskType == VHD_TYPE_FIXED)
+    {
+        /* The data comes first and is followed by the footer */
+        if (impl->nsectors * VHD_SECTOR_SIZE + sizeof(VHDFooter) > 
+            impl->fileSize)
+        {
+            goto failed;
+        }
+    }
+    else if (diskType == VHD_TYPE_DYNAMIC)
+    {
+        if (_LoadDynamic(impl) != 0)
+            goto failed;
+    }
+    else
+    {
+        /* Differencing disks (which need a parent) are not supported */
+        goto failed;
+    }
+
+    impl->base.Close = _Close;
+    impl->base.GetN = _GetN;
+    impl->base.PutN = _PutN;
+    impl->base.SetFlags = _SetFlags;
+    impl->base.Flush = _Flush;
+    impl->base.GetNumBlocks = _GetNumBlocks;
+    impl->base.blksize = VHD_SECTOR_SIZE;
+    impl->magic = VHDBLKDEV_MAGIC;
+
+    goto done;
+
+failed:
+
+    if (impl->file)
+        impl->file->Close(impl->file);
+
+    if (impl->bat)
+        Free(impl->bat);
+
+    Free(impl);
+    impl = NULL;
+
+done:
+    return &impl->base;
+}
+
+static Blkdev* _OpenImage(
+    const char* path,
+    BlkdevAccess access,
+    UINTN offset,
+    UINT32 flags)
+{
+    if (IsVHDFile(path))
+        return VHDBlkdevOpen(path, access, offset, 
+            flags & ~BLKDEV_OPEN_SEQUENTIAL);
+
+    /* Map read-only images (and any image if asked) into memory, unless
+     * O_DIRECT was requested. Devices cannot be mapped so they are opened 
+     * with BlkdevOpen() as are images at an offset. */
+    if ((access == BLKDEV_ACCESS_RDONLY || (flags & BLKDEV_OPEN_MMAP)) &&
+        !(flags & BLKDEV_OPEN_DIRECT) && offset == 0)
+    {
+        Blkdev* dev;
+        UINT32 mapFlags = 0;
+
+        if (flags & BLKDEV_OPEN_SEQUENTIAL)
+            mapFlags |= MMAPBLKDEV_SEQUENTIAL;
+
+        if ((dev = MmapBlkdevOpen(path, access, mapFlags)))
+            return dev;
+    }
+
+    return BlkdevOpen(path, access, offset, 
+        flags & ~(BLKDEV_OPEN_MMAP | BLKDEV_OPEN_SEQUENTIAL));
+}
+
+Blkdev* BlkdevOpenImage(
+    const char* path,
+    BlkdevAccess access,
+    UINTN offset,
+    UINT32 flags)
+{
+    /* Count the I/O that reaches the image (if --iostats was given) */
+    return StatsBlkdevWrap(_OpenImage(path, access, offset, flags), path);
+}
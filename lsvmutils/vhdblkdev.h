@@ -0,0 +1,121 @@
+/*
+**==============================================================================
+**
+** LSVMTools 
+** 
+** MIT License
+** 
+** Copyright (c) Microsoft Corporation. All rights reserved.
+** 
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+** 
+** The above copyright notice and this permission notice shall be included in 
+** all copies or substantial portions of the Software.
+** 
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE
+**
+**==============================================================================
+*/
+#ifndef _vhdblkdev_h
+#define _vhdblkdev_h
+
+#include "config.h"
+#include <lsvmutils/eficommon.h>
+#include <lsvmutils/blkdev.h>
+
+#define VHD_SECTOR_SIZE 512
+
+#define VHD_FOOTER_COOKIE "conectix"
+#define VHD_DYNAMIC_COOKIE "cxsparse"
+
+#define VHD_TYPE_FIXED 2
+#define VHD_TYPE_DYNAMIC 3
+#define VHD_TYPE_DIFFERENCING 4
+
+/* BAT entry of a block that has not been allocated */
+#define VHD_BAT_UNUSED 0xFFFFFFFF
+
+/* All fields are big-endian on disk */
+typedef struct _VHDFooter
+{
+    char cookie[8];
+    UINT32 features;
+    UINT32 fileFormatVersion;
+    UINT64 dataOffset;
+    UINT32 timeStamp;
+    char creatorApplication[4];
+    UINT32 creatorVersion;
+    UINT32 creatorHostOS;
+    UINT64 originalSize;
+    UINT64 currentSize;
+    UINT32 diskGeometry;
+    UINT32 diskType;
+    UINT32 checksum;
+    UINT8 uniqueId[16];
+    UINT8 savedState;
+    UINT8 reserved[427];
+}
+PACKED
+VHDFooter;
+
+/* All fields are big-endian on disk */
+typedef struct _VHDDynamicHeader
+{
+    char cookie[8];
+    UINT64 dataOffset;
+    UINT64 tableOffset;
+    UINT32 headerVersion;
+    UINT32 maxTableEntries;
+    UINT32 blockSize;
+    UINT32 checksum;
+    UINT8 parentUniqueId[16];
+    UINT32 parentTimeStamp;
+    UINT32 reserved1;
+    UINT16 parentUnicodeName[256];
+    UINT8 parentLocatorEntries[8][24];
+    UINT8 reserved2[256];
+}
+PACKED
+VHDDynamicHeader;
+
+#if !defined(BUILD_EFI)
+
+/* Return TRUE if the file ends with a valid VHD footer */
+BOOLEAN IsVHDFile(
+    const char* path);
+
+/* Open a fixed or dynamic VHD file as a device of 512-byte blocks covering
+ * the virtual disk (starting 'offset' bytes into it). Unallocated blocks of
+ * a dynamic VHD read as zeros and are allocated when first written. The 
+ * flags apply to the VHD file (BLKDEV_OPEN_MMAP is rejected). */
+Blkdev* VHDBlkdevOpen(
+    const char* path,
+    BlkdevAccess access,
+    UINTN offset,
+    UINT32 flags); /* BLKDEV_OPEN_* */
+
+/* Open a VHD with VHDBlkdevOpen(), a regular image file with 
+ * MmapBlkdevOpen() when opened read-only or with BLKDEV_OPEN_MMAP, and 
+ * anything else with BlkdevOpen(). BLKDEV_OPEN_SEQUENTIAL only affects
+ * mapped images. With StatsBlkdevEnable() the device is wrapped by 
+ * StatsBlkdevWrap() under the name of the image. */
+Blkdev* BlkdevOpenImage(
+    const char* path,
+    BlkdevAccess access,
+    UINTN offset,
+    UINT32 flags); /* BLKDEV_OPEN_* */
+
+#endif /* !defined(BUILD_EFI) */
+
+#endif /* _vhdblkdev_h */